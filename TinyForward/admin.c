@@ -0,0 +1,157 @@
+//
+//  admin.c
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "admin.h"
+#include "metrics.h"
+#include "tinyforward.h"
+
+typedef struct admin_client {
+    admin_t *admin;
+    event_source_t source;
+    char request[ADMIN_REQUEST_SIZE];
+    unsigned long length;
+    char *response;
+    unsigned long size;
+    unsigned long sent;
+} admin_client_t;
+
+#define NOT_FOUND_RESPONSE "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+
+static void close_client(admin_client_t *client){
+    int socket = client->source.fd;
+    
+    // the loop reports a source once per batch, and this is its handler
+    event_remove(client->admin->loop, &client->source);
+    close(socket);
+    free(client->response);
+    free(client);
+}
+
+static void respond(admin_client_t *client){
+    char header[128];
+    char *body;
+    unsigned long size;
+    int length;
+    
+    if(strncmp(client->request, "GET /metrics ", 13) != 0 && strncmp(client->request, "GET /metrics?", 13) != 0){
+        client->response = strdup(NOT_FOUND_RESPONSE);
+        client->size = client->response != NULL ? strlen(NOT_FOUND_RESPONSE) : 0;
+        return;
+    }
+    if((body = metrics_format(&size)) == NULL){
+        return;
+    }
+    length = snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                      "Content-Length: %lu\r\nConnection: close\r\n\r\n", size);
+    if((client->response = malloc(length + size)) == NULL){
+        free(body);
+        return;
+    }
+    memcpy(client->response, header, length);
+    memcpy(client->response + length, body, size);
+    client->size = length + size;
+    free(body);
+}
+
+static void client_handler(event_source_t *source, int events){
+    admin_client_t *client = source->owner;
+    ssize_t count;
+    
+    while(client->response == NULL){ // still reading the request
+        count = read(source->fd, client->request + client->length, sizeof(client->request) - 1 - client->length);
+        if(count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+            return;
+        }
+        if(count <= 0){
+            close_client(client);
+            return;
+        }
+        client->length += count;
+        client->request[client->length] = '\0';
+        if(strstr(client->request, "\r\n\r\n") != NULL || strstr(client->request, "\n\n") != NULL){
+            respond(client);
+            if(client->response == NULL){
+                close_client(client);
+                return;
+            }
+            event_modify(client->admin->loop, source, EVENT_WRITE);
+        }else if(client->length == sizeof(client->request) - 1){ // nobody needs a head this long
+            close_client(client);
+            return;
+        }
+    }
+    while(client->sent < client->size){
+        count = write(source->fd, client->response + client->sent, client->size - client->sent);
+        if(count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+            return;
+        }
+        if(count <= 0){
+            break;
+        }
+        client->sent += count;
+    }
+    close_client(client);
+}
+
+static void listener_handler(event_source_t *source, int events){
+    admin_t *admin = source->owner;
+    admin_client_t *client;
+    int socket;
+    
+    while((socket = accept(source->fd, NULL, NULL)) >= 0){
+        fcntl(socket, F_SETFL, O_NONBLOCK);
+        if((client = calloc(1, sizeof(admin_client_t))) == NULL){
+            close(socket);
+            continue;
+        }
+        client->admin = admin;
+        event_source_init(&client->source, socket, client_handler, client);
+        if(event_add(admin->loop, &client->source, EVENT_READ) < 0){
+            close(socket);
+            free(client);
+        }
+    }
+}
+
+int admin_init(admin_t *admin, event_loop_t *loop, const char *host, uint16_t port){
+    int socket = create_listener_socket(host, port, 0);
+    
+    if(socket < 0){
+        return -1;
+    }
+    fcntl(socket, F_SETFL, O_NONBLOCK);
+    admin->loop = loop;
+    event_source_init(&admin->listener, socket, listener_handler, admin);
+    if(event_add(loop, &admin->listener, EVENT_READ) < 0){
+        close(socket);
+        return -1;
+    }
+    return 0;
+}
+
+void admin_destroy(admin_t *admin){
+    int socket = admin->listener.fd;
+    
+    if(socket < 0){
+        return;
+    }
+    event_remove(admin->loop, &admin->listener);
+    close(socket);
+}
@@ -0,0 +1,40 @@
+//
+//  admin.h
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef TinyForward_admin_h
+#define TinyForward_admin_h
+
+#include "event.h"
+
+#define ADMIN_HOST          "127.0.0.1"
+#define ADMIN_PORT          "5556"
+#define ADMIN_REQUEST_SIZE  2048
+
+// Local listener for operators, separate from the proxy port. Scrapes are
+// answered one request per connection from the loop it runs in.
+typedef struct admin {
+    event_loop_t *loop;
+    event_source_t listener;
+} admin_t;
+
+int admin_init(admin_t *admin, event_loop_t *loop, const char *host, uint16_t port);
+void admin_destroy(admin_t *admin);
+
+#endif
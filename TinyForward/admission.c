@@ -0,0 +1,177 @@
+//
+//  admission.c
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include "admission.h"
+#include "buffer.h"
+
+typedef struct admission_entry admission_entry_t;
+
+struct admission_entry {
+    admission_key_t key;
+    unsigned int hash;
+    int count;
+    admission_entry_t *next_bucket;
+};
+
+typedef struct admission_shard {
+    pthread_mutex_t lock;
+    admission_entry_t *buckets[ADMISSION_BUCKETS];
+} admission_shard_t;
+
+static int g_max_connections = 0;
+static int g_max_per_address = 0;
+static unsigned long g_max_buffer_memory = 0;
+static int g_connections = 0; // atomic, only kept with a limit on them
+static admission_shard_t g_addresses[ADMISSION_SHARDS];
+
+void admission_init(int max_connections, int max_per_address, unsigned long max_buffer_memory){
+    int i;
+    
+    g_max_connections = max_connections;
+    g_max_per_address = max_per_address;
+    g_max_buffer_memory = max_buffer_memory;
+    for(i = 0; i < ADMISSION_SHARDS; i++){
+        memset(&g_addresses[i], 0, sizeof(admission_shard_t));
+        pthread_mutex_init(&g_addresses[i].lock, NULL);
+    }
+}
+
+static unsigned int hash_key(const admission_key_t *key){
+    unsigned int hash = 2166136261u; // FNV-1a
+    int i;
+    
+    for(i = 0; i < 16; i++){
+        hash = (hash ^ key->address[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// IPv4-mapped addresses count as the IPv4 ones they are
+static int peer_key(int socket, admission_key_t *key){
+    struct sockaddr_storage peer;
+    socklen_t length = sizeof(peer);
+    
+    memset(key, 0, sizeof(admission_key_t));
+    if(getpeername(socket, (struct sockaddr *)&peer, &length) < 0){
+        return -1;
+    }
+    if(peer.ss_family == AF_INET6){
+        const struct in6_addr *address = &((struct sockaddr_in6 *)&peer)->sin6_addr;
+        if(IN6_IS_ADDR_V4MAPPED(address)){
+            key->family = AF_INET;
+            memcpy(key->address, address->s6_addr + 12, 4);
+        }else{
+            key->family = AF_INET6;
+            memcpy(key->address, address->s6_addr, 16);
+        }
+    }else if(peer.ss_family == AF_INET){
+        key->family = AF_INET;
+        memcpy(key->address, &((struct sockaddr_in *)&peer)->sin_addr, 4);
+    }else{ // a local socket, nothing to tell clients apart by
+        return -1;
+    }
+    return 0;
+}
+
+static admission_entry_t **find_entry(admission_shard_t *shard, const admission_key_t *key, unsigned int hash){
+    admission_entry_t **link = &shard->buckets[(hash / ADMISSION_SHARDS) & (ADMISSION_BUCKETS - 1)];
+    
+    for(; *link != NULL; link = &(*link)->next_bucket){
+        if((*link)->hash == hash && memcmp(&(*link)->key, key, sizeof(admission_key_t)) == 0){
+            break;
+        }
+    }
+    return link;
+}
+
+static int count_address(const admission_key_t *key){
+    unsigned int hash = hash_key(key);
+    admission_shard_t *shard = &g_addresses[hash & (ADMISSION_SHARDS - 1)];
+    admission_entry_t **link, *entry;
+    int admitted = 1;
+    
+    pthread_mutex_lock(&shard->lock);
+    link = find_entry(shard, key, hash);
+    if((entry = *link) == NULL){
+        if((entry = calloc(1, sizeof(admission_entry_t))) != NULL){
+            entry->key = *key;
+            entry->hash = hash;
+            *link = entry;
+        }
+    }
+    if(entry != NULL && entry->count >= g_max_per_address){
+        admitted = 0;
+    }else if(entry != NULL){
+        entry->count++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return admitted;
+}
+
+static void uncount_address(const admission_key_t *key){
+    unsigned int hash = hash_key(key);
+    admission_shard_t *shard = &g_addresses[hash & (ADMISSION_SHARDS - 1)];
+    admission_entry_t **link, *entry;
+    
+    pthread_mutex_lock(&shard->lock);
+    link = find_entry(shard, key, hash);
+    if((entry = *link) != NULL && --entry->count <= 0){
+        *link = entry->next_bucket;
+        free(entry);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// returns 0 with key set, to be released once the client is gone, or -1
+// with the reason (a METRIC_SHED_ value) it has to be turned away
+int admission_admit(int socket, admission_key_t *key, int *reason){
+    memset(key, 0, sizeof(admission_key_t));
+    if(g_max_buffer_memory > 0 && buffer_memory() > g_max_buffer_memory){
+        *reason = METRIC_SHED_MEMORY;
+        return -1;
+    }
+    if(g_max_connections > 0 && __atomic_add_fetch(&g_connections, 1, __ATOMIC_RELAXED) > g_max_connections){
+        __atomic_sub_fetch(&g_connections, 1, __ATOMIC_RELAXED);
+        *reason = METRIC_SHED_CONNECTIONS;
+        return -1;
+    }
+    if(g_max_per_address > 0 && peer_key(socket, key) == 0 && !count_address(key)){
+        if(g_max_connections > 0){
+            __atomic_sub_fetch(&g_connections, 1, __ATOMIC_RELAXED);
+        }
+        key->family = 0;
+        *reason = METRIC_SHED_ADDRESS;
+        return -1;
+    }
+    return 0;
+}
+
+void admission_release(const admission_key_t *key){
+    if(g_max_connections > 0){
+        __atomic_sub_fetch(&g_connections, 1, __ATOMIC_RELAXED);
+    }
+    if(key->family != 0){
+        uncount_address(key);
+    }
+}
@@ -0,0 +1,41 @@
+//
+//  admission.h
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef TinyForward_admission_h
+#define TinyForward_admission_h
+
+#include "metrics.h"
+
+#define ADMISSION_SHARDS   16  // must be a power of two
+#define ADMISSION_BUCKETS  256 // per shard, must be a power of two
+
+// The client address a connection is counted against, family 0 when
+// addresses aren't counted.
+typedef struct admission_key {
+    int family;
+    unsigned char address[16];
+} admission_key_t;
+
+// Decides whether a freshly accepted client is served or turned away,
+// shared by every worker. Limits of 0 are off.
+void admission_init(int max_connections, int max_per_address, unsigned long max_buffer_memory);
+int admission_admit(int socket, admission_key_t *key, int *reason);
+void admission_release(const admission_key_t *key);
+
+#endif
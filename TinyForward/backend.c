@@ -0,0 +1,525 @@
+//
+//  backend.c
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "backend.h"
+#include "log.h"
+
+#define BACKEND_HASH_INIT  14695981039346656037ull // FNV-1a
+
+backend_pool_t g_http_backends = {"Parent"};
+backend_pool_t g_connect_backends = {"CONNECT parent"};
+
+static event_loop_t *g_check_loop = NULL;
+static dns_resolver_t *g_check_resolver = NULL;
+static char *g_check_request = NULL; // NULL for checks that only connect
+static int g_check_length = 0;
+
+static void check_resolved(dns_waiter_t *waiter, const dns_result_t *result);
+static void check_event_handler(event_source_t *source, int events);
+
+// host:port or [address]:port, then an optional ,weight
+int backend_add(backend_pool_t *pool, const char *spec){
+    backend_t *backend;
+    const char *end = spec + strlen(spec), *colon, *comma, *host = spec;
+    char *rest;
+    long port, weight = 1;
+    
+    if(pool->count == BACKEND_MAX_COUNT){
+        return -1;
+    }
+    if((comma = strchr(spec, ',')) != NULL){
+        weight = strtol(comma + 1, &rest, 10);
+        if(*rest != '\0' || weight < 1 || weight > BACKEND_MAX_WEIGHT){
+            return -1;
+        }
+        end = comma;
+    }
+    for(colon = end - 1; colon >= spec && *colon != ':'; colon--);
+    if(colon < spec){
+        return -1;
+    }
+    port = strtol(colon + 1, &rest, 10);
+    if(rest != end || colon + 1 == end || port <= 0 || port > 65535){
+        return -1;
+    }
+    if(*host == '[' && colon > host && colon[-1] == ']'){ // IPv6 literal
+        host++;
+        colon--;
+    }
+    if(colon == host){
+        return -1;
+    }
+    backend = &pool->backends[pool->count++];
+    memset(backend, 0, sizeof(backend_t));
+    backend->pool = pool;
+    backend->host = strndup(host, colon - host);
+    backend->port = (int)port;
+    backend->weight = (int)weight;
+    backend->healthy = 1;
+    return 0;
+}
+
+int backend_policy(const char *name){
+    if(strcasecmp(name, "rr") == 0){
+        return BACKEND_ROUND_ROBIN;
+    }
+    if(strcasecmp(name, "least") == 0){
+        return BACKEND_LEAST_PENDING;
+    }
+    if(strcasecmp(name, "host") == 0){
+        return BACKEND_HASH_HOST;
+    }
+    if(strcasecmp(name, "url") == 0){
+        return BACKEND_HASH_URL;
+    }
+    return -1;
+}
+
+// checks send HEAD for this through the parent and want a status line back
+int backend_check_url(const char *url){
+    const char *authority, *path;
+    size_t length;
+    
+    if(strncasecmp(url, "http://", 7) != 0){
+        return -1;
+    }
+    authority = url + 7;
+    for(path = authority; *path != '\0' && *path != '/'; path++);
+    if(path == authority){
+        return -1;
+    }
+    length = strlen(url) + (path - authority) + 64;
+    free(g_check_request);
+    if((g_check_request = malloc(length)) == NULL){
+        return -1;
+    }
+    g_check_length = snprintf(g_check_request, length, "HEAD %s%s HTTP/1.1\r\nHost: %.*s\r\nConnection: close\r\n\r\n",
+                              url, *path == '\0' ? "/" : "", (int)(path - authority), authority);
+    return 0;
+}
+
+// FNV-1a over data, continuing from hash or starting afresh from 0
+unsigned long long backend_hash(unsigned long long hash, const char *data, unsigned long length){
+    unsigned long i;
+    
+    if(hash == 0){
+        hash = BACKEND_HASH_INIT;
+    }
+    for(i = 0; i < length; i++){
+        hash = (hash ^ (unsigned char)data[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// FNV leaves the high bits of short keys poorly spread, the ring needs them
+static unsigned long long mix(unsigned long long hash){
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    return hash ^ (hash >> 33);
+}
+
+static int compare_points(const void *a, const void *b){
+    const backend_point_t *left = a, *right = b;
+    
+    return left->hash < right->hash ? -1 : left->hash > right->hash;
+}
+
+static int build_ring(backend_pool_t *pool){
+    backend_t *backend;
+    char name[300];
+    int i, j, n, size = 0;
+    
+    for(i = 0; i < pool->count; i++){
+        size += pool->backends[i].weight * BACKEND_RING_POINTS;
+    }
+    if((pool->ring = malloc(size * sizeof(backend_point_t))) == NULL){
+        return -1;
+    }
+    for(i = 0; i < pool->count; i++){
+        backend = &pool->backends[i];
+        for(j = 0; j < backend->weight * BACKEND_RING_POINTS; j++){
+            n = snprintf(name, sizeof(name), "%s:%d-%d", backend->host, backend->port, j);
+            pool->ring[pool->ring_size].hash = mix(backend_hash(0, name, n));
+            pool->ring[pool->ring_size++].backend = backend;
+        }
+    }
+    qsort(pool->ring, pool->ring_size, sizeof(backend_point_t), compare_points);
+    return 0;
+}
+
+static int init_pool(backend_pool_t *pool){
+    backend_t *backend;
+    int i;
+    
+    pthread_mutex_init(&pool->lock, NULL);
+    if(pool->count == 0){
+        return 0;
+    }
+    if(build_ring(pool) < 0){
+        return -1;
+    }
+    for(i = 0; i < pool->count; i++){
+        backend = &pool->backends[i];
+        event_source_init(&backend->check, -1, check_event_handler, backend);
+        dns_waiter_init(&backend->resolving, check_resolved, backend);
+        backend->next_check = event_now(); // the first check goes out right away
+        log_message(LOG_INFO, "%s %s:%d with weight %d.", pool->name, backend->host, backend->port, backend->weight);
+    }
+    return 0;
+}
+
+// checks run on this loop and resolve through its resolver
+int backend_init(event_loop_t *loop, dns_resolver_t *resolver){
+    g_check_loop = loop;
+    g_check_resolver = resolver;
+    if(init_pool(&g_http_backends) < 0 || init_pool(&g_connect_backends) < 0){
+        log_message(LOG_ERROR, "Cannot set up the backends.");
+        return -1;
+    }
+    return 0;
+}
+
+int backend_available(backend_t *backend){
+    return __atomic_load_n(&backend->healthy, __ATOMIC_RELAXED);
+}
+
+static backend_t *pick_round_robin(backend_pool_t *pool, int all){
+    backend_t *backend, *best = NULL;
+    int i, total = 0;
+    
+    pthread_mutex_lock(&pool->lock);
+    for(i = 0; i < pool->count; i++){
+        backend = &pool->backends[i];
+        if(!all && !backend_available(backend)){
+            continue;
+        }
+        backend->current_weight += backend->weight;
+        total += backend->weight;
+        if(best == NULL || backend->current_weight > best->current_weight){
+            best = backend;
+        }
+    }
+    if(best != NULL){
+        best->current_weight -= total;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return best;
+}
+
+static backend_t *pick_least_pending(backend_pool_t *pool, int all){
+    backend_t *backend, *best = NULL;
+    long long outstanding, best_outstanding = 0;
+    unsigned int start = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+    int i;
+    
+    // ties go round in turn instead of always to the first
+    for(i = 0; i < pool->count; i++){
+        backend = &pool->backends[(start + i) % pool->count];
+        if(!all && !backend_available(backend)){
+            continue;
+        }
+        outstanding = __atomic_load_n(&backend->outstanding, __ATOMIC_RELAXED);
+        if(best == NULL || outstanding * best->weight < best_outstanding * backend->weight){
+            best = backend;
+            best_outstanding = outstanding;
+        }
+    }
+    return best;
+}
+
+static backend_t *pick_hashed(backend_pool_t *pool, unsigned long long hash, int all){
+    int low = 0, high = pool->ring_size, middle, i;
+    
+    hash = mix(hash);
+    while(low < high){ // the first point at or after the key
+        middle = (low + high) / 2;
+        if(pool->ring[middle].hash < hash){
+            low = middle + 1;
+        }else{
+            high = middle;
+        }
+    }
+    // an ejected backend's keys move to the next ones along, the rest stay put
+    for(i = 0; i < pool->ring_size; i++){
+        if(all || backend_available(pool->ring[(low + i) % pool->ring_size].backend)){
+            return pool->ring[(low + i) % pool->ring_size].backend;
+        }
+    }
+    return NULL;
+}
+
+static backend_t *pick(backend_pool_t *pool, unsigned long long hash, int all){
+    switch(pool->policy){
+        case BACKEND_LEAST_PENDING:
+            return pick_least_pending(pool, all);
+        case BACKEND_HASH_HOST:
+        case BACKEND_HASH_URL:
+            return pick_hashed(pool, hash, all);
+        default:
+            return pick_round_robin(pool, all);
+    }
+}
+
+// hash only matters to the hashing policies
+backend_t *backend_pick(backend_pool_t *pool, unsigned long long hash){
+    backend_t *backend;
+    
+    if(pool->count == 1){
+        return &pool->backends[0];
+    }
+    if((backend = pick(pool, hash, 0)) == NULL){ // all ejected, one may have come back since
+        backend = pick(pool, hash, 1);
+    }
+    return backend;
+}
+
+void backend_begin(backend_t *backend){
+    __atomic_add_fetch(&backend->outstanding, 1, __ATOMIC_RELAXED);
+}
+
+void backend_finish(backend_t *backend, int count){
+    __atomic_sub_fetch(&backend->outstanding, count, __ATOMIC_RELAXED);
+}
+
+static void fail(backend_t *backend){
+    int failures = __atomic_add_fetch(&backend->failures, 1, __ATOMIC_RELAXED);
+    
+    if(failures >= BACKEND_MAX_FAILURES && __atomic_exchange_n(&backend->healthy, 0, __ATOMIC_RELAXED)){
+        log_message(LOG_WARN, "%s %s:%d ejected after %d failures.", backend->pool->name, backend->host, backend->port, failures);
+    }
+}
+
+// from the workers when connecting to it failed, only the checks clear these
+void backend_failed(backend_t *backend){
+    fail(backend);
+}
+
+static void finish_check(backend_t *backend, int ok){
+    long long now = event_now();
+    
+    dns_cancel(&backend->resolving);
+    if(backend->check.fd >= 0){
+        event_remove(g_check_loop, &backend->check);
+        close(backend->check.fd);
+        backend->check.fd = -1;
+    }
+    backend->check_deadline = 0;
+    backend->check_sent = 0;
+    if(ok){
+        __atomic_store_n(&backend->failures, 0, __ATOMIC_RELAXED);
+        if(!__atomic_exchange_n(&backend->healthy, 1, __ATOMIC_RELAXED)){
+            log_message(LOG_INFO, "%s %s:%d is back.", backend->pool->name, backend->host, backend->port);
+        }
+        // a backend that keeps flapping waits longer every time it goes
+        backend->backoff = backend->backoff / 2 >= BACKEND_BACKOFF_MIN ? backend->backoff / 2 : 0;
+        backend->next_check = now + BACKEND_CHECK_INTERVAL;
+        return;
+    }
+    fail(backend);
+    if(backend_available(backend)){
+        backend->next_check = now + BACKEND_CHECK_INTERVAL;
+        return;
+    }
+    if(backend->backoff < BACKEND_BACKOFF_MIN){
+        backend->backoff = BACKEND_BACKOFF_MIN;
+    }else if((backend->backoff *= 2) > BACKEND_BACKOFF_MAX){
+        backend->backoff = BACKEND_BACKOFF_MAX;
+    }
+    backend->next_check = now + backend->backoff;
+}
+
+static void start_connect(backend_t *backend, const dns_result_t *result){
+    struct sockaddr_storage address;
+    struct sockaddr_in *sin = (struct sockaddr_in *)&address;
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&address;
+    int sockfd;
+    
+    if(result->count == 0){
+        log_message(LOG_DEBUG, "Check of %s:%d: cannot resolve.", backend->host, backend->port);
+        finish_check(backend, 0);
+        return;
+    }
+    memset(&address, 0, sizeof(address));
+    if(result->addresses[0].family == AF_INET6){
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_addr = result->addresses[0].addr.v6;
+        sin6->sin6_port = htons(backend->port);
+    }else{
+        sin->sin_family = AF_INET;
+        sin->sin_addr = result->addresses[0].addr.v4;
+        sin->sin_port = htons(backend->port);
+    }
+    if((sockfd = socket(address.ss_family, SOCK_STREAM, 0)) < 0){
+        finish_check(backend, 0);
+        return;
+    }
+    fcntl(sockfd, F_SETFL, O_NONBLOCK);
+    if(connect(sockfd, (struct sockaddr *)&address, address.ss_family == AF_INET6 ?
+               sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in)) < 0 && errno != EINPROGRESS){
+        close(sockfd);
+        finish_check(backend, 0);
+        return;
+    }
+    backend->check.fd = sockfd;
+    if(event_add(g_check_loop, &backend->check, EVENT_WRITE) < 0){
+        close(sockfd);
+        backend->check.fd = -1;
+        finish_check(backend, 0);
+    }
+}
+
+static void check_resolved(dns_waiter_t *waiter, const dns_result_t *result){
+    start_connect(waiter->owner, result);
+}
+
+static void start_check(backend_t *backend){
+    dns_result_t result;
+    int n;
+    
+    backend->check_deadline = event_now() + BACKEND_CHECK_TIMEOUT;
+    n = dns_resolve(g_check_resolver, backend->host, &backend->resolving, &result);
+    if(n < 0){
+        finish_check(backend, 0);
+    }else if(n > 0){
+        start_connect(backend, &result);
+    }
+}
+
+static void check_event_handler(event_source_t *source, int events){
+    backend_t *backend = source->owner;
+    char reply[12]; // "HTTP/1.1 200"
+    ssize_t count;
+    int err = 0, status;
+    socklen_t length = sizeof(err);
+    
+    if(backend->check_sent == 0){ // connecting
+        if(getsockopt(source->fd, SOL_SOCKET, SO_ERROR, &err, &length) < 0){
+            err = errno;
+        }
+        if(err != 0){
+            log_message(LOG_DEBUG, "Check of %s:%d: %s", backend->host, backend->port, strerror(err));
+            finish_check(backend, 0);
+            return;
+        }
+        if(!(events & EVENT_WRITE)){ // still in progress
+            return;
+        }
+        if(g_check_request == NULL){ // connecting is all we ask
+            finish_check(backend, 1);
+            return;
+        }
+    }
+    if(backend->check_sent < g_check_length){
+        count = send(source->fd, g_check_request + backend->check_sent, g_check_length - backend->check_sent, 0);
+        if(count < 0){
+            if(errno != EAGAIN && errno != EWOULDBLOCK){
+                finish_check(backend, 0);
+            }
+            return;
+        }
+        if((backend->check_sent += count) < g_check_length){
+            return;
+        }
+        if(event_modify(g_check_loop, source, EVENT_READ) < 0){
+            finish_check(backend, 0);
+        }
+        return;
+    }
+    // left in the socket until the status code is there
+    count = recv(source->fd, reply, sizeof(reply), MSG_PEEK);
+    if(count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+        return;
+    }
+    if(count > 0 && count < (ssize_t)sizeof(reply)){
+        return;
+    }
+    status = 0;
+    if(count == sizeof(reply) && memcmp(reply, "HTTP/", 5) == 0 && reply[8] == ' ' &&
+       isdigit((unsigned char)reply[9]) && isdigit((unsigned char)reply[10]) && isdigit((unsigned char)reply[11])){
+        status = (reply[9] - '0') * 100 + (reply[10] - '0') * 10 + (reply[11] - '0');
+    }
+    if(status >= 400 || (status > 0 && status < 200)){ // a parent that is up but can't serve
+        log_message(LOG_DEBUG, "Check of %s:%d: status %d.", backend->host, backend->port, status);
+    }
+    finish_check(backend, status >= 200 && status < 400);
+}
+
+static void run_pool(backend_pool_t *pool, long long now){
+    backend_t *backend;
+    int i;
+    
+    for(i = 0; i < pool->count; i++){
+        backend = &pool->backends[i];
+        if(backend->check_deadline != 0){
+            if(now >= backend->check_deadline){
+                log_message(LOG_DEBUG, "Check of %s:%d timed out.", backend->host, backend->port);
+                finish_check(backend, 0);
+            }
+        }else if(now >= backend->next_check){
+            start_check(backend);
+        }
+    }
+}
+
+void backend_run_timers(void){
+    long long now = event_now();
+    
+    if(g_check_loop == NULL){
+        return;
+    }
+    run_pool(&g_http_backends, now);
+    run_pool(&g_connect_backends, now);
+}
+
+static long long pool_wait(backend_pool_t *pool, long long now, long long wait){
+    backend_t *backend;
+    long long at;
+    int i;
+    
+    for(i = 0; i < pool->count; i++){
+        backend = &pool->backends[i];
+        at = backend->check_deadline != 0 ? backend->check_deadline : backend->next_check;
+        if(wait < 0 || at - now < wait){
+            wait = at > now ? at - now : 0;
+        }
+    }
+    return wait;
+}
+
+int backend_timeout(void){
+    long long now = event_now();
+    long long wait = -1;
+    
+    if(g_check_loop == NULL){
+        return -1;
+    }
+    wait = pool_wait(&g_http_backends, now, wait);
+    return (int)pool_wait(&g_connect_backends, now, wait);
+}
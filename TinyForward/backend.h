@@ -0,0 +1,101 @@
+//
+//  backend.h
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef TinyForward_backend_h
+#define TinyForward_backend_h
+
+#include <pthread.h>
+#include "dns.h"
+#include "event.h"
+
+#define BACKEND_MAX_COUNT       64     // per pool
+#define BACKEND_MAX_WEIGHT      100
+#define BACKEND_RING_POINTS     40     // on the hash ring per unit of weight
+#define BACKEND_MAX_FAILURES    3      // in a row, then the backend is ejected
+#define BACKEND_CHECK_INTERVAL  2000   // ms between checks of a healthy backend
+#define BACKEND_CHECK_TIMEOUT   1000   // ms for a check to connect and, with a URL, get a status line
+#define BACKEND_BACKOFF_MIN     1000   // ms before checking an ejected backend again,
+#define BACKEND_BACKOFF_MAX     60000  // doubled every time it is still down
+
+#define BACKEND_ROUND_ROBIN     0 // smooth weighted round-robin
+#define BACKEND_LEAST_PENDING   1 // fewest outstanding requests for its weight
+#define BACKEND_HASH_HOST       2 // consistent hashing, one origin sticks to one backend
+#define BACKEND_HASH_URL        3 // consistent hashing, for cache affinity
+
+typedef struct backend_pool backend_pool_t;
+
+// A parent proxy. Workers pick it and count what they send its way, the
+// health checks run on one event loop and flip it in and out of rotation.
+typedef struct backend {
+    backend_pool_t *pool;
+    char *host;
+    int port;
+    int weight;
+    int healthy; // atomic, read by every worker
+    int failures; // atomic, in a row from checks and connects
+    int outstanding; // atomic, requests sent and not answered yet
+    int current_weight; // round-robin state, under the pool's lock
+    // the checker's own
+    long long next_check; // ms
+    long long check_deadline; // ms, while a check is in flight
+    int backoff; // ms, 0 while healthy
+    int check_sent; // bytes of the check request written
+    dns_waiter_t resolving;
+    event_source_t check;
+} backend_t;
+
+typedef struct backend_point {
+    unsigned long long hash;
+    backend_t *backend;
+} backend_point_t;
+
+struct backend_pool {
+    const char *name; // for the log
+    int policy;
+    int count;
+    backend_t backends[BACKEND_MAX_COUNT];
+    pthread_mutex_t lock; // round-robin
+    unsigned int next; // atomic, where least-pending starts looking
+    backend_point_t *ring; // sorted by hash
+    int ring_size;
+};
+
+extern backend_pool_t g_http_backends; // parents for plain requests
+extern backend_pool_t g_connect_backends; // parents for CONNECT
+
+/* Setup */
+int backend_add(backend_pool_t *pool, const char *spec);
+int backend_policy(const char *name);
+void backend_set_policy(int policy);
+int backend_check_url(const char *url);
+int backend_init(event_loop_t *loop, dns_resolver_t *resolver);
+
+/* Selection */
+unsigned long long backend_hash(unsigned long long hash, const char *data, unsigned long length);
+backend_t *backend_pick(backend_pool_t *pool, unsigned long long hash);
+int backend_available(backend_t *backend);
+void backend_begin(backend_t *backend);
+void backend_finish(backend_t *backend, int count);
+void backend_failed(backend_t *backend);
+
+/* Health checks */
+int backend_timeout(void);
+void backend_run_timers(void);
+
+#endif
@@ -0,0 +1,359 @@
+//
+//  buffer.c
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "buffer.h"
+
+static unsigned long g_buffer_memory = 0; // atomic, bytes held by buffers that aren't spare
+static unsigned long g_buffer_count = 0; // atomic, buffers those bytes are spread over
+static unsigned long g_buffer_budget = 0;
+
+static void charge(buffer_t *buffer){
+    __atomic_add_fetch(&g_buffer_memory, buffer->capacity, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&g_buffer_count, 1, __ATOMIC_RELAXED);
+}
+
+static void discharge(buffer_t *buffer){
+    __atomic_sub_fetch(&g_buffer_memory, buffer->capacity, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&g_buffer_count, 1, __ATOMIC_RELAXED);
+}
+
+void buffer_init(buffer_t *buffer, size_t minimum, size_t limit){
+    assert((minimum & (minimum - 1)) == 0 && (limit & (limit - 1)) == 0); // powers of two
+    assert(minimum <= limit);
+    buffer->data = NULL;
+    buffer->capacity = minimum;
+    buffer->minimum = minimum;
+    buffer->limit = limit;
+    buffer->head = 0;
+    buffer->tail = 0;
+    buffer->spare = 0;
+}
+
+void buffer_free(buffer_t *buffer){
+    if(buffer->data != NULL && !buffer->spare){
+        discharge(buffer);
+    }
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->capacity = buffer->minimum;
+    buffer->head = 0;
+    buffer->tail = 0;
+    buffer->spare = 0;
+}
+
+// empty again, storage of the minimum size is kept for whoever uses the buffer next
+void buffer_reset(buffer_t *buffer){
+    if(buffer->capacity > buffer->minimum){
+        buffer_free(buffer);
+        return;
+    }
+    if(buffer->data != NULL && !buffer->spare){
+        discharge(buffer);
+        buffer->spare = 1;
+    }
+    buffer->head = 0;
+    buffer->tail = 0;
+}
+
+void buffer_budget(unsigned long bytes){
+    g_buffer_budget = bytes;
+}
+
+unsigned long buffer_memory(void){
+    return __atomic_load_n(&g_buffer_memory, __ATOMIC_RELAXED);
+}
+
+int buffer_memory_left(void){
+    return g_buffer_budget == 0 || buffer_memory() < g_buffer_budget;
+}
+
+// past half the budget memory is tight, buffers only grow to their share
+static int buffer_tight(void){
+    return g_buffer_budget > 0 && buffer_memory() > g_buffer_budget / 2;
+}
+
+// an empty buffer that grew goes back to the minimum once the connection
+// waits for something to do, or right away when memory is tight, and
+// while it is tight waiting connections give up even that
+void buffer_trim(buffer_t *buffer, int idle){
+    if(buffer->data == NULL || buffer_length(buffer) > 0){
+        return;
+    }
+    if(buffer->capacity > buffer->minimum ? idle || buffer_tight() : idle && buffer_tight()){
+        buffer_free(buffer);
+    }
+}
+
+static int buffer_alloc(buffer_t *buffer, int forced){
+    if(buffer->data == NULL){
+        if(!forced && !buffer_memory_left()){
+            return -1;
+        }
+        buffer->data = malloc(buffer->capacity);
+        if(buffer->data == NULL){
+            return -1;
+        }
+        charge(buffer);
+    }else if(buffer->spare){
+        if(!forced && !buffer_memory_left()){
+            return -1;
+        }
+        charge(buffer);
+        buffer->spare = 0;
+    }
+    return 0;
+}
+
+// doubles the storage, the contents line up from the start of the new one
+static int buffer_grow(buffer_t *buffer, int forced){
+    size_t capacity = buffer->capacity * 2;
+    size_t length = buffer_length(buffer), start, first;
+    unsigned long memory, count;
+    unsigned char *data;
+    
+    if(capacity > buffer->limit){
+        return -1;
+    }
+    if(!forced && g_buffer_budget > 0){
+        memory = buffer_memory() + buffer->capacity;
+        count = __atomic_load_n(&g_buffer_count, __ATOMIC_RELAXED);
+        if(memory > g_buffer_budget || (memory > g_buffer_budget / 2 && count > 0 && capacity > g_buffer_budget / count)){
+            return -1;
+        }
+    }
+    if((data = malloc(capacity)) == NULL){
+        return -1;
+    }
+    if(length > 0){
+        start = buffer->head & (buffer->capacity - 1);
+        first = buffer->capacity - start < length ? buffer->capacity - start : length;
+        memcpy(data, buffer->data + start, first);
+        memcpy(data + first, buffer->data, length - first);
+    }
+    discharge(buffer);
+    free(buffer->data);
+    buffer->data = data;
+    buffer->capacity = capacity;
+    buffer->head = 0;
+    buffer->tail = length;
+    charge(buffer);
+    return 0;
+}
+
+// room for size more bytes at the current capacity, growing if it has to;
+// forced for the few bytes of our own that go in, the budget has its say otherwise
+static int buffer_reserve(buffer_t *buffer, size_t size, int forced){
+    if(size > buffer_space(buffer) || buffer_alloc(buffer, forced) < 0){
+        return -1;
+    }
+    while(buffer->capacity - buffer_length(buffer) < size){
+        if(buffer_grow(buffer, forced) < 0){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// the free space, after growing the buffer if it was full
+int buffer_space_iov(buffer_t *buffer, struct iovec iov[2]){
+    size_t mask, start, space;
+    
+    if(buffer_reserve(buffer, 1, 0) < 0){
+        return 0;
+    }
+    mask = buffer->capacity - 1;
+    start = buffer->tail & mask;
+    space = buffer->capacity - buffer_length(buffer);
+    iov[0].iov_base = buffer->data + start;
+    if(start + space <= buffer->capacity){
+        iov[0].iov_len = space;
+        return 1;
+    }
+    iov[0].iov_len = buffer->capacity - start;
+    iov[1].iov_base = buffer->data;
+    iov[1].iov_len = space - iov[0].iov_len;
+    return 2;
+}
+
+int buffer_data_iov(buffer_t *buffer, size_t max, struct iovec iov[2]){
+    size_t mask = buffer->capacity - 1;
+    size_t start = buffer->head & mask;
+    size_t length = buffer_length(buffer);
+    
+    if(length > max){
+        length = max;
+    }
+    if(length == 0){
+        return 0;
+    }
+    iov[0].iov_base = buffer->data + start;
+    if(start + length <= buffer->capacity){
+        iov[0].iov_len = length;
+        return 1;
+    }
+    iov[0].iov_len = buffer->capacity - start;
+    iov[1].iov_base = buffer->data;
+    iov[1].iov_len = length - iov[0].iov_len;
+    return 2;
+}
+
+// size bytes starting offset bytes past the head, e.g. what a read just added
+int buffer_range_iov(buffer_t *buffer, size_t offset, size_t size, struct iovec iov[2]){
+    size_t mask = buffer->capacity - 1;
+    size_t start = (buffer->head + offset) & mask;
+    
+    assert(offset + size <= buffer_length(buffer));
+    if(size == 0){
+        return 0;
+    }
+    iov[0].iov_base = buffer->data + start;
+    if(start + size <= buffer->capacity){
+        iov[0].iov_len = size;
+        return 1;
+    }
+    iov[0].iov_len = buffer->capacity - start;
+    iov[1].iov_base = buffer->data;
+    iov[1].iov_len = size - iov[0].iov_len;
+    return 2;
+}
+
+void buffer_commit(buffer_t *buffer, size_t count){
+    assert(count <= buffer->capacity - buffer_length(buffer));
+    buffer->tail += count;
+}
+
+void buffer_consume(buffer_t *buffer, size_t count){
+    assert(count <= buffer_length(buffer));
+    buffer->head += count;
+    if(buffer->head == buffer->tail){ // empty, start from the beginning again
+        buffer->head = buffer->tail = 0;
+    }
+}
+
+// takes back the last count bytes committed
+void buffer_truncate(buffer_t *buffer, size_t count){
+    assert(count <= buffer_length(buffer));
+    buffer->tail -= count;
+    if(buffer->head == buffer->tail){
+        buffer->head = buffer->tail = 0;
+    }
+}
+
+// storage for size more bytes, as far as the budget allows, returns how much
+// it takes without growing or -1 if that wasn't enough
+long buffer_room(buffer_t *buffer, size_t size){
+    if(buffer_reserve(buffer, size, 0) < 0){
+        return -1;
+    }
+    return buffer->capacity - buffer_length(buffer);
+}
+
+static int append(buffer_t *buffer, const void *data, size_t size, int forced){
+    struct iovec iov[2];
+    int n;
+    
+    if(buffer_reserve(buffer, size, forced) < 0 || (n = buffer_space_iov(buffer, iov)) == 0){
+        return -1;
+    }
+    if(size <= iov[0].iov_len){
+        memcpy(iov[0].iov_base, data, size);
+    }else{
+        memcpy(iov[0].iov_base, data, iov[0].iov_len);
+        memcpy(iov[1].iov_base, (const unsigned char *)data + iov[0].iov_len, size - iov[0].iov_len);
+    }
+    buffer->tail += size;
+    return 0;
+}
+
+int buffer_append(buffer_t *buffer, const void *data, size_t size){
+    return append(buffer, data, size, 1);
+}
+
+// only grows while the budget has room
+int buffer_append_budgeted(buffer_t *buffer, const void *data, size_t size){
+    return append(buffer, data, size, 0);
+}
+
+int buffer_prepend(buffer_t *buffer, const void *data, size_t size){
+    size_t mask, start, first;
+    
+    if(buffer_reserve(buffer, size, 1) < 0){
+        return -1;
+    }
+    mask = buffer->capacity - 1;
+    // the free space wraps around in front of head as well
+    buffer->head -= size;
+    start = buffer->head & mask;
+    first = buffer->capacity - start;
+    if(size <= first){
+        memcpy(buffer->data + start, data, size);
+    }else{
+        memcpy(buffer->data + start, data, first);
+        memcpy(buffer->data, (const unsigned char *)data + first, size - first);
+    }
+    return 0;
+}
+
+// opens a gap offset bytes past the head, meant for a few header lines
+int buffer_insert(buffer_t *buffer, size_t offset, const void *data, size_t size){
+    size_t mask, i;
+    
+    assert(offset <= buffer_length(buffer));
+    if(buffer_reserve(buffer, size, 1) < 0){
+        return -1;
+    }
+    mask = buffer->capacity - 1;
+    // byte by byte from the end, the ring may wrap anywhere in between
+    for(i = buffer_length(buffer) - offset; i > 0; i--){
+        buffer->data[(buffer->head + offset + i - 1 + size) & mask] = buffer->data[(buffer->head + offset + i - 1) & mask];
+    }
+    for(i = 0; i < size; i++){
+        buffer->data[(buffer->head + offset + i) & mask] = ((const unsigned char *)data)[i];
+    }
+    buffer->tail += size;
+    return 0;
+}
+
+unsigned char *buffer_linearize(buffer_t *buffer){
+    size_t mask = buffer->capacity - 1;
+    size_t start = buffer->head & mask;
+    size_t length = buffer_length(buffer);
+    unsigned char *copy;
+    
+    if(buffer->data == NULL){
+        return NULL;
+    }
+    if(start + length > buffer->capacity){ // wrapped, only happens when a message straddles the end
+        copy = malloc(buffer->capacity);
+        if(copy == NULL){
+            return NULL;
+        }
+        memcpy(copy, buffer->data + start, buffer->capacity - start);
+        memcpy(copy + buffer->capacity - start, buffer->data, length - (buffer->capacity - start));
+        free(buffer->data);
+        buffer->data = copy;
+        buffer->tail = length;
+        buffer->head = 0;
+        return buffer->data;
+    }
+    return buffer->data + start;
+}
@@ -0,0 +1,79 @@
+//
+//  buffer.h
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef TinyForward_buffer_h
+#define TinyForward_buffer_h
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+// Ring buffer. head and tail only ever grow, the offset into data is taken
+// modulo the capacity (a power of two), so consuming bytes never moves
+// anything. The storage is allocated on first write at the minimum size and
+// doubled, up to the limit, whenever a write finds it full.
+//
+// All buffers share one memory budget. A buffer only grows while the
+// budget has room, and past half of it only up to an even share of the
+// budget between the buffers in use. New storage is refused once the budget
+// is spent. Storage that empty buffers give back with buffer_trim() is
+// what lets the others go on.
+typedef struct buffer {
+    unsigned char *data;
+    size_t capacity; // of data, doubles up to limit as it fills
+    size_t minimum;
+    size_t limit;
+    size_t head; // next byte to consume
+    size_t tail; // next byte to fill
+    int spare; // storage kept by buffer_reset(), not counted until it is written again
+} buffer_t;
+
+void buffer_init(buffer_t *buffer, size_t minimum, size_t limit);
+void buffer_free(buffer_t *buffer);
+void buffer_reset(buffer_t *buffer);
+void buffer_trim(buffer_t *buffer, int idle);
+void buffer_budget(unsigned long bytes); // 0 for no limit
+unsigned long buffer_memory(void); // allocated by all buffers in use together
+int buffer_memory_left(void); // whether new storage would be handed out
+long buffer_room(buffer_t *buffer, size_t size);
+
+static inline size_t buffer_length(const buffer_t *buffer){
+    return buffer->tail - buffer->head;
+}
+
+// how much more it can take, growing to its limit on the way
+static inline size_t buffer_space(const buffer_t *buffer){
+    return buffer->limit - buffer_length(buffer);
+}
+
+/* Scatter/gather access, at most two segments each */
+int buffer_space_iov(buffer_t *buffer, struct iovec iov[2]);
+int buffer_data_iov(buffer_t *buffer, size_t max, struct iovec iov[2]);
+int buffer_range_iov(buffer_t *buffer, size_t offset, size_t size, struct iovec iov[2]);
+void buffer_commit(buffer_t *buffer, size_t count);
+void buffer_consume(buffer_t *buffer, size_t count);
+void buffer_truncate(buffer_t *buffer, size_t count);
+
+/* Copying */
+int buffer_append(buffer_t *buffer, const void *data, size_t size);
+int buffer_append_budgeted(buffer_t *buffer, const void *data, size_t size);
+int buffer_prepend(buffer_t *buffer, const void *data, size_t size);
+int buffer_insert(buffer_t *buffer, size_t offset, const void *data, size_t size);
+unsigned char *buffer_linearize(buffer_t *buffer);
+
+#endif
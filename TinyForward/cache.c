@@ -0,0 +1,1290 @@
+//
+//  cache.c
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifdef __linux__
+#define _GNU_SOURCE // strptime(), timegm()
+#endif
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#include <time.h>
+#include "cache.h"
+#include "disk.h"
+#include "event.h"
+#include "log.h"
+
+enum {
+    SEGMENT_NONE, // evicted, freed with the last reference
+    SEGMENT_WINDOW,
+    SEGMENT_PROBATION,
+    SEGMENT_PROTECTED,
+    SEGMENTS
+};
+
+struct cache_entry {
+    int references; // atomic, one is held by the cache while the entry is indexed
+    int shard;
+    int segment;
+    unsigned long long hash;
+    unsigned long charge; // bytes counted against the shard
+    cache_entry_t *next_bucket;
+    cache_entry_t *previous; // towards the most recently used
+    cache_entry_t *next;
+    char *key;
+    char *vary_names; // lower case, comma separated, NULL if the response has no Vary
+    char *vary_values; // the request's values for them, one per line
+    char *etag;
+    char *last_modified;
+    long long stored; // ms, event_now() when the response arrived or was revalidated
+    long long age; // ms, how old the response already was then
+    long long lifetime; // ms of freshness
+    const unsigned char *head; // status line and headers, without the blank line
+    unsigned long head_length;
+    const unsigned char *body;
+    unsigned long long body_length;
+    disk_object_t *disk; // a response kept on disk, for the time it is sent
+    unsigned char data[];
+};
+
+// what the cache needs to know from a response head
+typedef struct response_info {
+    int status;
+    int no_store;
+    int no_cache;
+    int private;
+    int set_cookie;
+    int chunked;
+    long long content_length; // -1 if absent
+    long long max_age; // s, -1 if absent
+    long long s_maxage;
+    long long age;
+    int must_revalidate; // or proxy-revalidate, never served stale
+    long long min_fresh; // s, from a request, -1 if absent
+    long long max_stale;
+    int has_expires;
+    time_t expires;
+    time_t date; // 0 if absent
+    time_t last_modified_time;
+    char *etag;
+    char *last_modified;
+    char vary[256];
+    char unstored[256]; // lower case, comma separated fields named by private= and no-cache=
+} response_info_t;
+
+struct cache_fill {
+    char *key;
+    char *request; // copy of the request head, the parser's spans point into it
+    http_request_t parser;
+    cache_entry_t *revalidating;
+    unsigned char *data;
+    unsigned long length;
+    unsigned long capacity;
+    int abandoned; // grew past the object limits
+    disk_write_t *disk; // too big for memory, streamed to disk instead of data
+    response_info_t info; // the head that was spilled
+};
+
+typedef struct cache_list {
+    cache_entry_t *first; // most recently used
+    cache_entry_t *last;
+    unsigned long bytes;
+} cache_list_t;
+
+typedef struct cache_shard {
+    pthread_mutex_t lock;
+    cache_entry_t *buckets[CACHE_BUCKETS];
+    cache_list_t lists[SEGMENTS];
+    unsigned char sketch[CACHE_SKETCH_DEPTH][CACHE_SKETCH_WIDTH];
+    unsigned long samples; // sketch increments since the counters were last halved
+} cache_shard_t;
+
+static cache_shard_t *g_cache = NULL;
+static unsigned long g_shard_size; // bytes
+static unsigned long g_window_size;
+static unsigned long g_protected_size;
+static unsigned long g_max_object;
+
+static const char *hop_by_hop[] = {"connection", "keep-alive", "proxy-connection", "age", NULL};
+static const char *unmerged[] = {"content-length", "transfer-encoding", "content-range", NULL}; // they'd describe the 304
+
+static void cache_directives(response_info_t *info, const char *value, int pragma);
+static unsigned long parse_head(const unsigned char *data, unsigned long size, response_info_t *info);
+static void info_free(response_info_t *info);
+
+int cache_init(unsigned long size){
+    int i;
+    
+    if(size == 0){
+        return 0;
+    }
+    if((g_cache = calloc(CACHE_SHARDS, sizeof(cache_shard_t))) == NULL){
+        return -1;
+    }
+    for(i = 0; i < CACHE_SHARDS; i++){
+        pthread_mutex_init(&g_cache[i].lock, NULL);
+    }
+    g_shard_size = size / CACHE_SHARDS;
+    g_window_size = g_shard_size * CACHE_WINDOW_PERCENT / 100;
+    g_protected_size = (g_shard_size - g_window_size) * CACHE_PROTECTED_PERCENT / 100;
+    g_max_object = g_shard_size / CACHE_OBJECT_SHARE;
+    return 0;
+}
+
+int cache_enabled(void){
+    return g_cache != NULL;
+}
+
+unsigned long long cache_key_hash(const char *key){
+    unsigned long long hash = 14695981039346656037ull; // FNV-1a
+    
+    while(*key != '\0'){
+        hash = (hash ^ (unsigned char)*key++) * 1099511628211ull;
+    }
+    return hash;
+}
+
+static cache_shard_t *shard_of(unsigned long long hash){
+    return &g_cache[hash >> 61 & (CACHE_SHARDS - 1)]; // high bits, the sketch rows use the low ones
+}
+
+/* Frequency sketch, a count-min sketch with 4 bit counters */
+
+static void sketch_increment(cache_shard_t *shard, unsigned long long hash){
+    unsigned char *counter;
+    int i, j;
+    
+    for(i = 0; i < CACHE_SKETCH_DEPTH; i++){
+        counter = &shard->sketch[i][(hash >> (i * 16)) & (CACHE_SKETCH_WIDTH - 1)];
+        if(*counter < 15){
+            (*counter)++;
+        }
+    }
+    // age everything now and then so yesterday's favourites make room
+    if(++shard->samples >= CACHE_SKETCH_WIDTH * 10){
+        for(i = 0; i < CACHE_SKETCH_DEPTH; i++){
+            for(j = 0; j < CACHE_SKETCH_WIDTH; j++){
+                shard->sketch[i][j] >>= 1;
+            }
+        }
+        shard->samples = 0;
+    }
+}
+
+static int sketch_estimate(cache_shard_t *shard, unsigned long long hash){
+    int i, count, estimate = 15;
+    
+    for(i = 0; i < CACHE_SKETCH_DEPTH; i++){
+        count = shard->sketch[i][(hash >> (i * 16)) & (CACHE_SKETCH_WIDTH - 1)];
+        if(count < estimate){
+            estimate = count;
+        }
+    }
+    return estimate;
+}
+
+/* Segments */
+
+static void list_remove(cache_shard_t *shard, cache_entry_t *entry){
+    cache_list_t *list = &shard->lists[entry->segment];
+    
+    if(entry->previous != NULL){
+        entry->previous->next = entry->next;
+    }else{
+        list->first = entry->next;
+    }
+    if(entry->next != NULL){
+        entry->next->previous = entry->previous;
+    }else{
+        list->last = entry->previous;
+    }
+    list->bytes -= entry->charge;
+    entry->previous = entry->next = NULL;
+    entry->segment = SEGMENT_NONE;
+}
+
+static void list_push(cache_shard_t *shard, cache_entry_t *entry, int segment){
+    cache_list_t *list = &shard->lists[segment];
+    
+    entry->segment = segment;
+    entry->previous = NULL;
+    entry->next = list->first;
+    if(list->first != NULL){
+        list->first->previous = entry;
+    }else{
+        list->last = entry;
+    }
+    list->first = entry;
+    list->bytes += entry->charge;
+}
+
+static void entry_free(cache_entry_t *entry){
+    free(entry->key);
+    free(entry->vary_names);
+    free(entry->vary_values);
+    free(entry->etag);
+    free(entry->last_modified);
+    disk_release(entry->disk);
+    free(entry);
+}
+
+void cache_release(cache_entry_t *entry){
+    if(entry != NULL && __sync_sub_and_fetch(&entry->references, 1) == 0){
+        entry_free(entry);
+    }
+}
+
+static void evict(cache_shard_t *shard, cache_entry_t *entry){
+    cache_entry_t **link = &shard->buckets[(entry->hash >> 32) & (CACHE_BUCKETS - 1)];
+    
+    while(*link != entry){
+        link = &(*link)->next_bucket;
+    }
+    *link = entry->next_bucket;
+    list_remove(shard, entry);
+    cache_release(entry); // whoever is still sending it keeps it alive
+}
+
+static unsigned long main_bytes(cache_shard_t *shard){
+    return shard->lists[SEGMENT_PROBATION].bytes + shard->lists[SEGMENT_PROTECTED].bytes;
+}
+
+// TinyLFU admission, the candidate only gets into the main segments if it
+// is wanted more often than whatever it would push out
+static void admit(cache_shard_t *shard, cache_entry_t *candidate){
+    cache_entry_t *victim;
+    
+    list_push(shard, candidate, SEGMENT_PROBATION);
+    while(main_bytes(shard) > g_shard_size - g_window_size){
+        victim = shard->lists[SEGMENT_PROBATION].last;
+        if(victim == candidate){
+            victim = shard->lists[SEGMENT_PROTECTED].last;
+        }
+        if(victim == NULL || sketch_estimate(shard, candidate->hash) <= sketch_estimate(shard, victim->hash)){
+            evict(shard, candidate);
+            return;
+        }
+        evict(shard, victim);
+    }
+}
+
+static void rebalance(cache_shard_t *shard){
+    cache_entry_t *entry;
+    
+    while(shard->lists[SEGMENT_WINDOW].bytes > g_window_size){
+        entry = shard->lists[SEGMENT_WINDOW].last;
+        list_remove(shard, entry);
+        admit(shard, entry);
+    }
+    while(shard->lists[SEGMENT_PROTECTED].bytes > g_protected_size){ // back on probation
+        entry = shard->lists[SEGMENT_PROTECTED].last;
+        list_remove(shard, entry);
+        list_push(shard, entry, SEGMENT_PROBATION);
+    }
+}
+
+static void touch(cache_shard_t *shard, cache_entry_t *entry){
+    int segment = entry->segment;
+    
+    list_remove(shard, entry);
+    // a second hit while on probation earns a place in the protected segment
+    list_push(shard, entry, segment == SEGMENT_PROBATION ? SEGMENT_PROTECTED : segment);
+    rebalance(shard);
+}
+
+/* Requests */
+
+// the request's Cache-Control and Pragma, through the same parser as a response's
+static void request_directives(const http_request_t *request, const unsigned char *data, response_info_t *limits){
+    const http_span_t *name;
+    char value[1024];
+    int i, pragma;
+    
+    memset(limits, 0, sizeof(response_info_t));
+    limits->max_age = limits->s_maxage = limits->min_fresh = limits->max_stale = -1;
+    for(i = 0; i < request->header_count; i++){
+        name = &request->names[i];
+        if(name->length == 13 && strncasecmp((const char *)data + name->offset, "cache-control", 13) == 0){
+            pragma = 0;
+        }else if(name->length == 6 && strncasecmp((const char *)data + name->offset, "pragma", 6) == 0){
+            pragma = 1;
+        }else{
+            continue;
+        }
+        snprintf(value, sizeof(value), "%.*s", (int)request->values[i].length, data + request->values[i].offset);
+        cache_directives(limits, value, pragma);
+    }
+}
+
+int cache_request_policy(const http_request_t *request, const unsigned char *data){
+    static const char *bypass[] = {"authorization", "range", "if-none-match", "if-modified-since",
+        "if-match", "if-unmodified-since", "if-range", NULL};
+    response_info_t limits;
+    http_span_t value;
+    int i;
+    
+    // HTTP/1.0 clients might not take the chunked responses kept for 1.1 ones
+    if(g_cache == NULL || request->version < 1 || !http_span_equals(data, request->method, "GET") || request->upgrade ||
+       request->content_length > 0 || request->transfer_encoding ||
+       request->header_count >= HTTP_MAX_HEADERS){ // headers we didn't record could be any of the above
+        return 0;
+    }
+    // the client's own conditionals and ranges go to the origin untouched
+    for(i = 0; bypass[i] != NULL; i++){
+        if(http_request_header(request, data, bypass[i], &value)){
+            return 0;
+        }
+    }
+    request_directives(request, data, &limits);
+    if(limits.no_store){
+        return 0;
+    }
+    if(limits.no_cache || limits.max_age == 0){
+        return CACHE_STORE; // a fresh copy is wanted, it can still be kept
+    }
+    return CACHE_LOOKUP | CACHE_STORE;
+}
+
+char *cache_key(const http_request_t *request, const unsigned char *data, const char *host, int port){
+    const char *target = (const char *)data + request->target.offset;
+    const char *path = target, *end = target + request->target.length;
+    size_t length;
+    char *key;
+    
+    if(request->target.length > 7 && strncasecmp(target, "http://", 7) == 0){ // absolute form
+        for(path = target + 7; path < end && *path != '/'; path++);
+    }else if(request->target.length == 0 || *target != '/'){
+        return NULL;
+    }
+    length = strlen(host) + (end - path) + 32;
+    if((key = malloc(length)) == NULL){
+        return NULL;
+    }
+    snprintf(key, length, "GET http://%s:%d%.*s", host, port, path < end ? (int)(end - path) : 1, path < end ? path : "/");
+    return key;
+}
+
+// the request's values for the headers a response varies on
+char *cache_vary_values(const char *names, const http_request_t *request, const unsigned char *data){
+    char name[64], *values;
+    const char *end;
+    http_span_t value;
+    size_t length = 0, capacity = 256, size;
+    
+    if((values = malloc(capacity)) == NULL){
+        return NULL;
+    }
+    values[0] = '\0';
+    while(*names != '\0'){
+        end = strchr(names, ',');
+        size = end != NULL ? (size_t)(end - names) : strlen(names);
+        snprintf(name, sizeof(name), "%.*s", (int)size, names);
+        names += size + (end != NULL);
+        if(!http_request_header(request, data, name, &value)){
+            value.offset = value.length = 0;
+        }
+        if(length + value.length + 2 > capacity){
+            capacity = (length + value.length + 2) * 2;
+            if((end = realloc(values, capacity)) == NULL){
+                free(values);
+                return NULL;
+            }
+            values = (char *)end;
+        }
+        memcpy(values + length, data + value.offset, value.length);
+        length += value.length;
+        values[length++] = '\n';
+        values[length] = '\0';
+    }
+    return values;
+}
+
+static int fresh(cache_entry_t *entry, long long now){
+    return entry->age + (now - entry->stored) < entry->lifetime;
+}
+
+// whether the entry does for a request with these limits, RFC 7234 5.2.1
+static int acceptable(cache_entry_t *entry, const response_info_t *limits, long long now){
+    long long age = entry->age + (now - entry->stored);
+    response_info_t stored;
+    int revalidate;
+    
+    if(limits->max_age >= 0 && age > limits->max_age * 1000){
+        return 0;
+    }
+    if(limits->min_fresh >= 0){
+        age += limits->min_fresh * 1000;
+    }
+    if(age < entry->lifetime){
+        return 1;
+    }
+    if(limits->max_stale < 0 || age - entry->lifetime > limits->max_stale * 1000){
+        return 0;
+    }
+    // the client takes it stale, unless the response said not to. There's no
+    // blank line after the stored head, but every field in it gets seen
+    parse_head(entry->head, entry->head_length, &stored);
+    revalidate = stored.must_revalidate || stored.no_cache || stored.s_maxage >= 0;
+    info_free(&stored);
+    return !revalidate;
+}
+
+// wraps a response found on disk for the connection that sends it
+static cache_entry_t *disk_entry(const char *key, unsigned long long hash, const http_request_t *request, const unsigned char *data,
+                                 const response_info_t *limits, int *is_fresh){
+    disk_object_t *object = disk_get(key, hash, request, data);
+    cache_entry_t *entry;
+    long long stored;
+    
+    if(object == NULL){
+        return NULL;
+    }
+    if((entry = calloc(1, sizeof(cache_entry_t))) == NULL){
+        disk_release(object);
+        return NULL;
+    }
+    entry->references = 1;
+    entry->shard = -1; // not in memory
+    entry->disk = object;
+    disk_times(object, &stored, &entry->age, &entry->lifetime, &entry->etag, &entry->last_modified);
+    entry->stored = event_now() - (disk_clock() - stored); // on the monotonic clock like the rest
+    entry->head = object->head;
+    entry->head_length = object->head_length;
+    entry->body = object->slab->map + object->body;
+    entry->body_length = object->body_length;
+    *is_fresh = acceptable(entry, limits, event_now());
+    if(!*is_fresh && !fresh(entry, event_now()) && entry->etag == NULL && entry->last_modified == NULL){
+        entry_free(entry);
+        return NULL;
+    }
+    return entry;
+}
+
+cache_entry_t *cache_get(const char *key, const http_request_t *request, const unsigned char *data, int *is_fresh){
+    unsigned long long hash = cache_key_hash(key);
+    cache_shard_t *shard;
+    cache_entry_t *entry;
+    response_info_t limits;
+    char *values;
+    
+    if(g_cache == NULL){
+        return NULL;
+    }
+    request_directives(request, data, &limits);
+    shard = shard_of(hash);
+    pthread_mutex_lock(&shard->lock);
+    sketch_increment(shard, hash); // every request counts towards admission, hit or not
+    for(entry = shard->buckets[(hash >> 32) & (CACHE_BUCKETS - 1)]; entry != NULL; entry = entry->next_bucket){
+        if(entry->hash != hash || strcmp(entry->key, key) != 0){
+            continue;
+        }
+        if(entry->vary_names != NULL){ // one entry per variant
+            values = cache_vary_values(entry->vary_names, request, data);
+            if(values == NULL || strcmp(values, entry->vary_values) != 0){
+                free(values);
+                continue;
+            }
+            free(values);
+        }
+        *is_fresh = acceptable(entry, &limits, event_now());
+        if(!*is_fresh && !fresh(entry, event_now()) && entry->etag == NULL && entry->last_modified == NULL){ // nothing to revalidate with
+            evict(shard, entry);
+            entry = NULL;
+            break;
+        }
+        touch(shard, entry);
+        __sync_add_and_fetch(&entry->references, 1);
+        break;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    if(entry == NULL && disk_enabled()){
+        entry = disk_entry(key, hash, request, data, &limits, is_fresh);
+    }
+    return entry;
+}
+
+int cache_validators(cache_entry_t *entry, char *headers, unsigned long size){
+    int length = 0;
+    
+    if(entry->etag != NULL){
+        length += snprintf(headers + length, size - length, "If-None-Match: %s\r\n", entry->etag);
+    }
+    if(entry->last_modified != NULL && length < (int)size){
+        length += snprintf(headers + length, size - length, "If-Modified-Since: %s\r\n", entry->last_modified);
+    }
+    return length < (int)size ? length : -1;
+}
+
+/* Serving */
+
+long long cache_entry_age(cache_entry_t *entry){
+    long long age;
+    
+    if(entry->shard < 0){ // only this connection has the wrapper
+        return (entry->age + (event_now() - entry->stored)) / 1000;
+    }
+    pthread_mutex_lock(&g_cache[entry->shard].lock); // revalidation moves it
+    age = entry->age + (event_now() - entry->stored);
+    pthread_mutex_unlock(&g_cache[entry->shard].lock);
+    return age / 1000;
+}
+
+// the stored head starts with the status line, "HTTP/1.1 200"
+int cache_entry_status(cache_entry_t *entry){
+    return entry->head_length > 12 ? atoi((const char *)entry->head + 9) : 0;
+}
+
+unsigned long cache_entry_size(cache_entry_t *entry, const char *age){
+    return entry->head_length + strlen(age) + entry->body_length;
+}
+
+// sends what is left from offset on, bodies on disk go from the file
+ssize_t cache_entry_send(cache_entry_t *entry, const char *age, unsigned long offset, int socket){
+    struct iovec parts[3], iov[3];
+    unsigned long head = entry->head_length + strlen(age);
+    ssize_t count;
+    int i, n = 0;
+#ifdef __linux__
+    off_t position;
+    
+    if(entry->disk != NULL && offset >= head){ // page cache to socket, no copy through us
+        position = entry->disk->body + (offset - head);
+        return sendfile(socket, entry->disk->slab->fd, &position, entry->body_length - (offset - head));
+    }
+#endif
+    parts[0].iov_base = (void *)entry->head;
+    parts[0].iov_len = entry->head_length;
+    parts[1].iov_base = (void *)age;
+    parts[1].iov_len = strlen(age);
+    parts[2].iov_base = (void *)entry->body;
+#ifdef __linux__
+    parts[2].iov_len = entry->disk != NULL ? 0 : entry->body_length;
+#else
+    parts[2].iov_len = entry->body_length; // straight from the mapping
+#endif
+    for(i = 0; i < 3; i++){
+        if(offset >= parts[i].iov_len){
+            offset -= parts[i].iov_len;
+            continue;
+        }
+        iov[n].iov_base = (char *)parts[i].iov_base + offset;
+        iov[n].iov_len = parts[i].iov_len - offset;
+        offset = 0;
+        n++;
+    }
+    count = writev(socket, iov, n);
+    log_payload("WRITING", socket, iov, count);
+    return count;
+}
+
+/* Responses */
+
+static time_t parse_date(const char *value){
+    struct tm tm;
+    
+    memset(&tm, 0, sizeof(tm));
+    if(strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL){ // IMF-fixdate, RFC 7231 7.1.1.1
+        return -1;
+    }
+    return timegm(&tm);
+}
+
+// whether a comma separated list of lower case names has this one
+static int listed(const char *list, const char *name, size_t length){
+    const char *end;
+    
+    for(; *list != '\0'; list = *end != '\0' ? end + 1 : end){
+        if((end = strchr(list, ',')) == NULL){
+            end = list + strlen(list);
+        }
+        if((size_t)(end - list) == length && strncasecmp(list, name, length) == 0){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// the field names of a qualified private or no-cache, those fields are left out of the stored head
+static void unstored_fields(response_info_t *info, const char *argument, size_t length){
+    size_t used;
+    
+    for(; length > 0; argument++, length--){
+        used = strlen(info->unstored);
+        if(*argument == '"' || *argument == ' ' || *argument == '\t'){
+            continue;
+        }
+        if(used >= sizeof(info->unstored) - 2){ // too many to keep track of, nothing is kept
+            info->private = 1;
+            return;
+        }
+        info->unstored[used] = tolower((unsigned char)*argument);
+    }
+    used = strlen(info->unstored);
+    if(used > 0 && info->unstored[used - 1] != ','){
+        info->unstored[used] = ',';
+    }
+}
+
+static long long delta_seconds(const char *argument, size_t length){
+    long long seconds = 0;
+    size_t i;
+    
+    if(length > 1 && argument[0] == '"'){ // quoted is tolerated
+        argument++;
+        length -= 2;
+    }
+    for(i = 0; i < length; i++){
+        if(!isdigit((unsigned char)argument[i])){
+            return 0; // invalid means stale, RFC 7234 4.2.1
+        }
+        if(seconds < CACHE_DELTA_MAX){
+            seconds = seconds * 10 + (argument[i] - '0');
+        }
+    }
+    return seconds < CACHE_DELTA_MAX ? seconds : CACHE_DELTA_MAX;
+}
+
+static void cache_directive(response_info_t *info, const char *name, size_t length, const char *argument, size_t argument_length){
+    if(length == 8 && strncasecmp(name, "no-store", 8) == 0){
+        info->no_store = 1;
+    }else if(length == 8 && strncasecmp(name, "no-cache", 8) == 0){
+        if(argument != NULL){ // only the fields it names need revalidation
+            unstored_fields(info, argument, argument_length);
+        }else{
+            info->no_cache = 1;
+        }
+    }else if(length == 7 && strncasecmp(name, "private", 7) == 0){
+        if(argument != NULL){
+            unstored_fields(info, argument, argument_length);
+        }else{
+            info->private = 1;
+        }
+    }else if(length == 8 && strncasecmp(name, "s-maxage", 8) == 0 && argument != NULL){
+        info->s_maxage = delta_seconds(argument, argument_length);
+    }else if(length == 7 && strncasecmp(name, "max-age", 7) == 0 && argument != NULL){
+        info->max_age = delta_seconds(argument, argument_length);
+    }else if((length == 15 && strncasecmp(name, "must-revalidate", 15) == 0) ||
+             (length == 16 && strncasecmp(name, "proxy-revalidate", 16) == 0)){
+        info->must_revalidate = 1;
+    }else if(length == 9 && strncasecmp(name, "min-fresh", 9) == 0 && argument != NULL){
+        info->min_fresh = delta_seconds(argument, argument_length);
+    }else if(length == 9 && strncasecmp(name, "max-stale", 9) == 0){ // however stale without a limit
+        info->max_stale = argument != NULL ? delta_seconds(argument, argument_length) : CACHE_DELTA_MAX;
+    }
+}
+
+// Cache-Control and Pragma, directives with an optional =argument separated by
+// commas, only no-cache means anything in Pragma
+static void cache_directives(response_info_t *info, const char *value, int pragma){
+    const char *name, *argument;
+    size_t length, argument_length;
+    
+    while(*value != '\0'){
+        while(*value == ' ' || *value == '\t' || *value == ','){
+            value++;
+        }
+        for(name = value; *value != '\0' && *value != ',' && *value != '=' && *value != ' ' && *value != '\t'; value++);
+        length = value - name;
+        while(*value == ' ' || *value == '\t'){
+            value++;
+        }
+        argument = NULL;
+        argument_length = 0;
+        if(*value == '='){
+            for(value++; *value == ' ' || *value == '\t'; value++);
+            argument = value;
+            if(*value == '"'){ // commas inside belong to it
+                for(value++; *value != '\0' && *value != '"'; value++){
+                    if(*value == '\\' && value[1] != '\0'){
+                        value++;
+                    }
+                }
+                if(*value == '"'){
+                    value++;
+                }
+            }else{
+                while(*value != '\0' && *value != ',' && *value != ' ' && *value != '\t'){
+                    value++;
+                }
+            }
+            argument_length = value - argument;
+        }
+        while(*value != '\0' && *value != ','){ // whatever else, up to the next one
+            value++;
+        }
+        if(length > 0 && (!pragma || (length == 8 && strncasecmp(name, "no-cache", 8) == 0))){
+            cache_directive(info, name, length, argument, argument_length);
+        }
+    }
+}
+
+static void header_field(response_info_t *info, char *name, char *value){
+    size_t used;
+    int i;
+    
+    for(i = 0; name[i] != '\0'; i++){
+        name[i] = tolower((unsigned char)name[i]);
+    }
+    if(strcmp(name, "cache-control") == 0){
+        cache_directives(info, value, 0);
+    }else if(strcmp(name, "pragma") == 0){
+        cache_directives(info, value, 1);
+    }else if(strcmp(name, "expires") == 0){
+        info->has_expires = 1;
+        info->expires = parse_date(value); // invalid dates mean already expired
+    }else if(strcmp(name, "date") == 0){
+        info->date = parse_date(value);
+    }else if(strcmp(name, "last-modified") == 0){
+        free(info->last_modified);
+        info->last_modified = strdup(value);
+        info->last_modified_time = parse_date(value);
+    }else if(strcmp(name, "etag") == 0){
+        free(info->etag);
+        info->etag = strdup(value);
+    }else if(strcmp(name, "age") == 0){
+        info->age = atoll(value);
+    }else if(strcmp(name, "set-cookie") == 0){
+        info->set_cookie = 1;
+    }else if(strcmp(name, "content-length") == 0){
+        info->content_length = atoll(value);
+    }else if(strcmp(name, "transfer-encoding") == 0){
+        info->chunked = 1; // or anything else, the length isn't known up front
+    }else if(strcmp(name, "vary") == 0){
+        used = strlen(info->vary);
+        if(used > 0 && *value != '\0'){ // another Vary line goes on with the list
+            info->vary[used++] = ',';
+        }
+        for(; *value != '\0'; value++){ // normalised
+            if(*value == ' ' || *value == '\t'){
+                continue;
+            }
+            if(used >= sizeof(info->vary) - 1){ // the variants couldn't be told apart, nothing is kept
+                info->private = 1;
+                return;
+            }
+            info->vary[used++] = tolower((unsigned char)*value);
+        }
+    }
+}
+
+// parses a head up to the blank line, returns its length or 0 if it's incomplete
+static unsigned long parse_head(const unsigned char *data, unsigned long size, response_info_t *info){
+    char line[1024], *value;
+    const unsigned char *start = data, *end = data + size, *newline;
+    unsigned long length;
+    
+    memset(info, 0, sizeof(response_info_t));
+    info->max_age = info->s_maxage = info->min_fresh = info->max_stale = info->content_length = -1;
+    for(;;){
+        if((newline = memchr(start, '\n', end - start)) == NULL){
+            return 0;
+        }
+        length = newline - start;
+        if(length > 0 && start[length - 1] == '\r'){
+            length--;
+        }
+        if(length >= sizeof(line)){
+            length = sizeof(line) - 1; // only the start of a long line matters
+        }
+        memcpy(line, start, length);
+        line[length] = '\0';
+        start = newline + 1;
+        if(info->status == 0){
+            if(strncmp(line, "HTTP/1.", 7) != 0){
+                return 0;
+            }
+            info->status = atoi(line + 9);
+        }else if(line[0] == '\0'){
+            return start - data;
+        }else if((value = strchr(line, ':')) != NULL){
+            *value++ = '\0';
+            while(*value == ' ' || *value == '\t'){
+                value++;
+            }
+            header_field(info, line, value);
+        }
+    }
+}
+
+static void info_free(response_info_t *info){
+    free(info->etag);
+    free(info->last_modified);
+    info->etag = info->last_modified = NULL;
+}
+
+static int cacheable_status(int status){
+    switch(status){
+        case 200: case 203: case 204: case 300: case 301: case 308: case 404: case 410:
+            return 1;
+    }
+    return 0;
+}
+
+// seconds of freshness a response came with, RFC 7234 4.2.1
+static long long freshness(const response_info_t *info, time_t now){
+    time_t date = info->date > 0 ? info->date : now;
+    long long lifetime = 0;
+    
+    if(info->no_cache){
+        return 0;
+    }
+    if(info->s_maxage >= 0){
+        lifetime = info->s_maxage;
+    }else if(info->max_age >= 0){
+        lifetime = info->max_age;
+    }else if(info->has_expires){
+        lifetime = info->expires > date ? info->expires - date : 0;
+    }else if(info->last_modified_time > 0 && info->last_modified_time < date){ // heuristic, a tenth of its age
+        lifetime = (date - info->last_modified_time) / 10;
+        if(lifetime > CACHE_HEURISTIC_MAX){
+            lifetime = CACHE_HEURISTIC_MAX;
+        }
+    }
+    return lifetime;
+}
+
+// ms the response was already old when it got here
+static long long initial_age(const response_info_t *info, time_t now){
+    long long apparent = info->date > 0 && now > info->date ? now - info->date : 0;
+    
+    return (apparent > info->age ? apparent : info->age) * 1000;
+}
+
+static int storable(const response_info_t *info){
+    return cacheable_status(info->status) && !info->no_store && !info->private && !info->set_cookie &&
+        !listed(info->vary, "*", 1);
+}
+
+// parses past any informational responses, returns the length of the final head
+static unsigned long final_head(const unsigned char *data, unsigned long length, response_info_t *info, unsigned long *skipped){
+    unsigned long head_length;
+    
+    for(*skipped = 0; *skipped < length; *skipped += head_length){
+        head_length = parse_head(data + *skipped, length - *skipped, info);
+        if(head_length == 0 || info->status >= 200){
+            return head_length;
+        }
+        info_free(info);
+    }
+    return 0;
+}
+
+// the stored head leaves out what only concerned the connection it came on,
+// and the fields the response said not to keep
+static unsigned long filter_head(const unsigned char *head, unsigned long length, const char *unstored, unsigned char *out){
+    const unsigned char *start = head, *end = head + length, *newline, *colon;
+    unsigned long size = 0, line;
+    int i, skip;
+    
+    while(start < end && (newline = memchr(start, '\n', end - start)) != NULL){
+        line = newline - start;
+        if(line == 0 || (line == 1 && start[0] == '\r')){ // the blank line, the Age header goes before it
+            break;
+        }
+        for(i = 0, skip = 0; hop_by_hop[i] != NULL && !skip; i++){
+            skip = strncasecmp((const char *)start, hop_by_hop[i], strlen(hop_by_hop[i])) == 0 &&
+                start[strlen(hop_by_hop[i])] == ':';
+        }
+        if(!skip && unstored[0] != '\0' && (colon = memchr(start, ':', line)) != NULL){
+            skip = listed(unstored, (const char *)start, colon - start);
+        }
+        if(!skip){
+            memcpy(out + size, start, line + 1);
+            size += line + 1;
+            if(line == 0 || start[line - 1] != '\r'){ // keep line endings uniform
+                out[size - 1] = '\r';
+                out[size++] = '\n';
+            }
+        }
+        start = newline + 1;
+    }
+    return size;
+}
+
+// the response outgrew the memory cache, a large one worth keeping goes on to disk
+static int spill(cache_fill_t *fill){
+    response_info_t *info = &fill->info;
+    unsigned long head_length, skipped, length;
+    unsigned char *head;
+    char *vary_values = NULL;
+    disk_meta_t meta;
+    
+    if(!disk_enabled() || (head_length = final_head(fill->data, fill->length, info, &skipped)) == 0 ||
+       !storable(info) || info->chunked || info->content_length < 0){ // the record is sized up front
+        return -1;
+    }
+    if((head = malloc(head_length * 2)) == NULL ||
+       (info->vary[0] != '\0' && (vary_values = cache_vary_values(info->vary, &fill->parser, (const unsigned char *)fill->request)) == NULL)){
+        free(head);
+        return -1;
+    }
+    meta.key = fill->key;
+    meta.vary_names = info->vary[0] != '\0' ? info->vary : NULL;
+    meta.vary_values = vary_values;
+    meta.etag = info->etag;
+    meta.last_modified = info->last_modified;
+    length = filter_head(fill->data + skipped, head_length, info->unstored, head);
+    fill->disk = disk_write_start(&meta, head, length, info->content_length);
+    free(head);
+    free(vary_values);
+    if(fill->disk == NULL || disk_write(fill->disk, fill->data + skipped + head_length, fill->length - skipped - head_length) < 0){
+        return -1;
+    }
+    free(fill->data);
+    fill->data = NULL;
+    fill->capacity = 0;
+    return 0;
+}
+
+cache_fill_t *cache_fill_start(const char *key, const http_request_t *request, const unsigned char *data, cache_entry_t *revalidating){
+    cache_fill_t *fill = calloc(1, sizeof(cache_fill_t));
+    
+    if(fill == NULL){
+        return NULL;
+    }
+    fill->key = strdup(key);
+    fill->request = malloc(request->header_size);
+    if(fill->key == NULL || fill->request == NULL){
+        free(fill->key);
+        free(fill->request);
+        free(fill);
+        return NULL;
+    }
+    memcpy(fill->request, data, request->header_size);
+    fill->parser = *request;
+    fill->revalidating = revalidating;
+    return fill;
+}
+
+// the response won't be kept after all
+static void abandon(cache_fill_t *fill){
+    fill->abandoned = 1;
+    free(fill->data);
+    fill->data = NULL;
+    disk_write_abort(fill->disk);
+    fill->disk = NULL;
+}
+
+void cache_fill_append(cache_fill_t *fill, const unsigned char *data, unsigned long size){
+    unsigned char *grown;
+    unsigned long capacity;
+    
+    if(fill->abandoned){
+        return;
+    }
+    if(fill->disk != NULL){
+        if(disk_write(fill->disk, data, size) < 0){
+            abandon(fill);
+        }
+        return;
+    }
+    if(fill->length + size > fill->capacity){
+        capacity = fill->capacity ? fill->capacity : 4096;
+        while(capacity < fill->length + size){
+            capacity *= 2;
+        }
+        if((grown = realloc(fill->data, capacity)) == NULL){
+            abandon(fill);
+            return;
+        }
+        fill->data = grown;
+        fill->capacity = capacity;
+    }
+    memcpy(fill->data + fill->length, data, size);
+    fill->length += size;
+    if(fill->length > g_max_object && spill(fill) < 0){ // too big for memory and not going to disk
+        abandon(fill);
+    }
+}
+
+void cache_fill_abort(cache_fill_t *fill){
+    if(fill == NULL){
+        return;
+    }
+    cache_release(fill->revalidating);
+    disk_write_abort(fill->disk);
+    info_free(&fill->info);
+    free(fill->key);
+    free(fill->request);
+    free(fill->data);
+    free(fill);
+}
+
+const char *cache_fill_key(const cache_fill_t *fill){
+    return fill->key;
+}
+
+static cache_entry_t *find_variant(cache_shard_t *shard, unsigned long long hash, const char *key, const char *vary_values){
+    cache_entry_t *entry;
+    
+    for(entry = shard->buckets[(hash >> 32) & (CACHE_BUCKETS - 1)]; entry != NULL; entry = entry->next_bucket){
+        if(entry->hash == hash && strcmp(entry->key, key) == 0 &&
+           (entry->vary_values == NULL ? vary_values == NULL : vary_values != NULL && strcmp(entry->vary_values, vary_values) == 0)){
+            break;
+        }
+    }
+    return entry;
+}
+
+static void insert(cache_entry_t *entry){
+    cache_shard_t *shard = &g_cache[entry->shard];
+    cache_entry_t **link = &shard->buckets[(entry->hash >> 32) & (CACHE_BUCKETS - 1)], *old;
+    
+    pthread_mutex_lock(&shard->lock);
+    if((old = find_variant(shard, entry->hash, entry->key, entry->vary_values)) != NULL){ // replaced
+        evict(shard, old);
+    }
+    entry->next_bucket = *link;
+    *link = entry;
+    list_push(shard, entry, SEGMENT_WINDOW);
+    rebalance(shard);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+static void store(cache_fill_t *fill, response_info_t *info, unsigned long head_length, long long lifetime, time_t now){
+    unsigned long long hash = cache_key_hash(fill->key);
+    unsigned long body_length = fill->length - head_length;
+    cache_entry_t *entry;
+    
+    if((entry = calloc(1, sizeof(cache_entry_t) + head_length * 2 + body_length)) == NULL){ // room for bare LFs turned into CRLFs
+        return;
+    }
+    entry->references = 1;
+    entry->hash = hash;
+    entry->shard = shard_of(hash) - g_cache;
+    entry->key = strdup(fill->key);
+    entry->etag = info->etag;
+    entry->last_modified = info->last_modified;
+    info->etag = info->last_modified = NULL;
+    if(info->vary[0] != '\0'){
+        entry->vary_names = strdup(info->vary);
+        entry->vary_values = cache_vary_values(info->vary, &fill->parser, (const unsigned char *)fill->request);
+        if(entry->vary_names == NULL || entry->vary_values == NULL){
+            entry_free(entry);
+            return;
+        }
+    }
+    entry->stored = event_now();
+    entry->age = initial_age(info, now);
+    entry->lifetime = lifetime * 1000;
+    entry->head = entry->data;
+    entry->head_length = filter_head(fill->data, head_length, info->unstored, entry->data);
+    entry->body = entry->data + entry->head_length;
+    memcpy(entry->data + entry->head_length, fill->data + head_length, body_length);
+    entry->body_length = body_length;
+    entry->charge = sizeof(cache_entry_t) + entry->head_length + body_length + strlen(entry->key) * 2;
+    if(entry->key == NULL || entry->charge > g_max_object){
+        entry_free(entry);
+        return;
+    }
+    insert(entry);
+}
+
+static int is_unmerged(const unsigned char *name, size_t length){
+    int i;
+    
+    for(i = 0; unmerged[i] != NULL; i++){
+        if(strlen(unmerged[i]) == length && strncasecmp((const char *)name, unmerged[i], length) == 0){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int has_field(const unsigned char *head, unsigned long length, const unsigned char *name, size_t name_length){
+    const unsigned char *start = head, *end = head + length, *newline;
+    
+    for(; start < end && (newline = memchr(start, '\n', end - start)) != NULL; start = newline + 1){
+        if((unsigned long)(newline - start) > name_length && start[name_length] == ':' &&
+           strncasecmp((const char *)start, (const char *)name, name_length) == 0){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// the stored head with the fields a 304 came with in place of its own, RFC 7234 4.3.4,
+// the update is a filtered head without its status line
+static unsigned long merge_head(const unsigned char *stored, unsigned long stored_length,
+                                const unsigned char *update, unsigned long update_length, unsigned char *out){
+    const unsigned char *start, *end, *newline, *colon;
+    unsigned long size = 0, line;
+    
+    for(start = stored, end = stored + stored_length; start < end && (newline = memchr(start, '\n', end - start)) != NULL; start = newline + 1){
+        line = newline + 1 - start;
+        colon = start == stored ? NULL : memchr(start, ':', line); // the status line stays
+        if(colon == NULL || is_unmerged(start, colon - start) || !has_field(update, update_length, start, colon - start)){
+            memcpy(out + size, start, line);
+            size += line;
+        }
+    }
+    for(start = update, end = update + update_length; start < end && (newline = memchr(start, '\n', end - start)) != NULL; start = newline + 1){
+        line = newline + 1 - start;
+        if((colon = memchr(start, ':', line)) != NULL && !is_unmerged(start, colon - start)){
+            memcpy(out + size, start, line);
+            size += line;
+        }
+    }
+    return size;
+}
+
+// a copy of the entry with the merged head takes its place, the caller gets a reference
+static cache_entry_t *replace(cache_entry_t *entry, const unsigned char *head, unsigned long head_length,
+                              response_info_t *info, long long age, long long lifetime){
+    cache_entry_t *copy;
+    
+    if((copy = calloc(1, sizeof(cache_entry_t) + head_length + entry->body_length)) == NULL){
+        return NULL;
+    }
+    copy->references = 2;
+    copy->hash = entry->hash;
+    copy->shard = entry->shard;
+    copy->key = strdup(entry->key);
+    copy->vary_names = entry->vary_names != NULL ? strdup(entry->vary_names) : NULL;
+    copy->vary_values = entry->vary_values != NULL ? strdup(entry->vary_values) : NULL;
+    copy->etag = info->etag;
+    copy->last_modified = info->last_modified;
+    info->etag = info->last_modified = NULL;
+    copy->stored = event_now();
+    copy->age = age;
+    copy->lifetime = lifetime;
+    copy->head = copy->data;
+    copy->head_length = head_length;
+    memcpy(copy->data, head, head_length);
+    copy->body = copy->data + head_length;
+    memcpy(copy->data + head_length, entry->body, entry->body_length);
+    copy->body_length = entry->body_length;
+    copy->charge = sizeof(cache_entry_t) + head_length + copy->body_length + strlen(entry->key) * 2;
+    if(copy->key == NULL || (entry->vary_names != NULL && (copy->vary_names == NULL || copy->vary_values == NULL)) ||
+       copy->charge > g_max_object){
+        entry_free(copy);
+        return NULL;
+    }
+    insert(copy); // the old one goes
+    return copy;
+}
+
+// a 304 to our own revalidation freshens the entry up, returns the entry to send
+static cache_entry_t *refresh(cache_entry_t *entry, response_info_t *info, const unsigned char *update,
+                              unsigned long update_length, time_t now){
+    response_info_t merged;
+    unsigned char *fields = malloc(update_length * 2), *head = malloc(entry->head_length + update_length * 2);
+    const unsigned char *newline;
+    unsigned long length, skip = 0;
+    long long age = initial_age(info, now), lifetime = freshness(info, now) * 1000;
+    cache_entry_t *copy = NULL;
+    
+    memset(&merged, 0, sizeof(merged));
+    if(fields != NULL && head != NULL){
+        length = filter_head(update, update_length, info->unstored, fields);
+        if((newline = memchr(fields, '\n', length)) != NULL){
+            skip = newline + 1 - fields;
+        }
+        length = merge_head(entry->head, entry->head_length, fields + skip, length - skip, head);
+        parse_head(head, length, &merged); // no blank line, but every field gets seen
+        lifetime = freshness(&merged, now) * 1000;
+        if(entry->shard >= 0 && (copy = replace(entry, head, length, &merged, age, lifetime)) != NULL){
+            cache_release(entry);
+            entry = copy;
+        }
+    }else if(!(info->max_age >= 0 || info->s_maxage >= 0 || info->has_expires || info->no_cache)){
+        lifetime = entry->lifetime; // no room to merge, the old lifetime stands
+    }
+    if(copy == NULL){ // the times at least, the head stays as it was
+        if(entry->shard >= 0){
+            pthread_mutex_lock(&g_cache[entry->shard].lock);
+        }
+        entry->lifetime = lifetime;
+        entry->stored = event_now();
+        entry->age = age;
+        if(entry->shard >= 0){
+            pthread_mutex_unlock(&g_cache[entry->shard].lock);
+        }else{ // the record on disk too, for everyone else and the next start
+            if(merged.etag != NULL || merged.last_modified != NULL){ // only this connection has the wrapper
+                free(entry->etag);
+                free(entry->last_modified);
+                entry->etag = merged.etag != NULL ? strdup(merged.etag) : NULL;
+                entry->last_modified = merged.last_modified != NULL ? strdup(merged.last_modified) : NULL;
+            }
+            disk_refresh(entry->disk, disk_clock(), entry->age, entry->lifetime, merged.etag, merged.last_modified);
+        }
+    }
+    info_free(&merged);
+    free(fields);
+    free(head);
+    return entry;
+}
+
+// a newer copy went to disk, the one in memory would hide it
+static void forget(cache_fill_t *fill){
+    unsigned long long hash = cache_key_hash(fill->key);
+    cache_shard_t *shard = shard_of(hash);
+    cache_entry_t *entry;
+    char *vary_values = NULL;
+    
+    if(fill->info.vary[0] != '\0' &&
+       (vary_values = cache_vary_values(fill->info.vary, &fill->parser, (const unsigned char *)fill->request)) == NULL){
+        return;
+    }
+    pthread_mutex_lock(&shard->lock);
+    if((entry = find_variant(shard, hash, fill->key, vary_values)) != NULL){
+        evict(shard, entry);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    free(vary_values);
+}
+
+// the response is complete, returns the revalidated entry if it was a 304
+cache_entry_t *cache_fill_finish(cache_fill_t *fill){
+    response_info_t info;
+    cache_entry_t *entry = NULL;
+    unsigned long head_length = 0, skipped = 0;
+    long long lifetime;
+    time_t now = time(NULL);
+    
+    memset(&info, 0, sizeof(info));
+    if(fill->disk != NULL){ // spilled, commit the record if it all arrived
+        lifetime = freshness(&fill->info, now);
+        if(disk_write_complete(fill->disk) && (lifetime > 0 || fill->info.etag != NULL || fill->info.last_modified != NULL)){
+            forget(fill);
+            disk_write_finish(fill->disk, disk_clock(), initial_age(&fill->info, now), lifetime * 1000);
+            fill->disk = NULL;
+        }
+    }else if(fill->abandoned || (head_length = final_head(fill->data, fill->length, &info, &skipped)) == 0){
+        // nothing to go by
+    }else if(info.status == 304 && fill->revalidating != NULL){
+        entry = refresh(fill->revalidating, &info, fill->data + skipped, head_length, now);
+        fill->revalidating = NULL;
+    }else if(skipped == 0 && storable(&info)){ // 1xx heads aren't kept
+        lifetime = freshness(&info, now);
+        if(lifetime > 0 || info.etag != NULL || info.last_modified != NULL){ // worth keeping
+            store(fill, &info, head_length, lifetime, now);
+        }
+    }
+    info_free(&info);
+    cache_fill_abort(fill);
+    return entry;
+}
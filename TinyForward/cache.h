@@ -0,0 +1,76 @@
+//
+//  cache.h
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef TinyForward_cache_h
+#define TinyForward_cache_h
+
+#include <sys/types.h>
+#include "http.h"
+
+#define CACHE_SIZE_MB          64    // default, -c
+#define CACHE_SHARDS           8     // must be a power of two
+#define CACHE_BUCKETS          1024  // per shard, must be a power of two
+#define CACHE_OBJECT_SHARE     4     // one object takes at most this fraction of a shard
+#define CACHE_WINDOW_PERCENT   1     // admission window, the rest is the main SLRU
+#define CACHE_PROTECTED_PERCENT 80   // of the main SLRU
+#define CACHE_SKETCH_WIDTH     4096  // counters per row of the frequency sketch, must be a power of two
+#define CACHE_SKETCH_DEPTH     4
+#define CACHE_HEURISTIC_MAX    86400 // s, cap on freshness guessed from Last-Modified
+#define CACHE_DELTA_MAX        2147483648LL // s, larger delta-seconds are taken as this, RFC 7234 1.2.1
+
+// what a request may do with the cache, 0 means leave it alone
+#define CACHE_LOOKUP  0x01
+#define CACHE_STORE   0x02
+
+typedef struct cache_entry cache_entry_t;
+typedef struct cache_fill cache_fill_t;
+
+// A shared, memory bounded cache of GET responses keyed by absolute URL,
+// with a W-TinyLFU policy: new entries go through a small LRU window and
+// only make it into the main segmented LRU if a frequency sketch says they
+// are wanted more than what they would push out. Entries are reference
+// counted so a client can keep streaming one after it has been evicted.
+// Responses too large for memory spill over into the disk tier if there is one.
+int cache_init(unsigned long size);
+int cache_enabled(void);
+unsigned long long cache_key_hash(const char *key);
+
+/* Requests */
+int cache_request_policy(const http_request_t *request, const unsigned char *data);
+char *cache_key(const http_request_t *request, const unsigned char *data, const char *host, int port);
+char *cache_vary_values(const char *names, const http_request_t *request, const unsigned char *data);
+cache_entry_t *cache_get(const char *key, const http_request_t *request, const unsigned char *data, int *fresh);
+int cache_validators(cache_entry_t *entry, char *headers, unsigned long size);
+void cache_release(cache_entry_t *entry);
+
+/* Serving, the stored head plus an Age header */
+unsigned long cache_entry_size(cache_entry_t *entry, const char *age);
+ssize_t cache_entry_send(cache_entry_t *entry, const char *age, unsigned long offset, int socket);
+long long cache_entry_age(cache_entry_t *entry);
+int cache_entry_status(cache_entry_t *entry);
+
+/* Filling from a response */
+cache_fill_t *cache_fill_start(const char *key, const http_request_t *request, const unsigned char *data, cache_entry_t *revalidating);
+void cache_fill_append(cache_fill_t *fill, const unsigned char *data, unsigned long size);
+cache_entry_t *cache_fill_finish(cache_fill_t *fill);
+void cache_fill_abort(cache_fill_t *fill);
+const char *cache_fill_key(const cache_fill_t *fill);
+
+#endif
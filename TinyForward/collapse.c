@@ -0,0 +1,155 @@
+//
+//  collapse.c
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "tinyforward.h"
+#include "worker.h"
+
+static void wake_waiters(wheel_timer_t *timer);
+
+static collapse_t **bucket_of(worker_t *worker, unsigned long long hash){
+    return &worker->collapsing[hash & (COLLAPSE_BUCKETS - 1)];
+}
+
+static collapse_t **find(worker_t *worker, const char *key, unsigned long long hash){
+    collapse_t **link;
+    
+    for(link = bucket_of(worker, hash); *link != NULL; link = &(*link)->next_bucket){
+        if((*link)->hash == hash && strcmp((*link)->key, key) == 0){
+            break;
+        }
+    }
+    return link;
+}
+
+static void unlink_collapse(collapse_t *collapse){
+    collapse_t **link;
+    
+    for(link = bucket_of(collapse->worker, collapse->hash); *link != NULL; link = &(*link)->next_bucket){
+        if(*link == collapse){
+            *link = collapse->next_bucket;
+            break;
+        }
+    }
+}
+
+static void free_collapse(collapse_t *collapse){
+    wheel_cancel(&collapse->worker->timers, &collapse->timer);
+    free(collapse->key);
+    free(collapse);
+}
+
+// the response about to be fetched for the cache is the one others can wait for
+void collapse_lead(connection_t *conn, const char *key, cache_fill_t *fill){
+    worker_t *worker = conn->worker;
+    unsigned long long hash = cache_key_hash(key);
+    collapse_t *collapse, **link;
+    
+    if(*(link = find(worker, key, hash)) != NULL){ // someone is already at it
+        return;
+    }
+    if((collapse = calloc(1, sizeof(collapse_t))) == NULL || (collapse->key = strdup(key)) == NULL){
+        free(collapse);
+        return;
+    }
+    collapse->hash = hash;
+    collapse->worker = worker;
+    collapse->fill = fill;
+    wheel_timer_init(&collapse->timer, wake_waiters, collapse);
+    *link = collapse;
+}
+
+// returns 1 if the request waits for one already on its way
+int collapse_follow(connection_t *conn, const char *key){
+    worker_t *worker = conn->worker;
+    collapse_t *collapse = *find(worker, key, cache_key_hash(key));
+    
+    if(collapse == NULL){
+        return 0;
+    }
+    if(collapse->waiters == NULL){ // gives up on the first one after a while
+        wheel_arm(&worker->timers, &collapse->timer, event_now() + COLLAPSE_TIMEOUT);
+    }
+    conn->collapse = collapse;
+    conn->next_waiter = collapse->waiters;
+    collapse->waiters = conn;
+    metrics_add(&worker->metrics.cache_collapsed, 1);
+    return 1;
+}
+
+// a waiting client went away
+void collapse_leave(connection_t *conn){
+    collapse_t *collapse = conn->collapse;
+    connection_t **link;
+    
+    if(collapse == NULL){
+        return;
+    }
+    for(link = &collapse->waiters; *link != NULL; link = &(*link)->next_waiter){
+        if(*link == conn){
+            *link = conn->next_waiter;
+            break;
+        }
+    }
+    conn->collapse = NULL;
+    conn->next_waiter = NULL;
+    if(collapse->waiters == NULL && collapse->fill == NULL){ // done with, nobody left to wake
+        free_collapse(collapse);
+    }else if(collapse->waiters == NULL){ // nobody to give up for
+        wheel_cancel(&conn->worker->timers, &collapse->timer);
+    }
+}
+
+// the response is complete, or won't be. The waiters are woken from the
+// timer rather than right here, in the middle of reading it.
+void collapse_done(worker_t *worker, cache_fill_t *fill){
+    const char *key = cache_fill_key(fill);
+    collapse_t *collapse = *find(worker, key, cache_key_hash(key));
+    
+    if(collapse == NULL || collapse->fill != fill){ // not one anybody waits for
+        return;
+    }
+    unlink_collapse(collapse);
+    collapse->fill = NULL;
+    if(collapse->waiters == NULL){
+        free_collapse(collapse);
+        return;
+    }
+    wheel_arm(&worker->timers, &collapse->timer, event_now());
+}
+
+// Each waiter tries its request again, now a hit if the response was kept.
+// If it wasn't, or the first one took too long, they all go to the server
+// at once rather than lining up behind each other.
+static void wake_waiters(wheel_timer_t *timer){
+    collapse_t *collapse = timer->owner;
+    connection_t *conn;
+    
+    if(collapse->fill != NULL){ // timed out, whoever comes next doesn't wait either
+        log_message(LOG_INFO, "Gave up waiting for %s after %d ms.", collapse->key, COLLAPSE_TIMEOUT);
+        unlink_collapse(collapse);
+    }
+    while((conn = collapse->waiters) != NULL){
+        collapse->waiters = conn->next_waiter;
+        conn->collapse = NULL;
+        conn->next_waiter = NULL;
+        conn->collapse_bypass = 1;
+        client_event_handler(&conn->client, EVENT_READ); // as if more of the request had come in
+    }
+    free_collapse(collapse);
+}
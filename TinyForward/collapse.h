@@ -0,0 +1,53 @@
+//
+//  collapse.h
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef TinyForward_collapse_h
+#define TinyForward_collapse_h
+
+#include "cache.h"
+#include "wheel.h"
+
+#define COLLAPSE_BUCKETS  256  // per worker, must be a power of two
+#define COLLAPSE_TIMEOUT  5000 // ms the others wait for the first one's response before fetching it themselves
+
+typedef struct connection connection_t;
+typedef struct worker worker_t;
+typedef struct collapse collapse_t;
+
+// Cache misses for the same key coming in while one is already being
+// fetched wait for that response instead of asking the server again, and
+// are then answered from the entry it leaves in the cache. Each worker
+// keeps its own table, so no locks and no wakeups across threads: there are
+// at most as many fetches as workers.
+struct collapse {
+    char *key;
+    unsigned long long hash;
+    worker_t *worker;
+    cache_fill_t *fill; // the response everyone waits for, NULL once it is done with
+    connection_t *waiters; // through next_waiter
+    wheel_timer_t timer; // wakes the waiters once it is done, or gives up on it
+    collapse_t *next_bucket;
+};
+
+void collapse_lead(connection_t *conn, const char *key, cache_fill_t *fill);
+int collapse_follow(connection_t *conn, const char *key);
+void collapse_leave(connection_t *conn);
+void collapse_done(worker_t *worker, cache_fill_t *fill);
+
+#endif
@@ -0,0 +1,546 @@
+//
+//  disk.c
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "cache.h"
+#include "disk.h"
+#include "log.h"
+
+#define RECORD_PENDING    1 // space reserved, the body is still being written
+#define RECORD_COMMITTED  2
+
+// On disk in front of every response, followed by the key, the Vary names
+// and values, ETag, Last-Modified, the stored head and the body.
+typedef struct disk_record {
+    unsigned int magic;
+    unsigned int state;
+    unsigned long long length; // the whole record
+    long long stored;
+    long long age;
+    long long lifetime;
+    unsigned int key_length;
+    unsigned int vary_names_length; // 0 if there is no Vary
+    unsigned int vary_values_length;
+    unsigned int etag_length; // 0 if absent, and so on
+    unsigned int last_modified_length;
+    unsigned int head_length;
+    unsigned long long body_length;
+} disk_record_t;
+
+struct disk_write {
+    disk_slab_t *slab;
+    unsigned long long offset; // of the record
+    unsigned long long body; // where the next body byte goes
+    unsigned long long remaining;
+    disk_record_t record;
+};
+
+static pthread_mutex_t g_disk_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *g_disk_directory = NULL;
+static unsigned long long g_disk_quota;
+static unsigned long long g_disk_used; // reserved in every slab
+static disk_object_t *g_disk_buckets[DISK_BUCKETS];
+static disk_slab_t *g_oldest_slab = NULL;
+static disk_slab_t *g_open_slab = NULL; // the youngest, appended to
+static int g_next_slab = 0;
+
+int disk_enabled(void){
+    return g_disk_directory != NULL;
+}
+
+unsigned long long disk_max_object(void){
+    return g_disk_quota / DISK_OBJECT_SHARE;
+}
+
+// small quotas get smaller slabs so eviction doesn't throw out most of the cache at once
+static unsigned long long slab_size(void){
+    return DISK_SLAB_SIZE < disk_max_object() ? DISK_SLAB_SIZE : disk_max_object();
+}
+
+long long disk_clock(void){
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void slab_path(int number, char *path, size_t size){
+    snprintf(path, size, "%s/slab.%08d", g_disk_directory, number);
+}
+
+static void slab_release(disk_slab_t *slab){
+    if(__sync_sub_and_fetch(&slab->references, 1) == 0){
+        munmap(slab->map, slab->capacity);
+        close(slab->fd);
+        free(slab);
+    }
+}
+
+// maps a slab file, a new one is sized to capacity
+static disk_slab_t *slab_open(int number, unsigned long long capacity){
+    disk_slab_t *slab;
+    struct stat st;
+    char path[PATH_MAX];
+    int fd;
+    
+    slab_path(number, path, sizeof(path));
+    if((fd = open(path, capacity > 0 ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644)) < 0){
+        log_message(LOG_ERROR, "Cannot open %s: %s", path, strerror(errno));
+        return NULL;
+    }
+    // sparse, only what is written takes up space
+    if((capacity > 0 && ftruncate(fd, capacity) < 0) || fstat(fd, &st) < 0 || st.st_size == 0 ||
+       (slab = calloc(1, sizeof(disk_slab_t))) == NULL){
+        log_message(LOG_ERROR, "Cannot size %s: %s", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    slab->capacity = st.st_size;
+    if((slab->map = mmap(NULL, slab->capacity, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED){
+        log_message(LOG_ERROR, "Cannot map %s: %s", path, strerror(errno));
+        close(fd);
+        free(slab);
+        return NULL;
+    }
+    slab->references = 1;
+    slab->number = number;
+    slab->fd = fd;
+    return slab;
+}
+
+static int same_variant(const char *a, const char *b){
+    return a == NULL ? b == NULL : b != NULL && strcmp(a, b) == 0;
+}
+
+static void object_free(disk_object_t *object){
+    free(object->key);
+    free(object->vary_names);
+    free(object->vary_values);
+    free(object->etag);
+    free(object->last_modified);
+    slab_release(object->slab);
+    free(object);
+}
+
+void disk_release(disk_object_t *object){
+    if(object != NULL && __sync_sub_and_fetch(&object->references, 1) == 0){
+        object_free(object);
+    }
+}
+
+// takes it out of the index, whoever is sending it keeps it alive
+static void unindex(disk_object_t *object){
+    disk_object_t **link = &g_disk_buckets[object->hash & (DISK_BUCKETS - 1)];
+    
+    while(*link != object){
+        link = &(*link)->next_bucket;
+    }
+    *link = object->next_bucket;
+    for(link = &object->slab->objects; *link != object; link = &(*link)->next_in_slab);
+    *link = object->next_in_slab;
+    disk_release(object);
+}
+
+static char *field(const unsigned char *data, unsigned int length){
+    return length > 0 ? strndup((const char *)data, length) : NULL;
+}
+
+// whether the lengths in a record add up to what it takes in the slab
+static int record_sound(const disk_slab_t *slab, unsigned long long offset, const disk_record_t *record){
+    unsigned long long length = sizeof(disk_record_t);
+    
+    length += (unsigned long long)record->key_length + record->vary_names_length + record->vary_values_length;
+    length += (unsigned long long)record->etag_length + record->last_modified_length + record->head_length;
+    if(record->body_length > slab->capacity || record->key_length == 0){
+        return 0;
+    }
+    length += record->body_length;
+    return length == record->length && offset <= slab->capacity && record->length <= slab->capacity - offset;
+}
+
+// adds the committed record at offset to the index, an older copy of the
+// same variant is replaced unless it was stored later
+static void index_record(disk_slab_t *slab, unsigned long long offset, int newest){
+    const unsigned char *data = slab->map + offset + sizeof(disk_record_t);
+    disk_object_t *object, *old;
+    disk_record_t record;
+    
+    memcpy(&record, slab->map + offset, sizeof(record));
+    if(!record_sound(slab, offset, &record)){
+        log_message(LOG_WARN, "Skipping a damaged record in disk cache slab %d.", slab->number);
+        return;
+    }
+    if((object = calloc(1, sizeof(disk_object_t))) == NULL){
+        return;
+    }
+    object->references = 1;
+    object->key = field(data, record.key_length);
+    data += record.key_length;
+    object->vary_names = field(data, record.vary_names_length);
+    data += record.vary_names_length;
+    object->vary_values = record.vary_names_length > 0 ? strndup((const char *)data, record.vary_values_length) : NULL;
+    data += record.vary_values_length;
+    object->etag = field(data, record.etag_length);
+    data += record.etag_length;
+    object->last_modified = field(data, record.last_modified_length);
+    data += record.last_modified_length;
+    object->head = data;
+    object->head_length = record.head_length;
+    object->body = data + record.head_length - slab->map;
+    object->body_length = record.body_length;
+    object->stored = record.stored;
+    object->age = record.age;
+    object->lifetime = record.lifetime;
+    object->offset = offset;
+    object->slab = slab;
+    __sync_add_and_fetch(&slab->references, 1);
+    if(object->key == NULL){
+        object_free(object);
+        return;
+    }
+    object->hash = cache_key_hash(object->key);
+    for(old = g_disk_buckets[object->hash & (DISK_BUCKETS - 1)]; old != NULL; old = old->next_bucket){
+        if(old->hash == object->hash && strcmp(old->key, object->key) == 0 && same_variant(old->vary_values, object->vary_values)){
+            if(!newest && old->stored > object->stored){
+                object_free(object);
+                return;
+            }
+            unindex(old);
+            break;
+        }
+    }
+    object->next_bucket = g_disk_buckets[object->hash & (DISK_BUCKETS - 1)];
+    g_disk_buckets[object->hash & (DISK_BUCKETS - 1)] = object;
+    object->next_in_slab = slab->objects;
+    slab->objects = object;
+}
+
+// walks the records of a slab left by an earlier run
+static void scan_slab(disk_slab_t *slab){
+    unsigned long long offset = 0;
+    disk_record_t record;
+    
+    while(offset + sizeof(record) <= slab->capacity){
+        memcpy(&record, slab->map + offset, sizeof(record));
+        if(record.magic != DISK_MAGIC || record.length < sizeof(record) || record.length > slab->capacity - offset){
+            break; // the unwritten end, or torn by a crash
+        }
+        if(record.state == RECORD_COMMITTED){
+            index_record(slab, offset, 0);
+        }
+        offset += record.length;
+    }
+    slab->used = offset;
+}
+
+static void evict_slab(void){
+    disk_slab_t *slab = g_oldest_slab;
+    char path[PATH_MAX];
+    
+    g_oldest_slab = slab->next;
+    if(g_open_slab == slab){
+        g_open_slab = NULL;
+    }
+    while(slab->objects != NULL){
+        unindex(slab->objects);
+    }
+    slab_path(slab->number, path, sizeof(path));
+    unlink(path); // the mapping stays valid for anyone still sending from it
+    slab->evicted = 1;
+    g_disk_used -= slab->used;
+    slab_release(slab);
+}
+
+static void add_slab(disk_slab_t *slab){
+    disk_slab_t **link = &g_oldest_slab;
+    
+    while(*link != NULL){
+        link = &(*link)->next;
+    }
+    *link = slab;
+    g_disk_used += slab->used;
+}
+
+static int compare_numbers(const void *a, const void *b){
+    return *(const int *)a - *(const int *)b;
+}
+
+int disk_init(const char *directory, unsigned long long quota){
+    struct dirent *entry;
+    disk_slab_t *slab;
+    DIR *dir;
+    int *numbers = NULL, count = 0, capacity = 0, number, i;
+    
+    if(directory == NULL || quota == 0){
+        return 0;
+    }
+    if((dir = opendir(directory)) == NULL){
+        log_message(LOG_ERROR, "Cannot open cache directory %s: %s", directory, strerror(errno));
+        return -1;
+    }
+    g_disk_directory = strdup(directory);
+    g_disk_quota = quota;
+    while((entry = readdir(dir)) != NULL){
+        if(sscanf(entry->d_name, "slab.%d", &number) != 1){
+            continue;
+        }
+        if(count == capacity){
+            capacity = capacity ? capacity * 2 : 64;
+            if((numbers = realloc(numbers, capacity * sizeof(int))) == NULL){
+                closedir(dir);
+                return -1;
+            }
+        }
+        numbers[count++] = number;
+    }
+    closedir(dir);
+    // oldest first, so newer copies of a response win
+    if(count > 0){
+        qsort(numbers, count, sizeof(int), compare_numbers);
+    }
+    for(i = 0; i < count; i++){
+        if((slab = slab_open(numbers[i], 0)) != NULL){
+            scan_slab(slab);
+            add_slab(slab);
+        }
+        g_next_slab = numbers[i] + 1;
+    }
+    free(numbers);
+    while(g_oldest_slab != NULL && g_disk_used > g_disk_quota){ // the quota may have shrunk
+        evict_slab();
+    }
+    log_message(LOG_INFO, "Disk cache in %s, %llu MB of %llu MB in use", directory, g_disk_used >> 20, quota >> 20);
+    return 0;
+}
+
+disk_object_t *disk_get(const char *key, unsigned long long hash, const http_request_t *request, const unsigned char *data){
+    disk_object_t *object;
+    char *values;
+    
+    if(g_disk_directory == NULL){
+        return NULL;
+    }
+    pthread_mutex_lock(&g_disk_lock);
+    for(object = g_disk_buckets[hash & (DISK_BUCKETS - 1)]; object != NULL; object = object->next_bucket){
+        if(object->hash != hash || strcmp(object->key, key) != 0){
+            continue;
+        }
+        if(object->vary_names != NULL){
+            values = cache_vary_values(object->vary_names, request, data);
+            if(values == NULL || strcmp(values, object->vary_values) != 0){
+                free(values);
+                continue;
+            }
+            free(values);
+        }
+        __sync_add_and_fetch(&object->references, 1);
+        break;
+    }
+    pthread_mutex_unlock(&g_disk_lock);
+    return object;
+}
+
+// the validators are copies for the caller to free
+void disk_times(disk_object_t *object, long long *stored, long long *age, long long *lifetime, char **etag, char **last_modified){
+    pthread_mutex_lock(&g_disk_lock); // disk_refresh() may be at it
+    *stored = object->stored;
+    *age = object->age;
+    *lifetime = object->lifetime;
+    *etag = object->etag != NULL ? strdup(object->etag) : NULL;
+    *last_modified = object->last_modified != NULL ? strdup(object->last_modified) : NULL;
+    pthread_mutex_unlock(&g_disk_lock);
+}
+
+static int write_all(int fd, const void *data, unsigned long long size, unsigned long long offset){
+    ssize_t count;
+    
+    while(size > 0){
+        if((count = pwrite(fd, data, size, offset)) <= 0){
+            if(count < 0 && errno == EINTR){
+                continue;
+            }
+            log_message(LOG_WARN, "Cannot write to disk cache: %s", count < 0 ? strerror(errno) : "short write");
+            return -1;
+        }
+        data = (const unsigned char *)data + count;
+        size -= count;
+        offset += count;
+    }
+    return 0;
+}
+
+// a revalidation came back not modified, the record's times are updated in place,
+// new validators only in the index since their room in the record is fixed
+void disk_refresh(disk_object_t *object, long long stored, long long age, long long lifetime, const char *etag, const char *last_modified){
+    long long times[3] = {stored, age, lifetime}; // laid out like the record
+    char *copy;
+    
+    pthread_mutex_lock(&g_disk_lock);
+    object->stored = stored;
+    object->age = age;
+    object->lifetime = lifetime;
+    if(etag != NULL && (copy = strdup(etag)) != NULL){
+        free(object->etag);
+        object->etag = copy;
+    }
+    if(last_modified != NULL && (copy = strdup(last_modified)) != NULL){
+        free(object->last_modified);
+        object->last_modified = copy;
+    }
+    pthread_mutex_unlock(&g_disk_lock);
+    if(write_all(object->slab->fd, times, sizeof(times), object->offset + offsetof(disk_record_t, stored)) < 0){
+        log_message(LOG_WARN, "Cannot update disk cache record.");
+    }
+}
+
+// room at the end of the open slab, or a new one
+static disk_slab_t *reserve(unsigned long long length, unsigned long long *offset){
+    disk_slab_t *slab = g_open_slab;
+    
+    if(slab == NULL || slab->used + length > slab->capacity){
+        if((slab = slab_open(g_next_slab++, length > slab_size() ? length : slab_size())) == NULL){
+            return NULL;
+        }
+        add_slab(slab);
+        g_open_slab = slab;
+    }
+    *offset = slab->used;
+    slab->used += length;
+    g_disk_used += length;
+    while(g_oldest_slab != slab && g_disk_used > g_disk_quota){
+        evict_slab();
+    }
+    __sync_add_and_fetch(&slab->references, 1);
+    return slab;
+}
+
+disk_write_t *disk_write_start(const disk_meta_t *meta, const unsigned char *head, unsigned long head_length, unsigned long long body_length){
+    const char *fields[5] = {meta->key, meta->vary_names, meta->vary_values, meta->etag, meta->last_modified};
+    unsigned int lengths[5];
+    unsigned long long length = sizeof(disk_record_t) + head_length + body_length, position;
+    disk_write_t *write;
+    int i;
+    
+    for(i = 0; i < 5; i++){
+        lengths[i] = fields[i] != NULL ? strlen(fields[i]) : 0;
+        length += lengths[i];
+    }
+    if(g_disk_directory == NULL || length > disk_max_object() || (write = calloc(1, sizeof(disk_write_t))) == NULL){
+        return NULL;
+    }
+    pthread_mutex_lock(&g_disk_lock);
+    write->slab = reserve(length, &write->offset);
+    pthread_mutex_unlock(&g_disk_lock);
+    if(write->slab == NULL){
+        free(write);
+        return NULL;
+    }
+    write->record.magic = DISK_MAGIC;
+    write->record.state = RECORD_PENDING; // skipped after a restart until it is committed
+    write->record.length = length;
+    write->record.key_length = lengths[0];
+    write->record.vary_names_length = lengths[1];
+    write->record.vary_values_length = lengths[2];
+    write->record.etag_length = lengths[3];
+    write->record.last_modified_length = lengths[4];
+    write->record.head_length = head_length;
+    write->record.body_length = body_length;
+    position = write->offset;
+    if(write_all(write->slab->fd, &write->record, sizeof(disk_record_t), position) < 0){
+        disk_write_abort(write);
+        return NULL;
+    }
+    position += sizeof(disk_record_t);
+    for(i = 0; i < 5; i++){
+        if(write_all(write->slab->fd, fields[i], lengths[i], position) < 0){
+            disk_write_abort(write);
+            return NULL;
+        }
+        position += lengths[i];
+    }
+    if(write_all(write->slab->fd, head, head_length, position) < 0){
+        disk_write_abort(write);
+        return NULL;
+    }
+    write->body = position + head_length;
+    write->remaining = body_length;
+    return write;
+}
+
+int disk_write(disk_write_t *write, const unsigned char *data, unsigned long size){
+    if(size > write->remaining || write_all(write->slab->fd, data, size, write->body) < 0){
+        return -1;
+    }
+    write->body += size;
+    write->remaining -= size;
+    return 0;
+}
+
+int disk_write_complete(disk_write_t *write){
+    return write->remaining == 0;
+}
+
+// the body is synced before the record says it's there, a crash can't leave
+// a committed record in front of a body that never made it out of the page cache
+void disk_write_finish(disk_write_t *write, long long stored, long long age, long long lifetime){
+    int synced;
+    
+    write->record.state = RECORD_COMMITTED;
+    write->record.stored = stored;
+    write->record.age = age;
+    write->record.lifetime = lifetime;
+#ifdef __linux__
+    synced = write->remaining == 0 && fdatasync(write->slab->fd) == 0;
+#else
+    synced = write->remaining == 0 && fsync(write->slab->fd) == 0;
+#endif
+    if(write->remaining == 0 && !synced){
+        log_message(LOG_WARN, "Cannot sync disk cache: %s", strerror(errno));
+    }
+    if(synced && write_all(write->slab->fd, &write->record, sizeof(disk_record_t), write->offset) == 0){
+        pthread_mutex_lock(&g_disk_lock);
+        if(!write->slab->evicted){
+            index_record(write->slab, write->offset, 1);
+        }
+        pthread_mutex_unlock(&g_disk_lock);
+    }
+    slab_release(write->slab);
+    free(write);
+}
+
+// the reserved space stays behind as a pending record until the slab goes
+void disk_write_abort(disk_write_t *write){
+    if(write != NULL){
+        slab_release(write->slab);
+        free(write);
+    }
+}
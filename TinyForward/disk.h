@@ -0,0 +1,102 @@
+//
+//  disk.h
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef TinyForward_disk_h
+#define TinyForward_disk_h
+
+#include "http.h"
+
+#define DISK_QUOTA_MB     4096           // default, -Q
+#define DISK_SLAB_SIZE    (256UL << 20)  // bytes per slab file at most, bigger objects get one of their own
+#define DISK_OBJECT_SHARE 8              // one object takes at most this fraction of the quota
+#define DISK_BUCKETS      4096           // must be a power of two
+#define DISK_MAGIC        0x54466331     // "TFc1"
+
+typedef struct disk_slab disk_slab_t;
+typedef struct disk_object disk_object_t;
+typedef struct disk_write disk_write_t;
+
+// A slab file, mapped read only in full. Records are appended until it is
+// full and whole slabs are deleted oldest first to stay under the quota.
+struct disk_slab {
+    int references; // atomic, the index and every object and writer in it
+    int number; // file name
+    int fd;
+    int evicted;
+    unsigned char *map;
+    unsigned long long capacity; // mapped and reserved in the file
+    unsigned long long used;
+    disk_object_t *objects; // indexed ones, for eviction
+    disk_slab_t *next; // younger
+};
+
+// An indexed record. Times are wall clock ms so they mean something after a restart.
+struct disk_object {
+    int references; // atomic, one is held by the index
+    unsigned long long hash;
+    disk_object_t *next_bucket;
+    disk_object_t *next_in_slab;
+    disk_slab_t *slab;
+    unsigned long long offset; // of the record header in the slab
+    char *key;
+    char *vary_names; // NULL if the response has no Vary
+    char *vary_values;
+    char *etag; // replaced by a revalidation, read under the lock
+    char *last_modified;
+    long long stored;
+    long long age;
+    long long lifetime;
+    const unsigned char *head; // into the mapping, without the blank line
+    unsigned long head_length;
+    unsigned long long body; // file offset
+    unsigned long long body_length;
+};
+
+// What goes into a record besides the response itself
+typedef struct disk_meta {
+    const char *key;
+    const char *vary_names;
+    const char *vary_values;
+    const char *etag;
+    const char *last_modified;
+} disk_meta_t;
+
+// Large responses that outgrow the memory cache are streamed into slab
+// files and served from there with sendfile(). The index is rebuilt from
+// the slabs at startup, so the cache comes back warm after a restart.
+int disk_init(const char *directory, unsigned long long quota);
+int disk_enabled(void);
+unsigned long long disk_max_object(void);
+long long disk_clock(void);
+
+/* Lookups */
+disk_object_t *disk_get(const char *key, unsigned long long hash, const http_request_t *request, const unsigned char *data);
+void disk_times(disk_object_t *object, long long *stored, long long *age, long long *lifetime, char **etag, char **last_modified);
+void disk_refresh(disk_object_t *object, long long stored, long long age, long long lifetime, const char *etag, const char *last_modified);
+void disk_release(disk_object_t *object);
+
+/* Storing */
+disk_write_t *disk_write_start(const disk_meta_t *meta, const unsigned char *head, unsigned long head_length, unsigned long long body_length);
+int disk_write(disk_write_t *write, const unsigned char *data, unsigned long size);
+int disk_write_complete(disk_write_t *write);
+void disk_write_finish(disk_write_t *write, long long stored, long long age, long long lifetime);
+void disk_write_abort(disk_write_t *write);
+
+#endif
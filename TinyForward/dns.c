@@ -0,0 +1,870 @@
+//
+//  dns.c
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h>
+#include "dns.h"
+#include "log.h"
+
+#define RESOLV_CONF  "/etc/resolv.conf"
+#define HOSTS_FILE   "/etc/hosts"
+
+#define TYPE_A       1
+#define TYPE_CNAME   5
+#define TYPE_SOA     6
+#define TYPE_AAAA    28
+#define CLASS_IN     1
+
+#define RCODE_NOERROR   0
+#define RCODE_NXDOMAIN  3
+
+#define MAX_PACKET   512 // no EDNS, larger answers come back truncated
+#define MAX_CHAIN    8   // names in a CNAME chain, the one asked included
+#define MAX_POINTERS 16  // compression pointers followed in one name
+
+enum { QUERY_A, QUERY_AAAA, QUERY_TYPES };
+
+struct dns_query {
+    dns_resolver_t *resolver;
+    event_source_t source; // a socket of its own, connected to the nameserver asked last
+    char name[DNS_MAX_NAME + 1]; // lower case, no trailing dot
+    unsigned int hash;
+    unsigned short ids[QUERY_TYPES];
+    int answered[QUERY_TYPES];
+    int counts[QUERY_TYPES];
+    dns_address_t addresses[QUERY_TYPES][DNS_MAX_ADDRESSES];
+    long ttl; // smallest TTL seen across both answers, seconds
+    int tries; // sends so far, rotating through the nameservers
+    long long deadline; // ms, resend anything unanswered after this
+    dns_waiter_t *waiters;
+    dns_query_t *previous;
+    dns_query_t *next;
+};
+
+typedef struct dns_entry dns_entry_t;
+
+struct dns_entry {
+    char *name;
+    unsigned int hash;
+    long long expires; // ms
+    dns_result_t result;
+    dns_entry_t *next_bucket;
+    dns_entry_t *older;
+    dns_entry_t *newer;
+};
+
+// The cache is shared by every worker, sharded by name so workers rarely
+// wait on each other's locks.
+typedef struct dns_shard {
+    pthread_mutex_t lock;
+    dns_entry_t *buckets[DNS_CACHE_BUCKETS];
+    dns_entry_t *oldest; // evicted first when the shard is full
+    dns_entry_t *newest;
+    int count;
+} dns_shard_t;
+
+typedef struct dns_host {
+    char *name;
+    dns_result_t result;
+} dns_host_t;
+
+// read only once dns_init() returns
+static struct sockaddr_storage g_nameservers[DNS_MAX_NAMESERVERS];
+static socklen_t g_nameserver_lengths[DNS_MAX_NAMESERVERS];
+static int g_nameserver_count = 0;
+static dns_host_t *g_hosts = NULL;
+static int g_host_count = 0;
+static unsigned int g_seed = 0;
+
+static dns_shard_t g_cache[DNS_CACHE_SHARDS];
+
+static void resolver_event_handler(event_source_t *source, int events);
+
+/* Names */
+
+static unsigned int hash_name(const char *name){
+    unsigned int hash = 2166136261u; // FNV-1a
+    
+    while(*name){
+        hash = (hash ^ (unsigned char)*name++) * 16777619u;
+    }
+    return hash;
+}
+
+// lower case and strip the trailing dot, returns -1 if it isn't a valid name
+static int normalize_name(const char *name, char *out){
+    int i, label = 0;
+    
+    for(i = 0; name[i] != '\0'; i++){
+        if(i >= DNS_MAX_NAME){
+            return -1;
+        }
+        if(name[i] == '.'){
+            if(label == 0 && name[i+1] != '\0'){ // empty label
+                return -1;
+            }
+            label = 0;
+        }else if(++label > 63){
+            return -1;
+        }
+        out[i] = tolower((unsigned char)name[i]);
+    }
+    if(i > 0 && out[i-1] == '.'){
+        i--;
+    }
+    out[i] = '\0';
+    return i > 0 ? 0 : -1;
+}
+
+static int parse_address(const char *text, dns_address_t *address){
+    if(inet_pton(AF_INET, text, &address->addr.v4) == 1){
+        address->family = AF_INET;
+        return 0;
+    }
+    if(inet_pton(AF_INET6, text, &address->addr.v6) == 1){
+        address->family = AF_INET6;
+        return 0;
+    }
+    return -1;
+}
+
+static void add_address(dns_result_t *result, const dns_address_t *address){
+    int i;
+    
+    if(result->count == DNS_MAX_ADDRESSES){
+        return;
+    }
+    for(i = 0; i < result->count; i++){
+        if(memcmp(&result->addresses[i], address, sizeof(dns_address_t)) == 0){
+            return;
+        }
+    }
+    result->addresses[result->count++] = *address;
+}
+
+/* Configuration */
+
+static int parse_nameserver(const char *spec, struct sockaddr_storage *ss, socklen_t *length){
+    struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+    char host[INET6_ADDRSTRLEN];
+    const char *end, *port = NULL;
+    size_t size;
+    
+    if(spec[0] == '['){ // [v6]:port
+        if((end = strchr(spec, ']')) == NULL){
+            return -1;
+        }
+        spec++;
+        if(end[1] == ':'){
+            port = end + 2;
+        }
+    }else if((end = strchr(spec, ':')) != NULL && strchr(end + 1, ':') == NULL){ // v4:port
+        port = end + 1;
+    }else{
+        end = spec + strlen(spec);
+    }
+    size = end - spec;
+    if(size >= sizeof(host)){
+        return -1;
+    }
+    memcpy(host, spec, size);
+    host[size] = '\0';
+    
+    memset(ss, 0, sizeof(struct sockaddr_storage));
+    if(inet_pton(AF_INET, host, &sin->sin_addr) == 1){
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(port ? atoi(port) : DNS_PORT);
+        *length = sizeof(struct sockaddr_in);
+    }else if(inet_pton(AF_INET6, host, &sin6->sin6_addr) == 1){
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(port ? atoi(port) : DNS_PORT);
+        *length = sizeof(struct sockaddr_in6);
+    }else{
+        return -1;
+    }
+    return 0;
+}
+
+static void load_resolv_conf(void){
+    char line[512], *key, *value, *save;
+    FILE *file;
+    
+    if((file = fopen(RESOLV_CONF, "r")) == NULL){
+        return;
+    }
+    while(fgets(line, sizeof(line), file) != NULL && g_nameserver_count < DNS_MAX_NAMESERVERS){
+        if((key = strtok_r(line, " \t\r\n", &save)) == NULL || strcmp(key, "nameserver") != 0){
+            continue;
+        }
+        if((value = strtok_r(NULL, " \t\r\n", &save)) == NULL){
+            continue;
+        }
+        if(parse_nameserver(value, &g_nameservers[g_nameserver_count], &g_nameserver_lengths[g_nameserver_count]) == 0){
+            g_nameserver_count++;
+        }
+    }
+    fclose(file);
+}
+
+static void load_hosts(void){
+    char line[1024], *address_text, *name, *save, *comment;
+    char normalized[DNS_MAX_NAME + 1];
+    dns_address_t address;
+    dns_host_t *hosts;
+    FILE *file;
+    int i;
+    
+    if((file = fopen(HOSTS_FILE, "r")) == NULL){
+        return;
+    }
+    while(fgets(line, sizeof(line), file) != NULL){
+        if((comment = strchr(line, '#')) != NULL){
+            *comment = '\0';
+        }
+        if((address_text = strtok_r(line, " \t\r\n", &save)) == NULL || parse_address(address_text, &address) < 0){
+            continue;
+        }
+        while((name = strtok_r(NULL, " \t\r\n", &save)) != NULL){
+            if(normalize_name(name, normalized) < 0){
+                continue;
+            }
+            for(i = 0; i < g_host_count && strcmp(g_hosts[i].name, normalized) != 0; i++);
+            if(i == g_host_count){
+                if((hosts = realloc(g_hosts, (g_host_count + 1) * sizeof(dns_host_t))) == NULL){
+                    break;
+                }
+                g_hosts = hosts;
+                g_hosts[i].name = strdup(normalized);
+                g_hosts[i].result.count = 0;
+                g_host_count++;
+            }
+            add_address(&g_hosts[i].result, &address); // file order is kept
+        }
+    }
+    fclose(file);
+}
+
+int dns_init(const char *nameserver){
+    int i, fd;
+    
+    if(nameserver != NULL){
+        if(parse_nameserver(nameserver, &g_nameservers[0], &g_nameserver_lengths[0]) < 0){
+            fprintf(stderr, "Invalid nameserver address: %s\n", nameserver);
+            return -1;
+        }
+        g_nameserver_count = 1;
+    }else{
+        load_resolv_conf();
+        if(g_nameserver_count == 0){ // same default as the libc resolver
+            parse_nameserver("127.0.0.1", &g_nameservers[0], &g_nameserver_lengths[0]);
+            g_nameserver_count = 1;
+        }
+    }
+    load_hosts();
+    
+    // only for query ids when getrandom() has nothing to give
+    if((fd = open("/dev/urandom", O_RDONLY)) >= 0){
+        if(read(fd, &g_seed, sizeof(g_seed)) != sizeof(g_seed)){
+            g_seed = 0;
+        }
+        close(fd);
+    }
+    g_seed ^= (unsigned int)time(NULL) ^ ((unsigned int)getpid() << 16);
+    
+    for(i = 0; i < DNS_CACHE_SHARDS; i++){
+        memset(&g_cache[i], 0, sizeof(dns_shard_t));
+        pthread_mutex_init(&g_cache[i].lock, NULL);
+    }
+    return 0;
+}
+
+/* Cache */
+
+static void cache_unlink(dns_shard_t *shard, dns_entry_t *entry){
+    dns_entry_t **link = &shard->buckets[(entry->hash / DNS_CACHE_SHARDS) & (DNS_CACHE_BUCKETS - 1)];
+    
+    while(*link != entry){
+        link = &(*link)->next_bucket;
+    }
+    *link = entry->next_bucket;
+    if(entry->older != NULL){
+        entry->older->newer = entry->newer;
+    }else{
+        shard->oldest = entry->newer;
+    }
+    if(entry->newer != NULL){
+        entry->newer->older = entry->older;
+    }else{
+        shard->newest = entry->older;
+    }
+    shard->count--;
+    free(entry->name);
+    free(entry);
+}
+
+static int cache_lookup(const char *name, unsigned int hash, dns_result_t *result){
+    dns_shard_t *shard = &g_cache[hash & (DNS_CACHE_SHARDS - 1)];
+    dns_entry_t *entry;
+    int found = 0;
+    
+    pthread_mutex_lock(&shard->lock);
+    entry = shard->buckets[(hash / DNS_CACHE_SHARDS) & (DNS_CACHE_BUCKETS - 1)];
+    for(; entry != NULL; entry = entry->next_bucket){
+        if(entry->hash == hash && strcmp(entry->name, name) == 0){
+            if(entry->expires <= event_now()){
+                cache_unlink(shard, entry);
+            }else{
+                *result = entry->result;
+                found = 1;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return found;
+}
+
+static void cache_store(const char *name, unsigned int hash, const dns_result_t *result, long ttl){
+    dns_shard_t *shard = &g_cache[hash & (DNS_CACHE_SHARDS - 1)];
+    dns_entry_t **bucket, *entry;
+    
+    if(ttl < DNS_MIN_TTL){
+        ttl = DNS_MIN_TTL;
+    }else if(ttl > DNS_MAX_TTL){
+        ttl = DNS_MAX_TTL;
+    }
+    if((entry = malloc(sizeof(dns_entry_t))) == NULL || (entry->name = strdup(name)) == NULL){
+        free(entry);
+        return;
+    }
+    entry->hash = hash;
+    entry->expires = event_now() + ttl * 1000;
+    entry->result = *result;
+    
+    pthread_mutex_lock(&shard->lock);
+    bucket = &shard->buckets[(hash / DNS_CACHE_SHARDS) & (DNS_CACHE_BUCKETS - 1)];
+    for(entry->next_bucket = *bucket; entry->next_bucket != NULL; entry->next_bucket = entry->next_bucket->next_bucket){
+        if(entry->next_bucket->hash == hash && strcmp(entry->next_bucket->name, name) == 0){
+            cache_unlink(shard, entry->next_bucket); // another worker got here first
+            break;
+        }
+    }
+    if(shard->count >= DNS_CACHE_ENTRIES){
+        cache_unlink(shard, shard->oldest);
+    }
+    entry->next_bucket = *bucket;
+    *bucket = entry;
+    entry->older = shard->newest;
+    entry->newer = NULL;
+    if(shard->newest != NULL){
+        shard->newest->newer = entry;
+    }else{
+        shard->oldest = entry;
+    }
+    shard->newest = entry;
+    shard->count++;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/* Wire format */
+
+static int encode_query(unsigned char *packet, unsigned short id, const char *name, int type){
+    const char *label, *dot;
+    int offset = 12, length;
+    
+    memset(packet, 0, 12);
+    packet[0] = id >> 8;
+    packet[1] = id & 0xff;
+    packet[2] = 0x01; // recursion desired
+    packet[5] = 1; // one question
+    for(label = name; *label != '\0'; label = *dot ? dot + 1 : dot){
+        if((dot = strchr(label, '.')) == NULL){
+            dot = label + strlen(label);
+        }
+        length = (int)(dot - label);
+        packet[offset++] = length;
+        memcpy(packet + offset, label, length);
+        offset += length;
+    }
+    packet[offset++] = 0;
+    packet[offset++] = type >> 8;
+    packet[offset++] = type & 0xff;
+    packet[offset++] = 0;
+    packet[offset++] = CLASS_IN;
+    return offset;
+}
+
+static unsigned int read16(const unsigned char *p){
+    return (p[0] << 8) | p[1];
+}
+
+static unsigned long read32(const unsigned char *p){
+    return ((unsigned long)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+// returns the offset past the name, or -1 if it runs off the packet
+static int skip_name(const unsigned char *packet, int size, int offset){
+    while(offset < size){
+        if(packet[offset] == 0){
+            return offset + 1;
+        }
+        if((packet[offset] & 0xc0) == 0xc0){ // compressed, the pointer ends it
+            return offset + 2 <= size ? offset + 2 : -1;
+        }
+        if(packet[offset] & 0xc0){
+            return -1;
+        }
+        offset += packet[offset] + 1;
+    }
+    return -1;
+}
+
+// expands the name at offset, lower case and without the trailing dot,
+// returns -1 if it is malformed or too long
+static int read_name(const unsigned char *packet, int size, int offset, char *out){
+    int length = 0, pointers = 0, label, i;
+    
+    while(offset < size){
+        label = packet[offset];
+        if(label == 0){
+            out[length] = '\0';
+            return 0;
+        }
+        if((label & 0xc0) == 0xc0){
+            if(offset + 2 > size || ++pointers > MAX_POINTERS){
+                return -1;
+            }
+            offset = ((label & 0x3f) << 8) | packet[offset + 1];
+            continue;
+        }
+        if(label & 0xc0 || offset + 1 + label > size || length + label + 1 > DNS_MAX_NAME){
+            return -1;
+        }
+        if(length > 0){
+            out[length++] = '.';
+        }
+        for(i = 0; i < label; i++){
+            out[length++] = tolower(packet[offset + 1 + i]);
+        }
+        offset += label + 1;
+    }
+    return -1;
+}
+
+// the fixed part of the resource record at offset, returns the offset of its
+// data or -1 if it runs off the packet
+static int read_record(const unsigned char *packet, int size, int offset, int *type, unsigned long *ttl, int *length){
+    if((offset = skip_name(packet, size, offset)) < 0 || offset + 10 > size){
+        return -1;
+    }
+    *type = read16(packet + offset);
+    *ttl = read32(packet + offset + 4);
+    *length = read16(packet + offset + 8);
+    if(*ttl > 0x7fffffff){
+        *ttl = 0;
+    }
+    offset += 10;
+    return offset + *length <= size ? offset : -1;
+}
+
+static int in_chain(char chain[][DNS_MAX_NAME + 1], int links, const char *name){
+    int i;
+    
+    for(i = 0; i < links && strcmp(chain[i], name) != 0; i++);
+    return i < links;
+}
+
+// the question is echoed back uncompressed, compare it with what we asked
+static int match_question(const unsigned char *packet, int size, const char *name){
+    int offset = 12, length;
+    
+    while(offset < size && (length = packet[offset]) != 0){
+        if(length & 0xc0 || offset + 1 + length > size || strncasecmp((const char *)packet + offset + 1, name, length) != 0){
+            return -1;
+        }
+        name += length;
+        if(*name == '.'){
+            name++;
+        }else if(*name != '\0'){
+            return -1;
+        }
+        offset += length + 1;
+    }
+    if(offset >= size || *name != '\0'){
+        return -1;
+    }
+    return offset + 1;
+}
+
+static void finish_query(dns_query_t *query);
+
+static void parse_answer(dns_query_t *query, int type, const unsigned char *packet, int size){
+    int offset, start, i, answers, authorities, rcode, rtype, rdlength, rdata, wanted, links, added;
+    char chain[MAX_CHAIN][DNS_MAX_NAME + 1], owner[DNS_MAX_NAME + 1];
+    dns_address_t address;
+    unsigned long ttl, minimum;
+    long negative_ttl = -1;
+    
+    rcode = packet[3] & 0x0f;
+    answers = read16(packet + 6);
+    authorities = read16(packet + 8);
+    wanted = type == QUERY_A ? TYPE_A : TYPE_AAAA;
+    
+    if(rcode != RCODE_NOERROR && rcode != RCODE_NXDOMAIN){ // SERVFAIL etc, let the timer try the next server
+        return;
+    }
+    if((offset = match_question(packet, size, query->name)) < 0 || offset + 4 > size){
+        return;
+    }
+    start = offset + 4; // past type and class
+    
+    // only the name asked and the CNAMEs it leads to count, whatever order
+    // the server put them in, any other record could be planted
+    strcpy(chain[0], query->name);
+    links = 1;
+    do{
+        added = 0;
+        for(i = 0, offset = start; i < answers && links < MAX_CHAIN; i++, offset = rdata + rdlength){
+            if((rdata = read_record(packet, size, offset, &rtype, &ttl, &rdlength)) < 0){
+                return;
+            }
+            if(rtype != TYPE_CNAME || read_name(packet, size, offset, owner) < 0 || !in_chain(chain, links, owner) ||
+               read_name(packet, size, rdata, chain[links]) < 0 || in_chain(chain, links, chain[links])){
+                continue;
+            }
+            links++;
+            added = 1;
+            if(query->ttl < 0 || (long)ttl < query->ttl){
+                query->ttl = ttl;
+            }
+        }
+    }while(added && links < MAX_CHAIN);
+    
+    for(i = 0, offset = start; i < answers + authorities; i++, offset = rdata + rdlength){
+        if((rdata = read_record(packet, size, offset, &rtype, &ttl, &rdlength)) < 0){
+            return; // garbage, the timer asks again
+        }
+        if(i < answers){
+            if(rtype != wanted || read_name(packet, size, offset, owner) < 0 || !in_chain(chain, links, owner)){
+                continue;
+            }
+            if(rtype == TYPE_A && rdlength == 4){
+                address.family = AF_INET;
+                memcpy(&address.addr.v4, packet + rdata, 4);
+            }else if(rtype == TYPE_AAAA && rdlength == 16){
+                address.family = AF_INET6;
+                memcpy(&address.addr.v6, packet + rdata, 16);
+            }else{
+                continue;
+            }
+            if(query->counts[type] < DNS_MAX_ADDRESSES){
+                query->addresses[type][query->counts[type]++] = address;
+            }
+            if(query->ttl < 0 || (long)ttl < query->ttl){
+                query->ttl = ttl;
+            }
+        }else if(rtype == TYPE_SOA){ // RFC 2308, negative answers live for min(TTL, MINIMUM)
+            int end = skip_name(packet, rdata + rdlength, rdata);
+            if(end >= 0 && (end = skip_name(packet, rdata + rdlength, end)) >= 0 && end + 20 <= rdata + rdlength){
+                minimum = read32(packet + end + 16);
+                negative_ttl = (long)(minimum < ttl ? minimum : ttl);
+            }
+        }
+    }
+    
+    query->answered[type] = 1;
+    if(rcode == RCODE_NXDOMAIN){ // the name is gone, no need to wait for the other type
+        query->answered[QUERY_A] = query->answered[QUERY_AAAA] = 1;
+    }
+    if(query->counts[type] == 0 && negative_ttl >= 0 && (query->ttl < 0 || negative_ttl < query->ttl)){
+        query->ttl = negative_ttl;
+    }
+}
+
+/* Queries */
+
+static void close_socket(dns_query_t *query){
+    int fd = query->source.fd;
+    
+    if(fd >= 0){
+        event_remove(query->resolver->loop, &query->source);
+        close(fd);
+    }
+}
+
+// a new socket for every send, so a spoofer has to guess the port as well as
+// the id, connected so the kernel drops anything the server didn't send
+static int open_socket(dns_query_t *query, int server){
+    int fd;
+    
+    if((fd = socket(g_nameservers[server].ss_family, SOCK_DGRAM, 0)) < 0){
+        log_message(LOG_ERROR, "Cannot create DNS socket: %s", strerror(errno));
+        return -1;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    if(connect(fd, (struct sockaddr *)&g_nameservers[server], g_nameserver_lengths[server]) < 0){
+        log_message(LOG_WARN, "Cannot reach nameserver for %s: %s", query->name, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    query->source.fd = fd;
+    if(event_add(query->resolver->loop, &query->source, EVENT_READ) < 0){
+        query->source.fd = -1;
+        close(fd);
+        return -1;
+    }
+    return 0;
+}
+
+static void send_query(dns_query_t *query){
+    dns_resolver_t *resolver = query->resolver;
+    unsigned char packet[MAX_PACKET];
+    int server = query->tries % g_nameserver_count;
+    int type, size;
+    
+    query->tries++;
+    query->deadline = event_now() + DNS_TIMEOUT;
+    close_socket(query); // late answers to the last send are ignored
+    if(open_socket(query, server) < 0){ // the timer moves on to the next server
+        return;
+    }
+    // fresh ids, from rand_r() only when the kernel won't give any
+    if(getrandom(query->ids, sizeof(query->ids), GRND_NONBLOCK) != sizeof(query->ids)){
+        for(type = 0; type < QUERY_TYPES; type++){
+            query->ids[type] = rand_r(&resolver->seed) & 0xffff;
+        }
+    }
+    for(type = 0; type < QUERY_TYPES; type++){
+        if(query->answered[type]){
+            continue;
+        }
+        size = encode_query(packet, query->ids[type], query->name, type == QUERY_A ? TYPE_A : TYPE_AAAA);
+        if(send(query->source.fd, packet, size, 0) < 0){
+            log_message(LOG_WARN, "Cannot send DNS query for %s: %s", query->name, strerror(errno));
+        }
+    }
+}
+
+static void finish_query(dns_query_t *query){
+    dns_resolver_t *resolver = query->resolver;
+    dns_result_t result;
+    dns_waiter_t *waiter;
+    int type, i;
+    
+    result.count = 0;
+    for(type = QUERY_AAAA; type >= QUERY_A; type--){ // IPv6 first, RFC 6724
+        for(i = 0; i < query->counts[type]; i++){
+            add_address(&result, &query->addresses[type][i]);
+        }
+    }
+    if(query->answered[QUERY_A] && query->answered[QUERY_AAAA]){
+        cache_store(query->name, query->hash, &result, query->ttl >= 0 ? query->ttl : DNS_NEGATIVE_TTL);
+    }else if(result.count == 0){ // timed out, not worth remembering
+        log_message(LOG_WARN, "DNS lookup for %s timed out", query->name);
+    }
+    
+    close_socket(query);
+    if(query->previous != NULL){
+        query->previous->next = query->next;
+    }else{
+        resolver->queries = query->next;
+    }
+    if(query->next != NULL){
+        query->next->previous = query->previous;
+    }
+    // a callback may cancel other waiters, so take them off one at a time
+    while((waiter = query->waiters) != NULL){
+        dns_cancel(waiter);
+        waiter->callback(waiter, &result);
+    }
+    free(query);
+}
+
+static void resolver_event_handler(event_source_t *source, int events){
+    dns_query_t *query = source->owner;
+    unsigned char packet[MAX_PACKET];
+    ssize_t size;
+    unsigned short id;
+    int type;
+    
+    while((size = recv(source->fd, packet, sizeof(packet), 0)) >= 0 || errno == EINTR){
+        if(size < 12 || !(packet[2] & 0x80)){ // not a response
+            continue;
+        }
+        id = read16(packet);
+        for(type = 0; type < QUERY_TYPES && (query->answered[type] || query->ids[type] != id); type++);
+        if(type == QUERY_TYPES){
+            continue;
+        }
+        parse_answer(query, type, packet, (int)size);
+        if(query->answered[QUERY_A] && query->answered[QUERY_AAAA]){
+            finish_query(query); // the socket goes with it
+            return;
+        }
+    }
+}
+
+void dns_waiter_init(dns_waiter_t *waiter, dns_callback_t callback, void *owner){
+    memset(waiter, 0, sizeof(dns_waiter_t));
+    waiter->callback = callback;
+    waiter->owner = owner;
+}
+
+int dns_resolve(dns_resolver_t *resolver, const char *name, dns_waiter_t *waiter, dns_result_t *result){
+    char normalized[DNS_MAX_NAME + 1];
+    dns_address_t address;
+    dns_query_t *query;
+    unsigned int hash;
+    int i;
+    
+    result->count = 0;
+    if(parse_address(name, &address) == 0){ // nothing to look up
+        result->addresses[result->count++] = address;
+        return 1;
+    }
+    if(normalize_name(name, normalized) < 0){
+        return 1;
+    }
+    for(i = 0; i < g_host_count; i++){
+        if(strcmp(g_hosts[i].name, normalized) == 0){
+            *result = g_hosts[i].result;
+            return 1;
+        }
+    }
+    hash = hash_name(normalized);
+    if(cache_lookup(normalized, hash, result)){
+        return 1;
+    }
+    
+    // join a lookup for the same name that is already on its way
+    for(query = resolver->queries; query != NULL; query = query->next){
+        if(query->hash == hash && strcmp(query->name, normalized) == 0){
+            break;
+        }
+    }
+    if(query == NULL){
+        if((query = calloc(1, sizeof(dns_query_t))) == NULL){
+            return -1;
+        }
+        query->resolver = resolver;
+        event_source_init(&query->source, -1, resolver_event_handler, query);
+        strcpy(query->name, normalized);
+        query->hash = hash;
+        query->ttl = -1;
+        query->next = resolver->queries;
+        if(resolver->queries != NULL){
+            resolver->queries->previous = query;
+        }
+        resolver->queries = query;
+        send_query(query);
+    }
+    waiter->query = query;
+    waiter->previous = NULL;
+    waiter->next = query->waiters;
+    if(query->waiters != NULL){
+        query->waiters->previous = waiter;
+    }
+    query->waiters = waiter;
+    return 0;
+}
+
+void dns_cancel(dns_waiter_t *waiter){
+    dns_query_t *query = waiter->query;
+    
+    if(query == NULL){
+        return;
+    }
+    // the query itself keeps going, the answer is still worth caching
+    if(waiter->previous != NULL){
+        waiter->previous->next = waiter->next;
+    }else{
+        query->waiters = waiter->next;
+    }
+    if(waiter->next != NULL){
+        waiter->next->previous = waiter->previous;
+    }
+    waiter->query = NULL;
+    waiter->previous = waiter->next = NULL;
+}
+
+int dns_timeout(dns_resolver_t *resolver){
+    dns_query_t *query;
+    long long now = event_now();
+    long long wait = -1;
+    
+    for(query = resolver->queries; query != NULL; query = query->next){
+        if(query->deadline <= now){
+            return 0;
+        }
+        if(wait < 0 || query->deadline - now < wait){
+            wait = query->deadline - now;
+        }
+    }
+    return (int)wait;
+}
+
+void dns_run_timers(dns_resolver_t *resolver){
+    dns_query_t *query, *next;
+    long long now = event_now();
+    
+    for(query = resolver->queries; query != NULL; query = next){
+        next = query->next;
+        if(query->deadline > now){
+            continue;
+        }
+        if(query->tries >= DNS_ATTEMPTS * g_nameserver_count){ // give up with whatever arrived
+            finish_query(query);
+            next = resolver->queries; // callbacks may have finished other queries
+        }else{
+            send_query(query);
+        }
+    }
+}
+
+/* Per worker state */
+
+int dns_resolver_init(dns_resolver_t *resolver, event_loop_t *loop, int id){
+    memset(resolver, 0, sizeof(dns_resolver_t));
+    resolver->loop = loop;
+    resolver->seed = g_seed ^ ((unsigned int)id * 2654435761u);
+    return 0;
+}
+
+void dns_resolver_destroy(dns_resolver_t *resolver){
+    dns_query_t *query;
+    
+    while((query = resolver->queries) != NULL){
+        while(query->waiters != NULL){
+            dns_cancel(query->waiters);
+        }
+        close_socket(query);
+        resolver->queries = query->next;
+        free(query);
+    }
+}
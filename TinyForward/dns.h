@@ -0,0 +1,93 @@
+//
+//  dns.h
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef TinyForward_dns_h
+#define TinyForward_dns_h
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "event.h"
+
+#define DNS_PORT             53
+#define DNS_MAX_NAMESERVERS  3
+#define DNS_MAX_ADDRESSES    8    // per answer, extra records are dropped
+#define DNS_MAX_NAME         255
+#define DNS_TIMEOUT          1000 // ms before asking the next nameserver
+#define DNS_ATTEMPTS         2    // rounds through the nameserver list
+#define DNS_MIN_TTL          1    // seconds
+#define DNS_MAX_TTL          3600
+#define DNS_NEGATIVE_TTL     30   // when the answer carries no SOA
+#define DNS_CACHE_SHARDS     16   // must be a power of two
+#define DNS_CACHE_BUCKETS    256  // per shard, must be a power of two
+#define DNS_CACHE_ENTRIES    1024 // per shard, the oldest entry is evicted past this
+
+typedef struct dns_query dns_query_t;
+
+typedef struct dns_address {
+    int family; // AF_INET or AF_INET6
+    union {
+        struct in_addr v4;
+        struct in6_addr v6;
+    } addr;
+} dns_address_t;
+
+// An empty answer (count == 0) means the name does not resolve.
+typedef struct dns_result {
+    int count;
+    dns_address_t addresses[DNS_MAX_ADDRESSES]; // IPv6 first, then IPv4
+} dns_result_t;
+
+typedef struct dns_waiter dns_waiter_t;
+typedef void (*dns_callback_t)(dns_waiter_t *waiter, const dns_result_t *result);
+
+// Embedded in whoever is waiting for an answer so nothing is allocated
+// per lookup. Every waiter on the same name shares one query.
+struct dns_waiter {
+    dns_callback_t callback;
+    void *owner;
+    dns_query_t *query; // set while the lookup is outstanding
+    dns_waiter_t *previous;
+    dns_waiter_t *next;
+};
+
+// One per worker: the queries it has in flight on the worker's event loop,
+// each on a UDP socket of its own. Only the cache is shared between workers.
+typedef struct dns_resolver {
+    event_loop_t *loop;
+    dns_query_t *queries;
+    unsigned int seed; // for query ids when getrandom() fails
+} dns_resolver_t;
+
+/* Setup */
+int dns_init(const char *nameserver);
+int dns_resolver_init(dns_resolver_t *resolver, event_loop_t *loop, int id);
+void dns_resolver_destroy(dns_resolver_t *resolver);
+
+/* Lookups */
+void dns_waiter_init(dns_waiter_t *waiter, dns_callback_t callback, void *owner);
+int dns_resolve(dns_resolver_t *resolver, const char *name, dns_waiter_t *waiter, dns_result_t *result);
+void dns_cancel(dns_waiter_t *waiter);
+
+/* Timers */
+int dns_timeout(dns_resolver_t *resolver);
+void dns_run_timers(dns_resolver_t *resolver);
+
+#endif
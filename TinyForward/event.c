@@ -0,0 +1,376 @@
+//
+//  event.c
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifdef __linux__
+#define _GNU_SOURCE // accept4()
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "event.h"
+#include "log.h"
+#include "uring.h"
+
+#ifdef EVENT_USE_URING
+static int g_use_uring = 0;
+
+int event_use_uring(void){
+    const char *reason;
+    
+    if(uring_probe(&reason) < 0){
+        log_message(LOG_WARN, "Cannot use io_uring (%s), staying with epoll.", reason);
+        return -1;
+    }
+    g_use_uring = 1;
+    log_message(LOG_INFO, "Event loops use io_uring.");
+    return 0;
+}
+#else
+int event_use_uring(void){
+    log_message(LOG_WARN, "io_uring is only available on Linux.");
+    return -1;
+}
+#endif
+
+long long event_now(void){
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void event_source_init(event_source_t *source, int fd, event_handler_t handler, void *owner){
+    source->fd = fd;
+    source->events = 0;
+    source->index = -1;
+    source->handler = handler;
+    source->owner = owner;
+    source->complete = 0;
+#ifdef EVENT_USE_URING
+    source->poll_slot = -1;
+    source->poll_mask = 0;
+    source->io_slot = -1;
+    source->io_cancelled = 0;
+    source->received = -1;
+    source->received_last = -1;
+    source->received_eof = 0;
+    source->received_error = 0;
+    source->starved = 0;
+    source->accepted = -1;
+    source->ready = 0;
+    source->next_ready = NULL;
+    source->next_starved = NULL;
+#endif
+}
+
+void event_complete(event_source_t *source, int complete){
+    source->complete = complete;
+}
+
+int event_completing(event_loop_t *loop, event_source_t *source){
+#ifdef EVENT_USE_URING
+    return loop->ring != NULL && source->complete != 0;
+#else
+    return 0;
+#endif
+}
+
+ssize_t event_read(event_loop_t *loop, event_source_t *source, struct iovec *iov, int count){
+#ifdef EVENT_USE_URING
+    if(loop->ring != NULL && source->complete == EVENT_COMPLETE_RECV){
+        return uring_read(loop->ring, source, iov, count);
+    }
+#endif
+    return readv(source->fd, iov, count);
+}
+
+int event_accept(event_loop_t *loop, event_source_t *source){
+    int socket;
+    
+#ifdef EVENT_USE_URING
+    if(loop->ring != NULL && source->complete == EVENT_COMPLETE_ACCEPT){
+        if((socket = source->accepted) < 0){
+            errno = EAGAIN;
+            return -1;
+        }
+        source->accepted = -1;
+        return socket;
+    }
+#endif
+#ifdef __linux__
+    socket = accept4(source->fd, NULL, NULL, SOCK_NONBLOCK);
+#else
+    if((socket = accept(source->fd, NULL, NULL)) >= 0){
+        fcntl(socket, F_SETFL, O_NONBLOCK);
+    }
+#endif
+    return socket;
+}
+
+#ifdef EVENT_USE_EPOLL
+
+static unsigned int epoll_events(int events){
+    unsigned int flags = EPOLLET | EPOLLRDHUP;
+    if(events & EVENT_READ){
+        flags |= EPOLLIN;
+    }
+    if(events & EVENT_WRITE){
+        flags |= EPOLLOUT;
+    }
+    return flags;
+}
+
+int event_loop_init(event_loop_t *loop){
+    loop->ring = NULL;
+    loop->epoll_fd = -1;
+    if(g_use_uring){
+        if((loop->ring = uring_create()) != NULL){
+            return 0;
+        }
+        log_message(LOG_WARN, "Cannot set up io_uring, this loop uses epoll.");
+    }
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(loop->epoll_fd < 0){
+        log_message(LOG_ERROR, "Unable to create epoll instance: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+void event_loop_destroy(event_loop_t *loop){
+    if(loop->ring != NULL){
+        uring_destroy(loop->ring);
+        loop->ring = NULL;
+    }
+    if(loop->epoll_fd >= 0){
+        close(loop->epoll_fd);
+    }
+    loop->epoll_fd = -1;
+}
+
+int event_add(event_loop_t *loop, event_source_t *source, int events){
+    struct epoll_event ev;
+
+    if(loop->ring != NULL){
+        return uring_watch(loop->ring, source, events);
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = epoll_events(events);
+    ev.data.ptr = source;
+    if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, source->fd, &ev) < 0){
+        log_message(LOG_ERROR, "Cannot watch socket %d: %s", source->fd, strerror(errno));
+        return -1;
+    }
+    source->events = events;
+    return 0;
+}
+
+int event_modify(event_loop_t *loop, event_source_t *source, int events){
+    struct epoll_event ev;
+
+    if(source->events == events){ // nothing changed, save the syscall
+        return 0;
+    }
+    if(loop->ring != NULL){
+        return uring_watch(loop->ring, source, events);
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = epoll_events(events);
+    ev.data.ptr = source;
+    if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, source->fd, &ev) < 0){
+        log_message(LOG_ERROR, "Cannot modify socket %d: %s", source->fd, strerror(errno));
+        return -1;
+    }
+    source->events = events;
+    return 0;
+}
+
+void event_remove(event_loop_t *loop, event_source_t *source){
+    if(source->fd < 0)
+        return;
+    if(loop->ring != NULL){
+        uring_forget(loop->ring, source);
+    }else{
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+    }
+    source->fd = -1; // pending events for this source will be skipped
+    source->events = 0;
+}
+
+int event_loop_poll(event_loop_t *loop, int timeout){
+    struct epoll_event events[MAX_EVENTS];
+    event_source_t *source;
+    int count, i, flags;
+
+    if(loop->ring != NULL){
+        return uring_wait(loop->ring, timeout);
+    }
+    count = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, timeout);
+    if(count < 0){
+        if(errno == EINTR){
+            return 0;
+        }
+        log_message(LOG_ERROR, "Exception in epoll_wait(): %s", strerror(errno));
+        return -1;
+    }
+
+    for(i = 0; i < count; i++){
+        source = events[i].data.ptr;
+        if(source->fd < 0){ // closed by an earlier handler in this batch
+            continue;
+        }
+        flags = 0;
+        if(events[i].events & (EPOLLIN | EPOLLRDHUP)){
+            flags |= EVENT_READ;
+        }
+        if(events[i].events & EPOLLOUT){
+            flags |= EVENT_WRITE;
+        }
+        if(events[i].events & (EPOLLERR | EPOLLHUP)){
+            flags |= EVENT_ERROR;
+        }
+        source->handler(source, flags);
+    }
+
+    return count;
+}
+
+#else // portable poll() fallback, level-triggered
+
+static short poll_events(int events){
+    short flags = 0;
+    if(events & EVENT_READ){
+        flags |= POLLIN;
+    }
+    if(events & EVENT_WRITE){
+        flags |= POLLOUT;
+    }
+    return flags;
+}
+
+int event_loop_init(event_loop_t *loop){
+    memset(loop, 0, sizeof(event_loop_t));
+    return 0;
+}
+
+void event_loop_destroy(event_loop_t *loop){
+    free(loop->poll_fds);
+    free(loop->poll_sources);
+    memset(loop, 0, sizeof(event_loop_t));
+}
+
+int event_add(event_loop_t *loop, event_source_t *source, int events){
+    if(loop->poll_count == loop->poll_capacity){
+        int capacity = loop->poll_capacity ? loop->poll_capacity * 2 : 64;
+        struct pollfd *fds = realloc(loop->poll_fds, capacity * sizeof(struct pollfd));
+        event_source_t **sources = realloc(loop->poll_sources, capacity * sizeof(event_source_t *));
+        if(fds != NULL){
+            loop->poll_fds = fds;
+        }
+        if(sources != NULL){
+            loop->poll_sources = sources;
+        }
+        if(fds == NULL || sources == NULL){
+            log_message(LOG_ERROR, "Cannot watch socket %d: out of memory", source->fd);
+            return -1;
+        }
+        loop->poll_capacity = capacity;
+    }
+    source->index = loop->poll_count++;
+    source->events = events;
+    loop->poll_fds[source->index].fd = source->fd;
+    loop->poll_fds[source->index].events = poll_events(events);
+    loop->poll_fds[source->index].revents = 0;
+    loop->poll_sources[source->index] = source;
+    return 0;
+}
+
+int event_modify(event_loop_t *loop, event_source_t *source, int events){
+    source->events = events;
+    loop->poll_fds[source->index].events = poll_events(events);
+    return 0;
+}
+
+void event_remove(event_loop_t *loop, event_source_t *source){
+    int last;
+
+    if(source->fd < 0 || source->index < 0)
+        return;
+    // move the last entry into the hole
+    last = --loop->poll_count;
+    if(source->index != last){
+        loop->poll_fds[source->index] = loop->poll_fds[last];
+        loop->poll_sources[source->index] = loop->poll_sources[last];
+        loop->poll_sources[source->index]->index = source->index;
+    }
+    source->fd = -1;
+    source->index = -1;
+    source->events = 0;
+}
+
+int event_loop_poll(event_loop_t *loop, int timeout){
+    event_source_t *ready[MAX_EVENTS];
+    short revents[MAX_EVENTS];
+    int count, i, n, flags;
+
+    count = poll(loop->poll_fds, loop->poll_count, timeout);
+    if(count < 0){
+        if(errno == EINTR){
+            return 0;
+        }
+        log_message(LOG_ERROR, "Exception in poll(): %s", strerror(errno));
+        return -1;
+    }
+
+    // snapshot first, handlers reorder the table when they remove sources
+    for(i = 0, n = 0; i < loop->poll_count && n < count && n < MAX_EVENTS; i++){
+        if(loop->poll_fds[i].revents != 0){
+            ready[n] = loop->poll_sources[i];
+            revents[n] = loop->poll_fds[i].revents;
+            n++;
+        }
+    }
+
+    for(i = 0; i < n; i++){
+        if(ready[i]->fd < 0){ // closed by an earlier handler in this batch
+            continue;
+        }
+        flags = 0;
+        if(revents[i] & POLLIN){
+            flags |= EVENT_READ;
+        }
+        if(revents[i] & POLLOUT){
+            flags |= EVENT_WRITE;
+        }
+        if(revents[i] & (POLLERR | POLLHUP | POLLNVAL)){
+            flags |= EVENT_ERROR;
+        }
+        ready[i]->handler(ready[i], flags);
+    }
+
+    return n;
+}
+
+#endif
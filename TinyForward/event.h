@@ -0,0 +1,112 @@
+//
+//  event.h
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef TinyForward_event_h
+#define TinyForward_event_h
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#define EVENT_USE_EPOLL
+#define EVENT_USE_URING // io_uring when asked for at startup, epoll otherwise
+#else
+#include <poll.h>
+#endif
+
+#define EVENT_READ   0x01
+#define EVENT_WRITE  0x02
+#define EVENT_ERROR  0x04 // hang up or socket error, always reported
+
+#define MAX_EVENTS   256  // events dispatched per wakeup
+
+// What a source would like the io_uring backend to do for it, the other
+// backends only ever report readiness
+#define EVENT_COMPLETE_RECV    1 // receive into the loop's buffers, read with event_read()
+#define EVENT_COMPLETE_ACCEPT  2 // accept as connections come in, take them with event_accept()
+
+typedef struct event_source event_source_t;
+typedef void (*event_handler_t)(event_source_t *source, int events);
+
+// One registered file descriptor. Sources are embedded in the structure
+// that owns the fd (e.g. a connection_t) so readiness is dispatched
+// straight to the owner without looking anything up. Epoll is used in
+// edge-triggered mode, so handlers must drain the fd until EAGAIN. The
+// io_uring backend keeps the same contract with multishot requests.
+struct event_source {
+    int fd;
+    int events; // registered interest
+    int index; // slot in the poll() table, unused with epoll
+    event_handler_t handler;
+    void *owner;
+    int complete; // EVENT_COMPLETE_*, 0 to just be told about readiness
+#ifdef EVENT_USE_URING
+    // io_uring bookkeeping, see uring.c
+    int poll_slot; // multishot poll, -1 if none
+    int poll_mask;
+    int io_slot; // multishot recv or accept, -1 if none
+    int io_cancelled;
+    int received, received_last; // buffer ids in arrival order, -1 if none
+    int received_eof;
+    int received_error;
+    int starved; // waiting for buffers to come back before receiving again
+    int accepted; // connection handed over by the accept completion
+    int ready; // flags gathered from this batch of completions
+    event_source_t *next_ready;
+    event_source_t *next_starved;
+#endif
+};
+
+typedef struct event_loop {
+#ifdef EVENT_USE_EPOLL
+    int epoll_fd;
+#ifdef EVENT_USE_URING
+    struct uring *ring; // takes over from epoll when set
+#endif
+#else
+    struct pollfd *poll_fds;
+    event_source_t **poll_sources;
+    int poll_count;
+    int poll_capacity;
+#endif
+} event_loop_t;
+
+/* Setup */
+int event_use_uring(void);
+int event_loop_init(event_loop_t *loop);
+void event_loop_destroy(event_loop_t *loop);
+
+/* Registration */
+void event_source_init(event_source_t *source, int fd, event_handler_t handler, void *owner);
+int event_add(event_loop_t *loop, event_source_t *source, int events);
+int event_modify(event_loop_t *loop, event_source_t *source, int events);
+void event_remove(event_loop_t *loop, event_source_t *source);
+void event_complete(event_source_t *source, int complete);
+int event_completing(event_loop_t *loop, event_source_t *source);
+
+/* I/O, through the ring when the source completes there */
+ssize_t event_read(event_loop_t *loop, event_source_t *source, struct iovec *iov, int count);
+int event_accept(event_loop_t *loop, event_source_t *source); // the socket comes back non-blocking
+
+/* Dispatching */
+int event_loop_poll(event_loop_t *loop, int timeout);
+long long event_now(void);
+
+#endif
@@ -0,0 +1,292 @@
+//
+//  gzip.c
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifdef __linux__
+#define _GNU_SOURCE // strcasestr()
+#endif
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#define ZLIB_CONST // next_in points at the response, zlib doesn't write to it
+#include <zlib.h>
+#include "gzip.h"
+#include "log.h"
+
+#define CHUNK_HEAD  8 // "%06lx\r\n", leading zeros are fine in a chunk size
+#define CHUNK_TAIL  2
+#define LAST_CHUNK  5 // "0\r\n\r\n", no trailers
+
+struct gzip_stream {
+    z_stream z;
+    int done; // the last chunk has gone out
+    gzip_stream_t *next;
+};
+
+int g_gzip_level = 0;
+static long g_min_size = GZIP_MIN_SIZE;
+static char *g_types[GZIP_TYPES_MAX]; // lower case prefixes of Content-Type, "text/" takes them all
+static int g_type_count = 0;
+
+int gzip_init(int level, long min_size, const char *types){
+    const char *end;
+    size_t length;
+    int i;
+    
+    g_gzip_level = level;
+    g_min_size = min_size;
+    while(*types != '\0'){
+        while(*types == ',' || *types == ' '){
+            types++;
+        }
+        for(end = types; *end != '\0' && *end != ',' && *end != ' '; end++);
+        if((length = end - types) == 0){
+            break;
+        }
+        if(g_type_count == GZIP_TYPES_MAX || (g_types[g_type_count] = strndup(types, length)) == NULL){
+            log_message(LOG_ERROR, "Too many content types to compress.");
+            return -1;
+        }
+        for(i = 0; g_types[g_type_count][i] != '\0'; i++){
+            g_types[g_type_count][i] = tolower((unsigned char)g_types[g_type_count][i]);
+        }
+        g_type_count++;
+        types = end;
+    }
+    return 0;
+}
+
+// a q of 0 in Accept-Encoding rules the coding out, RFC 7231 5.3.1
+static int zero_quality(const char *p, const char *end){
+    if(p >= end || *p != '0'){
+        return 0;
+    }
+    for(p++; p < end && (*p == '.' || *p == '0'); p++);
+    return p == end || !isdigit((unsigned char)*p);
+}
+
+// whether the client takes gzip, codings it doesn't name don't count even with "*"
+int gzip_accepted(const http_request_t *request, const unsigned char *data){
+    const char *p, *end, *token;
+    http_span_t value;
+    size_t length;
+    int zero;
+    
+    if(g_gzip_level == 0 || !http_request_header(request, data, "accept-encoding", &value)){
+        return 0;
+    }
+    p = (const char *)data + value.offset;
+    end = p + value.length;
+    while(p < end){
+        while(p < end && (*p == ',' || *p == ' ' || *p == '\t')){
+            p++;
+        }
+        for(token = p; p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t'; p++);
+        length = p - token;
+        for(zero = 0; p < end && *p != ','; p++){ // parameters, only q matters
+            if((*p == 'q' || *p == 'Q') && p + 1 < end && p[1] == '=' && (p[-1] == ';' || p[-1] == ' ')){
+                zero = zero_quality(p + 2, end);
+            }
+        }
+        if((length == 4 && strncasecmp(token, "gzip", 4) == 0) || (length == 6 && strncasecmp(token, "x-gzip", 6) == 0)){
+            return !zero;
+        }
+    }
+    return 0;
+}
+
+static int listed_type(const char *value){
+    size_t length;
+    int i;
+    
+    for(i = 0; i < g_type_count; i++){
+        length = strlen(g_types[i]);
+        if(strncasecmp(value, g_types[i], length) == 0 &&
+           (g_types[i][length - 1] == '/' || value[length] == '\0' || value[length] == ';' || value[length] == ' ')){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int put(char *out, unsigned long size, unsigned long *used, const char *data, unsigned long length){
+    if(*used + length > size){
+        return -1;
+    }
+    memcpy(out + *used, data, length);
+    *used += length;
+    return 0;
+}
+
+static int is_header(const char *line, unsigned long name, const char *header){
+    return name == strlen(header) && strncasecmp(line, header, name) == 0;
+}
+
+// the head for the compressed response, or -1 if this one goes through as it
+// is: anything but a 200 straight away from an HTTP/1.1 server, a type not
+// listed, already encoded, too small, of unknown length or no-transform
+long gzip_rewrite_head(const char *head, unsigned long length, char *out, unsigned long size){
+    const char *start = head, *end = head + length, *newline, *colon;
+    unsigned long line, used = 0, name;
+    char value[256];
+    int typed = 0, sized = 0, vary = 0, keep, failed = 0;
+    
+    if(length < 13 || strncmp(head, "HTTP/1.1 200", 12) != 0 || (head[12] != ' ' && head[12] != '\r' && head[12] != '\n')){
+        return -1;
+    }
+    for(; start < end && (newline = memchr(start, '\n', end - start)) != NULL; start = newline + 1){
+        line = newline - start;
+        if(line > 0 && start[line - 1] == '\r'){
+            line--;
+        }
+        if(line == 0){ // the blank line, ours go in front of it
+            break;
+        }
+        keep = 1;
+        if(used > 0 && (colon = memchr(start, ':', line)) != NULL){
+            name = colon - start;
+            for(colon++; colon < start + line && (*colon == ' ' || *colon == '\t'); colon++);
+            snprintf(value, sizeof(value), "%.*s", (int)(start + line - colon), colon); // only the start of a long one matters
+            if(is_header(start, name, "content-encoding") || is_header(start, name, "content-range") ||
+               (is_header(start, name, "cache-control") && strcasestr(value, "no-transform") != NULL)){
+                return -1;
+            }else if(is_header(start, name, "content-length")){
+                if(atol(value) < g_min_size){
+                    return -1;
+                }
+                sized = 1;
+                keep = 0;
+            }else if(is_header(start, name, "transfer-encoding")){
+                if(strcasecmp(value, "chunked") != 0){
+                    return -1;
+                }
+                sized = 1;
+                keep = 0;
+            }else if(is_header(start, name, "accept-ranges") || is_header(start, name, "content-md5")){
+                keep = 0; // they were about the uncompressed body
+            }else if(is_header(start, name, "content-type")){
+                typed = listed_type(value);
+            }else if(is_header(start, name, "etag") && value[0] == '"'){ // the bytes differ, so it can only be weak
+                failed |= put(out, size, &used, "ETag: W/", 8) < 0 || put(out, size, &used, colon, start + line - colon) < 0 ||
+                    put(out, size, &used, "\r\n", 2) < 0;
+                keep = 0;
+            }else if(is_header(start, name, "vary")){
+                vary = 1;
+                if(strchr(value, '*') == NULL && strcasestr(value, "accept-encoding") == NULL){
+                    failed |= put(out, size, &used, start, line) < 0 || put(out, size, &used, ", Accept-Encoding\r\n", 19) < 0;
+                    keep = 0;
+                }
+            }
+        }
+        if(keep){
+            failed |= put(out, size, &used, start, line) < 0 || put(out, size, &used, "\r\n", 2) < 0;
+        }
+    }
+    if(!typed || !sized || failed ||
+       put(out, size, &used, "Content-Encoding: gzip\r\nTransfer-Encoding: chunked\r\n", 52) < 0 ||
+       (!vary && put(out, size, &used, "Vary: Accept-Encoding\r\n", 23) < 0) || put(out, size, &used, "\r\n", 2) < 0){
+        return -1;
+    }
+    return used;
+}
+
+void gzip_pool_destroy(gzip_pool_t *pool){
+    gzip_stream_t *stream;
+    
+    while((stream = pool->free) != NULL){
+        pool->free = stream->next;
+        deflateEnd(&stream->z);
+        free(stream);
+    }
+    pool->count = 0;
+}
+
+// NULL when the worker has all the streams it may have in use
+gzip_stream_t *gzip_start(gzip_pool_t *pool){
+    gzip_stream_t *stream = pool->free;
+    
+    if(stream != NULL){
+        pool->free = stream->next;
+        deflateReset(&stream->z);
+    }else{
+        if(pool->count >= GZIP_STREAMS_MAX || (stream = calloc(1, sizeof(gzip_stream_t))) == NULL){
+            return NULL;
+        }
+        // a gzip wrapper (window bits + 16), deflate alone is handled inconsistently by browsers
+        if(deflateInit2(&stream->z, g_gzip_level, Z_DEFLATED, 15 + 16, GZIP_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK){
+            log_message(LOG_WARN, "Cannot set up a gzip stream.");
+            free(stream);
+            return NULL;
+        }
+        pool->count++;
+    }
+    stream->done = 0;
+    stream->next = NULL;
+    return stream;
+}
+
+// compresses what fits of data into one chunk at out, returns its length with
+// the framing, 0 once there is nothing more to write out for now
+long gzip_compress(gzip_stream_t *stream, const unsigned char **data, unsigned long *size, int flush, unsigned char *out, unsigned long room){
+    static const int flushes[] = {Z_NO_FLUSH, Z_SYNC_FLUSH, Z_FINISH};
+    z_stream *z = &stream->z;
+    unsigned long capacity = room - CHUNK_HEAD - CHUNK_TAIL - LAST_CHUNK, length;
+    char head[24];
+    int err;
+    
+    if(stream->done){
+        return 0;
+    }
+    z->next_in = *data;
+    z->avail_in = *size;
+    z->next_out = out + CHUNK_HEAD;
+    z->avail_out = capacity;
+    err = deflate(z, flushes[flush]);
+    *data += *size - z->avail_in;
+    *size = z->avail_in;
+    if(err == Z_STREAM_ERROR){
+        return -1;
+    }
+    if((length = capacity - z->avail_out) > 0){
+        snprintf(head, sizeof(head), "%06lx\r\n", length);
+        memcpy(out, head, CHUNK_HEAD);
+        memcpy(out + CHUNK_HEAD + length, "\r\n", CHUNK_TAIL);
+        length += CHUNK_HEAD + CHUNK_TAIL;
+    }
+    if(err == Z_STREAM_END){
+        stream->done = 1;
+        memcpy(out + length, "0\r\n\r\n", LAST_CHUNK);
+        length += LAST_CHUNK;
+    }
+    return length;
+}
+
+// what went in and came out of it so far
+void gzip_totals(const gzip_stream_t *stream, unsigned long long *in, unsigned long long *out){
+    *in = stream->z.total_in;
+    *out = stream->z.total_out;
+}
+
+// back to the pool for the next response
+void gzip_end(gzip_pool_t *pool, gzip_stream_t *stream){
+    stream->next = pool->free;
+    pool->free = stream;
+}
@@ -0,0 +1,74 @@
+//
+//  gzip.h
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef TinyForward_gzip_h
+#define TinyForward_gzip_h
+
+#include "http.h"
+
+#define GZIP_MIN_SIZE     1024  // default, -Z, smaller responses aren't worth it
+#define GZIP_MEM_LEVEL    6     // zlib's memLevel, about 160KB a stream
+#define GZIP_STREAMS_MAX  64    // per worker, responses beyond these go through as they are
+#define GZIP_TYPES        "text/,application/json,application/javascript,application/xml,application/xhtml+xml,image/svg+xml"
+#define GZIP_TYPES_MAX    32
+#define GZIP_HEAD_SIZE    8192  // longer response heads go through as they are
+#define GZIP_INPUT_SIZE   32768 // server bytes taken per read while compressing
+#define GZIP_OUTPUT_SIZE  16384 // one chunk of compressed output
+// room left in the response buffer for what a read can turn into, what zlib
+// held back from earlier reads plus the chunk framing
+#define GZIP_HEADROOM     32768
+// the same while only a head is held back, what rewriting it and the start
+// of the stream add
+#define GZIP_HEAD_HEADROOM 512
+
+enum {
+    GZIP_FLUSH_NONE,
+    GZIP_FLUSH_SYNC, // everything so far, the server has nothing more for now
+    GZIP_FLUSH_FINISH // the response ends here
+};
+
+typedef struct gzip_stream gzip_stream_t;
+
+// Compressor state and scratch space of one worker. Streams are allocated
+// the first time they are needed and reset for every response after that.
+typedef struct gzip_pool {
+    gzip_stream_t *free;
+    int count; // allocated, in use or not
+    unsigned char input[GZIP_INPUT_SIZE];
+    unsigned char output[GZIP_OUTPUT_SIZE];
+    char head[GZIP_HEAD_SIZE];
+    char rewritten[GZIP_HEAD_SIZE + 256];
+} gzip_pool_t;
+
+extern int g_gzip_level; // 0 is off
+
+// Responses are compressed on their way from the server when the client
+// takes gzip and the response is a 200 of a listed type, at least the
+// minimum size and not already encoded. The body goes out chunked.
+int gzip_init(int level, long min_size, const char *types);
+int gzip_accepted(const http_request_t *request, const unsigned char *data);
+long gzip_rewrite_head(const char *head, unsigned long length, char *out, unsigned long size);
+
+void gzip_pool_destroy(gzip_pool_t *pool);
+gzip_stream_t *gzip_start(gzip_pool_t *pool);
+long gzip_compress(gzip_stream_t *stream, const unsigned char **data, unsigned long *size, int flush, unsigned char *out, unsigned long room);
+void gzip_totals(const gzip_stream_t *stream, unsigned long long *in, unsigned long long *out);
+void gzip_end(gzip_pool_t *pool, gzip_stream_t *stream);
+
+#endif
@@ -0,0 +1,806 @@
+//
+//  http.c
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifdef __linux__
+#define _GNU_SOURCE // memmem()
+#endif
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "http.h"
+#include "scan.h"
+
+/* Requests */
+
+enum {
+    REQUEST_START,
+    REQUEST_METHOD,
+    REQUEST_TARGET_START,
+    REQUEST_TARGET,
+    REQUEST_VERSION,
+    REQUEST_HEADER_START,
+    REQUEST_NAME,
+    REQUEST_VALUE_START,
+    REQUEST_VALUE,
+    REQUEST_BODY,
+    REQUEST_CHUNK_SIZE,
+    REQUEST_CHUNK_EXTENSION,
+    REQUEST_CHUNK_DATA,
+    REQUEST_CHUNK_END,
+    REQUEST_TRAILER,
+    REQUEST_TRAILER_LINE
+};
+
+enum {
+    HEADER_OTHER,
+    HEADER_HOST,
+    HEADER_CONTENT_LENGTH,
+    HEADER_TRANSFER_ENCODING,
+    HEADER_CONNECTION
+};
+
+void http_request_init(http_request_t *request){
+    memset(request, 0, sizeof(http_request_t));
+    request->phase = HTTP_REQUEST_HEAD;
+    request->state = REQUEST_START;
+    request->content_length = -1;
+}
+
+// RFC 7230 tchar, one bit per ASCII character
+static const unsigned long long token_bits[2] = {0x03ff6cfa00000000ULL, 0x57ffffffc7fffffeULL};
+
+static inline int is_token(unsigned char c){
+    return c < 128 && (token_bits[c >> 6] >> (c & 63)) & 1;
+}
+
+static unsigned long request_error(http_request_t *request, unsigned long consumed){
+    request->phase = HTTP_REQUEST_ERROR;
+    return consumed;
+}
+
+// a comma separated token of Connection or Transfer-Encoding is complete
+static void end_token(http_request_t *request){
+    char *token = request->scratch;
+    
+    if(request->scratch_length == 0){
+        return;
+    }
+    token[request->scratch_length] = '\0';
+    if(request->header == HEADER_TRANSFER_ENCODING){
+        request->chunked = strcmp(token, "chunked") == 0; // has to be the last coding
+    }else if(strcmp(token, "close") == 0){
+        request->keep_alive = 0;
+    }else if(strcmp(token, "keep-alive") == 0){
+        request->keep_alive = 1;
+    }else if(strcmp(token, "upgrade") == 0){
+        request->upgrade = 1;
+    }
+    request->scratch_length = 0;
+}
+
+static void start_header(http_request_t *request){
+    const char *name = request->scratch;
+    
+    request->scratch[request->scratch_length] = '\0';
+    if(strcmp(name, "host") == 0){
+        request->header = HEADER_HOST;
+    }else if(strcmp(name, "content-length") == 0){
+        request->header = HEADER_CONTENT_LENGTH;
+    }else if(strcmp(name, "transfer-encoding") == 0){
+        request->header = HEADER_TRANSFER_ENCODING;
+        request->transfer_encoding = 1;
+    }else if(strcmp(name, "connection") == 0){
+        request->header = HEADER_CONNECTION;
+    }else{
+        request->header = HEADER_OTHER;
+    }
+    request->scratch_length = 0;
+    request->digits = 0;
+}
+
+// returns -1 if the value makes the request unusable
+static int value_char(http_request_t *request, unsigned char c){
+    long long length;
+    
+    switch(request->header){
+        case HEADER_CONTENT_LENGTH:
+            if(isdigit(c)){
+                length = request->remaining * 10 + (c - '0'); // remaining is scratch until the head ends
+                if(request->digits < 0 || length < (long long)request->remaining || length > 0x7fffffffffffLL){
+                    return -1; // digits after the trailing space, or absurdly large
+                }
+                request->remaining = length;
+                request->digits++;
+            }else if(c == ' ' || c == '\t'){
+                if(request->digits > 0){
+                    request->digits = -request->digits;
+                }
+            }else{
+                return -1;
+            }
+            break;
+        case HEADER_TRANSFER_ENCODING:
+        case HEADER_CONNECTION:
+            if(c == ','){
+                end_token(request);
+            }else if(c != ' ' && c != '\t' && request->scratch_length < (int)sizeof(request->scratch) - 1){
+                request->scratch[request->scratch_length++] = tolower(c);
+            }
+            break;
+    }
+    return 0;
+}
+
+static int end_header(http_request_t *request, http_span_t value){
+    long long length;
+    
+    switch(request->header){
+        case HEADER_HOST:
+            if(request->host.length > 0){ // RFC 7230 5.4
+                return -1;
+            }
+            request->host = value;
+            break;
+        case HEADER_CONTENT_LENGTH:
+            if(request->digits == 0){
+                return -1;
+            }
+            length = (long long)request->remaining;
+            request->remaining = 0;
+            if(request->content_length >= 0 && request->content_length != length){
+                return -1; // RFC 7230 3.3.3, conflicting lengths
+            }
+            request->content_length = length;
+            break;
+        case HEADER_TRANSFER_ENCODING:
+        case HEADER_CONNECTION:
+            end_token(request);
+            break;
+    }
+    if(request->header_count < HTTP_MAX_HEADERS){
+        request->header_count++;
+    }
+    return 0;
+}
+
+static int end_head(http_request_t *request){
+    request->header_size = (unsigned long)request->offset;
+    if(request->transfer_encoding && (!request->chunked || request->content_length >= 0)){
+        return -1; // unknown coding, or both framings at once (request smuggling)
+    }
+    if(request->chunked){
+        request->phase = HTTP_REQUEST_BODY;
+        request->state = REQUEST_CHUNK_SIZE;
+    }else if(request->content_length > 0){
+        request->phase = HTTP_REQUEST_BODY;
+        request->state = REQUEST_BODY;
+        request->remaining = request->content_length;
+    }else{
+        request->phase = HTTP_REQUEST_DONE;
+    }
+    return 0;
+}
+
+// the long runs of a head, the target and the values nothing is taken from,
+// are skipped many bytes at a time; whatever ends one goes through the
+// state machine as usual
+static unsigned long skip_run(http_request_t *request, const unsigned char *data, unsigned long size){
+    http_span_t *value = &request->values[request->header_count];
+    unsigned long count, last;
+    
+    if(request->state == REQUEST_TARGET){
+        count = scan_visible(data, size);
+        request->target.length += count;
+    }else if(request->state == REQUEST_VALUE && (request->header == HEADER_OTHER || request->header == HEADER_HOST)){
+        count = scan_text(data, size);
+        for(last = count; last > 0 && (data[last - 1] == ' ' || data[last - 1] == '\t'); last--); // not part of the value
+        if(last > 0){
+            value->length = (unsigned int)(request->offset + last - value->offset);
+        }
+    }else{
+        return 0;
+    }
+    request->offset += count;
+    return count;
+}
+
+unsigned long http_request_parse(http_request_t *request, const unsigned char *data, unsigned long size){
+    http_span_t *name = &request->names[request->header_count];
+    http_span_t value;
+    unsigned long i = 0, count;
+    unsigned int position;
+    unsigned char c;
+    int digit;
+    
+    while(i < size && request->phase < HTTP_REQUEST_DONE){
+        if(request->state == REQUEST_BODY || request->state == REQUEST_CHUNK_DATA){ // skipped in bulk
+            count = size - i < request->remaining ? size - i : (unsigned long)request->remaining;
+            i += count;
+            request->offset += count;
+            request->remaining -= count;
+            if(request->remaining == 0){
+                if(request->state == REQUEST_BODY){
+                    request->phase = HTTP_REQUEST_DONE;
+                }else{
+                    request->state = REQUEST_CHUNK_END;
+                }
+            }
+            continue;
+        }
+        if((i += skip_run(request, data + i, size - i)) == size){
+            break;
+        }
+        
+        c = data[i++];
+        position = (unsigned int)request->offset++;
+        switch(request->state){
+            case REQUEST_START:
+                if(c == '\r' || c == '\n'){ // RFC 7230 3.5, ignore empty lines before the request
+                    break;
+                }
+                if(!isupper(c)){
+                    return request_error(request, i);
+                }
+                request->method.offset = position;
+                request->method.length = 1;
+                request->state = REQUEST_METHOD;
+                break;
+            case REQUEST_METHOD:
+                if(c == ' '){
+                    request->state = REQUEST_TARGET_START;
+                }else if(!is_token(c) || ++request->method.length > HTTP_MAX_METHOD){
+                    return request_error(request, i);
+                }
+                break;
+            case REQUEST_TARGET_START:
+                if(c <= ' ' || c >= 0x7f){
+                    return request_error(request, i);
+                }
+                request->target.offset = position;
+                request->target.length = 1;
+                request->state = REQUEST_TARGET;
+                break;
+            case REQUEST_TARGET:
+                if(c == ' '){
+                    request->scratch_length = 0;
+                    request->state = REQUEST_VERSION;
+                }else if(c < ' ' || c >= 0x7f){
+                    return request_error(request, i);
+                }else{
+                    request->target.length++;
+                }
+                break;
+            case REQUEST_VERSION:
+                if(c == '\n'){
+                    if(request->scratch_length != 8 || strncmp(request->scratch, "HTTP/1.", 7) != 0 ||
+                       !isdigit((unsigned char)request->scratch[7])){
+                        return request_error(request, i);
+                    }
+                    request->version = request->scratch[7] - '0';
+                    request->keep_alive = request->version > 0; // persistent by default since HTTP/1.1
+                    request->state = REQUEST_HEADER_START;
+                }else if(c != '\r'){
+                    if(request->scratch_length == 8){
+                        return request_error(request, i);
+                    }
+                    request->scratch[request->scratch_length++] = c;
+                }
+                break;
+            case REQUEST_HEADER_START:
+                if(c == '\r'){
+                    break;
+                }
+                if(c == '\n'){ // blank line, end of the head
+                    if(end_head(request) < 0){
+                        return request_error(request, i);
+                    }
+                    break;
+                }
+                if(!is_token(c)){ // includes obsolete line folding, RFC 7230 3.2.4
+                    return request_error(request, i);
+                }
+                name = &request->names[request->header_count];
+                name->offset = position;
+                name->length = 1;
+                request->scratch[0] = tolower(c);
+                request->scratch_length = 1;
+                request->state = REQUEST_NAME;
+                break;
+            case REQUEST_NAME:
+                if(c == ':'){
+                    start_header(request);
+                    request->state = REQUEST_VALUE_START;
+                    break;
+                }
+                if(!is_token(c)){
+                    return request_error(request, i);
+                }
+                name->length++;
+                if(request->scratch_length < (int)sizeof(request->scratch) - 1){
+                    request->scratch[request->scratch_length++] = tolower(c);
+                }else{ // longer than anything we look for
+                    request->scratch[0] = '\0';
+                }
+                break;
+            case REQUEST_VALUE_START:
+                if(c == ' ' || c == '\t'){
+                    break;
+                }
+                request->values[request->header_count].offset = position;
+                request->values[request->header_count].length = 0;
+                request->state = REQUEST_VALUE;
+                // fall through
+            case REQUEST_VALUE:
+                value = request->values[request->header_count];
+                if(c == '\n'){
+                    if(end_header(request, value) < 0){
+                        return request_error(request, i);
+                    }
+                    request->state = REQUEST_HEADER_START;
+                    break;
+                }
+                if(c == '\r'){
+                    break;
+                }
+                if(c != ' ' && c != '\t'){ // trailing whitespace is not part of the value
+                    value.length = position + 1 - value.offset;
+                    request->values[request->header_count] = value;
+                }
+                if(value_char(request, c) < 0){
+                    return request_error(request, i);
+                }
+                break;
+            case REQUEST_CHUNK_SIZE:
+                if(c == ';' || c == ' ' || c == '\t'){
+                    request->state = REQUEST_CHUNK_EXTENSION;
+                    break;
+                }
+                if(c == '\r'){
+                    break;
+                }
+                if(c != '\n'){
+                    digit = isdigit(c) ? c - '0' : (isxdigit(c) ? tolower(c) - 'a' + 10 : -1);
+                    if(digit < 0 || request->remaining >> 56){
+                        return request_error(request, i);
+                    }
+                    request->remaining = request->remaining * 16 + digit;
+                    request->digits++;
+                    break;
+                }
+                // fall through
+            case REQUEST_CHUNK_EXTENSION:
+                if(c != '\n'){
+                    break;
+                }
+                if(request->digits == 0){
+                    return request_error(request, i);
+                }
+                request->digits = 0;
+                request->state = request->remaining == 0 ? REQUEST_TRAILER : REQUEST_CHUNK_DATA;
+                break;
+            case REQUEST_CHUNK_END:
+                if(c == '\n'){
+                    request->state = REQUEST_CHUNK_SIZE;
+                }else if(c != '\r'){
+                    return request_error(request, i);
+                }
+                break;
+            case REQUEST_TRAILER:
+                if(c == '\n'){
+                    request->phase = HTTP_REQUEST_DONE;
+                }else if(c != '\r'){
+                    request->state = REQUEST_TRAILER_LINE;
+                }
+                break;
+            case REQUEST_TRAILER_LINE:
+                if(c == '\n'){
+                    request->state = REQUEST_TRAILER;
+                }
+                break;
+        }
+    }
+    return i;
+}
+
+// finds a header the parser recorded, returns 0 if there is none
+int http_request_header(const http_request_t *request, const unsigned char *data, const char *name, http_span_t *value){
+    size_t length = strlen(name);
+    int i;
+    
+    for(i = 0; i < request->header_count; i++){
+        if(request->names[i].length == length && strncasecmp((const char *)data + request->names[i].offset, name, length) == 0){
+            *value = request->values[i];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int http_span_equals(const unsigned char *data, http_span_t span, const char *text){
+    return strlen(text) == span.length && memcmp(data + span.offset, text, span.length) == 0;
+}
+
+// host and port from the absolute-form or authority-form target, else from Host
+int http_request_authority(const http_request_t *request, const unsigned char *data, http_span_t *host, int *port){
+    const unsigned char *start = data + request->target.offset;
+    const unsigned char *end = start + request->target.length;
+    const unsigned char *p, *colon = NULL;
+    long number = 0;
+    
+    *port = 80;
+    if(http_span_equals(data, request->method, "CONNECT")){
+        *port = 0; // has to be given
+    }else if((p = memmem(start, end - start, "://", 3)) != NULL){
+        if(p - start == 5 && strncasecmp((const char *)start, "https", 5) == 0){
+            *port = 443;
+        }
+        start = p + 3;
+        for(p = start; p < end && *p != '/' && *p != '?' && *p != '#'; p++);
+        end = p;
+    }else if(request->host.length > 0){
+        start = data + request->host.offset;
+        end = start + request->host.length;
+    }else{ // origin-form without a Host, nothing to go on
+        return -1;
+    }
+    for(p = end; p > start && p[-1] != '@'; p--); // strip username/password
+    if(p > start){
+        start = p;
+    }
+    
+    if(start < end && *start == '['){ // IPv6
+        if((p = memchr(start, ']', end - start)) == NULL){
+            return -1;
+        }
+        host->offset = (unsigned int)(start + 1 - data);
+        host->length = (unsigned int)(p - start - 1);
+        if(p + 1 < end){
+            if(p[1] != ':'){
+                return -1;
+            }
+            colon = p + 1;
+        }
+    }else{
+        for(p = start; p < end && *p != ':'; p++);
+        host->offset = (unsigned int)(start - data);
+        host->length = (unsigned int)(p - start);
+        if(p < end){
+            colon = p;
+        }
+    }
+    if(colon != NULL && colon + 1 < end){
+        for(p = colon + 1; p < end; p++){
+            if(!isdigit(*p) || (number = number * 10 + (*p - '0')) > 65535){
+                return -1;
+            }
+        }
+        *port = (int)number;
+    }
+    if(host->length == 0 || *port <= 0){
+        return -1;
+    }
+    return 0;
+}
+
+/* Responses */
+
+enum {
+    RESPONSE_STATUS,
+    RESPONSE_HEADER,
+    RESPONSE_BODY,
+    RESPONSE_CHUNK_SIZE,
+    RESPONSE_CHUNK_DATA,
+    RESPONSE_CHUNK_END,
+    RESPONSE_TRAILER,
+    RESPONSE_UNTIL_CLOSE, // body ends with the connection, or we lost track
+    RESPONSE_CLOSING // the server is done after the last response, nothing more comes
+};
+
+void http_response_init(http_response_t *response){
+    memset(response, 0, sizeof(http_response_t));
+    response->state = RESPONSE_STATUS;
+    response->reusable = 1;
+    response->length = -1;
+}
+
+void http_response_expect(http_response_t *response, int head){
+    if(head){
+        response->heads |= 1u << response->pending;
+    }
+    response->pending++;
+}
+
+// the server closed, which ends a response that runs until close
+void http_response_eof(http_response_t *response){
+    if(response->state == RESPONSE_UNTIL_CLOSE && response->pending > 0){
+        response->pending--;
+        response->heads >>= 1;
+    }
+}
+
+int http_response_idle(const http_response_t *response){
+    return response->reusable && response->pending == 0 &&
+        response->state == RESPONSE_STATUS && response->line_length == 0;
+}
+
+// the status line and headers of the final response are in, 1xx ones don't count
+int http_response_head_done(const http_response_t *response){
+    return response->state != RESPONSE_STATUS && response->state != RESPONSE_HEADER;
+}
+
+static void give_up(http_response_t *response){
+    response->reusable = 0;
+    response->state = RESPONSE_UNTIL_CLOSE;
+}
+
+static void complete(http_response_t *response){
+    response->pending--;
+    response->heads >>= 1; // the next one in line
+    response->state = RESPONSE_STATUS;
+    if(!response->keep_alive){ // the server closes after this one
+        response->reusable = 0;
+        response->state = RESPONSE_CLOSING;
+    }
+}
+
+// the next element of a comma separated header value with the whitespace
+// around it trimmed, NULL at the end
+static const char *next_token(const char **value, size_t *length){
+    const char *start = *value, *end;
+    
+    while(*start == ' ' || *start == '\t' || *start == ','){
+        start++;
+    }
+    if(*start == '\0'){
+        return NULL;
+    }
+    for(end = start; *end != '\0' && *end != ','; end++);
+    *value = end;
+    while(end > start && (end[-1] == ' ' || end[-1] == '\t')){
+        end--;
+    }
+    *length = end - start;
+    return start;
+}
+
+static int token_is(const char *token, size_t length, const char *name){
+    return length == strlen(name) && strncasecmp(token, name, length) == 0;
+}
+
+// whether a comma separated header value has the token, case insensitive
+static int has_token(const char *value, const char *name){
+    const char *token;
+    size_t length;
+    
+    while((token = next_token(&value, &length)) != NULL){
+        if(token_is(token, length, name)){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// whether the token ends the list, as chunked has to in Transfer-Encoding
+static int last_token(const char *value, const char *name){
+    const char *token, *last = NULL;
+    size_t length, last_length = 0;
+    
+    while((token = next_token(&value, &length)) != NULL){
+        last = token;
+        last_length = length;
+    }
+    return last != NULL && token_is(last, last_length, name);
+}
+
+static void end_headers(http_response_t *response){
+    if(response->status >= 100 && response->status < 200){
+        if(response->status == 101){ // not HTTP any more
+            give_up(response);
+        }else{ // informational, the real response follows
+            response->state = RESPONSE_STATUS;
+        }
+        return;
+    }
+    if((response->heads & 1) || response->status == 204 || response->status == 304){
+        complete(response);
+    }else if(response->chunked){
+        response->state = RESPONSE_CHUNK_SIZE;
+    }else if(response->length == 0){
+        complete(response);
+    }else if(response->length > 0){
+        response->remaining = response->length;
+        response->state = RESPONSE_BODY;
+    }else{ // read until close
+        give_up(response);
+    }
+}
+
+static void header_line(http_response_t *response, char *line){
+    char *value, *end;
+    long long length;
+    
+    if((value = strchr(line, ':')) == NULL){
+        return;
+    }
+    *value++ = '\0';
+    while(*value == ' ' || *value == '\t'){
+        value++;
+    }
+    if(strcasecmp(line, "content-length") == 0){
+        length = strtoll(value, &end, 10);
+        if(response->line_truncated || end == value || length < 0 ||
+           (response->length >= 0 && response->length != length)){ // conflicting lengths, RFC 7230 3.3.3
+            give_up(response);
+            return;
+        }
+        response->length = length;
+    }else if(strcasecmp(line, "transfer-encoding") == 0){
+        if(response->line_truncated){
+            give_up(response);
+            return;
+        }
+        response->chunked = last_token(value, "chunked");
+        if(!response->chunked){ // the body runs until the close, RFC 7230 3.3.3
+            give_up(response);
+        }
+    }else if(strcasecmp(line, "connection") == 0){
+        if(has_token(value, "close")){
+            response->keep_alive = 0;
+        }else if(has_token(value, "keep-alive")){
+            response->keep_alive = 1;
+        }
+    }
+}
+
+static void handle_line(http_response_t *response, char *line){
+    unsigned long long size;
+    char *end;
+    
+    switch(response->state){
+        case RESPONSE_STATUS:
+            if(line[0] == '\0'){ // stray CRLF between messages
+                break;
+            }
+            if(response->pending == 0 || strncmp(line, "HTTP/1.", 7) != 0 || !isdigit((unsigned char)line[7])){
+                give_up(response); // nobody asked for this
+                break;
+            }
+            response->status = atoi(line + 8);
+            response->keep_alive = line[7] != '0'; // persistent by default since HTTP/1.1
+            response->chunked = 0;
+            response->length = -1;
+            response->state = RESPONSE_HEADER;
+            break;
+        case RESPONSE_HEADER:
+            if(line[0] == '\0'){
+                end_headers(response);
+            }else{
+                header_line(response, line);
+            }
+            break;
+        case RESPONSE_CHUNK_SIZE:
+            size = strtoull(line, &end, 16);
+            if(end == line || response->line_truncated){
+                give_up(response);
+            }else if(size == 0){
+                response->state = RESPONSE_TRAILER;
+            }else{
+                response->remaining = size;
+                response->state = RESPONSE_CHUNK_DATA;
+            }
+            break;
+        case RESPONSE_CHUNK_END:
+            response->state = line[0] == '\0' ? RESPONSE_CHUNK_SIZE : RESPONSE_UNTIL_CLOSE;
+            if(response->state == RESPONSE_UNTIL_CLOSE){
+                response->reusable = 0;
+            }
+            break;
+        case RESPONSE_TRAILER:
+            if(line[0] == '\0'){
+                complete(response);
+            }
+            break;
+    }
+}
+
+// takes one run of bytes in the current state, 0 if the rest can only be passed through
+static unsigned long feed_state(http_response_t *response, const unsigned char *data, unsigned long size){
+    const unsigned char *newline;
+    unsigned long count, copy;
+    
+    switch(response->state){
+        case RESPONSE_UNTIL_CLOSE:
+        case RESPONSE_CLOSING:
+            return 0;
+        case RESPONSE_BODY:
+        case RESPONSE_CHUNK_DATA:
+            // the body itself is skipped in bulk
+            count = size < response->remaining ? size : (unsigned long)response->remaining;
+            response->remaining -= count;
+            if(response->remaining == 0){
+                if(response->state == RESPONSE_BODY){
+                    complete(response);
+                }else{
+                    response->state = RESPONSE_CHUNK_END;
+                }
+            }
+            return count;
+        default: // line based states
+            newline = memchr(data, '\n', size);
+            count = newline != NULL ? (unsigned long)(newline - data) + 1 : size;
+            copy = count - (newline != NULL);
+            if(copy > sizeof(response->line) - 1 - response->line_length){
+                copy = sizeof(response->line) - 1 - response->line_length;
+                response->line_truncated = 1;
+            }
+            memcpy(response->line + response->line_length, data, copy);
+            response->line_length += copy;
+            if(newline != NULL){
+                if(response->line_length > 0 && response->line[response->line_length - 1] == '\r'){
+                    response->line_length--;
+                }
+                response->line[response->line_length] = '\0';
+                handle_line(response, response->line);
+                response->line_length = 0;
+                response->line_truncated = 0;
+            }
+            return count;
+    }
+}
+
+// returns how much was taken, it stops short after each complete response
+// and once the rest can only be passed through
+unsigned long http_response_feed(http_response_t *response, const unsigned char *data, unsigned long size){
+    unsigned long taken = 0, count;
+    int pending = response->pending;
+    
+    while(taken < size && response->pending == pending && (count = feed_state(response, data + taken, size - taken)) > 0){
+        taken += count;
+    }
+    return taken;
+}
+
+static int part_of(const http_response_t *response){
+    switch(response->state){
+        case RESPONSE_STATUS:
+        case RESPONSE_HEADER:
+            return HTTP_PART_HEAD;
+        case RESPONSE_CHUNK_SIZE:
+        case RESPONSE_CHUNK_END:
+        case RESPONSE_TRAILER:
+            return HTTP_PART_FRAMING;
+    }
+    return HTTP_PART_BODY;
+}
+
+// the same, also stopping wherever the kind of bytes changes, which goes in part
+unsigned long http_response_feed_part(http_response_t *response, const unsigned char *data, unsigned long size, int *part){
+    unsigned long taken = 0, count;
+    int pending = response->pending;
+    
+    *part = part_of(response);
+    while(taken < size && response->pending == pending && part_of(response) == *part &&
+          (count = feed_state(response, data + taken, size - taken)) > 0){
+        taken += count;
+    }
+    return taken;
+}
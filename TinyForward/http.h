@@ -0,0 +1,107 @@
+//
+//  http.h
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef TinyForward_http_h
+#define TinyForward_http_h
+
+#define HTTP_LINE_SIZE    64 // status and header lines are kept up to this much, the rest is skipped
+#define HTTP_MAX_HEADERS  32 // header spans recorded per request, the rest are still checked
+#define HTTP_MAX_METHOD   16
+#define HTTP_MAX_PIPELINE 16 // requests in flight on one server connection, at most 32
+
+// where the request parser is in the message
+#define HTTP_REQUEST_HEAD   0
+#define HTTP_REQUEST_BODY   1
+#define HTTP_REQUEST_DONE   2
+#define HTTP_REQUEST_ERROR  3
+
+// A piece of the message, counted from its first byte
+typedef struct http_span {
+    unsigned int offset;
+    unsigned int length;
+} http_span_t;
+
+// Resumable request parser. Bytes are fed as they arrive and nothing is
+// copied out of them: the interesting parts are recorded as spans, and the
+// body is only followed far enough to know where the message ends.
+typedef struct http_request {
+    int phase;
+    int state;
+    unsigned long long offset; // bytes of the message parsed so far
+    http_span_t method;
+    http_span_t target;
+    http_span_t host; // Host header
+    int version; // minor version of HTTP/1.x
+    int header_count;
+    http_span_t names[HTTP_MAX_HEADERS + 1]; // the last one is overwritten by any extra headers
+    http_span_t values[HTTP_MAX_HEADERS + 1];
+    unsigned long header_size; // request line and headers, blank line included
+    long long content_length; // -1 if absent
+    int transfer_encoding; // any Transfer-Encoding was sent
+    int chunked;
+    int keep_alive;
+    int upgrade;
+    unsigned long long remaining; // body or chunk bytes still to come
+    int header; // which of the headers we care about is being read
+    int digits;
+    int scratch_length;
+    char scratch[20]; // version, header name or a value token, lower case
+} http_request_t;
+
+// Follows the responses coming back on a server connection to find where
+// each one ends, so the connection can be handed to someone else once it
+// is quiet. Bytes are fed as they arrive, in any split.
+typedef struct http_response {
+    int state;
+    int pending; // requests sent whose response hasn't fully arrived
+    unsigned int heads; // which pending requests were HEAD, oldest in the lowest bit
+    int reusable; // cleared once framing can't be trusted or either side wants to close
+    int status;
+    int keep_alive;
+    int chunked;
+    long long length; // Content-Length, -1 if absent
+    unsigned long long remaining; // body or chunk bytes still to come
+    int line_length;
+    int line_truncated;
+    char line[HTTP_LINE_SIZE];
+} http_response_t;
+
+// what a run of response bytes is, see http_response_feed_part()
+enum {
+    HTTP_PART_HEAD, // status line and headers, those of 1xx responses too
+    HTTP_PART_BODY,
+    HTTP_PART_FRAMING // chunk sizes, the line ends after chunks and trailers
+};
+
+void http_request_init(http_request_t *request);
+unsigned long http_request_parse(http_request_t *request, const unsigned char *data, unsigned long size);
+int http_request_authority(const http_request_t *request, const unsigned char *data, http_span_t *host, int *port);
+int http_request_header(const http_request_t *request, const unsigned char *data, const char *name, http_span_t *value);
+int http_span_equals(const unsigned char *data, http_span_t span, const char *text);
+
+void http_response_init(http_response_t *response);
+void http_response_expect(http_response_t *response, int head);
+unsigned long http_response_feed(http_response_t *response, const unsigned char *data, unsigned long size);
+unsigned long http_response_feed_part(http_response_t *response, const unsigned char *data, unsigned long size, int *part);
+void http_response_eof(http_response_t *response);
+int http_response_idle(const http_response_t *response);
+int http_response_head_done(const http_response_t *response);
+
+#endif
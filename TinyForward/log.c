@@ -0,0 +1,283 @@
+//
+//  log.c
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+
+#define LOG_MAX_RINGS  256
+
+// single producer (the worker), single consumer (the drain thread)
+typedef struct log_ring {
+    int worker;
+    unsigned long head; // next byte to write out, only moved by the drain thread
+    unsigned long tail; // end of the last complete line, only moved by the worker
+    unsigned long dropped; // lines that didn't fit
+    unsigned long reported; // drops already written out
+    char data[LOG_RING_SIZE];
+} log_ring_t;
+
+static const char *level_names[] = {"ERROR", "WARN", "INFO", "DEBUG"};
+
+int g_log_level = LOG_INFO;
+int g_log_dump_rate = 0;
+
+static int g_log_fd = STDERR_FILENO;
+static log_ring_t *g_rings[LOG_MAX_RINGS];
+static int g_ring_count;
+static pthread_mutex_t g_rings_lock = PTHREAD_MUTEX_INITIALIZER; // only taken to add a ring
+static pthread_t g_drain_thread;
+static int g_draining;
+
+static __thread log_ring_t *t_ring;
+static __thread int t_worker = -1;
+static __thread unsigned long t_dump_count;
+
+static void write_all(const char *data, size_t size){
+    ssize_t count;
+    
+    while(size > 0){
+        count = write(g_log_fd, data, size);
+        if(count < 0 && errno == EINTR){
+            continue;
+        }
+        if(count <= 0){ // nowhere to report it
+            return;
+        }
+        data += count;
+        size -= count;
+    }
+}
+
+static void put_line(const char *line, size_t size){
+    log_ring_t *ring = t_ring;
+    unsigned long head, tail, offset, first;
+    
+    if(ring == NULL){
+        write_all(line, size);
+        return;
+    }
+    tail = ring->tail;
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if(LOG_RING_SIZE - (tail - head) < size){
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    offset = tail & (LOG_RING_SIZE - 1);
+    first = LOG_RING_SIZE - offset < size ? LOG_RING_SIZE - offset : size;
+    memcpy(ring->data + offset, line, first);
+    memcpy(ring->data, line + first, size - first);
+    __atomic_store_n(&ring->tail, tail + size, __ATOMIC_RELEASE); // publish the whole line
+}
+
+static int line_prefix(char *line, size_t size, int level){
+    struct timespec ts;
+    struct tm tm;
+    int length;
+    
+    clock_gettime(CLOCK_REALTIME, &ts);
+    localtime_r(&ts.tv_sec, &tm);
+    length = (int)strftime(line, size, "%Y-%m-%d %H:%M:%S", &tm);
+    if(t_worker >= 0){
+        length += snprintf(line + length, size - length, ".%03ld [%d] %-5s ", ts.tv_nsec / 1000000, t_worker, level_names[level]);
+    }else{
+        length += snprintf(line + length, size - length, ".%03ld [-] %-5s ", ts.tv_nsec / 1000000, level_names[level]);
+    }
+    return length;
+}
+
+void log_write(int level, const char *format, ...){
+    char line[LOG_LINE_SIZE];
+    va_list args;
+    int length;
+    
+    length = line_prefix(line, sizeof(line), level);
+    va_start(args, format);
+    length += vsnprintf(line + length, sizeof(line) - length, format, args);
+    va_end(args);
+    if(length > (int)sizeof(line) - 1){ // cut, keep the newline
+        length = sizeof(line) - 1;
+    }
+    if(line[length - 1] != '\n'){
+        line[length++] = '\n';
+    }
+    put_line(line, length);
+}
+
+void log_dump(const char *label, int socket, const struct iovec *iov, long count){
+    char line[LOG_LINE_SIZE];
+    unsigned char bytes[LOG_DUMP_BYTES];
+    unsigned long size, first, i, j;
+    int length;
+    
+    if(count <= 0 || ++t_dump_count % g_log_dump_rate != 0){ // sampled
+        return;
+    }
+    size = count < LOG_DUMP_BYTES ? count : LOG_DUMP_BYTES;
+    first = iov[0].iov_len < size ? iov[0].iov_len : size;
+    memcpy(bytes, iov[0].iov_base, first);
+    if(size > first){
+        memcpy(bytes + first, iov[1].iov_base, size - first);
+    }
+    length = line_prefix(line, sizeof(line), LOG_DEBUG);
+    length += snprintf(line + length, sizeof(line) - length, "%s: socket %d, for %ld\n", label, socket, count);
+    put_line(line, length);
+    for(i = 0; i < size; i += 16){
+        length = snprintf(line, sizeof(line), "%04lX: ", i);
+        for(j = i; j < i + 16; j++){ // hex value
+            length += j < size ? snprintf(line + length, sizeof(line) - length, "%02X ", bytes[j]) :
+                snprintf(line + length, sizeof(line) - length, "   ");
+        }
+        line[length++] = '|';
+        line[length++] = ' ';
+        for(j = i; j < i + 16 && j < size; j++){ // print only visible characters
+            line[length++] = bytes[j] < 32 || bytes[j] > 126 ? '.' : bytes[j];
+        }
+        line[length++] = '\n';
+        put_line(line, length);
+    }
+}
+
+static void drain_ring(log_ring_t *ring){
+    char line[64];
+    struct iovec iov[2];
+    unsigned long head, tail, offset, dropped;
+    ssize_t count;
+    int n;
+    
+    head = ring->head;
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    while(head != tail){
+        offset = head & (LOG_RING_SIZE - 1);
+        iov[0].iov_base = ring->data + offset;
+        iov[0].iov_len = LOG_RING_SIZE - offset < tail - head ? LOG_RING_SIZE - offset : tail - head;
+        iov[1].iov_base = ring->data;
+        iov[1].iov_len = tail - head - iov[0].iov_len;
+        n = iov[1].iov_len > 0 ? 2 : 1;
+        count = writev(g_log_fd, iov, n);
+        if(count < 0 && errno == EINTR){
+            continue;
+        }
+        if(count <= 0){ // throw it away rather than stall the workers
+            count = tail - head;
+        }
+        head += count;
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    }
+    dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    if(dropped != ring->reported){
+        n = snprintf(line, sizeof(line), "worker %d dropped %lu log lines\n", ring->worker, dropped - ring->reported);
+        write_all(line, n);
+        ring->reported = dropped;
+    }
+}
+
+static void drain_all(void){
+    int i, count = __atomic_load_n(&g_ring_count, __ATOMIC_ACQUIRE);
+    
+    for(i = 0; i < count; i++){
+        drain_ring(g_rings[i]);
+    }
+}
+
+static void *drain_run(void *arg){
+    struct timespec interval = {0, LOG_FLUSH_INTERVAL * 1000000L};
+    
+    (void)arg;
+    while(__atomic_load_n(&g_draining, __ATOMIC_ACQUIRE)){
+        drain_all();
+        nanosleep(&interval, NULL);
+    }
+    drain_all();
+    return NULL;
+}
+
+int log_level(const char *name){
+    int i;
+    
+    for(i = LOG_ERROR; i <= LOG_DEBUG; i++){
+        if(strcasecmp(name, level_names[i]) == 0){
+            return i;
+        }
+    }
+    return -1;
+}
+
+int log_init(const char *path, int level, int dump_rate){
+    int err;
+    
+    if(path != NULL){
+        g_log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if(g_log_fd < 0){
+            g_log_fd = STDERR_FILENO;
+            fprintf(stderr, "Cannot open log file %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+    }
+    g_log_level = level;
+    g_log_dump_rate = dump_rate;
+    g_draining = 1;
+    if((err = pthread_create(&g_drain_thread, NULL, drain_run, NULL)) != 0){
+        fprintf(stderr, "Cannot start log thread: %s\n", strerror(err));
+        g_draining = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void log_attach(int worker){
+    log_ring_t *ring;
+    
+    t_worker = worker;
+    if(!g_draining){ // nobody to drain a ring, keep writing directly
+        return;
+    }
+    pthread_mutex_lock(&g_rings_lock);
+    if(g_ring_count < LOG_MAX_RINGS && (ring = calloc(1, sizeof(log_ring_t))) != NULL){
+        ring->worker = worker;
+        g_rings[g_ring_count] = ring;
+        __atomic_store_n(&g_ring_count, g_ring_count + 1, __ATOMIC_RELEASE);
+        t_ring = ring;
+    }
+    pthread_mutex_unlock(&g_rings_lock);
+}
+
+void log_shutdown(void){
+    int i;
+    
+    if(!g_draining){
+        return;
+    }
+    __atomic_store_n(&g_draining, 0, __ATOMIC_RELEASE);
+    pthread_join(g_drain_thread, NULL); // drains once more on the way out
+    t_ring = NULL;
+    for(i = 0; i < g_ring_count; i++){
+        free(g_rings[i]);
+    }
+    g_ring_count = 0;
+}
@@ -0,0 +1,58 @@
+//
+//  log.h
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef TinyForward_log_h
+#define TinyForward_log_h
+
+#include <sys/uio.h>
+
+#define LOG_ERROR    0
+#define LOG_WARN     1
+#define LOG_INFO     2
+#define LOG_DEBUG    3
+
+#define LOG_RING_SIZE       65536 // per worker, must be a power of two
+#define LOG_LINE_SIZE       512   // longer messages are cut
+#define LOG_FLUSH_INTERVAL  50    // ms between drains of the worker rings
+#define LOG_DUMP_BYTES      256   // payload shown per sampled dump
+
+extern int g_log_level;
+extern int g_log_dump_rate;
+
+// Messages are formatted by the thread that logs them into a ring owned by
+// that thread, and a background thread writes the rings out. Nothing is
+// locked on the way in; when a ring is full the line is dropped and counted.
+// Threads without a ring (startup, shutdown) write straight to the file.
+#define log_message(level, ...) \
+    do{ if((level) <= g_log_level) log_write(level, __VA_ARGS__); }while(0)
+
+// hex dump of one in every g_log_dump_rate reads and writes, 0 turns them off
+#define log_payload(label, socket, iov, count) \
+    do{ if(g_log_dump_rate != 0) log_dump(label, socket, iov, count); }while(0)
+
+int log_init(const char *path, int level, int dump_rate);
+int log_level(const char *name);
+void log_attach(int worker);
+void log_shutdown(void);
+
+void log_write(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void log_dump(const char *label, int socket, const struct iovec *iov, long count);
+
+#endif
@@ -0,0 +1,261 @@
+//
+//  metrics.c
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "buffer.h"
+#include "metrics.h"
+
+#define STEP_BITS  4 // log2(HISTOGRAM_STEPS)
+
+typedef struct text {
+    char *data;
+    unsigned long length;
+    unsigned long capacity;
+} text_t;
+
+static const char *side_names[METRIC_SIDES] = {"client", "server"};
+static const char *error_names[METRIC_ERRORS] = {"accept", "request", "connect", "send", "client", "tunnel", "timeout"};
+static const char *shed_names[METRIC_SHED_REASONS] = {"connections", "address", "memory", "descriptors"};
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+static metrics_t *g_metrics[METRICS_MAX_WORKERS];
+static int g_metrics_count;
+
+long long metrics_now(void){
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void metrics_register(metrics_t *metrics, int worker){
+    metrics->worker = worker;
+    if(worker < METRICS_MAX_WORKERS){ // workers are set up before any thread starts
+        g_metrics[worker] = metrics;
+        if(worker >= g_metrics_count){
+            __atomic_store_n(&g_metrics_count, worker + 1, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+static int bucket_index(unsigned long long value){
+    int shift, index;
+    
+    if(value < HISTOGRAM_LINEAR){
+        return (int)value;
+    }
+    // the top STEP_BITS + 1 bits pick the bucket, the rest is precision we drop
+    shift = 63 - __builtin_clzll(value) - STEP_BITS;
+    index = HISTOGRAM_LINEAR + (shift - 1) * HISTOGRAM_STEPS + (int)(value >> shift) - HISTOGRAM_STEPS;
+    return index < HISTOGRAM_BUCKETS ? index : HISTOGRAM_BUCKETS - 1;
+}
+
+// largest value that lands in a bucket
+static unsigned long long bucket_value(int index){
+    int shift, step;
+    
+    if(index < HISTOGRAM_LINEAR){
+        return index;
+    }
+    shift = (index - HISTOGRAM_LINEAR) / HISTOGRAM_STEPS + 1;
+    step = (index - HISTOGRAM_LINEAR) % HISTOGRAM_STEPS + HISTOGRAM_STEPS;
+    return ((unsigned long long)(step + 1) << shift) - 1;
+}
+
+void histogram_record(histogram_t *histogram, long long value){
+    if(value < 0){ // clock oddities
+        value = 0;
+    }
+    metrics_add(&histogram->buckets[bucket_index(value)], 1);
+    metrics_add(&histogram->sum, value);
+    metrics_add(&histogram->count, 1);
+}
+
+static void histogram_merge(histogram_t *total, histogram_t *histogram){
+    int i;
+    
+    total->count += __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+    total->sum += __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED);
+    for(i = 0; i < HISTOGRAM_BUCKETS; i++){
+        total->buckets[i] += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+    }
+}
+
+static unsigned long long histogram_quantile(const histogram_t *histogram, double quantile){
+    unsigned long long rank, seen = 0, count = 0;
+    int i;
+    
+    // buckets and count are read separately, trust the buckets
+    for(i = 0; i < HISTOGRAM_BUCKETS; i++){
+        count += histogram->buckets[i];
+    }
+    if(count == 0){
+        return 0;
+    }
+    rank = (unsigned long long)(quantile * count + 0.5);
+    if(rank == 0){
+        rank = 1;
+    }
+    for(i = 0; i < HISTOGRAM_BUCKETS; i++){
+        seen += histogram->buckets[i];
+        if(seen >= rank){
+            break;
+        }
+    }
+    return bucket_value(i < HISTOGRAM_BUCKETS ? i : HISTOGRAM_BUCKETS - 1);
+}
+
+static void append(text_t *text, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void append(text_t *text, const char *format, ...){
+    va_list args;
+    char *data;
+    int length;
+    
+    if(text->data == NULL){
+        return; // out of memory earlier
+    }
+    for(;;){
+        va_start(args, format);
+        length = vsnprintf(text->data + text->length, text->capacity - text->length, format, args);
+        va_end(args);
+        if(length < 0){
+            return;
+        }
+        if(text->length + length < text->capacity){
+            text->length += length;
+            return;
+        }
+        if((data = realloc(text->data, text->capacity * 2)) == NULL){
+            free(text->data);
+            text->data = NULL;
+            return;
+        }
+        text->data = data;
+        text->capacity *= 2;
+    }
+}
+
+static void append_counter(text_t *text, const char *name, const char *help, unsigned long long value){
+    append(text, "# HELP tinyforward_%s %s\n# TYPE tinyforward_%s counter\ntinyforward_%s %llu\n", name, help, name, name, value);
+}
+
+static void append_summary(text_t *text, const char *name, const char *help, const histogram_t *histogram){
+    unsigned int i;
+    
+    append(text, "# HELP tinyforward_%s %s\n# TYPE tinyforward_%s summary\n", name, help, name);
+    for(i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++){
+        append(text, "tinyforward_%s{quantile=\"%g\"} %.6f\n", name, quantiles[i], histogram_quantile(histogram, quantiles[i]) / 1e6);
+    }
+    append(text, "tinyforward_%s_sum %.6f\ntinyforward_%s_count %llu\n", name, histogram->sum / 1e6, name, histogram->count);
+}
+
+// everything in Prometheus text format, the caller frees it
+char *metrics_format(unsigned long *size){
+    metrics_t *total, *metrics;
+    text_t text;
+    int i, j, count = __atomic_load_n(&g_metrics_count, __ATOMIC_ACQUIRE);
+    
+    if((total = calloc(1, sizeof(metrics_t))) == NULL){
+        return NULL;
+    }
+    text.length = 0;
+    text.capacity = 8192;
+    text.data = malloc(text.capacity);
+    
+    append(&text, "# HELP tinyforward_worker_connections_active Client connections open on each worker.\n"
+           "# TYPE tinyforward_worker_connections_active gauge\n");
+    for(i = 0; i < count; i++){
+        if((metrics = g_metrics[i]) == NULL){
+            continue;
+        }
+        total->accepted += __atomic_load_n(&metrics->accepted, __ATOMIC_RELAXED);
+        total->closed += __atomic_load_n(&metrics->closed, __ATOMIC_RELAXED);
+        total->requests += __atomic_load_n(&metrics->requests, __ATOMIC_RELAXED);
+        total->upstream_connects += __atomic_load_n(&metrics->upstream_connects, __ATOMIC_RELAXED);
+        total->upstream_reused += __atomic_load_n(&metrics->upstream_reused, __ATOMIC_RELAXED);
+        total->cache_hits += __atomic_load_n(&metrics->cache_hits, __ATOMIC_RELAXED);
+        total->cache_misses += __atomic_load_n(&metrics->cache_misses, __ATOMIC_RELAXED);
+        total->cache_revalidations += __atomic_load_n(&metrics->cache_revalidations, __ATOMIC_RELAXED);
+        total->cache_collapsed += __atomic_load_n(&metrics->cache_collapsed, __ATOMIC_RELAXED);
+        total->buffer_waits += __atomic_load_n(&metrics->buffer_waits, __ATOMIC_RELAXED);
+        total->gzip_responses += __atomic_load_n(&metrics->gzip_responses, __ATOMIC_RELAXED);
+        total->gzip_in += __atomic_load_n(&metrics->gzip_in, __ATOMIC_RELAXED);
+        total->gzip_out += __atomic_load_n(&metrics->gzip_out, __ATOMIC_RELAXED);
+        for(j = 0; j < METRIC_SIDES; j++){
+            total->received[j] += __atomic_load_n(&metrics->received[j], __ATOMIC_RELAXED);
+            total->sent[j] += __atomic_load_n(&metrics->sent[j], __ATOMIC_RELAXED);
+        }
+        for(j = 0; j < METRIC_ERRORS; j++){
+            total->errors[j] += __atomic_load_n(&metrics->errors[j], __ATOMIC_RELAXED);
+        }
+        for(j = 0; j < METRIC_SHED_REASONS; j++){
+            total->shed[j] += __atomic_load_n(&metrics->shed[j], __ATOMIC_RELAXED);
+        }
+        histogram_merge(&total->connect_time, &metrics->connect_time);
+        histogram_merge(&total->first_byte, &metrics->first_byte);
+        append(&text, "tinyforward_worker_connections_active{worker=\"%d\"} %lld\n", i,
+               (long long)(__atomic_load_n(&metrics->accepted, __ATOMIC_RELAXED) - __atomic_load_n(&metrics->closed, __ATOMIC_RELAXED)));
+    }
+    
+    append(&text, "# HELP tinyforward_connections_active Client connections open.\n"
+           "# TYPE tinyforward_connections_active gauge\ntinyforward_connections_active %lld\n",
+           (long long)(total->accepted - total->closed));
+    append_counter(&text, "connections_total", "Client connections accepted.", total->accepted);
+    append_counter(&text, "requests_total", "Requests sent upstream, tunnels included.", total->requests);
+    append_counter(&text, "upstream_connects_total", "New upstream connections attempted.", total->upstream_connects);
+    append_counter(&text, "upstream_reused_total", "Upstream connections taken from the idle pool.", total->upstream_reused);
+    append_counter(&text, "cache_hits_total", "Responses served from the cache.", total->cache_hits);
+    append_counter(&text, "cache_misses_total", "Cacheable requests sent to the server.", total->cache_misses);
+    append_counter(&text, "cache_revalidations_total", "Stale cache entries revalidated with the server.", total->cache_revalidations);
+    append_counter(&text, "cache_collapsed_total", "Cache misses that waited for a response already being fetched.", total->cache_collapsed);
+    append(&text, "# HELP tinyforward_buffer_bytes Memory held by connection buffers.\n"
+           "# TYPE tinyforward_buffer_bytes gauge\ntinyforward_buffer_bytes %lu\n", buffer_memory());
+    append_counter(&text, "buffer_waits_total", "Reads held back until there was buffer memory for them.", total->buffer_waits);
+    append_counter(&text, "gzip_responses_total", "Responses compressed on the way to the client.", total->gzip_responses);
+    append_counter(&text, "gzip_input_bytes_total", "Body bytes of compressed responses before compression.", total->gzip_in);
+    append_counter(&text, "gzip_output_bytes_total", "Body bytes of compressed responses after compression.", total->gzip_out);
+    append(&text, "# HELP tinyforward_received_bytes_total Bytes read from sockets.\n# TYPE tinyforward_received_bytes_total counter\n");
+    for(j = 0; j < METRIC_SIDES; j++){
+        append(&text, "tinyforward_received_bytes_total{side=\"%s\"} %llu\n", side_names[j], total->received[j]);
+    }
+    append(&text, "# HELP tinyforward_sent_bytes_total Bytes written to sockets.\n# TYPE tinyforward_sent_bytes_total counter\n");
+    for(j = 0; j < METRIC_SIDES; j++){
+        append(&text, "tinyforward_sent_bytes_total{side=\"%s\"} %llu\n", side_names[j], total->sent[j]);
+    }
+    append(&text, "# HELP tinyforward_errors_total Failures by where they happened.\n# TYPE tinyforward_errors_total counter\n");
+    for(j = 0; j < METRIC_ERRORS; j++){
+        append(&text, "tinyforward_errors_total{class=\"%s\"} %llu\n", error_names[j], total->errors[j]);
+    }
+    append(&text, "# HELP tinyforward_shed_total Clients turned away by admission control.\n# TYPE tinyforward_shed_total counter\n");
+    for(j = 0; j < METRIC_SHED_REASONS; j++){
+        append(&text, "tinyforward_shed_total{reason=\"%s\"} %llu\n", shed_names[j], total->shed[j]);
+    }
+    append_summary(&text, "upstream_connect_seconds", "Time to connect upstream, name resolution included.", &total->connect_time);
+    append_summary(&text, "first_byte_seconds", "Time from sending a request to the first byte of its response.", &total->first_byte);
+    
+    free(total);
+    *size = text.length;
+    return text.data;
+}
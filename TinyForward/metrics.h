@@ -0,0 +1,98 @@
+//
+//  metrics.h
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef TinyForward_metrics_h
+#define TinyForward_metrics_h
+
+#define HISTOGRAM_LINEAR   32 // values below this get a bucket each
+#define HISTOGRAM_STEPS    16 // buckets per power of two above that, about 6% apart
+#define HISTOGRAM_BUCKETS  (HISTOGRAM_LINEAR + HISTOGRAM_STEPS * 36) // up to 2^40 us, almost two weeks
+
+#define METRICS_MAX_WORKERS 256
+
+enum {
+    METRIC_CLIENT,
+    METRIC_SERVER,
+    METRIC_SIDES
+};
+
+enum {
+    METRIC_ERROR_ACCEPT, // accept() failed
+    METRIC_ERROR_REQUEST, // handle_request() refused it, bad body or oversized head
+    METRIC_ERROR_CONNECT, // name didn't resolve or no address answered
+    METRIC_ERROR_SEND, // request couldn't be sent, client got ERROR_RESPONSE
+    METRIC_ERROR_CLIENT, // reading from or writing to the client failed
+    METRIC_ERROR_TUNNEL, // splice relay failed
+    METRIC_ERROR_TIMEOUT, // a connection sat too long in one phase
+    METRIC_ERRORS
+};
+
+enum {
+    METRIC_SHED_CONNECTIONS, // at the limit on open client connections
+    METRIC_SHED_ADDRESS, // at the limit for the client's address
+    METRIC_SHED_MEMORY, // buffers already take up all they may
+    METRIC_SHED_DESCRIPTORS, // out of file descriptors
+    METRIC_SHED_REASONS
+};
+
+// Log-linear buckets in the style of HdrHistogram, values in microseconds.
+typedef struct histogram {
+    unsigned long long count;
+    unsigned long long sum;
+    unsigned long long buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+// Written only by the worker that owns it, without locks. The admin
+// listener adds every worker's copy together when it is scraped, so a
+// scrape may see one counter a moment ahead of another.
+typedef struct metrics {
+    int worker;
+    unsigned long long accepted;
+    unsigned long long closed;
+    unsigned long long requests;
+    unsigned long long upstream_connects;
+    unsigned long long upstream_reused; // taken from the idle pool
+    unsigned long long cache_hits; // answered from the cache, revalidated ones included
+    unsigned long long cache_misses; // could have been, went to the server
+    unsigned long long cache_revalidations; // stale copies checked with the server
+    unsigned long long cache_collapsed; // misses that waited for the same response on its way for someone else
+    unsigned long long buffer_waits; // reads held back until there was buffer memory for them
+    unsigned long long gzip_responses; // compressed on the way to the client
+    unsigned long long gzip_in; // bytes of their bodies before compression
+    unsigned long long gzip_out; // and after, chunk framing left out
+    unsigned long long received[METRIC_SIDES];
+    unsigned long long sent[METRIC_SIDES];
+    unsigned long long errors[METRIC_ERRORS];
+    unsigned long long shed[METRIC_SHED_REASONS]; // clients turned away with a 503 right after accept()
+    histogram_t connect_time; // upstream_connect() until the socket is up, DNS included
+    histogram_t first_byte; // request dispatched until the response starts
+} metrics_t;
+
+// plain loads and stores, the owner is the only writer
+static inline void metrics_add(unsigned long long *counter, unsigned long long value){
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+void metrics_register(metrics_t *metrics, int worker);
+void histogram_record(histogram_t *histogram, long long value);
+long long metrics_now(void);
+char *metrics_format(unsigned long *size);
+
+#endif
@@ -0,0 +1,250 @@
+//
+//  pool.c
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "event.h"
+#include "pool.h"
+
+typedef struct pool_socket pool_socket_t;
+typedef struct pool_origin pool_origin_t;
+
+struct pool_socket {
+    int fd;
+    long long connected; // ms
+    long long idle_since; // ms
+    pool_socket_t *next; // most recently used first
+};
+
+struct pool_origin {
+    char *host;
+    int port;
+    unsigned int hash;
+    int count;
+    pool_socket_t *idle;
+    pool_origin_t *next_bucket;
+};
+
+typedef struct pool_shard {
+    pthread_mutex_t lock;
+    pool_origin_t *buckets[POOL_BUCKETS];
+} pool_shard_t;
+
+static pool_shard_t g_pool[POOL_SHARDS];
+static int g_pool_idle = 0; // across all shards, atomic
+static long long g_next_sweep = 0; // atomic, written under g_sweep_lock
+static pthread_mutex_t g_sweep_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void pool_init(void){
+    int i;
+    
+    for(i = 0; i < POOL_SHARDS; i++){
+        memset(&g_pool[i], 0, sizeof(pool_shard_t));
+        pthread_mutex_init(&g_pool[i].lock, NULL);
+    }
+}
+
+static unsigned int hash_origin(const char *host, int port){
+    unsigned int hash = 2166136261u; // FNV-1a
+    
+    while(*host){
+        hash = (hash ^ (unsigned char)*host++) * 16777619u;
+    }
+    return (hash ^ (unsigned int)port) * 16777619u;
+}
+
+static pool_origin_t **find_origin(pool_shard_t *shard, const char *host, int port, unsigned int hash){
+    pool_origin_t **link = &shard->buckets[(hash / POOL_SHARDS) & (POOL_BUCKETS - 1)];
+    
+    for(; *link != NULL; link = &(*link)->next_bucket){
+        if((*link)->hash == hash && (*link)->port == port && strcmp((*link)->host, host) == 0){
+            break;
+        }
+    }
+    return link;
+}
+
+static void free_origin(pool_origin_t **link){
+    pool_origin_t *origin = *link;
+    
+    *link = origin->next_bucket;
+    free(origin->host);
+    free(origin);
+}
+
+// the server may have closed or sent something while nobody was listening
+static int is_stale(int fd){
+    char byte;
+    ssize_t count;
+    
+    count = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return !(count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+static int is_expired(pool_socket_t *socket, long long now){
+    return now - socket->idle_since >= POOL_IDLE_TIMEOUT || now - socket->connected >= POOL_MAX_AGE;
+}
+
+static void retire(pool_socket_t *socket){
+    close(socket->fd);
+    free(socket);
+    __atomic_sub_fetch(&g_pool_idle, 1, __ATOMIC_RELAXED);
+}
+
+int pool_checkout(const char *host, int port, long long *connected){
+    unsigned int hash = hash_origin(host, port);
+    pool_shard_t *shard = &g_pool[hash & (POOL_SHARDS - 1)];
+    pool_origin_t **link, *origin;
+    pool_socket_t *socket, *stale = NULL;
+    long long now = event_now();
+    int fd = -1;
+    
+    pthread_mutex_lock(&shard->lock);
+    link = find_origin(shard, host, port, hash);
+    if((origin = *link) != NULL){
+        while(fd < 0 && (socket = origin->idle) != NULL){
+            origin->idle = socket->next;
+            origin->count--;
+            if(is_expired(socket, now) || is_stale(socket->fd)){ // close outside the lock
+                socket->next = stale;
+                stale = socket;
+                continue;
+            }
+            fd = socket->fd;
+            *connected = socket->connected;
+            free(socket);
+            __atomic_sub_fetch(&g_pool_idle, 1, __ATOMIC_RELAXED);
+        }
+        if(origin->count == 0){
+            free_origin(link);
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+    
+    while((socket = stale) != NULL){
+        stale = socket->next;
+        retire(socket);
+    }
+    return fd;
+}
+
+void pool_checkin(const char *host, int port, int fd, long long connected){
+    unsigned int hash = hash_origin(host, port);
+    pool_shard_t *shard = &g_pool[hash & (POOL_SHARDS - 1)];
+    pool_origin_t **link, *origin;
+    pool_socket_t *socket, **last, *evicted = NULL;
+    long long now = event_now();
+    
+    if(now - connected >= POOL_MAX_AGE || __atomic_load_n(&g_pool_idle, __ATOMIC_RELAXED) >= POOL_MAX_TOTAL ||
+       (socket = malloc(sizeof(pool_socket_t))) == NULL){
+        close(fd);
+        return;
+    }
+    socket->fd = fd;
+    socket->connected = connected;
+    socket->idle_since = now;
+    __atomic_add_fetch(&g_pool_idle, 1, __ATOMIC_RELAXED);
+    
+    pthread_mutex_lock(&shard->lock);
+    link = find_origin(shard, host, port, hash);
+    if((origin = *link) == NULL){
+        if((origin = calloc(1, sizeof(pool_origin_t))) == NULL || (origin->host = strdup(host)) == NULL){
+            pthread_mutex_unlock(&shard->lock);
+            free(origin);
+            retire(socket);
+            return;
+        }
+        origin->port = port;
+        origin->hash = hash;
+        *link = origin;
+    }
+    socket->next = origin->idle;
+    origin->idle = socket;
+    if(++origin->count > POOL_MAX_IDLE){ // drop the one that has been idle longest
+        for(last = &origin->idle; (*last)->next != NULL; last = &(*last)->next);
+        evicted = *last;
+        *last = NULL;
+        origin->count--;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    
+    if(evicted != NULL){
+        retire(evicted);
+    }
+}
+
+int pool_timeout(void){
+    long long wait;
+    
+    if(__atomic_load_n(&g_pool_idle, __ATOMIC_RELAXED) == 0){
+        return -1;
+    }
+    wait = __atomic_load_n(&g_next_sweep, __ATOMIC_RELAXED) - event_now();
+    return wait > 0 ? (int)wait : 0;
+}
+
+void pool_expire(void){
+    pool_shard_t *shard;
+    pool_origin_t **link;
+    pool_socket_t **next, *socket, *stale = NULL;
+    long long now = event_now();
+    int i, j;
+    
+    if(__atomic_load_n(&g_pool_idle, __ATOMIC_RELAXED) == 0 || now < __atomic_load_n(&g_next_sweep, __ATOMIC_RELAXED) ||
+       pthread_mutex_trylock(&g_sweep_lock) != 0){
+        return;
+    }
+    __atomic_store_n(&g_next_sweep, now + POOL_SWEEP_INTERVAL, __ATOMIC_RELAXED);
+    for(i = 0; i < POOL_SHARDS; i++){
+        shard = &g_pool[i];
+        pthread_mutex_lock(&shard->lock);
+        for(j = 0; j < POOL_BUCKETS; j++){
+            link = &shard->buckets[j];
+            while(*link != NULL){
+                for(next = &(*link)->idle; (socket = *next) != NULL; ){
+                    if(is_expired(socket, now) || is_stale(socket->fd)){
+                        *next = socket->next;
+                        (*link)->count--;
+                        socket->next = stale;
+                        stale = socket;
+                    }else{
+                        next = &socket->next;
+                    }
+                }
+                if((*link)->count == 0){
+                    free_origin(link);
+                }else{
+                    link = &(*link)->next_bucket;
+                }
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    pthread_mutex_unlock(&g_sweep_lock);
+    
+    while((socket = stale) != NULL){
+        stale = socket->next;
+        retire(socket);
+    }
+}
@@ -0,0 +1,43 @@
+//
+//  pool.h
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef TinyForward_pool_h
+#define TinyForward_pool_h
+
+#define POOL_MAX_IDLE        8      // idle connections kept per origin
+#define POOL_MAX_TOTAL       1024   // idle connections kept overall
+#define POOL_IDLE_TIMEOUT    15000  // ms, servers tend to drop idle connections soon after
+#define POOL_MAX_AGE         300000 // ms since connecting, then the connection is retired
+#define POOL_SWEEP_INTERVAL  1000   // ms between closing expired connections
+#define POOL_SHARDS          16     // must be a power of two
+#define POOL_BUCKETS         64     // per shard, must be a power of two
+
+// Idle upstream connections shared by every worker, keyed by (host, port).
+// Sockets in the pool are not watched by any event loop, so whichever
+// worker checks one out simply adds it to its own.
+void pool_init(void);
+int pool_checkout(const char *host, int port, long long *connected);
+void pool_checkin(const char *host, int port, int socket, long long connected);
+
+/* Housekeeping */
+int pool_timeout(void);
+void pool_expire(void);
+
+#endif
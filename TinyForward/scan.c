@@ -0,0 +1,187 @@
+//
+//  scan.c
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "scan.h"
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define SCAN_USE_X86
+#include <immintrin.h>
+#endif
+
+static inline int visible_end(unsigned char c){
+    return c <= ' ' || c >= 0x7f;
+}
+
+static inline int text_end(unsigned char c){
+    return (c < ' ' && c != '\t') || c == 0x7f;
+}
+
+static size_t visible_scalar(const unsigned char *data, size_t size){
+    size_t i;
+    
+    for(i = 0; i < size && !visible_end(data[i]); i++);
+    return i;
+}
+
+static size_t text_scalar(const unsigned char *data, size_t size){
+    size_t i;
+    
+    for(i = 0; i < size && !text_end(data[i]); i++);
+    return i;
+}
+
+#ifdef SCAN_USE_X86
+
+// No unsigned byte compares before AVX-512, so ranges go through min/max:
+// c <= limit exactly when min(c, limit) == c.
+
+static inline unsigned int visible_mask_sse2(__m128i v){
+    __m128i visible = _mm_sub_epi8(v, _mm_set1_epi8(0x21)); // 0x21..0x7e becomes 0..0x5d
+    __m128i outside = _mm_cmpeq_epi8(_mm_max_epu8(visible, _mm_set1_epi8(0x5e)), visible);
+    return _mm_movemask_epi8(outside);
+}
+
+static inline unsigned int text_mask_sse2(__m128i v){
+    __m128i control = _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(0x1f)), v);
+    control = _mm_andnot_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\t')), control);
+    return _mm_movemask_epi8(_mm_or_si128(control, _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7f))));
+}
+
+static size_t visible_sse2(const unsigned char *data, size_t size){
+    unsigned int mask;
+    size_t i;
+    
+    for(i = 0; i + 16 <= size; i += 16){
+        if((mask = visible_mask_sse2(_mm_loadu_si128((const __m128i *)(data + i)))) != 0){
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + visible_scalar(data + i, size - i);
+}
+
+static size_t text_sse2(const unsigned char *data, size_t size){
+    unsigned int mask;
+    size_t i;
+    
+    for(i = 0; i + 16 <= size; i += 16){
+        if((mask = text_mask_sse2(_mm_loadu_si128((const __m128i *)(data + i)))) != 0){
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + text_scalar(data + i, size - i);
+}
+
+// The tails are done here as well rather than handed to the SSE2 kernels:
+// calling legacy SSE code with the upper halves of the registers in use
+// costs more than the whole scan of a short value.
+
+__attribute__((target("avx2")))
+static size_t visible_avx2(const unsigned char *data, size_t size){
+    __m256i visible, outside;
+    unsigned int mask;
+    size_t i;
+    
+    for(i = 0; i + 32 <= size; i += 32){
+        visible = _mm256_sub_epi8(_mm256_loadu_si256((const __m256i *)(data + i)), _mm256_set1_epi8(0x21));
+        outside = _mm256_cmpeq_epi8(_mm256_max_epu8(visible, _mm256_set1_epi8(0x5e)), visible);
+        if((mask = _mm256_movemask_epi8(outside)) != 0){
+            return i + __builtin_ctz(mask);
+        }
+    }
+    if(i + 16 <= size){
+        if((mask = visible_mask_sse2(_mm_loadu_si128((const __m128i *)(data + i)))) != 0){
+            return i + __builtin_ctz(mask);
+        }
+        i += 16;
+    }
+    for(; i < size && !visible_end(data[i]); i++);
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t text_avx2(const unsigned char *data, size_t size){
+    __m256i control, v;
+    unsigned int mask;
+    size_t i;
+    
+    for(i = 0; i + 32 <= size; i += 32){
+        v = _mm256_loadu_si256((const __m256i *)(data + i));
+        control = _mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8(0x1f)), v);
+        control = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')), control);
+        if((mask = _mm256_movemask_epi8(_mm256_or_si256(control, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7f))))) != 0){
+            return i + __builtin_ctz(mask);
+        }
+    }
+    if(i + 16 <= size){
+        if((mask = text_mask_sse2(_mm_loadu_si128((const __m128i *)(data + i)))) != 0){
+            return i + __builtin_ctz(mask);
+        }
+        i += 16;
+    }
+    for(; i < size && !text_end(data[i]); i++);
+    return i;
+}
+
+#endif
+
+static const scan_kernels_t kernels[] = {
+    {SCAN_SCALAR, "scalar", visible_scalar, text_scalar},
+#ifdef SCAN_USE_X86
+    {SCAN_SSE2, "sse2", visible_sse2, text_sse2},
+    {SCAN_AVX2, "avx2", visible_avx2, text_avx2},
+#endif
+};
+
+// usable before scan_init(), the parser works the same either way
+scan_kernels_t g_scan = {SCAN_SCALAR, "scalar", visible_scalar, text_scalar};
+
+const scan_kernels_t *scan_kernels(int level){
+    int i;
+    
+    for(i = 0; i < (int)(sizeof(kernels) / sizeof(kernels[0])); i++){
+        if(kernels[i].level == level){
+            return &kernels[i];
+        }
+    }
+    return NULL;
+}
+
+static int supported(int level){
+#ifdef SCAN_USE_X86
+    __builtin_cpu_init();
+    if(level == SCAN_AVX2){
+        return __builtin_cpu_supports("avx2");
+    }
+#endif
+    return scan_kernels(level) != NULL;
+}
+
+int scan_use(int level){
+    if(!supported(level)){
+        return -1;
+    }
+    g_scan = *scan_kernels(level);
+    return 0;
+}
+
+void scan_init(void){
+    int level;
+    
+    for(level = SCAN_AVX2; level > SCAN_SCALAR && scan_use(level) < 0; level--);
+}
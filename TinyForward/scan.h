@@ -0,0 +1,54 @@
+//
+//  scan.h
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef TinyForward_scan_h
+#define TinyForward_scan_h
+
+#include <stddef.h>
+
+// instruction sets the kernels come in, scan_init() picks the best one
+#define SCAN_SCALAR  0
+#define SCAN_SSE2    1
+#define SCAN_AVX2    2
+
+// Kernels that let the request parser skip over the long, uninteresting
+// runs of a head (the target, header values) many bytes at a time. Each
+// returns the index of the first byte that ends the run, or size.
+typedef struct scan_kernels {
+    int level;
+    const char *name;
+    size_t (*visible)(const unsigned char *data, size_t size); // stops at CTL, space, DEL or non-ASCII
+    size_t (*text)(const unsigned char *data, size_t size); // stops at CTL other than tab, or DEL
+} scan_kernels_t;
+
+extern scan_kernels_t g_scan;
+
+void scan_init(void);
+int scan_use(int level); // -1 if the CPU can't
+const scan_kernels_t *scan_kernels(int level); // NULL if not built in
+
+static inline size_t scan_visible(const unsigned char *data, size_t size){
+    return g_scan.visible(data, size);
+}
+
+static inline size_t scan_text(const unsigned char *data, size_t size){
+    return g_scan.text(data, size);
+}
+
+#endif
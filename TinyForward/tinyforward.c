@@ -18,443 +18,1162 @@
 //  along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "tinyforward.h"
+#include "worker.h"
 
-connection_t *g_last_connection;
-fd_set g_master_set, g_read_set, g_write_set, g_handle_set;
-
-const char *g_upstream_host = NULL;
-int g_upstream_port = 0;
-const char *g_upstream_ssl_host = NULL; //"home.yifanlu.com";
-int g_upstream_ssl_port = 8080;
-
-void hex_dump(unsigned char *data, unsigned int size, unsigned int num) {
-    unsigned int i = 0, j = 0, k = 0, l = 0;
-    // I hate letters, but I can't come up with good names
-    // i = counter, j = bytes printed, k = number of place values, l = temp
-    for(l = size/num, k = 1; l > 0; l/=num, k++); // find number of zeros to prepend line number
-    while(j < size) {
-        // line number
-        fprintf(stderr, "%0*X: ", k, j);
-        // hex value
-        for(i = 0; i < num; i++, j++) {
-            if(j < size) {
-                fprintf(stderr, "%02X ", data[j]);
-            } else { // print blank spaces
-                fprintf(stderr, "%s ", "  ");
-            }
-        }
-        // seperator
-        fprintf(stderr, "%s", "| ");
-        // ascii value
-        for(i = num; i > 0; i--) {
-            if(j-i < size) {
-                fprintf(stderr, "%c", data[j-i] < 32 || data[j-i] > 126 ? '.' : data[j-i]); // print only visible characters
-            } else {
-                fprintf(stderr, "%s", " ");
-            }
-        }
-        // new line
-        fprintf(stderr, "%s", "\n");
+int g_splice_tunnels = 1;
+int g_defer_accept = 0; // seconds the kernel holds a connection back until the request arrives
+int g_fastopen = 0; // queue of pending TCP Fast Open connections, 0 is off
+
+static const char *phase_names[] = {"idle", "header", "connect", "first byte", "transfer", "tunnel"};
+static const int phase_timeouts[] = {TIMEOUT_IDLE, TIMEOUT_HEADER, TIMEOUT_CONNECT, TIMEOUT_FIRST_BYTE, TIMEOUT_TRANSFER, TIMEOUT_TUNNEL};
+
+static void connection_timeout(wheel_timer_t *timer){
+    connection_t *conn = timer->owner;
+    long long deadline = conn->last_active + phase_timeouts[conn->phase];
+    
+    if((conn->phase == PHASE_TRANSFER || conn->phase == PHASE_TUNNEL) && deadline > event_now()){ // moved since
+        wheel_arm(&conn->worker->timers, &conn->timeout, deadline);
+        return;
     }
+    log_message(LOG_INFO, "Dropping connection after %d ms in %s.", phase_timeouts[conn->phase], phase_names[conn->phase]);
+    metrics_add(&conn->worker->metrics.errors[METRIC_ERROR_TIMEOUT], 1);
+    drop_connection(conn);
 }
 
-int is_host_local(const char *host){
-    struct addrinfo hints1, *res1, hints2, *res2;
+connection_t *add_connection(worker_t *worker, int socket){
+    connection_t *new_connection = worker->free_connections;
+    buffer_t request_buffer, response_buffer;
+    
+    if(new_connection != NULL){ // an old one, the buffers come with their storage
+        worker->free_connections = new_connection->next_connection;
+        worker->free_count--;
+        request_buffer = new_connection->request_buffer;
+        response_buffer = new_connection->response_buffer;
+    }else{
+        new_connection = malloc(sizeof(connection_t));
+        buffer_init(&request_buffer, BUFFER_START_SIZE, REQUEST_BUFFER_SIZE);
+        buffer_init(&response_buffer, BUFFER_START_SIZE, RESPONSE_BUFFER_SIZE);
+    }
+    memset(new_connection, 0, sizeof(connection_t)); // zero out everything
+    new_connection->worker = worker;
+    new_connection->request_buffer = request_buffer;
+    new_connection->response_buffer = response_buffer;
+    event_source_init(&new_connection->client, socket, client_event_handler, new_connection);
+    event_source_init(&new_connection->server, -1, server_event_handler, new_connection); // no socket yet
+    wheel_timer_init(&new_connection->timeout, connection_timeout, new_connection);
+    event_complete(&new_connection->client, EVENT_COMPLETE_RECV);
+    event_complete(&new_connection->server, EVENT_COMPLETE_RECV);
+    http_response_init(&new_connection->response);
+    http_request_init(&new_connection->parser);
+    upstream_init(new_connection);
+    new_connection->previous_connection = worker->last_connection;
+    if(worker->last_connection != NULL){
+        worker->last_connection->next_connection = new_connection;
+    }
+    worker->last_connection = new_connection;
+    metrics_add(&worker->metrics.accepted, 1);
     
-    memset (&hints1, 0, sizeof (struct addrinfo));
-    hints1.ai_family = AF_UNSPEC;
-    hints1.ai_socktype = SOCK_STREAM;
-    memset (&hints2, 0, sizeof (struct addrinfo));
-    hints2.ai_family = AF_UNSPEC;
-    hints2.ai_socktype = SOCK_STREAM;
+    return new_connection;
+}
+
+void remove_connection(connection_t *conn){
+    worker_t *worker = conn->worker;
     
-    if(getaddrinfo(host, "5555", &hints1, &res1) != 0){
-        freeaddrinfo(res1);
-        return 0;
+    // remove from linked list
+    if(conn->previous_connection != NULL){
+        conn->previous_connection->next_connection = conn->next_connection;
     }
-    if(getaddrinfo("127.0.0.1", "5555", &hints2, &res2) != 0){
-        freeaddrinfo(res1);
-        freeaddrinfo(res2);
-        return 0;
+    if(conn->next_connection != NULL){
+        conn->next_connection->previous_connection = conn->previous_connection;
     }
-    if(memcmp(res1->ai_addr, res2->ai_addr, sizeof(struct sockaddr)) != 0){
-        freeaddrinfo(res1);
-        freeaddrinfo(res2);
-        return 0;
+    if(worker->last_connection == conn){
+        worker->last_connection = conn->previous_connection;
     }
+    wheel_cancel(&worker->timers, &conn->timeout);
+    admission_release(&conn->admitted);
     
-    freeaddrinfo(res1);
-    freeaddrinfo(res2);
-    return 1;
+    // events for this connection may still be queued in the current batch,
+    // so the memory is only released by free_closed_connections()
+    conn->previous_connection = NULL;
+    conn->next_connection = worker->closed_connections;
+    worker->closed_connections = conn;
+    metrics_add(&worker->metrics.closed, 1);
 }
 
-// stolen from tinyproxy
-int opensock (const char *host, int port)
-{
-    int sockfd, n;
-    struct addrinfo hints, *res, *ressave;
-    char portstr[6];
+// nothing can refer to these any more, so they are fine to hand out again
+void free_closed_connections(worker_t *worker){
+    connection_t *conn;
     
-    assert (host != NULL);
-    assert (port > 0);
+    while((conn = worker->closed_connections) != NULL){
+        worker->closed_connections = conn->next_connection;
+        free(conn->request.host);
+        conn->request.host = NULL;
+        if(worker->free_count < CONNECTION_FREE_MAX){
+            buffer_reset(&conn->request_buffer);
+            buffer_reset(&conn->response_buffer);
+            conn->next_connection = worker->free_connections;
+            worker->free_connections = conn;
+            worker->free_count++;
+            continue;
+        }
+        buffer_free(&conn->request_buffer);
+        buffer_free(&conn->response_buffer);
+        free(conn);
+    }
+}
+
+
+#define SHED_RESPONSE "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nConnection: close\r\nContent-Length: 0\r\n\r\n"
+#define SHED_DRAIN_READS 4 // what the client sent already, more than this and it gets a reset
+
+// turned away before anything is set up for it. Whatever the client has sent
+// is read first, closing with unread data would reset the connection and the
+// 503 with it.
+static void shed_client(worker_t *worker, int socket, int reason){
+    char discard[2048];
+    int i;
     
-    memset (&hints, 0, sizeof (struct addrinfo));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
+    for(i = 0; i < SHED_DRAIN_READS && recv(socket, discard, sizeof(discard), MSG_DONTWAIT) > 0; i++);
+    send(socket, SHED_RESPONSE, strlen(SHED_RESPONSE), MSG_DONTWAIT);
+    shutdown(socket, SHUT_WR);
+    close(socket);
+    metrics_add(&worker->metrics.shed[reason], 1);
+}
+
+// out of descriptors, the client would sit in the backlog and, edge
+// triggered, never come up again; the spare one makes room to turn it away
+static int shed_descriptors(worker_t *worker, event_source_t *listener){
+    int new_client;
     
-    snprintf (portstr, sizeof (portstr), "%d", port);
+    log_message(LOG_WARN, "Out of file descriptors, turning clients away.");
+    if(worker->spare_fd < 0){
+        metrics_add(&worker->metrics.errors[METRIC_ERROR_ACCEPT], 1);
+        return 0;
+    }
+    close(worker->spare_fd);
+    if((new_client = event_accept(&worker->loop, listener)) >= 0){
+        shed_client(worker, new_client, METRIC_SHED_DESCRIPTORS);
+    }
+    worker->spare_fd = open("/dev/null", O_RDONLY);
+    return new_client >= 0;
+}
+
+// returns 0 once there is nothing more to accept for now
+int accept_client(worker_t *worker, event_source_t *listener){
+    connection_t *conn;
+    admission_key_t key;
+    int new_client, reason;
+    const int on = 1;
     
-    n = getaddrinfo (host, portstr, &hints, &res);
-    if (n != 0) {
-        fprintf(stderr, "opensock: Could not retrieve info for %s\n", host);
-        return -1;
+    new_client = event_accept(&worker->loop, listener);
+    if(new_client < 0){
+        if(errno == EMFILE || errno == ENFILE){
+            return shed_descriptors(worker, listener);
+        }
+        if(errno == ECONNABORTED){ // gone before it was taken, the next one may be fine
+            return 1;
+        }
+        if(errno != EAGAIN && errno != EWOULDBLOCK){
+            log_message(LOG_ERROR, "Error accepting new connection: socket error %d", errno);
+            metrics_add(&worker->metrics.errors[METRIC_ERROR_ACCEPT], 1);
+        }
+        return 0;
+    }
+    if(admission_admit(new_client, &key, &reason) < 0){
+        shed_client(worker, new_client, reason);
+        return 1;
     }
+    setsockopt(new_client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)); // responses go out as they are written
     
-    ressave = res;
-    do {
-        sockfd =
-        socket (res->ai_family, res->ai_socktype, res->ai_protocol);
-        if (sockfd < 0)
-            continue;       /* ignore this one */
-        
-        if (connect (sockfd, res->ai_addr, res->ai_addrlen) == 0)
-            break;  /* success */
-        
-        close (sockfd);
-    } while ((res = res->ai_next) != NULL);
+    conn = add_connection(worker, new_client);
+    conn->admitted = key;
+    if(event_add(&worker->loop, &conn->client, EVENT_READ) < 0){
+        close_connection(conn, &conn->client);
+        remove_connection(conn);
+        return 1;
+    }
+    update_timeout(conn);
     
-    freeaddrinfo (ressave);
-    if (res == NULL) {
-        fprintf(stderr, "opensock: Could not establish a connection to %s\n", host);
-        close(sockfd);
-        return -1;
+    return 1;
+}
+
+void close_connection(connection_t *conn, event_source_t *source){
+    int socket = source->fd;
+    if(socket < 0)
+        return;
+    event_remove(&conn->worker->loop, source);
+    close(socket); // close connection
+}
+
+void drop_connection(connection_t *conn){
+    trace_finish(&conn->trace); // as far as it got
+    leave_starving(conn);
+    upstream_cancel(conn);
+    collapse_leave(conn);
+    tunnel_close(conn);
+    close_connection(conn, &conn->client);
+    release_server(conn);
+    abort_fills(conn);
+    cache_release(conn->hit);
+    conn->hit = NULL;
+    remove_connection(conn);
+}
+
+// requests beyond the ones still pending are done with as far as the backend goes
+void settle_backend(connection_t *conn, int pending){
+    if(conn->backend != NULL && conn->backend_requests > pending){
+        backend_finish(conn->backend, conn->backend_requests - pending);
+        conn->backend_requests = pending;
     }
+}
+
+// round-robin and least-pending stay on a busy server connection, requests
+// pipelined behind one in flight would only be held back by a switch
+static backend_t *choose_backend(connection_t *conn, backend_pool_t *pool, const unsigned char *data, const char *origin){
+    unsigned long long hash = 0;
     
-    return sockfd;
+    if(pool->policy == BACKEND_HASH_HOST || pool->policy == BACKEND_HASH_URL){
+        if(origin != NULL){
+            hash = backend_hash(hash, origin, strlen(origin));
+        }
+        if(pool->policy == BACKEND_HASH_URL){
+            hash = backend_hash(hash, (const char *)data + conn->parser.target.offset, conn->parser.target.length);
+        }
+    }else if(conn->backend != NULL && conn->backend->pool == pool && conn->server.fd > 0 &&
+             !server_idle(conn) && backend_available(conn->backend)){
+        return conn->backend;
+    }
+    return backend_pick(pool, hash);
+}
+
+#define SSL_CONNECTED_RESPONSE "HTTP/1.0 200 Connection established\r\n\r\n"
+
+// answers the client from the cache once everything before it has been written
+void start_hit(connection_t *conn, cache_entry_t *entry){
+    conn->hit = entry;
+    conn->hit_offset = 0;
+    snprintf(conn->hit_age, sizeof(conn->hit_age), "Age: %lld\r\n\r\n", cache_entry_age(entry));
+    metrics_add(&conn->worker->metrics.cache_hits, 1);
 }
 
-int is_http_request(unsigned char *data, unsigned long len){
-    // there isn't a fool-proof way (that I know) to see if a TCP packet is HTTP
-    // so I'll just have to make some guesses and hope for no false positives
+// pairs the response just expected with a fill if it is to be kept, a stale
+// entry turns the request into a revalidation
+void expect_fill(connection_t *conn, const unsigned char *data, const char *key, int policy, cache_entry_t *stale){
+    http_request_t *parser = &conn->parser;
+    cache_fill_t *fill = NULL;
+    char validators[512];
+    unsigned long start = conn->request_scanned - (unsigned long)parser->offset, end;
+    int length = 0;
     
-    // Min size of a valid HTTP request should be theoretically:
-    // "X HTTP/1.1\r\n\r\n"
-    if(len < 14){
-        return 0;
+    if(stale != NULL && ((length = cache_validators(stale, validators, sizeof(validators))) <= 0 ||
+                         (unsigned long)length > buffer_space(&conn->request_buffer))){
+        cache_release(stale); // no room, fetched in full instead
+        stale = NULL;
     }
-    // Check if the first byte is alphabetical
-    if(!(data[0] >= 'A' && data[0] <= 'Z')){
-        return 0;
+    if(key != NULL && (policy & CACHE_STORE) && (fill = cache_fill_start(key, parser, data, stale)) == NULL){
+        cache_release(stale);
+        stale = NULL;
     }
-    // check for trailing CRLF
-    if(!(data[len-4] == '\r' && data[len-3] == '\n' && data[len-2] == '\r' && data[len-1] == '\n')){
-        return 0;
+    if(fill != NULL){
+        collapse_lead(conn, key, fill);
     }
-    // Look for HTTP tag before newline
-    if((data = (unsigned char*)strstr((const char*)data, "HTTP/")) != NULL){
-        // look for newline
-        if(!(data[8] == '\r' && data[9] == '\n')){
-            return 0;
+    if(stale != NULL){ // the validators go in front of the blank line
+        end = parser->header_size - (data[parser->header_size - 2] == '\r' ? 2 : 1);
+        buffer_insert(&conn->request_buffer, start + end, validators, length);
+        conn->request_scanned += length;
+        parser->offset += length;
+        parser->header_size += length;
+        conn->revalidating = 1;
+        metrics_add(&conn->worker->metrics.cache_revalidations, 1);
+    }else if(key != NULL && (policy & CACHE_LOOKUP)){
+        metrics_add(&conn->worker->metrics.cache_misses, 1);
+    }
+    conn->fills[(conn->fill_first + conn->fill_count++) % HTTP_MAX_PIPELINE] = fill;
+}
+
+// the responses on their way to the cache won't arrive after all
+void abort_fills(connection_t *conn){
+    for(; conn->fill_count > 0; conn->fill_count--){
+        if(conn->fills[conn->fill_first] != NULL){
+            collapse_done(conn->worker, conn->fills[conn->fill_first]);
         }
-    }else{
-        return 0;
+        cache_fill_abort(conn->fills[conn->fill_first]);
+        conn->fill_first = (conn->fill_first + 1) % HTTP_MAX_PIPELINE;
     }
-    // if after all that, the packet still seems to be HTTP, we'll say so
-    return 1;
+    conn->fill_first = 0;
+    buffer_truncate(&conn->response_buffer, conn->response_withheld);
+    conn->response_withheld = 0;
+    conn->revalidating = 0;
+    if(conn->gzip != NULL){
+        gzip_end(&conn->worker->gzip, conn->gzip);
+        conn->gzip = NULL;
+    }
+    conn->gzip_wanted = 0;
 }
 
-int get_host_port(unsigned char *request, unsigned long len, char** host, int *port){
-    char *copy = strdup((char*)request);
-    char *start;
-    char *temp;
+// returns 1 if the request has to wait for the server to finish the ones before it,
+// 2 if it was answered from the cache
+int handle_request(connection_t *conn){
+    http_request_t *parser = &conn->parser;
+    http_span_t authority;
+    cache_entry_t *entry = NULL;
+    char *host = NULL, *key = NULL;
+    unsigned char *data;
+    unsigned long start;
+    unsigned long header_size = 0;
+    char header[64];
+    struct sockaddr_in dest_addr;
+    socklen_t length = sizeof(dest_addr);
+    long long connected;
+    int port, sockfd;
+    int connect_method = 0, head = 0, same_server, policy = 0, fresh = 0, traced = 0;
+    backend_pool_t *pool;
+    backend_t *backend = NULL;
     
-    if((start = strchr(copy, ' ')) == NULL){
-        goto error;
+    if(conn->hit != NULL || conn->revalidating || conn->collapse != NULL){ // nothing overtakes a response from the cache
+        return 1;
     }
-    if((temp = strchr(start, ' ')) == NULL){
+    // spans point into one contiguous block, this only copies if the request wraps around the ring
+    if((data = buffer_linearize(&conn->request_buffer)) == NULL){
         goto error;
     }
-    start++; // strip leading space
-    temp[0] = '\0'; // strip trailing space
+    // pipelined requests ahead of this one may still be waiting to be written
+    start = conn->request_scanned - (unsigned long)parser->offset;
+    data += start;
     
-    // strip protocol if exists
-    temp = strstr(start, "://");
-    if(temp != NULL){
-        start = temp+3;
+    if(parser->phase != HTTP_REQUEST_ERROR){ // is HTTP
+        connect_method = http_span_equals(data, parser->method, "CONNECT");
+        pool = connect_method ? &g_connect_backends : &g_http_backends;
+        if(!connect_method && conn->response.pending == 0 && start == 0){ // alone, its phases are its own
+            trace_begin(&conn->trace);
+            traced = trace_active(&conn->trace);
+        }
+        if(http_request_authority(parser, data, &authority, &port) >= 0){ // from the URL or Host
+            host = strndup((char*)data + authority.offset, authority.length);
+        }else if(connect_method && pool->count == 0){
+            log_message(LOG_WARN, "Error getting SSL host.");
+            goto error;
+        }else if(pool->count == 0){ // transparent proxying, unless a parent takes the request as it is
+            if(getsockname(conn->client.fd, (struct sockaddr *)&dest_addr, &length) < 0){
+                log_message(LOG_WARN, "Cannot get address to connect.");
+                goto error;
+            }
+            host = malloc(INET_ADDRSTRLEN); // max length of IP
+            inet_ntop(AF_INET, &dest_addr.sin_addr, host, INET_ADDRSTRLEN);
+            port = ntohs(dest_addr.sin_port);
+        }
+        if(traced && host != NULL && conn->trace.at[TRACE_HOST] == 0){
+            snprintf(conn->trace.origin, sizeof(conn->trace.origin), "%s:%d", host, port);
+            trace_mark(&conn->trace, TRACE_HOST);
+        }
+        head = http_span_equals(data, parser->method, "HEAD");
+        if(!connect_method && host != NULL && (policy = cache_request_policy(parser, data)) != 0){
+            key = cache_key(parser, data, host, port);
+        }
+        if(key != NULL && (policy & CACHE_LOOKUP) && (entry = cache_get(key, parser, data, &fresh)) != NULL){
+            if(conn->response.pending > 0 || start > 0){ // answered in order, after what's in flight
+                goto hold;
+            }
+            if(fresh){ // no need to bother the server
+                buffer_consume(&conn->request_buffer, parser->header_size);
+                conn->request_scanned -= parser->header_size;
+                if(!parser->keep_alive){
+                    conn->client_eof = 1;
+                }
+                start_hit(conn, entry);
+                if(traced){
+                    conn->trace.cache = TRACE_CACHE_HIT;
+                }
+                free(key);
+                free(host);
+                return 2;
+            }
+        }
+        // the same response is already on its way for another client, wait for it
+        if(key != NULL && (policy & CACHE_LOOKUP) && !conn->collapse_bypass &&
+           conn->response.pending == 0 && start == 0 && collapse_follow(conn, key)){
+            conn->trace.collapsed = traced;
+            goto hold;
+        }
+        if(pool->count > 0){ // through a parent, the request goes as it is
+            backend = choose_backend(conn, pool, data, host);
+            free(host);
+            host = strdup(backend->host);
+            port = backend->port;
+        }
+    }else if(conn->server.fd > 0){ // not HTTP, already connected
+        host = strdup(conn->request.host);
+        port = conn->request.port;
+        backend = conn->backend;
+        conn->tunnel = 1; // can't tell where anything ends from here on
+    }else{ // not HTTP, not connected
+        if(start > 0){ // garbage behind a request
+            log_message(LOG_WARN, "Invalid HTTP request.");
+            goto error;
+        }
+        // make a HTTP CONNECT request and we'll do the rest later
+        if(getsockname(conn->client.fd, (struct sockaddr *)&dest_addr, &length) < 0){
+            log_message(LOG_WARN, "Cannot get address to connect.");
+            goto error;
+        }
+        host = malloc(INET_ADDRSTRLEN); // max length of IP
+        inet_ntop(AF_INET, &dest_addr.sin_addr, host, INET_ADDRSTRLEN);
+        port = ntohs(dest_addr.sin_port);
+        conn->tunnel = 1;
+        header_size = snprintf(header, sizeof(header), "CONNECT %s:%d HTTP/1.1\r\n\r\n", host, port);
+        if(buffer_prepend(&conn->request_buffer, header, header_size) < 0){
+            log_message(LOG_WARN, "No room for CONNECT request.");
+            goto error;
+        }
     }
     
-    // strip slash
-    temp = strchr(start, '/');
-    if(temp != NULL){
-        temp[0] = '\0';
+    if(conn->server.fd > 0 && !conn->tunnel){
+        same_server = port == conn->request.port && strcmp(host, conn->request.host) == 0;
+        // responses come back in order, so another server or a tunnel waits
+        // for everything already sent to be answered
+        if(((!same_server || connect_method) && !server_idle(conn)) ||
+           conn->response.pending >= HTTP_MAX_PIPELINE){
+            goto hold;
+        }
     }
-    
-    // strip username/password
-    temp = strchr(start, '@');
-    if(temp != NULL){
-        start = temp + 1;
+    if(connect_method){
+        conn->tunnel = 1;
+        if(backend == NULL){ // a parent answers the CONNECT itself
+            conn->request.send_established = 1;
+            buffer_consume(&conn->request_buffer, parser->header_size); // no request, we processed headers already
+        }
+    }
+    if(conn->tunnel){ // opaque bytes from here, nothing more to parse
+        conn->request_scanned = 0;
     }
     
-    temp = strchr(start, ']');
-    if(temp != NULL){ // IPv6
-        temp[0] = '\0'; // strip ]
-        if(temp[1] == ':'){ // ipv6 AND alt. port? wtf
-            *port = atoi(temp+2);
-            temp[1] = '\0'; // strip :
-        }else{
-            *port = 80; // normal port
+    if(conn->server.fd > 0 && (port != conn->request.port || strcmp(host, conn->request.host) != 0)){
+        release_server(conn); // another server this time, the old one goes back to the pool
+    }
+    if(conn->backend != backend){
+        settle_backend(conn, 0);
+        conn->backend = backend;
+    }
+    if(backend != NULL){ // answered or not, settle_backend() takes it off again
+        backend_begin(backend);
+        conn->backend_requests++;
+    }
+    conn->collapse_bypass = 0;
+    if(!conn->tunnel){
+        http_response_expect(&conn->response, head);
+        expect_fill(conn, data, key, policy, entry);
+        entry = NULL;
+        // compressed on the way if the response turns out to be worth it, a 1xx
+        // for a body waiting on 100-continue would be held back with the head
+        if(!head && !conn->revalidating && parser->version >= 1 && !parser->upgrade &&
+           parser->content_length <= 0 && !parser->transfer_encoding && gzip_accepted(parser, data)){
+            conn->gzip_wanted |= 1u << (conn->response.pending - 1);
         }
-        temp = strchr(start, '[');
-        if(temp == NULL){ // malformed request
-            goto error;
-        }else{
-            start = temp+1; // strip [
+        if(traced && key != NULL && (policy & CACHE_LOOKUP)){
+            conn->trace.cache = conn->revalidating ? TRACE_CACHE_REVALIDATED : TRACE_CACHE_MISS;
         }
-    }else{ // IPv4
-        temp = strchr(start, ':');
-        if(temp != NULL){ // port number
-            *port = atoi(temp+1);
-            temp[0] = '\0'; // strip :
-        }else{
-            *port = 80;
+    }
+    free(key);
+    key = NULL;
+    if(conn->server.fd > 0){ // We are reusing this socket
+        free(host);
+        if(traced){
+            conn->trace.reused = 1;
         }
-        
+        goto done;
     }
-    if(strlen(start) > 0){ // we still have a host string
-        *host = strdup(start);
-    }else{ // need to be transparent proxy
+    if(port <= 0 || port >= 65536){
+        log_message(LOG_WARN, "Port out of range.");
         goto error;
     }
-    
-    free(copy);
+    // save server details
+    free(conn->request.host);
+    conn->request.host = host;
+    conn->request.port = port;
+    // an idle connection to the same server saves the handshake
+    if(!conn->tunnel && (sockfd = pool_checkout(host, port, &connected)) >= 0){
+        if(attach_server(conn, sockfd, connected) < 0){
+            return -1;
+        }
+        metrics_add(&conn->worker->metrics.upstream_reused, 1);
+        if(traced){
+            conn->trace.reused = 1;
+        }
+        goto done;
+    }
+    // server_connected() picks up from here once the name resolves and the
+    // socket is ready, addresses on this host are refused there
+    conn->connect_started = metrics_now();
+    metrics_add(&conn->worker->metrics.upstream_connects, 1);
+    if(upstream_connect(conn, host, port) < 0){
+        log_message(LOG_WARN, "Cannot connect to server.");
+        return -1;
+    }
     return 0;
+done:
+    if(conn->request.send_established){ // tunnel to the server we already have
+        conn->request.send_established = 0;
+        buffer_append(&conn->response_buffer, SSL_CONNECTED_RESPONSE, strlen(SSL_CONNECTED_RESPONSE));
+    }
+    // update_events() will watch the server for writing if we have a request (NOT SSL)
+    return 0;
+hold:
+    cache_release(entry);
+    free(key);
+    free(host);
+    return 1;
 error:
-    free(copy);
+    cache_release(entry);
+    free(key);
+    free(host);
     return -1;
 }
 
-connection_t *add_connection(int socket){
-    connection_t *new_connection = malloc(sizeof(connection_t));
-    memset(new_connection, 0, sizeof(connection_t)); // zero out everything
-    new_connection->server_socket = -1; // no socket yet
-    new_connection->client_socket = socket;
-    new_connection->previous_connection = g_last_connection;
-    if(g_last_connection != NULL){
-        g_last_connection->next_connection = new_connection;
+// keep the parser going over whatever arrived since last time
+static void scan_request(connection_t *conn){
+    struct iovec iov[2];
+    size_t length = buffer_length(&conn->request_buffer);
+    int n, i;
+    
+    if(conn->request_scanned >= length){
+        return;
     }
-    g_last_connection = new_connection;
+    n = buffer_range_iov(&conn->request_buffer, conn->request_scanned, length - conn->request_scanned, iov);
+    for(i = 0; i < n && conn->parser.phase < HTTP_REQUEST_DONE; i++){
+        conn->request_scanned += http_request_parse(&conn->parser, iov[i].iov_base, iov[i].iov_len);
+    }
+}
+
+int dispatch_request(connection_t *conn){
+    int status;
     
-    return new_connection;
+    for(;;){
+        if(conn->tunnel){ // everything goes straight through
+            conn->current_request_size = buffer_length(&conn->request_buffer);
+            return 0;
+        }
+        if(conn->request_dispatched){
+            scan_request(conn); // more of the body may be here
+            if(conn->parser.phase == HTTP_REQUEST_ERROR){
+                log_message(LOG_WARN, "Invalid request body.");
+                metrics_add(&conn->worker->metrics.errors[METRIC_ERROR_REQUEST], 1);
+                return -1;
+            }
+            conn->current_request_size = conn->request_scanned;
+            if(conn->parser.phase != HTTP_REQUEST_DONE){
+                return 0;
+            }
+            // the next request can go out right behind this one
+            http_request_init(&conn->parser);
+            conn->request_dispatched = 0;
+        }
+        if(upstream_connecting(conn)){
+            return 0;
+        }
+        if(conn->parser.phase == HTTP_REQUEST_HEAD){
+            if(conn->request_scanned == buffer_length(&conn->request_buffer)){
+                return 0;
+            }
+            scan_request(conn);
+            if(conn->parser.phase == HTTP_REQUEST_HEAD){ // wait for the rest of the head
+                if(buffer_space(&conn->request_buffer) == 0){
+                    log_message(LOG_WARN, "Request header too large.");
+                    metrics_add(&conn->worker->metrics.errors[METRIC_ERROR_REQUEST], 1);
+                    return -1;
+                }
+                return 0;
+            }
+        }
+        if((status = handle_request(conn)) < 0){ // interpret request
+            log_message(LOG_WARN, "Error handing request.");
+            metrics_add(&conn->worker->metrics.errors[METRIC_ERROR_REQUEST], 1);
+            return -1;
+        }
+        if(status == 2){ // answered from the cache, on to the next one
+            http_request_init(&conn->parser);
+            metrics_add(&conn->worker->metrics.requests, 1);
+            continue;
+        }
+        if(status > 0){ // held back, tried again as responses come in
+            return 0;
+        }
+        conn->request_dispatched = 1;
+        metrics_add(&conn->worker->metrics.requests, 1);
+        if(!conn->tunnel && conn->response.pending == 1){ // pipelined ones would count the wait in line
+            conn->request_started = metrics_now();
+        }
+        if(conn->parser.upgrade && !conn->tunnel){ // whatever follows is up to the server
+            conn->tunnel = 1;
+            conn->request_scanned = 0;
+        }
+    }
 }
 
-void remove_connection(connection_t *conn){
-    // remove from linked list
-    if(conn->previous_connection != NULL){
-        conn->previous_connection->next_connection = conn->next_connection;
+void server_connected(connection_t *conn, int socket){
+    log_message(LOG_INFO, "Connected to %s:%d", conn->request.host, conn->request.port);
+    histogram_record(&conn->worker->metrics.connect_time, metrics_now() - conn->connect_started);
+    trace_mark(&conn->trace, TRACE_CONNECTED);
+    if(attach_server(conn, socket, event_now()) < 0){
+        drop_connection(conn);
+        return;
     }
-    if(conn->next_connection != NULL){
-        conn->next_connection->previous_connection = conn->previous_connection;
+    if(conn->request.send_established){
+        conn->request.send_established = 0;
+        buffer_append(&conn->response_buffer, SSL_CONNECTED_RESPONSE, strlen(SSL_CONNECTED_RESPONSE));
+    }
+    // anything that queued up while connecting
+    if(write_server(conn) < 0 || write_client(conn) < 0){
+        drop_connection(conn);
+        return;
+    }
+    finish_events(conn);
+}
+
+void server_connect_failed(connection_t *conn){
+    log_message(LOG_WARN, "Cannot connect to %s:%d", conn->request.host, conn->request.port);
+    metrics_add(&conn->worker->metrics.errors[METRIC_ERROR_CONNECT], 1);
+    if(conn->backend != NULL){
+        backend_failed(conn->backend);
     }
-    if(g_last_connection == conn){
-        g_last_connection = conn->previous_connection;
+    drop_connection(conn);
+}
+
+// the traced request is always the oldest one in flight, so it is the one whose response just ended
+static void finish_trace(connection_t *conn, int status){
+    if(trace_active(&conn->trace)){
+        conn->trace.status = status;
+        trace_mark(&conn->trace, TRACE_LAST_BYTE);
+        trace_finish(&conn->trace);
     }
+}
+
+// compressed output goes to the client and the cache a chunk at a time
+static int emit_compressed(connection_t *conn, cache_fill_t *fill, const unsigned char *data, unsigned long size, int flush){
+    gzip_pool_t *pool = &conn->worker->gzip;
+    long count;
     
-    free(conn->request.host);
-    free(conn->request_buffer);
-    free(conn->response_buffer);
-    free(conn);
+    while((count = gzip_compress(conn->gzip, &data, &size, flush, pool->output, sizeof(pool->output))) > 0){
+        if(buffer_append_budgeted(&conn->response_buffer, pool->output, count) < 0){
+            return -1;
+        }
+        if(fill != NULL){
+            cache_fill_append(fill, pool->output, count);
+        }
+    }
+    return count;
 }
 
+// the end of the compressed body, the stream goes back to the worker
+static int finish_compressing(connection_t *conn, cache_fill_t *fill){
+    metrics_t *metrics = &conn->worker->metrics;
+    unsigned long long in, out;
+    int result = emit_compressed(conn, fill, NULL, 0, GZIP_FLUSH_FINISH);
+    
+    gzip_totals(conn->gzip, &in, &out);
+    metrics_add(&metrics->gzip_responses, 1);
+    metrics_add(&metrics->gzip_in, in);
+    metrics_add(&metrics->gzip_out, out);
+    gzip_end(&conn->worker->gzip, conn->gzip);
+    conn->gzip = NULL;
+    return result;
+}
 
-connection_t *accept_client(int listener){
-    int new_client;
-    new_client = accept(listener, NULL, NULL);
-    if(new_client < 0){
-        fprintf(stderr, "Error accepting new connection: socket error %d\n", errno);
+void close_server(connection_t *conn){
+    int lost, pending = conn->response.pending, delimited = 0;
+    
+    http_response_eof(&conn->response);
+    if(conn->response.pending < pending){ // it was read until the close
+        if(conn->gzip != NULL){ // the last chunk ends it for the client
+            finish_compressing(conn, NULL);
+        }else{ // the client only knows it ended when we close as well
+            delimited = 1;
+        }
+        finish_trace(conn, conn->response.status);
+    }
+    // requests sent or queued for this server that won't be answered
+    lost = conn->current_request_size > 0 || conn->response.pending > 0 || delimited;
+    // whatever was still queued for this server is lost with it
+    buffer_consume(&conn->request_buffer, conn->current_request_size);
+    conn->request_scanned -= conn->request_scanned < conn->current_request_size ? conn->request_scanned : conn->current_request_size;
+    conn->current_request_size = 0;
+    if(!conn->tunnel && ((conn->request_dispatched && conn->parser.phase != HTTP_REQUEST_DONE) || lost)){
+        // responses can't be reordered around the missing ones and the rest
+        // of a body has nowhere to go, finish up like the client had left
+        buffer_consume(&conn->request_buffer, buffer_length(&conn->request_buffer));
+        conn->request_scanned = 0;
+        conn->client_eof = 1;
+    }
+    conn->server_paused = 0;
+    conn->server_shutdown = 0;
+    conn->request_started = 0;
+    settle_backend(conn, 0);
+    close_connection(conn, &conn->server);
+    abort_fills(conn);
+    http_response_init(&conn->response);
+}
+
+int attach_server(connection_t *conn, int socket, long long connected){
+    conn->server.fd = socket;
+    // set socket for reading
+    if(event_add(&conn->worker->loop, &conn->server, EVENT_READ) < 0){
+        close(socket);
+        conn->server.fd = -1;
+        return -1;
+    }
+    conn->server_connected = connected;
+    return 0;
+}
+
+int server_idle(connection_t *conn){
+    // every request written and every response read, nothing half done
+    return conn->server.fd >= 0 && !conn->tunnel && !conn->server_shutdown &&
+        conn->current_request_size == 0 && http_response_idle(&conn->response) &&
+        (!conn->request_dispatched || conn->parser.phase == HTTP_REQUEST_DONE);
+}
+
+void release_server(connection_t *conn){
+    int socket = conn->server.fd;
+    
+    settle_backend(conn, 0); // also when it never connected
+    if(socket < 0){
+        return;
+    }
+    if(server_idle(conn)){ // someone else may as well use it
+        event_remove(&conn->worker->loop, &conn->server);
+        pool_checkin(conn->request.host, conn->request.port, socket, conn->server_connected);
+    }else{
+        close_connection(conn, &conn->server);
+    }
+    conn->server_paused = 0;
+    conn->server_shutdown = 0;
+    conn->request_started = 0;
+    abort_fills(conn);
+    http_response_init(&conn->response);
+}
+
+#define ERROR_RESPONSE "HTTP/1.1 500 Proxy Error\r\n\r\nProxy cannot process request. Error connecting to server."
+
+ssize_t read_socket(event_loop_t *loop, event_source_t *source, buffer_t *buffer){
+    struct iovec iov[2];
+    ssize_t count;
+    int n;
+    
+    // read straight into the free space of the ring
+    if((n = buffer_space_iov(buffer, iov)) == 0){
+        errno = buffer_space(buffer) > 0 ? ENOMEM : ENOBUFS; // it could take more, the budget says no
+        return -1;
+    }
+    
+    count = event_read(loop, source, iov, n);
+    
+    log_payload("READING", source->fd, iov, count);
+    
+    if(count > 0){
+        buffer_commit(buffer, count);
+    }
+    
+    return count;
+}
+
+ssize_t write_socket(int socket, buffer_t *buffer, unsigned long size){
+    struct iovec iov[2];
+    ssize_t count;
+    int n;
+    
+    // write straight out of the ring, whatever the socket did not take stays queued
+    if((n = buffer_data_iov(buffer, size, iov)) == 0){
+        return 0;
+    }
+    
+    count = writev(socket, iov, n);
+    
+    log_payload("WRITING", socket, iov, count);
+    
+    if(count > 0){
+        buffer_consume(buffer, count);
+    }
+    
+    return count;
+}
+
+int read_client(connection_t *conn){
+    ssize_t count;
+    
+    if(conn->client_paused || conn->client_eof){
+        return 0;
+    }
+    for(;;){ // edge triggered, read until we would block
+        if(buffer_length(&conn->request_buffer) >= REQUEST_HIGH_WATER){ // wait for the server to catch up
+            conn->client_paused = 1;
+            return 0;
+        }
+        count = read_socket(&conn->worker->loop, &conn->client, &conn->request_buffer);
+        if(count > 0){
+            metrics_add(&conn->worker->metrics.received[METRIC_CLIENT], count);
+            continue;
+        }
+        if(count == 0){ // closed connection, finish what we have first
+            conn->client_eof = 1;
+            return 0;
+        }
+        if(errno == EAGAIN || errno == EWOULDBLOCK){ // persistant connection
+            return 0;
+        }
+        if(errno == ENOMEM){ // the data stays in the socket until there is room
+            starve_connection(conn, STARVING_CLIENT);
+            return 0;
+        }
+        log_message(LOG_WARN, "Error reading request.");
+        metrics_add(&conn->worker->metrics.errors[METRIC_ERROR_CLIENT], 1);
+        return -1;
+    }
+}
+
+// the response at the front is in, returns the entry if it was a 304 to a revalidation
+static cache_entry_t *finish_fill(connection_t *conn, cache_fill_t *fill){
+    conn->fill_first = (conn->fill_first + 1) % HTTP_MAX_PIPELINE;
+    conn->fill_count--;
+    if(fill == NULL){
         return NULL;
     }
-    fcntl(new_client, F_SETFL, O_NONBLOCK); // non-blocking read
+    collapse_done(conn->worker, fill);
+    return cache_fill_finish(fill);
+}
+
+// follows where responses end in bytes just read, copying them to the cache on
+// the way, returns how much was left when a revalidation turned into a hit
+static unsigned long track_response(connection_t *conn, const unsigned char *data, unsigned long size){
+    cache_fill_t *fill;
+    cache_entry_t *entry;
+    unsigned long count;
+    int pending;
     
-    FD_SET(new_client, &g_master_set);
+    while(size > 0){
+        fill = conn->fill_count > 0 ? conn->fills[conn->fill_first] : NULL;
+        pending = conn->response.pending;
+        if((count = http_response_feed(&conn->response, data, size)) == 0){ // passed through until the server closes
+            count = size;
+        }
+        if(fill != NULL){
+            cache_fill_append(fill, data, count);
+        }
+        if(conn->revalidating){
+            conn->response_withheld += count;
+        }
+        data += count;
+        size -= count;
+        if(conn->response.pending < pending){
+            conn->gzip_wanted >>= 1;
+        }
+        if(conn->response.pending < pending && conn->fill_count > 0){ // that one is complete
+            if((entry = finish_fill(conn, fill)) != NULL){ // not modified, the client gets our copy
+                conn->revalidating = 0;
+                start_hit(conn, entry);
+                return size;
+            }
+            conn->response_withheld = 0;
+            conn->revalidating = 0;
+            finish_trace(conn, conn->response.status);
+        }else if(conn->revalidating && http_response_head_done(&conn->response)){ // a new version, it goes through
+            conn->response_withheld = 0;
+            conn->revalidating = 0;
+        }
+        if(conn->response.pending < pending && (conn->gzip_wanted & 1)){ // the next one may be compressed, see relay_rest()
+            return size;
+        }
+    }
+    return 0;
+}
+
+// track_response() over the last size bytes in the ring, returns how much it
+// left for a hit or the next response to take
+static unsigned long track_rest(connection_t *conn, unsigned long size){
+    struct iovec iov[2];
+    unsigned long left;
+    int n, i;
     
-    return add_connection(new_client);
+    n = buffer_range_iov(&conn->response_buffer, buffer_length(&conn->response_buffer) - size, size, iov);
+    for(i = 0, left = 0; i < n; i++){
+        left += conn->hit != NULL || left > 0 ? iov[i].iov_len : track_response(conn, iov[i].iov_base, iov[i].iov_len);
+    }
+    return left;
 }
 
-void close_connection(int socket){
-    if(socket < 0)
-        return;
-    close(socket); // close connection
-    FD_CLR(socket, &g_master_set);
-    FD_CLR(socket, &g_read_set);
-    FD_CLR(socket, &g_handle_set);
-    FD_CLR(socket, &g_write_set);
+// the withheld head of a response the client takes gzip for is in, it goes
+// out rewritten if the response is worth compressing and as it was if not
+static int start_compressing(connection_t *conn, cache_fill_t *fill){
+    gzip_pool_t *pool = &conn->worker->gzip;
+    unsigned long length = conn->response_withheld, copied = 0;
+    struct iovec iov[2];
+    long rewritten = -1;
+    int n, i;
+    
+    conn->response_withheld = 0;
+    n = buffer_range_iov(&conn->response_buffer, buffer_length(&conn->response_buffer) - length, length, iov);
+    if(length <= sizeof(pool->head)){
+        for(i = 0; i < n; copied += iov[i++].iov_len){
+            memcpy(pool->head + copied, iov[i].iov_base, iov[i].iov_len);
+        }
+        rewritten = gzip_rewrite_head(pool->head, length, pool->rewritten, sizeof(pool->rewritten));
+    }
+    if(rewritten >= 0 && (conn->gzip = gzip_start(pool)) != NULL){
+        buffer_truncate(&conn->response_buffer, length);
+        if(buffer_append_budgeted(&conn->response_buffer, pool->rewritten, rewritten) < 0){
+            return -1;
+        }
+        if(fill != NULL){
+            cache_fill_append(fill, (const unsigned char *)pool->rewritten, rewritten);
+        }
+        return 0;
+    }
+    for(i = 0; i < n && fill != NULL; i++){
+        cache_fill_append(fill, iov[i].iov_base, iov[i].iov_len);
+    }
+    return 0;
 }
 
-#define SSL_CONNECTED_RESPONSE "HTTP/1.0 200 Connection established\r\n\r\n"
-
-int handle_request(connection_t *conn){
-    char *host;
-    char *temp;
-    struct sockaddr_in dest_addr;
-    socklen_t length;
-    int port;
-    
-    if(is_http_request(conn->request_buffer, conn->request_size)){ // is HTTP
-        if(strncmp((char*)conn->request_buffer, "CONNECT", 7) == 0){ // special upstream considerations
-            if(g_upstream_ssl_host != NULL){
-                host = strdup(g_upstream_ssl_host);
-                port = g_upstream_ssl_port;
-            }else{ // connect to SSL
-                if(get_host_port(conn->request_buffer, conn->request_size, &host, &port) < 0){
-                    fprintf(stderr, "Error getting SSL host.\n");
-                    goto error;
-                }
-                conn->response_buffer = (unsigned char*)strdup(SSL_CONNECTED_RESPONSE);
-                conn->response_size = strlen(SSL_CONNECTED_RESPONSE);
-                FD_SET(conn->client_socket, &g_write_set);
-                conn->request_size = 0; // no request, we processed headers already
+// track_response() for when responses may be compressed, the bytes were read
+// into the worker's scratch and go into the ring piece by piece from there
+static int relay_response(connection_t *conn, const unsigned char *data, unsigned long size){
+    cache_fill_t *fill;
+    unsigned long count;
+    int pending, part;
+    
+    while(size > 0){
+        fill = conn->fill_count > 0 ? conn->fills[conn->fill_first] : NULL;
+        pending = conn->response.pending;
+        if((count = http_response_feed_part(&conn->response, data, size, &part)) == 0){ // passed through until the server closes
+            count = size;
+            part = HTTP_PART_BODY;
+        }
+        if(conn->gzip != NULL){ // the server's chunk framing gives way to the stream's own
+            if(part == HTTP_PART_BODY && emit_compressed(conn, fill, data, count, GZIP_FLUSH_NONE) < 0){
+                return -1;
             }
-        }else if(g_upstream_host != NULL){
-            host = strdup(g_upstream_host);
-            port = g_upstream_port;
-        }else if(get_host_port(conn->request_buffer, conn->request_size, &host, &port) >= 0){ // get host from URL
-            // TODO: Something after getting host name
-        }else{ // transparent proxying
-            if(getsockname(conn->client_socket, (struct sockaddr *)&dest_addr, &length) < 0){
-                fprintf(stderr, "Cannot get address to connect.\n");
-                goto error;
+        }else{
+            if(buffer_append_budgeted(&conn->response_buffer, data, count) < 0){
+                return -1;
+            }
+            if(part == HTTP_PART_HEAD && (conn->gzip_wanted & 1)){ // the cache gets it once it's decided
+                conn->response_withheld += count;
+            }else if(fill != NULL){
+                cache_fill_append(fill, data, count);
             }
-            host = malloc(17); // max length of IP
-            strlcpy(host, inet_ntoa(dest_addr.sin_addr), 17);
-            port = ntohs(dest_addr.sin_port);
         }
-        // copy request from queue to buffer
-        if(conn->request_size > 0){ // if not ssl
-            temp = strstr((char*)conn->request_buffer, "\r\n\r\n");
-            if(temp == NULL){ // invalid request
-                fprintf(stderr, "Invalid HTTP request.\n");
-                goto error;
-            }else{
-                // check if we are piplining, if so, current_request_size < request_size
-                conn->current_request_size = ((int)temp - (int)conn->request_buffer + 4);
-                conn->current_request_buffer = realloc(conn->current_request_buffer, conn->current_request_size);
-                memcpy(conn->current_request_buffer, conn->request_buffer, conn->current_request_size);
-                // remove request from queue
-                memmove(conn->request_buffer, conn->request_buffer + conn->current_request_size, conn->request_size - conn->current_request_size);
-                conn->request_size -= conn->current_request_size;
+        data += count;
+        size -= count;
+        if(conn->response_withheld > 0 && (conn->response.pending < pending || http_response_head_done(&conn->response))){
+            if(start_compressing(conn, fill) < 0){
+                return -1;
             }
+            conn->gzip_wanted &= ~1u; // decided, reads go straight into the ring again unless compressing
         }
-        // modify request if necessary
-    }else if(conn->server_socket > 0){ // not HTTP, already connected
-        host = strdup(conn->request.host);
-        port = conn->request.port;
-        conn->current_request_buffer = realloc(conn->current_request_buffer, conn->request_size);
-        conn->current_request_size = conn->request_size;
-        memcpy(conn->current_request_buffer, conn->request_buffer, conn->current_request_size);
-        conn->request_size = 0;
-    }else{ // not HTTP, not connected
-        // make a HTTP CONNECT request and we'll do the rest later
-        if(getsockname(conn->client_socket, (struct sockaddr *)&dest_addr, &length) < 0){
-            fprintf(stderr, "Cannot get address to connect.\n");
-            goto error;
+        if(conn->response.pending < pending){ // that one is complete
+            if(conn->gzip != NULL && finish_compressing(conn, fill) < 0){
+                return -1;
+            }
+            conn->gzip_wanted >>= 1;
+            if(conn->fill_count > 0){
+                cache_release(finish_fill(conn, fill)); // revalidations never come this way
+            }
+            finish_trace(conn, conn->response.status);
         }
-        host = malloc(17); // max length of IP
-        strlcpy(host, inet_ntoa(dest_addr.sin_addr), 17);
-        port = ntohs(dest_addr.sin_port);
-        conn->current_request_buffer = malloc(50); // max length of header
-        conn->current_request_size = 
-            snprintf((char*)conn->current_request_buffer, 50, "CONNECT %s:%d HTTP/1.1\r\n\r\n", host, port);
     }
+    return 0;
+}
+
+// what a read for relay_response() can grow by on its way into the ring
+static size_t relay_headroom(const connection_t *conn){
+    return conn->gzip != NULL ? GZIP_HEADROOM : GZIP_HEAD_HEADROOM;
+}
+
+// reads into the worker's scratch for relay_response(), no more than the ring
+// already has storage for with the headroom on top, so nothing read ever has
+// to wait for the budget
+static ssize_t read_relayed(connection_t *conn){
+    struct iovec iov[1];
+    size_t headroom = relay_headroom(conn);
+    long room = buffer_room(&conn->response_buffer, headroom + 1);
+    ssize_t count;
     
-    if(conn->server_socket > 0){
-        if(strcmp(host, conn->request.host) == 0){ // We are reusing this socket
-            free(host);
-            goto done;
-        }else{ // seems like another socket will be created, destroy the old one
-            close_connection(conn->server_socket);
-            conn->server_socket = -1;
-        }
-    }
-    if(port <= 0 || port >= 65536){
-        fprintf(stderr, "Port out of range.\n");
-        goto error;
-    }
-    if(is_host_local(host)){
-        fprintf(stderr, "Error, trying to connect to a local port.\n");
-        goto error;
+    if(room < 0){
+        errno = ENOMEM;
+        return -1;
     }
-    conn->server_socket = opensock(host, port);
-    fprintf(stderr, "Connected to %s:%d\n", host, port);
-    if(conn->server_socket < 0){
-        fprintf(stderr, "Cannot connect to server.\n");
-        goto error;
+    room -= headroom;
+    iov[0].iov_base = conn->worker->gzip.input;
+    iov[0].iov_len = room < GZIP_INPUT_SIZE ? room : GZIP_INPUT_SIZE;
+    count = event_read(&conn->worker->loop, &conn->server, iov, 1);
+    log_payload("READING", conn->server.fd, iov, count);
+    return count;
+}
+
+// the end of a read that went straight into the ring starts a response the
+// client takes gzip for, it's taken back out and relayed when it fits in the
+// scratch, returns 1 when it has to go out as it is
+static int relay_rest(connection_t *conn, unsigned long size){
+    buffer_t *buffer = &conn->response_buffer;
+    unsigned char *input = conn->worker->gzip.input;
+    unsigned long copied = 0;
+    struct iovec iov[2];
+    int n, i;
+    
+    if(size > GZIP_INPUT_SIZE || buffer_room(buffer, GZIP_HEAD_HEADROOM) < 0){
+        return 1;
     }
-    // save server details
-    free(conn->request.host);
-    conn->request.host = host;
-    conn->request.port = port;
-    // set socket for reading
-    FD_SET(conn->server_socket, &g_master_set);
-done:
-    if(conn->current_request_size > 0){ // NOT SSL
-        //conn->response_size = 0; // reset buffer just in case
-        FD_SET(conn->server_socket, &g_write_set); // ready to write to server
+    n = buffer_range_iov(buffer, buffer_length(buffer) - size, size, iov);
+    for(i = 0; i < n; copied += iov[i++].iov_len){
+        memcpy(input + copied, iov[i].iov_base, iov[i].iov_len);
     }
-    return 0;
-error:
-    free(host);
-    return -1;
+    buffer_truncate(buffer, size);
+    return relay_response(conn, input, size);
 }
 
-ssize_t read_socket(int socket, unsigned char **p_buffer, unsigned long *p_size){
-    unsigned char *buffer = *p_buffer;
-    unsigned long size = *p_size;
+void read_server(connection_t *conn){
+    unsigned long left;
     ssize_t count;
+    int relayed, result;
     
-    buffer = realloc(buffer, size + MAX_BUFFER_SIZE); // resize buffer in case the last set was not written yet
-    
-    count = recv(socket, buffer + size, MAX_BUFFER_SIZE, 0);
-    
-#ifdef DEBUG_READ
-    fprintf(stderr, "READING: socket %d, for %zd\n", socket, count);
-    if(count > -1){
-        hex_dump(buffer + size, (unsigned int)count, 16);
+    if(conn->server_paused){
+        return;
     }
-#endif
-    
-    if(count > 0){
-        size += count;
+    while(conn->server.fd >= 0){
+        // only a head being held back or a body being compressed take the detour
+        relayed = !conn->tunnel && (conn->gzip != NULL || (conn->gzip_wanted & 1));
+        if(buffer_length(&conn->response_buffer) >= RESPONSE_HIGH_WATER - (relayed ? relay_headroom(conn) : 0)){ // wait for the client to catch up
+            conn->server_paused = 1;
+            return;
+        }
+        count = relayed ? read_relayed(conn) : read_socket(&conn->worker->loop, &conn->server, &conn->response_buffer);
+        if(count > 0){
+            metrics_add(&conn->worker->metrics.received[METRIC_SERVER], count);
+            if(conn->request_started != 0){
+                histogram_record(&conn->worker->metrics.first_byte, metrics_now() - conn->request_started);
+                conn->request_started = 0;
+            }
+            trace_mark(&conn->trace, TRACE_FIRST_BYTE);
+            if(relayed){
+                if(relay_response(conn, conn->worker->gzip.input, count) < 0){
+                    log_message(LOG_WARN, "No room for the compressed response.");
+                    close_server(conn);
+                    break;
+                }
+                settle_backend(conn, conn->response.pending);
+            }else if(!conn->tunnel){ // find where the response ends
+                left = track_rest(conn, count);
+                result = 0;
+                while(left > 0 && conn->hit == NULL){
+                    if((result = relay_rest(conn, left)) <= 0){
+                        break;
+                    }
+                    conn->gzip_wanted &= ~1u; // no room to hold its head back
+                    left = track_rest(conn, left);
+                }
+                if(result < 0){
+                    log_message(LOG_WARN, "No room for the compressed response.");
+                    close_server(conn);
+                    break;
+                }
+                if(conn->hit != NULL){ // the 304, and anything after it that nobody asked for
+                    buffer_truncate(&conn->response_buffer, conn->response_withheld + left);
+                    conn->response_withheld = 0;
+                }
+                settle_backend(conn, conn->response.pending);
+            }
+            continue;
+        }
+        if(count < 0 && errno == ENOMEM){
+            starve_connection(conn, STARVING_SERVER);
+        }else if(count == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)){ // done reading
+            close_server(conn);
+        }else if(conn->gzip != NULL && // all there is for now, the client shouldn't wait on zlib for it
+                 emit_compressed(conn, conn->fill_count > 0 ? conn->fills[conn->fill_first] : NULL, NULL, 0, GZIP_FLUSH_SYNC) < 0){
+            log_message(LOG_WARN, "No room for the compressed response.");
+            close_server(conn);
+        }
+        break;
     }
-    
-    *p_buffer = buffer;
-    *p_size = size;
-    
-    return count;
 }
 
-ssize_t write_socket(int socket, unsigned char **p_buffer, unsigned long *p_size){
-    unsigned char *buffer = *p_buffer;
-    unsigned long size = *p_size;
+int write_client(connection_t *conn){
     ssize_t count;
+    int from_cache;
     
-    count = send(socket, buffer, size, 0);
-    size = 0;
-    
-#ifdef DEBUG_WRITE
-    fprintf(stderr, "WRITING: socket %d, for %zd\n", socket, count);
-    if(count > -1){
-        hex_dump(buffer, (unsigned int)count, 16);
+    // keep going until the client would block, edge triggered sockets will
+    // only tell us about writability again after that
+    for(;;){
+        from_cache = 0;
+        if(buffer_length(&conn->response_buffer) > conn->response_withheld){
+            count = write_socket(conn->client.fd, &conn->response_buffer, buffer_length(&conn->response_buffer) - conn->response_withheld);
+        }else if(conn->hit != NULL){ // straight out of the cache once everything before it is out
+            from_cache = 1;
+            count = cache_entry_send(conn->hit, conn->hit_age, conn->hit_offset, conn->client.fd);
+        }else{
+            return 0;
+        }
+        if(count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){ // try again when writable
+            return 0;
+        }
+        if(count <= 0){ // error sending to client
+            metrics_add(&conn->worker->metrics.errors[METRIC_ERROR_CLIENT], 1);
+            return -1;
+        }
+        metrics_add(&conn->worker->metrics.sent[METRIC_CLIENT], count);
+        if(from_cache){
+            conn->hit_offset += count;
+            if(conn->hit_offset == cache_entry_size(conn->hit, conn->hit_age)){
+                finish_trace(conn, cache_entry_status(conn->hit));
+                cache_release(conn->hit);
+                conn->hit = NULL;
+                if(dispatch_request(conn) < 0){ // requests held back behind it
+                    return -1;
+                }
+            }
+        }else if(conn->server_paused && buffer_length(&conn->response_buffer) <= RESPONSE_LOW_WATER){
+            conn->server_paused = 0;
+            read_server(conn);
+        }
     }
-#endif
-    
-    *p_buffer = buffer;
-    *p_size = size;
+}
+
+int write_server(connection_t *conn){
+    ssize_t count;
     
-    return count;
+    while(conn->server.fd >= 0 && conn->current_request_size > 0){
+        count = write_socket(conn->server.fd, &conn->request_buffer, conn->current_request_size);
+        if(count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){ // try again when writable
+            return 0;
+        }
+        if(count <= 0){ // error sending to server
+            close_server(conn);
+            buffer_append(&conn->response_buffer, ERROR_RESPONSE, strlen(ERROR_RESPONSE)); // send error to client
+            log_message(LOG_WARN, "Error sending request to server.");
+            metrics_add(&conn->worker->metrics.errors[METRIC_ERROR_SEND], 1);
+            return 0;
+        }
+        conn->current_request_size -= count;
+        metrics_add(&conn->worker->metrics.sent[METRIC_SERVER], count);
+        if(conn->current_request_size == 0 && !conn->request_dispatched){ // body and all
+            trace_mark(&conn->trace, TRACE_SENT);
+        }
+        if(!conn->tunnel){
+            conn->request_scanned -= count;
+        }
+        if(conn->client_paused && buffer_length(&conn->request_buffer) <= REQUEST_LOW_WATER){
+            conn->client_paused = 0;
+            if(read_client(conn) < 0){
+                return -1;
+            }
+        }
+        if(dispatch_request(conn) < 0){ // maybe the next request
+            return -1;
+        }
+    }
+    return 0;
 }
 
 // also stolen from tinyproxy
-int create_listener_socket (const char *host, uint16_t port)
+int create_listener_socket (const char *host, uint16_t port, int reuse_port)
 {
     struct addrinfo hints, *result, *rp;
     char portstr[6];
@@ -485,6 +1204,18 @@ int create_listener_socket (const char *host, uint16_t port)
         
         setsockopt (listenfd, SOL_SOCKET, SO_REUSEADDR, &on,
                     sizeof (on));
+#ifdef SO_REUSEPORT
+        // every worker binds its own listener, the kernel balances between them
+        if (reuse_port &&
+            setsockopt (listenfd, SOL_SOCKET, SO_REUSEPORT, &on,
+                        sizeof (on)) < 0) {
+            fprintf (stderr,
+                         "Unable to set SO_REUSEPORT because of %s\n",
+                         strerror (errno));
+            close (listenfd);
+            continue;
+        }
+#endif
         
         if (bind (listenfd, rp->ai_addr, rp->ai_addrlen) == 0)
             break;  /* success */
@@ -502,7 +1233,7 @@ int create_listener_socket (const char *host, uint16_t port)
         return -1;
     }
     
-    if (listen (listenfd, 1024) < 0) {
+    if (listen (listenfd, LISTEN_BACKLOG) < 0) {
         fprintf (stderr,
                      "Unable to start listening socket because of %s",
                      strerror (errno));
@@ -512,143 +1243,525 @@ int create_listener_socket (const char *host, uint16_t port)
         return -1;
     }
     
+    // both are only hints, the proxy works the same without them
+#ifdef TCP_DEFER_ACCEPT
+    if (g_defer_accept > 0 &&
+        setsockopt (listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &g_defer_accept,
+                    sizeof (g_defer_accept)) < 0) {
+        fprintf (stderr,
+                     "Unable to set TCP_DEFER_ACCEPT because of %s\n",
+                     strerror (errno));
+    }
+#endif
+#ifdef TCP_FASTOPEN
+    if (g_fastopen > 0 &&
+        setsockopt (listenfd, IPPROTO_TCP, TCP_FASTOPEN, &g_fastopen,
+                    sizeof (g_fastopen)) < 0) {
+        fprintf (stderr,
+                     "Unable to set TCP_FASTOPEN because of %s\n",
+                     strerror (errno));
+    }
+#endif
+    
     freeaddrinfo (result);
     
     return listenfd;
 }
 
+void update_events(connection_t *conn){
+    tunnel_t *tunnel = conn->splice;
+    
+    update_timeout(conn);
+    // empty buffers hand their storage back while the connection waits, the splice() relay needs none
+    buffer_trim(&conn->request_buffer, conn->phase == PHASE_IDLE || tunnel != NULL);
+    buffer_trim(&conn->response_buffer, conn->phase == PHASE_IDLE || tunnel != NULL);
+    // only read while the other side keeps up, only watch for writing when something is queued
+    if(tunnel != NULL){ // data waits in the pipes
+        event_modify(&conn->worker->loop, &conn->client,
+                     (tunnel->to_server.pending == 0 && !tunnel->to_server.eof ? EVENT_READ : 0) |
+                     (tunnel->to_client.pending > 0 ? EVENT_WRITE : 0));
+        event_modify(&conn->worker->loop, &conn->server,
+                     (tunnel->to_client.pending == 0 && !tunnel->to_client.eof ? EVENT_READ : 0) |
+                     (tunnel->to_server.pending > 0 ? EVENT_WRITE : 0));
+        return;
+    }
+    event_modify(&conn->worker->loop, &conn->client,
+                 (conn->client_paused || conn->client_eof ? 0 : EVENT_READ) |
+                 (buffer_length(&conn->response_buffer) > conn->response_withheld || conn->hit != NULL ? EVENT_WRITE : 0));
+    if(conn->server.fd >= 0){
+        event_modify(&conn->worker->loop, &conn->server,
+                     (conn->server_paused ? 0 : EVENT_READ) |
+                     (conn->current_request_size > 0 ? EVENT_WRITE : 0));
+    }
+}
+
+static int current_phase(connection_t *conn){
+    if(conn->tunnel){
+        return PHASE_TUNNEL;
+    }
+    if(upstream_connecting(conn)){
+        return PHASE_CONNECT;
+    }
+    if(conn->request_started != 0 || conn->collapse != NULL){
+        return PHASE_FIRST_BYTE;
+    }
+    if(conn->response.pending > 0 || conn->request_dispatched || conn->current_request_size > 0 ||
+       buffer_length(&conn->response_buffer) > 0 || conn->hit != NULL){
+        return PHASE_TRANSFER;
+    }
+    if(buffer_length(&conn->request_buffer) > 0){ // the start of the next head
+        return PHASE_HEADER;
+    }
+    return PHASE_IDLE;
+}
 
-#define ERROR_RESPONSE "HTTP/1.1 500 Proxy Error\r\n\r\nProxy cannot process request. Error connecting to server."
+// called on every event, the timer only moves when the phase changes
+void update_timeout(connection_t *conn){
+    int phase = current_phase(conn);
+    
+    conn->last_active = event_now();
+    if(phase != conn->phase || !wheel_armed(&conn->timeout)){
+        conn->phase = phase;
+        wheel_arm(&conn->worker->timers, &conn->timeout, conn->last_active + phase_timeouts[phase]);
+    }
+}
+
+void finish_events(connection_t *conn){
+    if(conn->server.fd >= 0 && buffer_length(&conn->request_buffer) == 0 && server_idle(conn)){
+        release_server(conn); // back to the pool between requests
+    }
+    if(conn->client_eof && buffer_length(&conn->request_buffer) == 0){
+        if(conn->server.fd < 0 && buffer_length(&conn->response_buffer) == 0 && conn->hit == NULL){ // nothing left to do
+            drop_connection(conn);
+            return;
+        }
+        if(conn->server.fd >= 0 && !conn->server_shutdown){ // pass the half close along
+            shutdown(conn->server.fd, SHUT_WR);
+            conn->server_shutdown = 1;
+        }
+    }
+    if(can_splice(conn) && tunnel_start(conn) == 0){ // kernel to kernel from now on
+        relay_tunnel(conn);
+        return;
+    }
+    update_events(conn);
+}
+
+int can_splice(connection_t *conn){
+    // switch once everything read into userspace so far has been flushed,
+    // not at all while the ring receives for us, it would race splice()
+    return g_splice_tunnels && conn->tunnel && conn->splice == NULL && conn->server.fd >= 0 &&
+        buffer_length(&conn->request_buffer) == 0 && buffer_length(&conn->response_buffer) == 0 &&
+        !event_completing(&conn->worker->loop, &conn->client);
+}
 
-int main (int argc, const char * argv[]){
-    connection_t *current;
-    int listener_socket;
+void relay_tunnel(connection_t *conn){
+    int status;
     
-    listener_socket = create_listener_socket(HOST, atoi(PORT));
-    g_last_connection = NULL;
+    status = tunnel_pump(conn);
+    if(status != 0){ // both sides finished or failed
+        if(status < 0){
+            log_message(LOG_WARN, "Error relaying tunnel.");
+            metrics_add(&conn->worker->metrics.errors[METRIC_ERROR_TUNNEL], 1);
+        }
+        drop_connection(conn);
+        return;
+    }
+    update_events(conn);
+}
+
+void client_event_handler(event_source_t *source, int events){
+    connection_t *conn = source->owner;
     
-    if(listen(listener_socket, 1) < 0){ // start listening
-        perror("listen");
-        close(listener_socket);
-        exit(EXIT_FAILURE);
+    if(conn->splice != NULL){
+        relay_tunnel(conn);
+        return;
+    }
+    if(events & (EVENT_READ | EVENT_ERROR)){ // request to be read
+        if(read_client(conn) < 0 || dispatch_request(conn) < 0 || write_server(conn) < 0){
+            // close connection
+            drop_connection(conn);
+            return;
+        }
+    }
+    if((events & EVENT_WRITE) || conn->hit != NULL){ // response to be written, or just found in the cache
+        if(write_client(conn) < 0){
+            drop_connection(conn);
+            return;
+        }
     }
+    finish_events(conn);
+}
+
+void server_event_handler(event_source_t *source, int events){
+    connection_t *conn = source->owner;
     
-    fprintf(stdout, "Started listening on %s port %s\n", HOST, PORT);
+    if(conn->splice != NULL){
+        relay_tunnel(conn);
+        return;
+    }
+    if(events & (EVENT_READ | EVENT_ERROR)){ // response to be read
+        read_server(conn);
+        if(write_client(conn) < 0){
+            drop_connection(conn);
+            return;
+        }
+        // finished responses make room for requests that were held back
+        if(dispatch_request(conn) < 0){
+            drop_connection(conn);
+            return;
+        }
+        events |= EVENT_WRITE;
+    }
+    if(events & EVENT_WRITE){ // request to be written
+        if(write_server(conn) < 0){
+            drop_connection(conn);
+            return;
+        }
+    }
+    finish_events(conn);
+}
+
+static void line_up(connection_t *conn, int sides){
+    worker_t *worker = conn->worker;
     
-    FD_ZERO(&g_master_set);
-    FD_ZERO(&g_read_set);
-    FD_ZERO(&g_handle_set);
-    FD_ZERO(&g_write_set);
+    conn->previous_starving = worker->last_starving;
+    conn->next_starving = NULL;
+    if(worker->last_starving != NULL){
+        worker->last_starving->next_starving = conn;
+    }else{
+        worker->starving = conn;
+    }
+    worker->last_starving = conn;
+    worker->starving_count++;
+    conn->starving = sides;
+}
+
+// a read found no buffer memory, the connection gets in line for some
+void starve_connection(connection_t *conn, int side){
+    if(side == STARVING_CLIENT){
+        conn->client_paused = 1;
+    }else{
+        conn->server_paused = 1;
+    }
+    if(conn->starving == 0){
+        line_up(conn, side);
+        metrics_add(&conn->worker->metrics.buffer_waits, 1);
+    }
+    conn->starving |= side;
+}
+
+void leave_starving(connection_t *conn){
+    worker_t *worker = conn->worker;
     
-    FD_SET(listener_socket, &g_master_set);
+    if(conn->starving == 0){
+        return;
+    }
+    if(conn->previous_starving != NULL){
+        conn->previous_starving->next_starving = conn->next_starving;
+    }else{
+        worker->starving = conn->next_starving;
+    }
+    if(conn->next_starving != NULL){
+        conn->next_starving->previous_starving = conn->previous_starving;
+    }else{
+        worker->last_starving = conn->previous_starving;
+    }
+    conn->previous_starving = conn->next_starving = NULL;
+    conn->starving = 0;
+    worker->starving_count--;
+}
+
+// while there is memory to hand out, the connections waiting for it read
+// again in the order they ran out, one side at a time; those that run out
+// again go to the back, so everyone in line gets a turn before anyone a second
+void feed_starving(worker_t *worker){
+    connection_t *conn;
+    int turns = worker->starving_count, sides;
     
-    do{
-        g_read_set = g_master_set;
-        
-        if (select(FD_SETSIZE, &g_read_set, &g_write_set, NULL, NULL) < 0){
-            fprintf(stderr, "Exception in select().\n");
-            for(int s = 0; s < FD_SETSIZE; s++){
-                FD_CLR(s, &g_master_set);
-                g_read_set = g_master_set;
-                int n = select(FD_SETSIZE, &g_read_set, NULL, NULL, NULL);
-                fprintf(stderr, "Sock: %d removed, status: %d\n", s, n);
-                if(n >= 0)
-                    break;
-            }
-            
-            /*
-            perror("select");
-            close(listener_socket);
-            exit(EXIT_FAILURE);
-             */
-        }
-        
-        // check listener socket
-        if (FD_ISSET(listener_socket, &g_read_set)){
-            FD_CLR(listener_socket, &g_read_set);
-            if(accept_client(listener_socket) == NULL){
-                // TODO: Error handling
+    while(turns-- > 0 && (conn = worker->starving) != NULL && buffer_memory_left()){
+        sides = conn->starving;
+        leave_starving(conn);
+        if(sides & STARVING_CLIENT){
+            if(sides & STARVING_SERVER){ // its turn for that comes later
+                line_up(conn, STARVING_SERVER);
             }
-            continue; // redo loop since this new client might be read
+            conn->client_paused = 0;
+            client_event_handler(&conn->client, EVENT_READ);
+        }else{
+            conn->server_paused = 0;
+            server_event_handler(&conn->server, EVENT_READ);
         }
-        
-        ssize_t count;
-        int error = 0;
-        // first loop for client
-        for (current = g_last_connection; current != NULL; current = current->previous_connection){
-            if (FD_ISSET(current->client_socket, &g_read_set)){ // request to be read
-                FD_CLR(current->client_socket, &g_read_set);
-                for(;;){
-                    count = read_socket(current->client_socket, &current->request_buffer, &current->request_size);
-                    if(count == 0 || // closed connection
-                      (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))){ // persistant connection
-                        break;
-                    }else if(count < 0){
-                        fprintf(stderr, "%s\n", "Error reading request.");
-                        error = 1;
-                    }
+    }
+}
+
+void listener_event_handler(event_source_t *source, int events){
+    worker_t *worker = source->owner;
+    // edge triggered, take everything that is waiting
+    while(accept_client(worker, source));
+}
+
+void usage(const char *name){
+    fprintf(stderr, "usage: %s [-S] [-U] [-r nameserver] [-w workers] [-l file] [-L level] [-d rate] [-m port] [-c megabytes] [-D directory] [-Q megabytes]\n", name);
+    fprintf(stderr, "          [-u host:port[,weight]] [-s host:port[,weight]] [-b policy] [-k url]\n");
+    fprintf(stderr, "          [-M connections] [-I connections] [-R megabytes] [-B megabytes] [-A seconds] [-F queue] [-T file] [-t rate]\n");
+    fprintf(stderr, "          [-z level] [-Z bytes] [-C types]\n");
+    fprintf(stderr, "  -S           relay tunnels through userspace instead of splice()\n");
+    fprintf(stderr, "  -U           use io_uring for the event loops, epoll if the kernel lacks it\n");
+    fprintf(stderr, "  -r address   nameserver to query, ip[:port] (default from /etc/resolv.conf)\n");
+    fprintf(stderr, "  -w workers   number of event loop threads, each with its own listener (default 1)\n");
+    fprintf(stderr, "  -l file      append the log to a file instead of stderr\n");
+    fprintf(stderr, "  -L level     error, warn, info or debug (default info)\n");
+    fprintf(stderr, "  -d rate      hex dump one in every rate socket reads and writes (default 0, off)\n");
+    fprintf(stderr, "  -m port      serve /metrics on %s at this port, 0 to turn off (default %s)\n", ADMIN_HOST, ADMIN_PORT);
+    fprintf(stderr, "  -c megabytes memory for cached responses, 0 to turn off (default %d)\n", CACHE_SIZE_MB);
+    fprintf(stderr, "  -D directory keep large responses on disk here as well, kept across restarts\n");
+    fprintf(stderr, "  -Q megabytes disk quota for -D (default %d)\n", DISK_QUOTA_MB);
+    fprintf(stderr, "  -u parent    send requests through this proxy, repeat for more (weight 1 to %d)\n", BACKEND_MAX_WEIGHT);
+    fprintf(stderr, "  -s parent    send CONNECT through this proxy, repeat for more\n");
+    fprintf(stderr, "  -b policy    spread requests over the parents by rr, least, host or url (default rr)\n");
+    fprintf(stderr, "  -k url       check parents with HEAD for this instead of just connecting\n");
+    fprintf(stderr, "  -M count     answer 503 to clients beyond this many open connections (default 0, no limit)\n");
+    fprintf(stderr, "  -I count     the same, per client address\n");
+    fprintf(stderr, "  -R megabytes answer 503 to new clients while connection buffers take up more than this\n");
+    fprintf(stderr, "  -B megabytes connection buffers take up at most this much, reads wait their turn beyond it\n");
+    fprintf(stderr, "  -A seconds   TCP_DEFER_ACCEPT, only take connections once the request is in\n");
+    fprintf(stderr, "  -F queue     TCP_FASTOPEN with this many pending connections\n");
+    fprintf(stderr, "  -T file      append the phase times of sampled requests to a file, as JSON lines\n");
+    fprintf(stderr, "  -t rate      trace one in every rate requests (default %d)\n", TRACE_RATE);
+    fprintf(stderr, "  -z level     gzip responses for clients that take it, 1 (fastest) to 9 (smallest) (default 0, off)\n");
+    fprintf(stderr, "  -Z bytes     leave responses smaller than this alone (default %d)\n", GZIP_MIN_SIZE);
+    fprintf(stderr, "  -C types     content types to compress, comma separated, a trailing / takes all of them\n");
+    fprintf(stderr, "               (default %s)\n", GZIP_TYPES);
+}
+
+int main (int argc, char * const argv[]){
+    worker_t *workers;
+    const char *nameserver = NULL;
+    const char *log_path = NULL, *trace_path = NULL;
+    int trace_rate = TRACE_RATE;
+    int level = LOG_INFO, dump_rate = 0;
+    int admin_port = atoi(ADMIN_PORT);
+    long cache_size = CACHE_SIZE_MB, disk_quota = DISK_QUOTA_MB;
+    const char *disk_directory = NULL;
+    admin_t admin;
+    int worker_count = 1, use_uring = 0, policy;
+    int max_connections = 0, max_per_address = 0;
+    long buffer_limit = 0, memory_budget = 0;
+    int gzip_level = 0;
+    long gzip_min_size = GZIP_MIN_SIZE;
+    const char *gzip_types = GZIP_TYPES;
+    int opt, i;
+    
+    while((opt = getopt(argc, argv, "SUr:w:l:L:d:m:c:D:Q:u:s:b:k:M:I:R:B:A:F:T:t:z:Z:C:h")) != -1){
+        switch(opt){
+            case 'S':
+                g_splice_tunnels = 0;
+                break;
+            case 'U':
+                use_uring = 1;
+                break;
+            case 'r':
+                nameserver = optarg;
+                break;
+            case 'w':
+                worker_count = atoi(optarg);
+                if(worker_count < 1 || worker_count > MAX_WORKERS){
+                    fprintf(stderr, "Worker count must be between 1 and %d.\n", MAX_WORKERS);
+                    exit(EXIT_FAILURE);
                 }
-                if(error || current->request_size == 0){
-                    error = 0;
-                    // close connection
-                    close_connection(current->client_socket);
-                    close_connection(current->server_socket);
-                    remove_connection(current);
-                    break;
+                break;
+            case 'l':
+                log_path = optarg;
+                break;
+            case 'L':
+                if((level = log_level(optarg)) < 0){
+                    fprintf(stderr, "Unknown log level %s.\n", optarg);
+                    exit(EXIT_FAILURE);
                 }
-                FD_SET(current->client_socket, &g_handle_set);
-            }
-            if (FD_ISSET(current->client_socket, &g_handle_set)){ // handle request
-                FD_CLR(current->client_socket, &g_handle_set);
-                if(handle_request(current) < 0){ // interpret request
-                    // close connection
-                    close_connection(current->client_socket);
-                    close_connection(current->server_socket);
-                    fprintf(stderr, "%s\n", "Error handing request.");
-                    remove_connection(current);
-                    break;
+                break;
+            case 'd':
+                dump_rate = atoi(optarg);
+                if(dump_rate < 0){
+                    fprintf(stderr, "Dump rate cannot be negative.\n");
+                    exit(EXIT_FAILURE);
                 }
-            }
-            if (FD_ISSET(current->client_socket, &g_write_set)){ // response to be written
-                FD_CLR(current->client_socket, &g_write_set);
-                count = write_socket(current->client_socket, &current->response_buffer, &current->response_size);
-                if(count <= 0){ // error sending to client
-                    // close connection
-                    close_connection(current->client_socket);
-                    close_connection(current->server_socket);
-                    remove_connection(current);
-                    break;
+                break;
+            case 'm':
+                admin_port = atoi(optarg);
+                if(admin_port < 0 || admin_port > 65535){
+                    fprintf(stderr, "Admin port out of range.\n");
+                    exit(EXIT_FAILURE);
                 }
-            }
-        //}
-        // second loop for the server
-        //for (current = g_last_connection; current != NULL; current = current->previous_connection){
-            if (current->server_socket > -1 && FD_ISSET(current->server_socket, &g_read_set)){ // response to be read
-                FD_CLR(current->server_socket, &g_read_set);
-                count = read_socket(current->server_socket, &current->response_buffer, &current->response_size);
-                if(count <= 0){ // done reading
-                    close_connection(current->server_socket);
-                    current->server_socket = -1;
+                break;
+            case 'c':
+                cache_size = atol(optarg);
+                if(cache_size < 0){
+                    fprintf(stderr, "Cache size cannot be negative.\n");
+                    exit(EXIT_FAILURE);
                 }
-                FD_SET(current->client_socket, &g_write_set); // ready to write to client
-            }
-            if (current->server_socket > -1 && FD_ISSET(current->server_socket, &g_write_set)){ // request to be written
-                FD_CLR(current->server_socket, &g_write_set);
-                count = write_socket(current->server_socket, &current->current_request_buffer, &current->current_request_size);
-                // TODO: handle next request
-                if(count <= 0){ // error sending to server
-                    close_connection(current->server_socket);
-                    current->server_socket = -1;
-                    send(current->client_socket, ERROR_RESPONSE, strlen(ERROR_RESPONSE), 0); // send error to client
-                    fprintf(stderr, "%s\n", "Error sending request to server.");
+                break;
+            case 'D':
+                disk_directory = optarg;
+                break;
+            case 'Q':
+                disk_quota = atol(optarg);
+                if(disk_quota <= 0){
+                    fprintf(stderr, "Disk quota must be positive.\n");
+                    exit(EXIT_FAILURE);
                 }
-                if(current->request_size > 0){ // more data to read
-                    FD_SET(current->client_socket, &g_handle_set);
+                break;
+            case 'u':
+            case 's':
+                if(backend_add(opt == 'u' ? &g_http_backends : &g_connect_backends, optarg) < 0){
+                    fprintf(stderr, "Bad parent %s, expected host:port[,weight], at most %d of them.\n", optarg, BACKEND_MAX_COUNT);
+                    exit(EXIT_FAILURE);
                 }
-            }
+                break;
+            case 'b':
+                if((policy = backend_policy(optarg)) < 0){
+                    fprintf(stderr, "Unknown policy %s.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                g_http_backends.policy = g_connect_backends.policy = policy;
+                break;
+            case 'k':
+                if(backend_check_url(optarg) < 0){
+                    fprintf(stderr, "Bad check URL %s, expected http://host/path.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'M':
+            case 'I':
+                i = atoi(optarg);
+                if(i < 0){
+                    fprintf(stderr, "Connection limit cannot be negative.\n");
+                    exit(EXIT_FAILURE);
+                }
+                *(opt == 'M' ? &max_connections : &max_per_address) = i;
+                break;
+            case 'R':
+            case 'B':
+                *(opt == 'R' ? &buffer_limit : &memory_budget) = atol(optarg);
+                if(buffer_limit < 0 || memory_budget < 0){
+                    fprintf(stderr, "Buffer memory limit cannot be negative.\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'A':
+            case 'F':
+                i = atoi(optarg);
+                if(i < 0){
+                    fprintf(stderr, "-%c cannot be negative.\n", opt);
+                    exit(EXIT_FAILURE);
+                }
+                *(opt == 'A' ? &g_defer_accept : &g_fastopen) = i;
+                break;
+            case 'T':
+                trace_path = optarg;
+                break;
+            case 't':
+                trace_rate = atoi(optarg);
+                if(trace_rate < 1){
+                    fprintf(stderr, "Trace rate must be positive.\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'z':
+                gzip_level = atoi(optarg);
+                if(gzip_level < 0 || gzip_level > 9){
+                    fprintf(stderr, "Compression level must be from 0 to 9.\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'Z':
+                gzip_min_size = atol(optarg);
+                if(gzip_min_size < 0){
+                    fprintf(stderr, "Minimum size to compress cannot be negative.\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'C':
+                gzip_types = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+    
+    signal(SIGPIPE, SIG_IGN); // closed peers are handled where send() fails
+    
+    if(log_init(log_path, level, dump_rate) < 0){
+        exit(EXIT_FAILURE);
+    }
+    if(trace_path != NULL && trace_init(trace_path, trace_rate) < 0){
+        exit(EXIT_FAILURE);
+    }
+    if(use_uring){ // falls back to epoll by itself
+        event_use_uring();
+    }
+    scan_init();
+    log_message(LOG_DEBUG, "Scanning requests with the %s kernels.", g_scan.name);
+    if(dns_init(nameserver) < 0){
+        exit(EXIT_FAILURE);
+    }
+    pool_init();
+    admission_init(max_connections, max_per_address, (unsigned long)buffer_limit << 20);
+    buffer_budget((unsigned long)memory_budget << 20);
+    if(gzip_init(gzip_level, gzip_min_size, gzip_types) < 0){
+        exit(EXIT_FAILURE);
+    }
+    if(cache_init((unsigned long)cache_size << 20) < 0){
+        fprintf(stderr, "Cannot allocate the cache.\n");
+        exit(EXIT_FAILURE);
+    }
+    if(cache_size > 0 && disk_init(disk_directory, (unsigned long long)disk_quota << 20) < 0){ // responses only spill over from memory
+        exit(EXIT_FAILURE);
+    }
+    
+    // bind every listener before any thread starts so errors are reported up front
+    workers = calloc(worker_count, sizeof(worker_t));
+    for(i = 0; i < worker_count; i++){
+        if(worker_init(&workers[i], i, HOST, atoi(PORT), worker_count > 1) < 0){
+            fprintf(stderr, "Cannot start worker %d.\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    // so are the parents' health checks
+    if(backend_init(&workers[0].loop, &workers[0].resolver) < 0){
+        exit(EXIT_FAILURE);
+    }
+    
+    // scrapes are served by the first worker, they read everyone's counters
+    admin.loop = NULL;
+    if(admin_port > 0 && admin_init(&admin, &workers[0].loop, ADMIN_HOST, admin_port) < 0){
+        fprintf(stderr, "Cannot start admin listener on port %d.\n", admin_port);
+        exit(EXIT_FAILURE);
+    }
+    
+    fprintf(stdout, "Started listening on %s port %s with %d worker(s)\n", HOST, PORT, worker_count);
+    
+    // the main thread runs the first worker
+    for(i = 1; i < worker_count; i++){
+        if(worker_start(&workers[i]) < 0){
+            exit(EXIT_FAILURE);
         }
-    }while(1);
+    }
+    worker_run(&workers[0]);
     
-    close(listener_socket);
+    for(i = 1; i < worker_count; i++){
+        pthread_join(workers[i].thread, NULL);
+    }
+    if(admin.loop != NULL){
+        admin_destroy(&admin);
+    }
+    for(i = 0; i < worker_count; i++){
+        worker_destroy(&workers[i]);
+    }
+    free(workers);
+    trace_shutdown();
+    log_shutdown();
     return 0;
 }
@@ -20,68 +20,187 @@
 #ifndef TinyForward_tinyforward_h
 #define TinyForward_tinyforward_h
 
+#ifdef __linux__
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // memmem(), splice()
+#endif
+#endif
+
 #include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <netdb.h>
+#include <netinet/tcp.h>
 #include <regex.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#include "admin.h"
+#include "admission.h"
+#include "backend.h"
+#include "buffer.h"
+#include "cache.h"
+#include "collapse.h"
+#include "disk.h"
+#include "event.h"
+#include "gzip.h"
+#include "http.h"
+#include "log.h"
+#include "metrics.h"
+#include "pool.h"
+#include "scan.h"
+#include "trace.h"
+#include "tunnel.h"
+#include "upstream.h"
+#include "wheel.h"
 
 #define HOST    "0.0.0.0"
 #define PORT    "5555"
-#define MAX_BUFFER_SIZE  10240
-#define DEBUG_READ
-#define DEBUG_WRITE
+#define BUFFER_START_SIZE     4096  // buffers start out this big and double as they fill
+#define REQUEST_BUFFER_SIZE   16384 // per connection cap, must be a power of two
+#define RESPONSE_BUFFER_SIZE  65536
+#define BUFFER_RETRY_INTERVAL 10    // ms between tries while reads wait for buffer memory
+#define CONNECTION_FREE_MAX   64 // closed connections each worker keeps, buffers and all, for the next accepts
+#define LISTEN_BACKLOG        4096 // the kernel caps it at net.core.somaxconn
+// stop reading from a peer once this much is queued for the other side,
+// start again when it has drained down to the low water mark
+#define REQUEST_HIGH_WATER    REQUEST_BUFFER_SIZE
+#define REQUEST_LOW_WATER     (REQUEST_BUFFER_SIZE / 4)
+#define RESPONSE_HIGH_WATER   RESPONSE_BUFFER_SIZE
+#define RESPONSE_LOW_WATER    (RESPONSE_BUFFER_SIZE / 4)
+// how long a connection may stay in each phase, ms; the transfer and
+// tunnel ones count from the last progress, the rest from the start
+#define TIMEOUT_IDLE          30000  // waiting for a request, also right after accept
+#define TIMEOUT_HEADER        10000  // from the first byte of a request head to its end
+#define TIMEOUT_CONNECT       10000  // resolving and connecting to the server
+#define TIMEOUT_FIRST_BYTE    60000  // request sent, nothing back yet
+#define TIMEOUT_TRANSFER      60000  // requests or responses under way
+#define TIMEOUT_TUNNEL        300000 // opaque bytes either way
+
+#define PHASE_IDLE        0
+#define PHASE_HEADER      1
+#define PHASE_CONNECT     2
+#define PHASE_FIRST_BYTE  3
+#define PHASE_TRANSFER    4
+#define PHASE_TUNNEL      5
+
+#define STARVING_CLIENT   1
+#define STARVING_SERVER   2
 
 typedef struct connection connection_t;
+typedef struct worker worker_t;
 
 typedef struct request {
     char *host;
     int port;
-    int is_http;
+    int send_established; // answer the CONNECT once the server is reached
 } request_t;
 
 struct connection {
     connection_t *previous_connection;
-    int client_socket;
-    int server_socket;
+    worker_t *worker;
+    event_source_t client;
+    event_source_t server;
+    long long server_connected; // ms, how old the server connection is for the pool
+    long long connect_started; // us, for the metrics
+    long long request_started; // us, a request sent with nothing else in flight, until its response starts
+    wheel_timer_t timeout; // for the phase it is in
+    int phase;
+    long long last_active; // ms, progress pushes the transfer and tunnel timeouts back
+    http_response_t response; // where the server's responses end
+    upstream_connect_t upstream;
+    admission_key_t admitted; // what the client counts against in admission control
+    backend_t *backend; // the parent the server connection goes through, NULL when direct
+    int backend_requests; // counted in its outstanding requests
     request_t request;
-    unsigned char *request_buffer;
-    unsigned long request_size;
-    unsigned char *current_request_buffer;
-    unsigned long current_request_size;
-    unsigned char *response_buffer;
-    unsigned long response_size;
+    buffer_t request_buffer; // from the client
+    http_request_t parser; // the request at the head of request_buffer
+    unsigned long request_scanned; // bytes of it the parser has seen
+    int request_dispatched; // its head went to handle_request(), the rest follows as it arrives
+    unsigned long current_request_size; // bytes at the head of request_buffer being sent to the server
+    buffer_t response_buffer; // to the client
+    unsigned long response_withheld; // bytes at the end of response_buffer the client mustn't see yet
+    cache_fill_t *fills[HTTP_MAX_PIPELINE]; // one per pending response, NULL for those not kept
+    int fill_first;
+    int fill_count;
+    int revalidating; // a conditional request of ours is out, its response is withheld until the head is in
+    unsigned int gzip_wanted; // pending responses the client takes gzip for, oldest in the lowest bit until its head is decided
+    gzip_stream_t *gzip; // compressing the response being read, its head went out rewritten
+    collapse_t *collapse; // waiting for someone else's response to the same request
+    connection_t *next_waiter;
+    int collapse_bypass; // woken from waiting, the request goes to the server if it is still a miss
+    trace_t trace; // phase times of a sampled request
+    cache_entry_t *hit; // sent to the client once response_buffer drains
+    unsigned long hit_offset;
+    char hit_age[32]; // Age header and the blank line, between the stored head and the body
+    int client_paused; // request_buffer reached the high water mark
+    int server_paused; // response_buffer reached the high water mark
+    int starving; // STARVING_* sides whose reads wait for buffer memory
+    connection_t *previous_starving;
+    connection_t *next_starving;
+    int client_eof; // client finished sending, passed on to the server once flushed
+    int server_shutdown;
+    int tunnel; // only opaque bytes follow, e.g. after CONNECT
+    tunnel_t *splice; // set while the tunnel is relayed with splice()
     connection_t *next_connection;
 };
 
-/* Helper functions */
-int opensock (const char *host, int port);
-int is_http_request(unsigned char *data, unsigned long len);
-int get_host_port(unsigned char *request, unsigned long len, char** host, int *port);
-
 /* Linked list functions */
-connection_t *add_connection(int socket);
+connection_t *add_connection(worker_t *worker, int socket);
 void remove_connection(connection_t *conn);
+void free_closed_connections(worker_t *worker);
 
 /* Connecting clients */
-connection_t *accept_client(int listener);
-void close_connection(int socket);
+int accept_client(worker_t *worker, event_source_t *listener);
+void close_connection(connection_t *conn, event_source_t *source);
+void drop_connection(connection_t *conn);
 
 /* Connecting servers */
 int handle_request(connection_t *conn);
+int dispatch_request(connection_t *conn);
+void close_server(connection_t *conn);
+int attach_server(connection_t *conn, int socket, long long connected);
+int server_idle(connection_t *conn);
+void release_server(connection_t *conn);
+void settle_backend(connection_t *conn, int pending);
+void server_connected(connection_t *conn, int socket);
+void server_connect_failed(connection_t *conn);
+
+/* Caching */
+void start_hit(connection_t *conn, cache_entry_t *entry);
+void expect_fill(connection_t *conn, const unsigned char *data, const char *key, int policy, cache_entry_t *stale);
+void abort_fills(connection_t *conn);
+
+/* Event handlers */
+void update_events(connection_t *conn);
+void update_timeout(connection_t *conn);
+void finish_events(connection_t *conn);
+int can_splice(connection_t *conn);
+void relay_tunnel(connection_t *conn);
+void client_event_handler(event_source_t *source, int events);
+void server_event_handler(event_source_t *source, int events);
+void listener_event_handler(event_source_t *source, int events);
+
+/* Buffer memory */
+void starve_connection(connection_t *conn, int side);
+void leave_starving(connection_t *conn);
+void feed_starving(worker_t *worker);
 
 /* Sockets IO */
-ssize_t read_socket(int socket, unsigned char **p_buffer, unsigned long *p_size);
-ssize_t write_socket(int socket, unsigned char **p_buffer, unsigned long *p_size);
+ssize_t read_socket(event_loop_t *loop, event_source_t *source, buffer_t *buffer);
+ssize_t write_socket(int socket, buffer_t *buffer, unsigned long size);
+int read_client(connection_t *conn);
+void read_server(connection_t *conn);
+int write_client(connection_t *conn);
+int write_server(connection_t *conn);
 
 /* Listening */
-int create_listener_socket(const char *host, uint16_t port);
+int create_listener_socket(const char *host, uint16_t port, int reuse_port);
 
 #endif
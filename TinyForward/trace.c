@@ -0,0 +1,245 @@
+//
+//  trace.c
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+#include "trace.h"
+
+#define TRACE_MAX_RINGS  256
+#define TRACE_LINE_SIZE  1024 // room for the longest record
+
+// single producer (the worker), single consumer (the drain thread)
+typedef struct trace_ring {
+    int worker;
+    unsigned long head; // next record to write out, only moved by the drain thread
+    unsigned long tail; // end of the last complete record, only moved by the worker
+    unsigned long dropped; // records that didn't fit
+    unsigned long reported; // drops already logged
+    trace_t records[TRACE_RING_SIZE];
+} trace_ring_t;
+
+static const char *phase_names[] = {"head", "host", "resolved", "connected", "sent", "first_byte", "last_byte"};
+static const char *cache_names[] = {"none", "hit", "miss", "revalidated"};
+
+int g_trace_rate = 0;
+
+static int g_trace_fd = -1;
+static trace_ring_t *g_rings[TRACE_MAX_RINGS];
+static int g_ring_count;
+static pthread_mutex_t g_rings_lock = PTHREAD_MUTEX_INITIALIZER; // only taken to add a ring
+static pthread_t g_drain_thread;
+static int g_draining;
+
+static __thread trace_ring_t *t_ring;
+static __thread unsigned long t_count;
+
+void trace_start(trace_t *trace){
+    if(trace_active(trace) || t_ring == NULL || ++t_count % g_trace_rate != 0){ // sampled
+        return;
+    }
+    memset(trace, 0, sizeof(trace_t));
+    trace->at[TRACE_HEAD] = metrics_now();
+}
+
+void trace_finish(trace_t *trace){
+    trace_ring_t *ring = t_ring;
+    unsigned long head, tail;
+    
+    if(!trace_active(trace)){
+        return;
+    }
+    if(ring == NULL){ // a worker tearing down another's connections
+        trace->at[TRACE_HEAD] = 0;
+        return;
+    }
+    tail = ring->tail;
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if(tail - head == TRACE_RING_SIZE){
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+    }else{
+        ring->records[tail & (TRACE_RING_SIZE - 1)] = *trace;
+        __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE); // publish the whole record
+    }
+    trace->at[TRACE_HEAD] = 0;
+}
+
+void trace_cancel(trace_t *trace){
+    trace->at[TRACE_HEAD] = 0;
+}
+
+static void write_all(const char *data, size_t size){
+    ssize_t count;
+    
+    while(size > 0){
+        count = write(g_trace_fd, data, size);
+        if(count < 0 && errno == EINTR){
+            continue;
+        }
+        if(count <= 0){ // throw it away rather than stall
+            return;
+        }
+        data += count;
+        size -= count;
+    }
+}
+
+// quotes and control characters can't come from a parsed authority, but the
+// file has to stay valid whatever ends up in it
+static int format_origin(char *line, size_t size, const char *origin){
+    int length = 0;
+    
+    for(; *origin != '\0' && (size_t)length + 7 < size; origin++){
+        if(*origin == '"' || *origin == '\\' || (unsigned char)*origin < 32){
+            length += snprintf(line + length, size - length, "\\u%04x", (unsigned char)*origin);
+        }else{
+            line[length++] = *origin;
+        }
+    }
+    return length;
+}
+
+static int format_record(char *line, size_t size, int worker, const trace_t *trace, long long clock_offset){
+    long long at = trace->at[TRACE_HEAD] + clock_offset; // us since the epoch
+    int length, i;
+    
+    length = snprintf(line, size, "{\"time\":%lld.%06lld,\"worker\":%d,\"origin\":\"", at / 1000000, at % 1000000, worker);
+    length += format_origin(line + length, size - length, trace->origin);
+    length += snprintf(line + length, size - length, "\",\"status\":%d,\"cache\":\"%s\",\"reused\":%d,\"collapsed\":%d",
+                       trace->status, cache_names[trace->cache], trace->reused, trace->collapsed);
+    // us after the head was in, phases a request skipped are left out
+    for(i = TRACE_HEAD + 1; i < TRACE_PHASES; i++){
+        if(trace->at[i] != 0){
+            length += snprintf(line + length, size - length, ",\"%s\":%lld", phase_names[i], trace->at[i] - trace->at[TRACE_HEAD]);
+        }
+    }
+    length += snprintf(line + length, size - length, "}\n");
+    return length;
+}
+
+static void drain_ring(trace_ring_t *ring, long long clock_offset){
+    char block[16384];
+    unsigned long head, tail, dropped;
+    int length = 0;
+    
+    head = ring->head;
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    for(; head != tail; head++){
+        if(length + TRACE_LINE_SIZE > (int)sizeof(block)){
+            write_all(block, length);
+            length = 0;
+        }
+        length += format_record(block + length, TRACE_LINE_SIZE, ring->worker, &ring->records[head & (TRACE_RING_SIZE - 1)], clock_offset);
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE); // copied out, the slot is free again
+    }
+    write_all(block, length);
+    dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    if(dropped != ring->reported){
+        log_message(LOG_WARN, "Worker %d dropped %lu trace records.", ring->worker, dropped - ring->reported);
+        ring->reported = dropped;
+    }
+}
+
+static void drain_all(void){
+    struct timespec ts;
+    long long clock_offset;
+    int i, count = __atomic_load_n(&g_ring_count, __ATOMIC_ACQUIRE);
+    
+    // the records are on the monotonic clock, the file gets wall clock times
+    clock_gettime(CLOCK_REALTIME, &ts);
+    clock_offset = (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 - metrics_now();
+    for(i = 0; i < count; i++){
+        drain_ring(g_rings[i], clock_offset);
+    }
+}
+
+static void *drain_run(void *arg){
+    struct timespec interval = {0, TRACE_FLUSH_INTERVAL * 1000000L};
+    
+    (void)arg;
+    while(__atomic_load_n(&g_draining, __ATOMIC_ACQUIRE)){
+        drain_all();
+        nanosleep(&interval, NULL);
+    }
+    drain_all();
+    return NULL;
+}
+
+int trace_init(const char *path, int rate){
+    int err;
+    
+    if(path == NULL || rate == 0){
+        return 0;
+    }
+    g_trace_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(g_trace_fd < 0){
+        fprintf(stderr, "Cannot open trace file %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    g_draining = 1;
+    if((err = pthread_create(&g_drain_thread, NULL, drain_run, NULL)) != 0){
+        fprintf(stderr, "Cannot start trace thread: %s\n", strerror(err));
+        g_draining = 0;
+        close(g_trace_fd);
+        g_trace_fd = -1;
+        return -1;
+    }
+    g_trace_rate = rate;
+    return 0;
+}
+
+void trace_attach(int worker){
+    trace_ring_t *ring;
+    
+    if(!g_draining){
+        return;
+    }
+    pthread_mutex_lock(&g_rings_lock);
+    if(g_ring_count < TRACE_MAX_RINGS && (ring = calloc(1, sizeof(trace_ring_t))) != NULL){
+        ring->worker = worker;
+        g_rings[g_ring_count] = ring;
+        __atomic_store_n(&g_ring_count, g_ring_count + 1, __ATOMIC_RELEASE);
+        t_ring = ring;
+    }
+    pthread_mutex_unlock(&g_rings_lock);
+}
+
+void trace_shutdown(void){
+    int i;
+    
+    if(!g_draining){
+        return;
+    }
+    __atomic_store_n(&g_draining, 0, __ATOMIC_RELEASE);
+    pthread_join(g_drain_thread, NULL); // drains once more on the way out
+    t_ring = NULL;
+    for(i = 0; i < g_ring_count; i++){
+        free(g_rings[i]);
+    }
+    g_ring_count = 0;
+    close(g_trace_fd);
+    g_trace_fd = -1;
+}
@@ -0,0 +1,82 @@
+//
+//  trace.h
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef TinyForward_trace_h
+#define TinyForward_trace_h
+
+#include "metrics.h"
+
+#define TRACE_RATE            100  // default, -t
+#define TRACE_RING_SIZE       1024 // records per worker, must be a power of two
+#define TRACE_FLUSH_INTERVAL  100  // ms between drains of the worker rings
+#define TRACE_ORIGIN_SIZE     64   // host:port, longer ones are cut
+
+// what a request goes through, in order
+enum {
+    TRACE_HEAD, // its head is in from the client
+    TRACE_HOST, // where it goes is known
+    TRACE_RESOLVED, // the server's name resolved
+    TRACE_CONNECTED, // the server's socket is up
+    TRACE_SENT, // written out to the server in full
+    TRACE_FIRST_BYTE, // the response starts to arrive
+    TRACE_LAST_BYTE, // the response is in, or sent in full from the cache
+    TRACE_PHASES
+};
+
+enum {
+    TRACE_CACHE_NONE, // not one the cache looks at
+    TRACE_CACHE_HIT,
+    TRACE_CACHE_MISS,
+    TRACE_CACHE_REVALIDATED, // a stale copy was checked with the server
+    TRACE_CACHE_OUTCOMES
+};
+
+// Phase times of one sampled request, kept on its connection. Only one
+// request per connection is traced at a time, the one sent with nothing
+// else in flight, so every phase belongs to it.
+typedef struct trace {
+    long long at[TRACE_PHASES]; // us from metrics_now(), 0 for phases it skipped, at[TRACE_HEAD] is 0 when not tracing
+    char origin[TRACE_ORIGIN_SIZE];
+    int status;
+    int cache;
+    int reused; // the server connection came from the idle pool
+    int collapsed; // waited for someone else's response first
+} trace_t;
+
+extern int g_trace_rate;
+
+// Finished records go into a ring owned by the worker and a background
+// thread writes them out as JSON lines, so tracing never waits on the file.
+// When a ring is full the record is dropped and counted.
+#define trace_begin(trace) \
+    do{ if(g_trace_rate != 0) trace_start(trace); }while(0)
+#define trace_active(trace) ((trace)->at[TRACE_HEAD] != 0)
+// only the first time it gets there counts
+#define trace_mark(trace, phase) \
+    do{ if(trace_active(trace) && (trace)->at[phase] == 0) (trace)->at[phase] = metrics_now(); }while(0)
+
+int trace_init(const char *path, int rate);
+void trace_attach(int worker);
+void trace_shutdown(void);
+
+void trace_start(trace_t *trace);
+void trace_finish(trace_t *trace);
+void trace_cancel(trace_t *trace);
+
+#endif
@@ -0,0 +1,141 @@
+//
+//  tunnel.c
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "tinyforward.h"
+#include "tunnel.h"
+#include "worker.h"
+
+#ifdef HAVE_SPLICE
+
+static int open_pipe(tunnel_pipe_t *pipe){
+    pipe->pending = 0;
+    pipe->eof = 0;
+    if(pipe2(pipe->fds, O_NONBLOCK | O_CLOEXEC) < 0){
+        pipe->fds[0] = pipe->fds[1] = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static void close_pipe(tunnel_pipe_t *pipe){
+    if(pipe->fds[0] >= 0){
+        close(pipe->fds[0]);
+        close(pipe->fds[1]);
+    }
+    pipe->fds[0] = pipe->fds[1] = -1;
+}
+
+// move everything we can from src to dst, returns -1 on error
+static int pump_pipe(tunnel_pipe_t *pipe, int src, int dst, unsigned long long *received, unsigned long long *sent){
+    ssize_t count;
+    
+    for(;;){
+        if(pipe->pending > 0){ // flush what we have before taking more
+            count = splice(pipe->fds[0], NULL, dst, NULL, pipe->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if(count > 0){
+                pipe->pending -= count;
+                metrics_add(sent, count);
+                continue;
+            }
+            if(count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){ // receiver is slow, wait for it
+                return 0;
+            }
+            return -1;
+        }
+        if(pipe->eof){
+            return 0;
+        }
+        // the pipe is empty here, so EAGAIN can only mean src has nothing
+        count = splice(src, NULL, pipe->fds[1], NULL, TUNNEL_CHUNK_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if(count > 0){
+            pipe->pending += count;
+            metrics_add(received, count);
+        }else if(count == 0){ // pass the half close along
+            pipe->eof = 1;
+            shutdown(dst, SHUT_WR);
+            return 0;
+        }else if(errno == EAGAIN || errno == EWOULDBLOCK){
+            return 0;
+        }else{
+            return -1;
+        }
+    }
+}
+
+int tunnel_start(connection_t *conn){
+    tunnel_t *tunnel = malloc(sizeof(tunnel_t));
+    
+    if(tunnel == NULL){
+        return -1;
+    }
+    if(open_pipe(&tunnel->to_server) < 0){
+        free(tunnel);
+        return -1;
+    }
+    if(open_pipe(&tunnel->to_client) < 0){
+        close_pipe(&tunnel->to_server);
+        free(tunnel);
+        return -1;
+    }
+    conn->splice = tunnel;
+    return 0;
+}
+
+int tunnel_pump(connection_t *conn){
+    tunnel_t *tunnel = conn->splice;
+    metrics_t *metrics = &conn->worker->metrics;
+    
+    if(pump_pipe(&tunnel->to_server, conn->client.fd, conn->server.fd,
+                 &metrics->received[METRIC_CLIENT], &metrics->sent[METRIC_SERVER]) < 0){
+        return -1;
+    }
+    if(pump_pipe(&tunnel->to_client, conn->server.fd, conn->client.fd,
+                 &metrics->received[METRIC_SERVER], &metrics->sent[METRIC_CLIENT]) < 0){
+        return -1;
+    }
+    if(tunnel->to_server.eof && tunnel->to_server.pending == 0 &&
+       tunnel->to_client.eof && tunnel->to_client.pending == 0){ // both sides are done
+        return 1;
+    }
+    return 0;
+}
+
+void tunnel_close(connection_t *conn){
+    if(conn->splice == NULL)
+        return;
+    close_pipe(&conn->splice->to_server);
+    close_pipe(&conn->splice->to_client);
+    free(conn->splice);
+    conn->splice = NULL;
+}
+
+#else // no splice(), tunnels keep going through the userspace buffers
+
+int tunnel_start(connection_t *conn){
+    return -1;
+}
+
+int tunnel_pump(connection_t *conn){
+    return -1;
+}
+
+void tunnel_close(connection_t *conn){
+}
+
+#endif
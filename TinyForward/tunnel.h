@@ -0,0 +1,48 @@
+//
+//  tunnel.h
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef TinyForward_tunnel_h
+#define TinyForward_tunnel_h
+
+#ifdef __linux__
+#define HAVE_SPLICE
+#endif
+
+#define TUNNEL_CHUNK_SIZE  65536 // default pipe capacity on Linux
+
+typedef struct connection connection_t;
+
+// One direction of a spliced tunnel. Bytes move socket -> pipe -> socket
+// inside the kernel, the pipe doubles as the buffer for a slow receiver.
+typedef struct tunnel_pipe {
+    int fds[2];
+    size_t pending; // bytes sitting in the pipe
+    int eof; // source socket finished sending
+} tunnel_pipe_t;
+
+typedef struct tunnel {
+    tunnel_pipe_t to_server;
+    tunnel_pipe_t to_client;
+} tunnel_t;
+
+int tunnel_start(connection_t *conn);
+int tunnel_pump(connection_t *conn);
+void tunnel_close(connection_t *conn);
+
+#endif
@@ -0,0 +1,241 @@
+//
+//  upstream.c
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "tinyforward.h"
+#include "worker.h"
+
+static void attempt_event_handler(event_source_t *source, int events);
+static void resolved(dns_waiter_t *waiter, const dns_result_t *result);
+static void stagger_expired(wheel_timer_t *timer);
+
+void upstream_init(connection_t *conn){
+    upstream_connect_t *up = &conn->upstream;
+    int i;
+    
+    memset(up, 0, sizeof(upstream_connect_t));
+    for(i = 0; i < CONNECT_MAX_INFLIGHT; i++){
+        event_source_init(&up->attempts[i], -1, attempt_event_handler, conn);
+    }
+    dns_waiter_init(&up->resolving, resolved, conn);
+    wheel_timer_init(&up->stagger, stagger_expired, conn);
+}
+
+int upstream_connecting(connection_t *conn){
+    return conn->upstream.resolving.query != NULL || conn->upstream.candidates != NULL;
+}
+
+// start the next candidate, returns 0 if there was nothing left to try
+static int start_attempt(connection_t *conn){
+    upstream_connect_t *up = &conn->upstream;
+    struct sockaddr_storage *address;
+    int i, sockfd;
+    const int on = 1;
+    
+    for(i = 0; i < CONNECT_MAX_INFLIGHT && up->attempts[i].fd >= 0; i++);
+    if(i == CONNECT_MAX_INFLIGHT){ // wait for one of the others to finish
+        return 0;
+    }
+    while(up->next_candidate < up->candidate_count){
+        address = &up->candidates[up->next_candidate++];
+        sockfd = socket(address->ss_family, SOCK_STREAM, 0);
+        if(sockfd < 0)
+            continue;       /* ignore this one */
+        fcntl(sockfd, F_SETFL, O_NONBLOCK);
+        setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        if(connect(sockfd, (struct sockaddr *)address, address->ss_family == AF_INET6 ?
+                   sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in)) < 0 && errno != EINPROGRESS){
+            close(sockfd);
+            continue;
+        }
+        // writable once connected (or failed)
+        up->attempts[i].fd = sockfd;
+        if(event_add(&conn->worker->loop, &up->attempts[i], EVENT_WRITE) < 0){
+            up->attempts[i].fd = -1;
+            close(sockfd);
+            continue;
+        }
+        up->inflight++;
+        if(up->next_candidate < up->candidate_count){
+            wheel_arm(&conn->worker->timers, &up->stagger, event_now() + CONNECT_ATTEMPT_DELAY);
+        }
+        return 1;
+    }
+    return 0;
+}
+
+static void finish_connect(connection_t *conn){
+    upstream_connect_t *up = &conn->upstream;
+    worker_t *worker = conn->worker;
+    int i, sockfd;
+    
+    for(i = 0; i < CONNECT_MAX_INFLIGHT; i++){ // the losers
+        if((sockfd = up->attempts[i].fd) >= 0){
+            event_remove(&worker->loop, &up->attempts[i]);
+            close(sockfd);
+        }
+    }
+    up->inflight = 0;
+    free(up->candidates);
+    up->candidates = NULL;
+    wheel_cancel(&worker->timers, &up->stagger);
+}
+
+static void attempt_event_handler(event_source_t *source, int events){
+    connection_t *conn = source->owner;
+    upstream_connect_t *up = &conn->upstream;
+    int sockfd = source->fd;
+    int err = 0;
+    socklen_t length = sizeof(err);
+    
+    if(getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err, &length) < 0){
+        err = errno;
+    }
+    if(err == 0 && !(events & EVENT_WRITE)){ // still in progress
+        return;
+    }
+    event_remove(&conn->worker->loop, source);
+    up->inflight--;
+    
+    if(err != 0){ // this one lost, move on to the next right away
+        close(sockfd);
+        if(start_attempt(conn) == 0 && up->inflight == 0){
+            finish_connect(conn);
+            server_connect_failed(conn);
+        }
+        return;
+    }
+    finish_connect(conn);
+    server_connected(conn, sockfd);
+}
+
+static void set_candidate(struct sockaddr_storage *candidate, const dns_address_t *address, int port){
+    struct sockaddr_in *sin = (struct sockaddr_in *)candidate;
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)candidate;
+    
+    memset(candidate, 0, sizeof(struct sockaddr_storage));
+    if(address->family == AF_INET6){
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_addr = address->addr.v6;
+        sin6->sin6_port = htons(port);
+    }else{
+        sin->sin_family = AF_INET;
+        sin->sin_addr = address->addr.v4;
+        sin->sin_port = htons(port);
+    }
+}
+
+static int is_address_local(const dns_address_t *address){
+    if(address->family == AF_INET6){
+        return IN6_IS_ADDR_LOOPBACK(&address->addr.v6);
+    }
+    return address->addr.v4.s_addr == htonl(INADDR_LOOPBACK);
+}
+
+static int start_connect(connection_t *conn, const dns_result_t *result){
+    upstream_connect_t *up = &conn->upstream;
+    const dns_address_t *sorted[DNS_MAX_ADDRESSES];
+    int n, first, count, i, j, preferred, other;
+    
+    trace_mark(&conn->trace, TRACE_RESOLVED);
+    count = result->count;
+    if(count <= 0){
+        log_message(LOG_WARN, "upstream_connect: Could not retrieve info for %s", conn->request.host);
+        return -1;
+    }
+    for(i = 0; i < count && conn->backend == NULL; i++){ // parents are up to the operator
+        if(is_address_local(&result->addresses[i])){
+            log_message(LOG_WARN, "Error, trying to connect to a local port.");
+            return -1;
+        }
+    }
+    
+    // interleave the families, starting with whatever the resolver preferred
+    if((up->candidates = malloc(count * sizeof(struct sockaddr_storage))) == NULL){
+        log_message(LOG_WARN, "upstream_connect: Cannot allocate the addresses of %s", conn->request.host);
+        finish_connect(conn);
+        return -1;
+    }
+    first = result->addresses[0].family;
+    for(i = 0, j = count, n = 0; n < count; n++){
+        if(result->addresses[n].family == first){
+            sorted[i++] = &result->addresses[n]; // preferred from the front
+        }else{
+            sorted[--j] = &result->addresses[n]; // the rest from the back
+        }
+    }
+    for(n = 0, preferred = 0, other = count - 1; n < count; ){
+        if(preferred < i){
+            set_candidate(&up->candidates[n++], sorted[preferred++], up->port);
+        }
+        if(other >= j){
+            set_candidate(&up->candidates[n++], sorted[other--], up->port);
+        }
+    }
+    up->candidate_count = count;
+    up->next_candidate = 0;
+    up->inflight = 0;
+    
+    if(start_attempt(conn) == 0){
+        log_message(LOG_WARN, "upstream_connect: Could not establish a connection to %s", conn->request.host);
+        finish_connect(conn);
+        return -1;
+    }
+    return 0;
+}
+
+static void resolved(dns_waiter_t *waiter, const dns_result_t *result){
+    connection_t *conn = waiter->owner;
+    
+    if(start_connect(conn, result) < 0){
+        server_connect_failed(conn);
+    }
+}
+
+int upstream_connect(connection_t *conn, const char *host, int port){
+    upstream_connect_t *up = &conn->upstream;
+    dns_result_t result;
+    int n;
+    
+    assert (host != NULL);
+    assert (port > 0);
+    
+    up->port = port;
+    n = dns_resolve(&conn->worker->resolver, host, &up->resolving, &result);
+    if(n < 0){
+        log_message(LOG_WARN, "upstream_connect: Could not resolve %s", host);
+        return -1;
+    }
+    if(n == 0){ // resolved() picks up once the answer is in
+        return 0;
+    }
+    return start_connect(conn, &result);
+}
+
+void upstream_cancel(connection_t *conn){
+    dns_cancel(&conn->upstream.resolving);
+    if(conn->upstream.candidates != NULL){
+        finish_connect(conn);
+    }
+}
+
+// the earlier attempts are taking too long
+static void stagger_expired(wheel_timer_t *timer){
+    start_attempt(timer->owner);
+}
@@ -0,0 +1,53 @@
+//
+//  upstream.h
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef TinyForward_upstream_h
+#define TinyForward_upstream_h
+
+#include "dns.h"
+#include "event.h"
+#include "wheel.h"
+
+#define CONNECT_ATTEMPT_DELAY  250 // ms before racing the next address, RFC 8305
+#define CONNECT_MAX_INFLIGHT   4
+
+typedef struct connection connection_t;
+typedef struct worker worker_t;
+
+// Non-blocking connect racing the resolved addresses Happy Eyeballs style.
+// Embedded in connection_t so pending events for the attempts stay valid
+// until the connection itself is freed.
+typedef struct upstream_connect {
+    dns_waiter_t resolving; // waiting on the resolver before any attempt starts
+    int port;
+    struct sockaddr_storage *candidates; // address families interleaved
+    int candidate_count;
+    int next_candidate;
+    int inflight;
+    wheel_timer_t stagger; // starts the next candidate when the ones in flight take too long
+    event_source_t attempts[CONNECT_MAX_INFLIGHT];
+} upstream_connect_t;
+
+void upstream_init(connection_t *conn);
+int upstream_connect(connection_t *conn, const char *host, int port);
+int upstream_connecting(connection_t *conn);
+void upstream_cancel(connection_t *conn);
+
+#endif
@@ -0,0 +1,717 @@
+//
+//  uring.c
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifdef __linux__
+#define _GNU_SOURCE // POLLRDHUP
+#endif
+
+#include "uring.h"
+
+#ifdef EVENT_USE_URING
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include "log.h"
+
+// The same edge triggered model as epoll, driven by multishot requests: a
+// poll for readiness, or a receive into the provided buffers or an accept
+// for the sources that asked for one. Interest changes only queue
+// submissions, they all go in with the next wait.
+//
+// Each outstanding request has a slot, user_data holds its index and
+// generation. Slots outlive their source until the last completion comes in,
+// completions for a source that went away find it NULL and are dropped.
+
+#define SLOT_DATA(ring, slot)  ((unsigned long long)(ring)->slots[slot].generation << 32 | (unsigned)(slot))
+#define CANCEL_DATA   (~0ULL) // only completes when there was nothing to cancel
+
+enum {
+    SLOT_POLL,
+    SLOT_RECV,
+    SLOT_ACCEPT
+};
+
+typedef struct uring_slot {
+    event_source_t *source;
+    unsigned generation;
+    int kind;
+    int next_free;
+} uring_slot_t;
+
+struct uring {
+    int fd;
+    void *sq_ring;
+    size_t sq_ring_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    uring_slot_t *slots;
+    int slot_count;
+    int slot_capacity;
+    int free_slot;
+    struct io_uring_buf_ring *buffer_ring;
+    size_t buffer_ring_size;
+    unsigned char *buffers;
+    unsigned short buffer_tail;
+    int held; // buffers we were handed and did not give back yet
+    int next[URING_BUFFER_COUNT]; // per buffer, the one after it in the same source
+    unsigned length[URING_BUFFER_COUNT];
+    unsigned offset[URING_BUFFER_COUNT];
+    event_source_t *starved;
+    event_source_t *ready;
+    event_source_t *ready_last;
+};
+
+static int ring_setup(unsigned entries, struct io_uring_params *params){
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int ring_enter(int fd, unsigned submit, unsigned wait, unsigned flags, void *arg, size_t size){
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, size);
+}
+
+static int ring_register(int fd, unsigned opcode, void *arg, unsigned count){
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+int uring_probe(const char **reason){
+    struct io_uring_params params;
+    struct io_uring_sync_cancel_reg cancel;
+    unsigned needed = IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG | IORING_FEAT_FAST_POLL;
+    int fd;
+    
+    memset(&params, 0, sizeof(params));
+    if((fd = ring_setup(8, &params)) < 0){
+        *reason = strerror(errno);
+        return -1;
+    }
+    // synchronous cancellation came with multishot receive, finding nothing
+    // to cancel is the answer a new enough kernel gives
+    memset(&cancel, 0, sizeof(cancel));
+    cancel.addr = CANCEL_DATA;
+    cancel.timeout.tv_sec = -1;
+    cancel.timeout.tv_nsec = -1;
+    if((params.features & needed) != needed ||
+       ring_register(fd, IORING_REGISTER_SYNC_CANCEL, &cancel, 1) == 0 || errno != ENOENT){
+        *reason = "the kernel is too old, 6.0 or later is needed";
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+static void give_buffer(uring_t *ring, int id){
+    struct io_uring_buf *buf = &ring->buffer_ring->bufs[ring->buffer_tail & (URING_BUFFER_COUNT - 1)];
+    
+    // the ring's tail shares its first entry, so only these fields are written
+    buf->addr = (unsigned long)(ring->buffers + (size_t)id * URING_BUFFER_SIZE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = id;
+    ring->buffer_tail++;
+    __atomic_store_n(&ring->buffer_ring->tail, ring->buffer_tail, __ATOMIC_RELEASE);
+}
+
+static void *map_ring(int fd, size_t size, off_t offset){
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    return map == MAP_FAILED ? NULL : map;
+}
+
+uring_t *uring_create(void){
+    struct io_uring_params params;
+    struct io_uring_buf_reg reg;
+    uring_t *ring;
+    int i;
+    
+    if((ring = calloc(1, sizeof(uring_t))) == NULL){
+        return NULL;
+    }
+    ring->free_slot = -1;
+    memset(&params, 0, sizeof(params));
+    if((ring->fd = ring_setup(URING_ENTRIES, &params)) < 0){
+        log_message(LOG_ERROR, "Cannot create io_uring: %s", strerror(errno));
+        free(ring);
+        return NULL;
+    }
+    
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP){ // both rings live in one mapping
+        if(ring->cq_ring_size > ring->sq_ring_size){
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = 0;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    if((ring->sq_ring = map_ring(ring->fd, ring->sq_ring_size, IORING_OFF_SQ_RING)) == NULL ||
+       (ring->cq_ring = ring->cq_ring_size == 0 ? ring->sq_ring :
+        map_ring(ring->fd, ring->cq_ring_size, IORING_OFF_CQ_RING)) == NULL ||
+       (ring->sqes = map_ring(ring->fd, ring->sqes_size, IORING_OFF_SQES)) == NULL){
+        log_message(LOG_ERROR, "Cannot map io_uring: %s", strerror(errno));
+        goto error;
+    }
+    ring->sq_head = (unsigned *)((char *)ring->sq_ring + params.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ring + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->cq_head = (unsigned *)((char *)ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + params.cq_off.cqes);
+    
+    // receive buffers the kernel picks from as data arrives
+    ring->buffer_ring_size = URING_BUFFER_COUNT * sizeof(struct io_uring_buf);
+    ring->buffer_ring = mmap(NULL, ring->buffer_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ring->buffer_ring == MAP_FAILED){
+        ring->buffer_ring = NULL;
+        log_message(LOG_ERROR, "Cannot map io_uring buffers: %s", strerror(errno));
+        goto error;
+    }
+    if((ring->buffers = malloc((size_t)URING_BUFFER_COUNT * URING_BUFFER_SIZE)) == NULL){
+        log_message(LOG_ERROR, "Cannot allocate io_uring buffers.");
+        goto error;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)ring->buffer_ring;
+    reg.ring_entries = URING_BUFFER_COUNT;
+    reg.bgid = 0;
+    if(ring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0){
+        log_message(LOG_ERROR, "Cannot register io_uring buffers: %s", strerror(errno));
+        goto error;
+    }
+    for(i = 0; i < URING_BUFFER_COUNT; i++){
+        give_buffer(ring, i);
+    }
+    return ring;
+error:
+    uring_destroy(ring);
+    return NULL;
+}
+
+void uring_destroy(uring_t *ring){
+    if(ring->sqes != NULL){
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if(ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring){
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if(ring->sq_ring != NULL){
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    close(ring->fd); // unregisters the buffers too
+    if(ring->buffer_ring != NULL){
+        munmap(ring->buffer_ring, ring->buffer_ring_size);
+    }
+    free(ring->buffers);
+    free(ring->slots);
+    free(ring);
+}
+
+static unsigned pending(uring_t *ring){
+    return *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+static int submit(uring_t *ring){
+    int count;
+
+    while((count = ring_enter(ring->fd, pending(ring), 0, 0, NULL, 0)) < 0 && errno == EINTR);
+    return count;
+}
+
+// the kernel only looks at the queue from inside io_uring_enter(), so an
+// entry may be filled in after it was published
+static struct io_uring_sqe *get_sqe(uring_t *ring){
+    struct io_uring_sqe *sqe;
+    unsigned tail = *ring->sq_tail;
+    
+    if(pending(ring) >= ring->sq_entries && (submit(ring) < 0 || pending(ring) >= ring->sq_entries)){
+        log_message(LOG_ERROR, "io_uring submission queue is full: %s", strerror(errno));
+        return NULL;
+    }
+    sqe = &ring->sqes[tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+static int slot_alloc(uring_t *ring, event_source_t *source, int kind){
+    uring_slot_t *slots;
+    int slot, capacity;
+    
+    if((slot = ring->free_slot) >= 0){
+        ring->free_slot = ring->slots[slot].next_free;
+    }else{
+        if(ring->slot_count == ring->slot_capacity){
+            capacity = ring->slot_capacity ? ring->slot_capacity * 2 : 64;
+            if((slots = realloc(ring->slots, capacity * sizeof(uring_slot_t))) == NULL){
+                return -1;
+            }
+            ring->slots = slots;
+            ring->slot_capacity = capacity;
+        }
+        slot = ring->slot_count++;
+        ring->slots[slot].generation = 0;
+    }
+    ring->slots[slot].source = source;
+    ring->slots[slot].kind = kind;
+    return slot;
+}
+
+static void slot_free(uring_t *ring, int slot){
+    ring->slots[slot].source = NULL;
+    ring->slots[slot].generation = (ring->slots[slot].generation + 1) & 0x7fffffff;
+    ring->slots[slot].next_free = ring->free_slot;
+    ring->free_slot = slot;
+}
+
+static int arm(uring_t *ring, event_source_t *source, int kind, unsigned mask){
+    struct io_uring_sqe *sqe;
+    int slot;
+    
+    if((slot = slot_alloc(ring, source, kind)) < 0){
+        return -1;
+    }
+    if((sqe = get_sqe(ring)) == NULL){
+        slot_free(ring, slot);
+        return -1;
+    }
+    sqe->fd = source->fd;
+    sqe->user_data = SLOT_DATA(ring, slot);
+    switch(kind){
+        case SLOT_POLL:
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->poll32_events = mask;
+            sqe->len = IORING_POLL_ADD_MULTI;
+            break;
+        case SLOT_RECV:
+            sqe->opcode = IORING_OP_RECV;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = 0;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            break;
+        case SLOT_ACCEPT:
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->accept_flags = SOCK_NONBLOCK;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            break;
+    }
+    return slot;
+}
+
+static void cancel(uring_t *ring, int slot){
+    struct io_uring_sqe *sqe;
+    
+    if((sqe = get_sqe(ring)) == NULL){
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = SLOT_DATA(ring, slot);
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = CANCEL_DATA;
+}
+
+// completions of a slot nobody owns any more are dropped
+static void drop(uring_t *ring, int slot){
+    ring->slots[slot].source = NULL;
+    cancel(ring, slot);
+}
+
+static void mark_ready(uring_t *ring, event_source_t *source, int flags){
+    if(flags == 0){
+        return;
+    }
+    if(source->ready == 0){ // not queued for this batch yet
+        source->next_ready = NULL;
+        if(ring->ready == NULL){
+            ring->ready = source;
+        }else{
+            ring->ready_last->next_ready = source;
+        }
+        ring->ready_last = source;
+    }
+    source->ready |= flags;
+}
+
+static void starve(uring_t *ring, event_source_t *source){
+    source->starved = 1;
+    source->next_starved = ring->starved;
+    ring->starved = source;
+}
+
+static void recycle(uring_t *ring, int id){
+    give_buffer(ring, id);
+    ring->held--;
+}
+
+// receiving sources hear about errors from the receive, they only need a
+// poll to know when they can write
+static unsigned poll_mask(event_source_t *source){
+    unsigned mask = 0;
+    
+    if(source->complete == 0){ // as with epoll, a half close counts as readable
+        mask |= POLLRDHUP;
+        if(source->events & EVENT_READ){
+            mask |= POLLIN;
+        }
+    }
+    if(source->events & EVENT_WRITE){
+        mask |= POLLOUT;
+    }
+    return mask;
+}
+
+// bring the outstanding requests in line with the source's interest
+static int sync_source(uring_t *ring, event_source_t *source){
+    unsigned mask;
+    int want;
+    
+    mask = source->complete == EVENT_COMPLETE_ACCEPT ? 0 : poll_mask(source);
+    if(source->poll_slot >= 0 && mask != source->poll_mask){
+        drop(ring, source->poll_slot);
+        source->poll_slot = -1;
+    }
+    if(source->poll_slot < 0 && (mask != 0 || source->complete == 0)){ // a fresh poll reports what is pending right away
+        if((source->poll_slot = arm(ring, source, SLOT_POLL, mask)) < 0){
+            return -1;
+        }
+        source->poll_mask = mask;
+    }
+    if(source->complete == 0){
+        return 0;
+    }
+    want = (source->events & EVENT_READ) && !source->received_eof && source->received_error == 0;
+    if(source->io_slot >= 0){
+        if(!want && !source->io_cancelled){ // anything it received on the way out still counts
+            cancel(ring, source->io_slot);
+            source->io_cancelled = 1;
+        }
+        return 0; // a cancelled one is replaced once its last completion is in
+    }
+    if(!want || source->starved){
+        return 0;
+    }
+    if(source->complete == EVENT_COMPLETE_RECV && ring->held == URING_BUFFER_COUNT){
+        starve(ring, source);
+        return 0;
+    }
+    source->io_slot = arm(ring, source, source->complete == EVENT_COMPLETE_RECV ? SLOT_RECV : SLOT_ACCEPT, 0);
+    return source->io_slot < 0 ? -1 : 0;
+}
+
+static void rearm_starved(uring_t *ring, int accepting){
+    event_source_t **link = &ring->starved;
+    event_source_t *source;
+    
+    while((source = *link) != NULL){
+        if(source->complete == EVENT_COMPLETE_RECV ? ring->held < URING_BUFFER_COUNT : accepting){
+            *link = source->next_starved;
+            source->starved = 0;
+            sync_source(ring, source);
+        }else{
+            link = &source->next_starved;
+        }
+    }
+}
+
+int uring_watch(uring_t *ring, event_source_t *source, int events){
+    int previous = source->events;
+    
+    source->events = events;
+    if(sync_source(ring, source) < 0){
+        log_message(LOG_ERROR, "Cannot watch socket %d: io_uring submission failed", source->fd);
+        return -1;
+    }
+    // epoll would report data still waiting when reading is switched back on,
+    // what we already took off the socket gets the same treatment
+    if((events & EVENT_READ) && !(previous & EVENT_READ) &&
+       (source->received >= 0 || source->received_eof || source->received_error != 0)){
+        mark_ready(ring, source, EVENT_READ);
+    }
+    return 0;
+}
+
+void uring_forget(uring_t *ring, event_source_t *source){
+    struct io_uring_sync_cancel_reg cancel_reg;
+    event_source_t **link, *previous;
+    int id;
+    
+    if(source->ready != 0){ // may be freed before the ready list is dispatched
+        for(link = &ring->ready, previous = NULL; *link != source; previous = *link, link = &(*link)->next_ready);
+        *link = source->next_ready;
+        if(ring->ready_last == source){
+            ring->ready_last = previous;
+        }
+        source->ready = 0;
+    }
+    if(source->poll_slot >= 0){
+        drop(ring, source->poll_slot);
+    }
+    if(source->io_slot >= 0){
+        ring->slots[source->io_slot].source = NULL;
+        if(source->complete == EVENT_COMPLETE_RECV){
+            // the socket may be handed to someone else next, so the receive
+            // has to be gone before we return, not some time later
+            submit(ring);
+            memset(&cancel_reg, 0, sizeof(cancel_reg));
+            cancel_reg.addr = SLOT_DATA(ring, source->io_slot);
+            cancel_reg.timeout.tv_sec = -1;
+            cancel_reg.timeout.tv_nsec = -1;
+            ring_register(ring->fd, IORING_REGISTER_SYNC_CANCEL, &cancel_reg, 1);
+        }else{
+            cancel(ring, source->io_slot);
+        }
+    }
+    while((id = source->received) >= 0){
+        source->received = ring->next[id];
+        recycle(ring, id);
+    }
+    if(source->starved){
+        for(link = &ring->starved; *link != source; link = &(*link)->next_starved);
+        *link = source->next_starved;
+    }
+    if(source->accepted >= 0){
+        close(source->accepted);
+    }
+    source->poll_slot = -1;
+    source->poll_mask = 0;
+    source->io_slot = -1;
+    source->io_cancelled = 0;
+    source->received_last = -1;
+    source->received_eof = 0;
+    source->received_error = 0;
+    source->starved = 0;
+    source->accepted = -1;
+}
+
+ssize_t uring_read(uring_t *ring, event_source_t *source, struct iovec *iov, int count){
+    size_t total = 0, used = 0, size;
+    int id, i = 0;
+    
+    while((id = source->received) >= 0 && i < count){
+        size = ring->length[id] - ring->offset[id];
+        if(size > iov[i].iov_len - used){
+            size = iov[i].iov_len - used;
+        }
+        memcpy((unsigned char *)iov[i].iov_base + used, ring->buffers + (size_t)id * URING_BUFFER_SIZE + ring->offset[id], size);
+        ring->offset[id] += size;
+        used += size;
+        total += size;
+        if(ring->offset[id] == ring->length[id]){ // all of it copied out, the kernel can have it back
+            if((source->received = ring->next[id]) < 0){
+                source->received_last = -1;
+            }
+            recycle(ring, id);
+        }
+        if(used == iov[i].iov_len){
+            i++;
+            used = 0;
+        }
+    }
+    if(total > 0){
+        return total;
+    }
+    if(source->received_error != 0){
+        errno = source->received_error;
+        return -1;
+    }
+    if(source->received_eof){
+        return 0;
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+static int poll_flags(unsigned revents){
+    int flags = 0;
+    
+    if(revents & (POLLIN | POLLRDHUP)){
+        flags |= EVENT_READ;
+    }
+    if(revents & POLLOUT){
+        flags |= EVENT_WRITE;
+    }
+    if(revents & (POLLERR | POLLHUP)){
+        flags |= EVENT_ERROR;
+    }
+    return flags;
+}
+
+static void receive(uring_t *ring, event_source_t *source, int id, int size){
+    ring->length[id] = size;
+    ring->offset[id] = 0;
+    ring->next[id] = -1;
+    if(source->received_last >= 0){
+        ring->next[source->received_last] = id;
+    }else{
+        source->received = id;
+    }
+    source->received_last = id;
+}
+
+static void complete(uring_t *ring, const struct io_uring_cqe *cqe){
+    unsigned long long data = cqe->user_data;
+    event_source_t *source;
+    int slot, kind, id = -1;
+    
+    if(data == CANCEL_DATA){
+        return;
+    }
+    if(cqe->flags & IORING_CQE_F_BUFFER){
+        id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        ring->held++;
+    }
+    slot = (int)(data & 0xffffffff);
+    source = ring->slots[slot].source;
+    kind = ring->slots[slot].kind;
+    
+    switch(kind){
+        case SLOT_POLL:
+            if(source != NULL && cqe->res > 0){
+                mark_ready(ring, source, poll_flags(cqe->res));
+            }
+            break;
+        case SLOT_RECV:
+            if(id >= 0){
+                if(source != NULL && cqe->res > 0){
+                    receive(ring, source, id, cqe->res);
+                    mark_ready(ring, source, EVENT_READ);
+                }else{
+                    recycle(ring, id);
+                }
+            }else if(source != NULL && cqe->res == 0){
+                source->received_eof = 1;
+                mark_ready(ring, source, EVENT_READ);
+            }else if(source != NULL && cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED){
+                source->received_error = -cqe->res;
+                mark_ready(ring, source, EVENT_READ | EVENT_ERROR);
+            }
+            break;
+        case SLOT_ACCEPT:
+            if(cqe->res >= 0){ // handed over right away, the handler takes it with event_accept()
+                if(source != NULL && source->fd >= 0){
+                    source->accepted = cqe->res;
+                    source->handler(source, EVENT_READ);
+                }
+                if(source == NULL || source->accepted >= 0){
+                    close(cqe->res);
+                    if(source != NULL){
+                        source->accepted = -1;
+                    }
+                }
+            }else if(cqe->res != -ECANCELED){
+                log_message(LOG_ERROR, "Error accepting new connection: %s", strerror(-cqe->res));
+            }
+            break;
+    }
+    
+    if(!(cqe->flags & IORING_CQE_F_MORE)){ // that was its last completion
+        slot_free(ring, slot);
+        if(source == NULL){
+            return;
+        }
+        if(source->poll_slot == slot){
+            source->poll_slot = -1;
+        }
+        if(source->io_slot == slot){
+            source->io_slot = -1;
+            source->io_cancelled = 0;
+            if(cqe->res == -ENOBUFS || (kind == SLOT_ACCEPT && cqe->res < 0 && cqe->res != -ECANCELED)){
+                starve(ring, source); // picked up again once there is something to give it
+            }
+        }
+        if(source->fd >= 0){
+            sync_source(ring, source);
+        }
+    }
+}
+
+int uring_wait(uring_t *ring, int timeout){
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    struct io_uring_cqe cqe;
+    event_source_t *source;
+    unsigned head, flags = IORING_ENTER_GETEVENTS, wait = 1;
+    void *argument = NULL;
+    size_t size = 0;
+    int count = 0, events;
+    
+    rearm_starved(ring, 0);
+    head = *ring->cq_head;
+    if(timeout == 0 || ring->ready != NULL || head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)){
+        wait = 0;
+    }else if(timeout > 0){
+        memset(&arg, 0, sizeof(arg));
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (long long)(timeout % 1000) * 1000000;
+        arg.ts = (unsigned long long)(unsigned long)&ts;
+        flags |= IORING_ENTER_EXT_ARG;
+        argument = &arg;
+        size = sizeof(arg);
+    }
+    // everything queued since the last wait goes in with this one call
+    if(ring_enter(ring->fd, pending(ring), wait, flags, argument, size) < 0 &&
+       errno != EINTR && errno != ETIME && errno != EBUSY && errno != EAGAIN){
+        log_message(LOG_ERROR, "Exception in io_uring_enter(): %s", strerror(errno));
+        return -1;
+    }
+    
+    while(head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)){
+        cqe = ring->cqes[head & *ring->cq_mask];
+        __atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+        complete(ring, &cqe);
+    }
+    
+    while((source = ring->ready) != NULL){
+        ring->ready = source->next_ready;
+        events = source->ready;
+        source->ready = 0;
+        if(source->fd < 0){ // closed by an earlier handler in this batch
+            continue;
+        }
+        source->handler(source, events);
+        count++;
+    }
+    if(count > 0){ // connections may have closed, worth another try for the listener
+        rearm_starved(ring, 1);
+    }
+    
+    return count;
+}
+
+#endif
@@ -0,0 +1,44 @@
+//
+//  uring.h
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef TinyForward_uring_h
+#define TinyForward_uring_h
+
+#include "event.h"
+
+#ifdef EVENT_USE_URING
+
+#define URING_ENTRIES       4096 // submission queue, twice that for completions
+#define URING_BUFFER_COUNT  64 // provided receive buffers per loop, a power of two
+#define URING_BUFFER_SIZE   65536
+
+typedef struct uring uring_t;
+
+int uring_probe(const char **reason);
+uring_t *uring_create(void);
+void uring_destroy(uring_t *ring);
+int uring_watch(uring_t *ring, event_source_t *source, int events);
+void uring_forget(uring_t *ring, event_source_t *source);
+ssize_t uring_read(uring_t *ring, event_source_t *source, struct iovec *iov, int count);
+int uring_wait(uring_t *ring, int timeout);
+
+#endif
+
+#endif
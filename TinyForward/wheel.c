@@ -0,0 +1,192 @@
+//
+//  wheel.c
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <limits.h>
+#include <string.h>
+#include "wheel.h"
+
+#define LEVEL_SHIFT(level)  (WHEEL_BITS * (level))
+#define WHEEL_SPAN          (1LL << LEVEL_SHIFT(WHEEL_LEVELS))
+
+void wheel_init(timer_wheel_t *wheel, long long now){
+    memset(wheel, 0, sizeof(timer_wheel_t));
+    wheel->base = now;
+}
+
+void wheel_timer_init(wheel_timer_t *timer, wheel_callback_t callback, void *owner){
+    memset(timer, 0, sizeof(wheel_timer_t));
+    timer->level = -1;
+    timer->callback = callback;
+    timer->owner = owner;
+}
+
+int wheel_armed(const wheel_timer_t *timer){
+    return timer->link != NULL;
+}
+
+// the level is picked by how far out the timer is, the slot by when it is due
+static void insert(timer_wheel_t *wheel, wheel_timer_t *timer){
+    long long expires = timer->expires < wheel->base ? wheel->base : timer->expires; // overdue runs with the next ms
+    wheel_timer_t **head;
+    int level;
+    
+    if(expires - wheel->base >= WHEEL_SPAN){ // comes round early and goes back in
+        expires = wheel->base + WHEEL_SPAN - 1;
+    }
+    for(level = 0; level < WHEEL_LEVELS - 1 && expires - wheel->base >= 1LL << LEVEL_SHIFT(level + 1); level++);
+    timer->level = level;
+    timer->slot = (int)(expires >> LEVEL_SHIFT(level)) & (WHEEL_SLOTS - 1);
+    head = &wheel->slots[level][timer->slot];
+    timer->next = *head;
+    if(*head != NULL){
+        (*head)->link = &timer->next;
+    }
+    *head = timer;
+    timer->link = head;
+    wheel->occupied[level] |= 1ull << timer->slot;
+}
+
+void wheel_cancel(timer_wheel_t *wheel, wheel_timer_t *timer){
+    if(timer->link == NULL){
+        return;
+    }
+    *timer->link = timer->next;
+    if(timer->next != NULL){
+        timer->next->link = timer->link;
+    }
+    if(timer->level >= 0 && wheel->slots[timer->level][timer->slot] == NULL){
+        wheel->occupied[timer->level] &= ~(1ull << timer->slot);
+    }
+    timer->next = NULL;
+    timer->link = NULL;
+}
+
+void wheel_arm(timer_wheel_t *wheel, wheel_timer_t *timer, long long expires){
+    wheel_cancel(wheel, timer);
+    timer->expires = expires;
+    insert(wheel, timer);
+}
+
+// a slot further up has come round, what's in it spreads over the levels below
+static void cascade(timer_wheel_t *wheel, int level, int slot){
+    wheel_timer_t *timer = wheel->slots[level][slot], *next;
+    
+    wheel->slots[level][slot] = NULL;
+    wheel->occupied[level] &= ~(1ull << slot);
+    for(; timer != NULL; timer = next){
+        next = timer->next;
+        insert(wheel, timer);
+    }
+}
+
+static void fire(timer_wheel_t *wheel, int slot){
+    wheel_timer_t *due = wheel->slots[0][slot], *timer;
+    
+    wheel->slots[0][slot] = NULL;
+    wheel->occupied[0] &= ~(1ull << slot);
+    if(due == NULL){
+        return;
+    }
+    // callbacks may cancel the others or arm new ones, so each is unlinked as it goes
+    due->link = &due;
+    for(timer = due; timer != NULL; timer = timer->next){
+        timer->level = -1;
+    }
+    while((timer = due) != NULL){
+        due = timer->next;
+        if(due != NULL){
+            due->link = &due;
+        }
+        timer->next = NULL;
+        timer->link = NULL;
+        timer->callback(timer);
+    }
+}
+
+static int is_empty(const timer_wheel_t *wheel){
+    int level;
+    
+    for(level = 0; level < WHEEL_LEVELS; level++){
+        if(wheel->occupied[level] != 0){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void wheel_run(timer_wheel_t *wheel, long long now){
+    unsigned long long ahead;
+    long long tick, boundary;
+    int level, slot;
+    
+    while(wheel->base <= now){
+        if(is_empty(wheel)){
+            wheel->base = now + 1;
+            break;
+        }
+        tick = wheel->base;
+        for(level = 1; level < WHEEL_LEVELS && (tick & ((1LL << LEVEL_SHIFT(level)) - 1)) == 0; level++){
+            cascade(wheel, level, (int)(tick >> LEVEL_SHIFT(level)) & (WHEEL_SLOTS - 1));
+        }
+        wheel->base = tick + 1; // anything armed for now from a callback runs next
+        fire(wheel, (int)tick & (WHEEL_SLOTS - 1));
+        
+        // on to the next ms with something in it, stopping at the end of the round
+        slot = (int)wheel->base & (WHEEL_SLOTS - 1);
+        if(slot != 0){
+            boundary = (wheel->base | (WHEEL_SLOTS - 1)) + 1;
+            ahead = wheel->occupied[0] >> slot;
+            wheel->base = ahead != 0 ? wheel->base + __builtin_ctzll(ahead) : boundary;
+            if(wheel->base > now + 1){
+                wheel->base = now + 1;
+            }
+        }
+    }
+}
+
+static unsigned long long rotate(unsigned long long bits, int by){
+    return by == 0 ? bits : bits >> by | bits << (WHEEL_SLOTS - by);
+}
+
+// ms until the nearest timer, or until a level above comes round with
+// timers that may be due sooner than anything below, -1 if none are armed
+int wheel_timeout(const timer_wheel_t *wheel, long long now){
+    unsigned long long ahead;
+    long long next = -1, at, span, round;
+    int level;
+    
+    for(level = 0; level < WHEEL_LEVELS; level++){
+        span = 1LL << LEVEL_SHIFT(level);
+        round = (wheel->base + span - 1) >> LEVEL_SHIFT(level); // the first slot that hasn't come round yet
+        ahead = rotate(wheel->occupied[level], (int)round & (WHEEL_SLOTS - 1));
+        if(ahead != 0){
+            at = (round + __builtin_ctzll(ahead)) << LEVEL_SHIFT(level);
+            if(next < 0 || at < next){
+                next = at;
+            }
+        }
+    }
+    if(next < 0){
+        return -1;
+    }
+    if(next <= now){
+        return 0;
+    }
+    return next - now > INT_MAX ? INT_MAX : (int)(next - now);
+}
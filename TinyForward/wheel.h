@@ -0,0 +1,60 @@
+//
+//  wheel.h
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef TinyForward_wheel_h
+#define TinyForward_wheel_h
+
+#define WHEEL_BITS    6
+#define WHEEL_SLOTS   (1 << WHEEL_BITS)
+#define WHEEL_LEVELS  4 // one ms per slot at the bottom, about 4.6 hours at the top
+
+typedef struct wheel_timer wheel_timer_t;
+typedef void (*wheel_callback_t)(wheel_timer_t *timer);
+
+// Embedded in whatever it times, like event_source_t. Arming and cancelling
+// only link and unlink it, timers far out are moved down a level as their
+// slot comes up.
+struct wheel_timer {
+    long long expires; // ms
+    int level; // -1 while it is about to fire
+    int slot;
+    wheel_timer_t *next;
+    wheel_timer_t **link; // whatever points at this one, NULL while not armed
+    wheel_callback_t callback;
+    void *owner;
+};
+
+// One per worker, only touched from its thread.
+typedef struct timer_wheel {
+    long long base; // the next ms to run
+    unsigned long long occupied[WHEEL_LEVELS]; // a bit per slot with timers in it
+    wheel_timer_t *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} timer_wheel_t;
+
+void wheel_init(timer_wheel_t *wheel, long long now);
+void wheel_timer_init(wheel_timer_t *timer, wheel_callback_t callback, void *owner);
+void wheel_arm(timer_wheel_t *wheel, wheel_timer_t *timer, long long expires);
+void wheel_cancel(timer_wheel_t *wheel, wheel_timer_t *timer);
+int wheel_armed(const wheel_timer_t *timer);
+
+/* Dispatching */
+int wheel_timeout(const timer_wheel_t *wheel, long long now);
+void wheel_run(timer_wheel_t *wheel, long long now);
+
+#endif
@@ -0,0 +1,138 @@
+//
+//  worker.c
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "worker.h"
+
+int worker_init(worker_t *worker, int id, const char *host, uint16_t port, int reuse_port){
+    int listener_socket;
+    
+    memset(worker, 0, sizeof(worker_t));
+    worker->id = id;
+    worker->spare_fd = -1;
+    wheel_init(&worker->timers, event_now());
+    metrics_register(&worker->metrics, id);
+    
+    listener_socket = create_listener_socket(host, port, reuse_port);
+    if(listener_socket < 0){
+        return -1;
+    }
+    fcntl(listener_socket, F_SETFL, O_NONBLOCK);
+    
+    if(event_loop_init(&worker->loop) < 0){
+        close(listener_socket);
+        return -1;
+    }
+    event_source_init(&worker->listener, listener_socket, listener_event_handler, worker);
+    event_complete(&worker->listener, EVENT_COMPLETE_ACCEPT);
+    if(event_add(&worker->loop, &worker->listener, EVENT_READ) < 0){
+        event_loop_destroy(&worker->loop);
+        close(listener_socket);
+        return -1;
+    }
+    if(dns_resolver_init(&worker->resolver, &worker->loop, id) < 0){
+        event_remove(&worker->loop, &worker->listener);
+        event_loop_destroy(&worker->loop);
+        close(listener_socket);
+        return -1;
+    }
+    worker->spare_fd = open("/dev/null", O_RDONLY);
+    
+    return 0;
+}
+
+void worker_destroy(worker_t *worker){
+    int listener_socket = worker->listener.fd;
+    connection_t *conn;
+    
+    while(worker->last_connection != NULL){
+        drop_connection(worker->last_connection);
+    }
+    free_closed_connections(worker);
+    while((conn = worker->free_connections) != NULL){
+        worker->free_connections = conn->next_connection;
+        buffer_free(&conn->request_buffer);
+        buffer_free(&conn->response_buffer);
+        free(conn);
+    }
+    gzip_pool_destroy(&worker->gzip);
+    dns_resolver_destroy(&worker->resolver);
+    if(worker->spare_fd >= 0){
+        close(worker->spare_fd);
+    }
+    event_remove(&worker->loop, &worker->listener);
+    close(listener_socket);
+    event_loop_destroy(&worker->loop);
+}
+
+int worker_start(worker_t *worker){
+    int err;
+    
+    err = pthread_create(&worker->thread, NULL, worker_run, worker);
+    if(err != 0){
+        log_message(LOG_ERROR, "Cannot start worker %d: %s", worker->id, strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+// the nearest timer decides how long the loop may sleep
+static int next_timeout(worker_t *worker){
+    int timers = wheel_timeout(&worker->timers, event_now());
+    int dns = dns_timeout(&worker->resolver);
+    int pool = worker->id == 0 ? pool_timeout() : -1; // one worker is enough to sweep the pool
+    int checks = worker->id == 0 ? backend_timeout() : -1; // and to check the parents
+    int wait = timers;
+    
+    if(wait < 0 || (dns >= 0 && dns < wait)){
+        wait = dns;
+    }
+    if(wait < 0 || (pool >= 0 && pool < wait)){
+        wait = pool;
+    }
+    if(wait < 0 || (checks >= 0 && checks < wait)){
+        wait = checks;
+    }
+    if(worker->starving != NULL && (wait < 0 || wait > BUFFER_RETRY_INTERVAL)){ // memory may come free on another worker
+        wait = BUFFER_RETRY_INTERVAL;
+    }
+    return wait;
+}
+
+void *worker_run(void *arg){
+    worker_t *worker = arg;
+    
+    log_attach(worker->id);
+    trace_attach(worker->id);
+    do{
+        if(event_loop_poll(&worker->loop, next_timeout(worker)) < 0){
+            break;
+        }
+        dns_run_timers(&worker->resolver);
+        wheel_run(&worker->timers, event_now());
+        pool_expire();
+        if(worker->id == 0){
+            backend_run_timers();
+        }
+        free_closed_connections(worker);
+        feed_starving(worker);
+    }while(1);
+    
+    log_message(LOG_INFO, "Worker %d stopped.", worker->id);
+    return NULL;
+}
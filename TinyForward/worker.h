@@ -0,0 +1,56 @@
+//
+//  worker.h
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef TinyForward_worker_h
+#define TinyForward_worker_h
+
+#include <pthread.h>
+#include "tinyforward.h"
+
+#define MAX_WORKERS  256
+
+// Everything a worker mutates is owned by that worker. Workers never touch
+// each other's connections; the kernel spreads clients across the
+// SO_REUSEPORT listeners.
+struct worker {
+    int id;
+    pthread_t thread;
+    event_loop_t loop;
+    event_source_t listener;
+    connection_t *last_connection;
+    connection_t *closed_connections; // freed once the current batch of events is dispatched
+    connection_t *free_connections; // reused by add_connection() before anything is allocated
+    int free_count;
+    int spare_fd; // given up to accept() and turn a client away when out of descriptors
+    connection_t *starving; // waiting for buffer memory, oldest first
+    connection_t *last_starving;
+    int starving_count;
+    gzip_pool_t gzip; // streams and scratch space for responses compressed on the way
+    collapse_t *collapsing[COLLAPSE_BUCKETS]; // responses fetched for the cache that others may wait for
+    timer_wheel_t timers; // connection timeouts, staggered connects and collapsed requests
+    dns_resolver_t resolver;
+    metrics_t metrics;
+};
+
+int worker_init(worker_t *worker, int id, const char *host, uint16_t port, int reuse_port);
+void worker_destroy(worker_t *worker);
+int worker_start(worker_t *worker);
+void *worker_run(void *arg);
+
+#endif
@@ -0,0 +1,770 @@
+#!/usr/bin/env python3
+#
+# Functional checks for TinyForward. Starts it between origins written here
+# and checks what clients get back, byte for byte. Every group restarts the
+# proxy with its own arguments on top of PROXY_ARGS, so the same checks
+# compare the event loops, e.g. PROXY_ARGS=-U make check.
+#
+#   bench/check.py [group ...]
+#
+# BUILD        where make put the binaries (default build)
+# PROXY_ARGS   extra arguments for tinyforward
+# ORIGIN_ADDR  address the origins bind, must not be 127.0.0.1 since the
+#              proxy refuses to connect to itself (default 127.0.0.2)
+#
+# Needs nothing beyond Python 3 on Linux.
+
+import os
+import shlex
+import shutil
+import socket
+import socketserver
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import urllib.parse
+
+BUILD = os.environ.get("BUILD", "build")
+PROXY_ARGS = shlex.split(os.environ.get("PROXY_ARGS", ""))
+ORIGIN_ADDR = os.environ.get("ORIGIN_ADDR", "127.0.0.2")
+PROXY = ("127.0.0.1", 5555) # fixed in tinyforward.h
+TIMEOUT = 5
+
+failures = 0
+
+
+def check(name, got, want):
+    global failures
+    if got == want:
+        print("ok   %s" % name)
+    else:
+        failures += 1
+        print("FAIL %s\n     got  %r\n     want %r" % (name, short(got), short(want)))
+
+
+def short(value):
+    if isinstance(value, list):
+        return [short(item) for item in value]
+    if isinstance(value, (bytes, str)) and len(value) > 60:
+        return "%r... %d long" % (value[:60], len(value))
+    return value
+
+
+def pattern(size, seed=0):
+    block = bytes((i * 7 + seed) & 0xff for i in range(256))
+    return (block * (size // 256 + 1))[:size]
+
+
+def wait_port(address, listening=True):
+    for _ in range(50):
+        try:
+            socket.create_connection(address, 0.2).close()
+            if listening:
+                return True
+        except OSError:
+            if not listening:
+                return True
+        time.sleep(0.1)
+    return False
+
+
+# -- HTTP on the wire ---------------------------------------------------------
+
+class Response:
+    def __init__(self, status, reason, headers, body):
+        self.status = status
+        self.reason = reason
+        self.headers = headers # (name, value) in order, names lower case
+        self.body = body
+
+    def header(self, name, default=None):
+        values = [v for k, v in self.headers if k == name.lower()]
+        return ", ".join(values) if values else default
+
+
+def read_head(stream):
+    line = stream.readline()
+    if not line:
+        return None
+    headers = []
+    while True:
+        field = stream.readline()
+        if field in (b"\r\n", b"\n", b""):
+            break
+        name, _, value = field.decode("latin-1").partition(":")
+        headers.append((name.strip().lower(), value.strip()))
+    return line.decode("latin-1").rstrip("\r\n"), headers
+
+
+def read_chunked(stream):
+    body = b""
+    while True:
+        size = int(stream.readline().split(b";")[0], 16)
+        if size == 0:
+            while stream.readline() not in (b"\r\n", b"\n", b""): # trailers
+                pass
+            return body
+        body += stream.read(size)
+        stream.readline()
+
+
+def read_response(stream, method="GET"):
+    while True:
+        head = read_head(stream)
+        if head is None:
+            return None
+        version, status, reason = (head[0].split(" ", 2) + [""])[:3]
+        status = int(status)
+        if status >= 200 or status == 101:
+            break
+    headers = head[1]
+    fields = dict(headers)
+    if method == "HEAD" or status in (204, 304) or method == "CONNECT" and status == 200:
+        body = b""
+    elif "chunked" in fields.get("transfer-encoding", "").lower():
+        body = read_chunked(stream)
+    elif "content-length" in fields:
+        body = stream.read(int(fields["content-length"]))
+    else:
+        body = stream.read()
+    return Response(status, reason, headers, body)
+
+
+def request_bytes(method, url, headers=(), body=None):
+    parts = urllib.parse.urlsplit(url)
+    target = url if method != "CONNECT" else parts.netloc
+    lines = ["%s %s HTTP/1.1" % (method, target), "Host: %s" % parts.netloc]
+    lines += ["%s: %s" % field for field in headers]
+    if body is not None and not any(k.lower() == "transfer-encoding" for k, _ in headers):
+        lines.append("Content-Length: %d" % len(body))
+    return ("\r\n".join(lines) + "\r\n\r\n").encode("latin-1") + (body or b"")
+
+
+class Client:
+    """One connection to the proxy, requests go out one at a time or all at once."""
+
+    def __init__(self):
+        self.sock = socket.create_connection(PROXY, TIMEOUT)
+        self.stream = self.sock.makefile("rb")
+
+    def send(self, data):
+        self.sock.sendall(data)
+
+    def request(self, method, url, headers=(), body=None):
+        self.send(request_bytes(method, url, headers, body))
+        return self.response(method)
+
+    def response(self, method="GET"):
+        try:
+            return read_response(self.stream, method)
+        except (OSError, ValueError):
+            return None
+
+    def closed(self):
+        try:
+            return self.sock.recv(1) == b""
+        except OSError:
+            return True
+
+    def close(self):
+        self.stream.close()
+        self.sock.close()
+
+
+def fetch(url, headers=(), method="GET", body=None):
+    client = Client()
+    try:
+        return client.request(method, url, headers, body)
+    finally:
+        client.close()
+
+
+def body_of(url, headers=()):
+    response = fetch(url, headers)
+    return response.body if response is not None else None
+
+
+# -- origins ------------------------------------------------------------------
+
+class Origin(socketserver.ThreadingMixIn, socketserver.TCPServer):
+    """
+    Keep-alive HTTP origin. Counts connections and requests per path.
+
+      /bytes/N        N bytes of pattern()
+      /chunked        a chunked body with an extension and a trailer
+      /nocontent      204
+      /continue       100 Continue, then the response
+      /close          answers with Connection: close
+      /eof            HTTP/1.0, the body runs until the close
+      /echo           the request body
+      /health         an empty response with the status in .health, 200 to start with
+      /obj/NAME?...   "NAME n=COUNT lang=ACCEPT-LANGUAGE", with h=Name:value
+                      fields from the query, size=N for pattern() instead,
+                      304 to a matching If-None-Match, h304= fields on it
+    """
+    daemon_threads = True
+    allow_reuse_address = True
+
+    def __init__(self, port):
+        self.port = port
+        self.lock = threading.Lock()
+        self.connections = 0
+        self.health = 200
+        self.hits = {}
+        self.requests = [] # (path, headers) in arrival order
+        super().__init__((ORIGIN_ADDR, port), OriginHandler)
+        threading.Thread(target=self.serve_forever, daemon=True).start()
+
+    def url(self, path):
+        return "http://%s:%d%s" % (ORIGIN_ADDR, self.port, path)
+
+    def hit_count(self, path):
+        with self.lock:
+            return self.hits.get(path, 0)
+
+    def stop(self):
+        self.shutdown()
+        self.server_close()
+
+
+class OriginHandler(socketserver.StreamRequestHandler):
+    def handle(self):
+        with self.server.lock:
+            self.server.connections += 1
+        while True:
+            try:
+                head = read_head(self.rfile)
+            except ConnectionResetError: # health checks hang up on what they didn't read
+                return
+            if head is None:
+                return
+            method, target, _ = head[0].split(" ", 2)
+            fields = dict(head[1])
+            body = b""
+            if "content-length" in fields:
+                body = self.rfile.read(int(fields["content-length"]))
+            elif fields.get("transfer-encoding", "").lower() == "chunked":
+                body = read_chunked(self.rfile)
+            if "://" in target:
+                target = "/" + target.split("://", 1)[1].partition("/")[2]
+            with self.server.lock:
+                self.server.hits[target] = count = self.server.hits.get(target, 0) + 1
+                self.server.requests.append((target, fields))
+            if not self.answer(method, target, fields, body, count):
+                return
+            self.wfile.flush()
+
+    def send(self, status, headers, body, method="GET"):
+        reason = {200: "OK", 204: "No Content", 304: "Not Modified", 503: "Service Unavailable"}.get(status, "Status")
+        head = "HTTP/1.1 %d %s\r\n" % (status, reason)
+        head += "".join("%s: %s\r\n" % field for field in headers)
+        if status not in (204, 304):
+            head += "Content-Length: %d\r\n" % len(body)
+        self.wfile.write((head + "\r\n").encode("latin-1") + (body if method != "HEAD" else b""))
+
+    def answer(self, method, target, fields, body, count):
+        path, _, query = target.partition("?")
+        w = self.wfile
+        if path.startswith("/bytes/"):
+            self.send(200, [], pattern(int(path[7:])), method)
+        elif path == "/chunked":
+            w.write(b"HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhello\r\n6;x=y\r\n world\r\n0\r\nX-T: 1\r\n\r\n")
+        elif path == "/nocontent":
+            self.send(204, [], b"")
+        elif path == "/continue":
+            w.write(b"HTTP/1.1 100 Continue\r\n\r\nHTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok")
+        elif path == "/close":
+            w.write(b"HTTP/1.1 200 OK\r\nConnection: close\r\nContent-Length: 3\r\n\r\nbye")
+            return False
+        elif path == "/eof":
+            w.write(b"HTTP/1.0 200 OK\r\n\r\nuntil close")
+            return False
+        elif path == "/echo":
+            self.send(200, [], body)
+        elif path == "/health":
+            self.send(self.server.health, [], b"", method)
+        elif path.startswith("/obj/"):
+            params = urllib.parse.parse_qs(query)
+            headers = [tuple(s.strip() for s in h.split(":", 1)) for h in params.get("h", [])]
+            etag = dict((k.lower(), v) for k, v in headers).get("etag")
+            if etag is not None and fields.get("if-none-match") == etag:
+                headers = [tuple(s.strip() for s in h.split(":", 1)) for h in params.get("h304", [])] or headers
+                self.send(304, headers, b"")
+            elif "size" in params:
+                self.send(200, headers, pattern(int(params["size"][0]), count), method)
+            else:
+                self.send(200, headers, ("%s n=%d lang=%s\n" % (path[5:], count, fields.get("accept-language"))).encode(), method)
+        else:
+            self.send(404, [], b"")
+        return True
+
+
+class Echo(socketserver.ThreadingMixIn, socketserver.TCPServer):
+    """Sends back whatever arrives, a CONNECT target."""
+    daemon_threads = True
+    allow_reuse_address = True
+
+    def __init__(self, port):
+        class Handler(socketserver.BaseRequestHandler):
+            def handle(self):
+                while True:
+                    data = self.request.recv(65536)
+                    if not data:
+                        return
+                    self.request.sendall(data)
+        super().__init__((ORIGIN_ADDR, port), Handler)
+        threading.Thread(target=self.serve_forever, daemon=True).start()
+
+    def stop(self):
+        self.shutdown()
+        self.server_close()
+
+
+class Nameserver:
+    """
+    Stub DNS server on 127.0.0.1, logs every question as (name, type).
+
+      a.test          A ORIGIN_ADDR, TTL 2, no AAAA
+      cname.test      CNAME to c1.test, CNAME to a.test, then its A
+      planted.test    only an A record for some other name
+      nx.test         NXDOMAIN, the SOA gives a negative TTL of 2
+      garbage.test    first answer to each question is noise, then a.test's
+      truncated.test  first answer is cut off in the middle of a record
+      wrongid.test    a forged answer with the wrong id comes first
+      spoofed.test    a forged answer from another port comes first
+    """
+    BOGUS = "127.0.0.9" # where forged answers point, nothing listens there
+
+    def __init__(self):
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.bind(("127.0.0.1", 0))
+        self.spoofer = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.spoofer.bind(("127.0.0.1", 0))
+        self.address = "127.0.0.1:%d" % self.sock.getsockname()[1]
+        self.questions = []
+        self.running = True
+        threading.Thread(target=self.serve, daemon=True).start()
+
+    def asked(self, name, qtype=1):
+        return self.questions.count((name, qtype))
+
+    def stop(self):
+        self.running = False
+        self.sock.sendto(b"", self.sock.getsockname())
+        self.spoofer.close()
+
+    @staticmethod
+    def encode(name):
+        return b"".join(bytes([len(label)]) + label.encode() for label in name.split(".")) + b"\0"
+
+    @staticmethod
+    def record(owner, rtype, ttl, data):
+        return owner + struct.pack(">HHIH", rtype, 1, ttl, len(data)) + data
+
+    def answer(self, qid, question, records, rcode=0, authority=()):
+        return struct.pack(">HHHHHH", qid, 0x8180 | rcode, 1, len(records), len(authority), 0) + question + \
+            b"".join(records) + b"".join(authority)
+
+    def serve(self):
+        seen = set()
+        while self.running:
+            packet, client = self.sock.recvfrom(512)
+            if len(packet) < 12:
+                continue
+            qid = struct.unpack(">H", packet[:2])[0]
+            offset, labels = 12, []
+            while packet[offset]:
+                labels.append(packet[offset + 1:offset + 1 + packet[offset]].decode().lower())
+                offset += packet[offset] + 1
+            name, qtype = ".".join(labels), struct.unpack(">H", packet[offset + 1:offset + 3])[0]
+            question = packet[12:offset + 5]
+            self.questions.append((name, qtype))
+            first = (name, qtype) not in seen
+            seen.add((name, qtype))
+            a = lambda owner, address, ttl=60: self.record(owner, 1, ttl, socket.inet_aton(address))
+            cname = lambda owner, target: self.record(owner, 5, 60, self.encode(target))
+            here = b"\xc0\x0c" # the name in the question
+            if name == "nx.test":
+                soa = self.encode("ns.test") + self.encode("admin.test") + struct.pack(">IIIII", 1, 60, 60, 60, 2)
+                reply = self.answer(qid, question, [], 3, [self.record(self.encode("test"), 6, 60, soa)])
+            elif qtype != 1:
+                reply = self.answer(qid, question, [])
+            elif name == "a.test":
+                reply = self.answer(qid, question, [a(here, ORIGIN_ADDR, 2)])
+            elif name == "cname.test":
+                reply = self.answer(qid, question, [cname(here, "c1.test"), cname(self.encode("c1.test"), "a.test"),
+                                                    a(self.encode("a.test"), ORIGIN_ADDR)])
+            elif name == "planted.test":
+                reply = self.answer(qid, question, [a(self.encode("other.test"), ORIGIN_ADDR)])
+            elif name in ("garbage.test", "truncated.test", "wrongid.test", "spoofed.test"):
+                reply = self.answer(qid, question, [a(here, ORIGIN_ADDR)])
+                forged = self.answer(qid, question, [a(here, self.BOGUS)])
+                if name == "garbage.test" and first:
+                    reply = packet[:2] + b"\x81\x80" + bytes((i * 37) & 0xff for i in range(60))
+                elif name == "truncated.test" and first:
+                    reply = reply[:-3]
+                elif name == "wrongid.test":
+                    self.sock.sendto(struct.pack(">H", qid ^ 1) + forged[2:], client)
+                elif name == "spoofed.test":
+                    self.spoofer.sendto(forged, client)
+                    time.sleep(0.05)
+            else:
+                reply = self.answer(qid, question, [], 3)
+            self.sock.sendto(reply, client)
+
+
+# -- the proxy ----------------------------------------------------------------
+
+class Proxy:
+    def __init__(self, group, args=()):
+        self.log = open(os.path.join(BUILD, "check-%s.log" % group), "ab")
+        self.process = subprocess.Popen([os.path.join(BUILD, "tinyforward"), "-L", "warn", "-m", "0"] + PROXY_ARGS + list(args),
+                                        stdout=subprocess.DEVNULL, stderr=self.log)
+        if not wait_port(PROXY):
+            raise RuntimeError("tinyforward is not listening")
+
+    def stop(self):
+        alive = self.process.poll() is None
+        self.process.terminate()
+        self.process.wait()
+        self.log.close()
+        wait_port(PROXY, listening=False) # with -U the ring lets go of the listener a little after exit
+        return alive
+
+
+def run(group, args, body):
+    proxy = Proxy(group, args)
+    try:
+        body()
+    finally:
+        check("%s: proxy still running" % group, proxy.stop(), True)
+
+
+# -- groups -------------------------------------------------------------------
+
+def smoke():
+    origin, echo = Origin(8000), Echo(8002)
+
+    def body():
+        for size in (100, 70000, 3000000):
+            check("GET %d bytes" % size, body_of(origin.url("/bytes/%d" % size)), pattern(size))
+        client = Client()
+        got = [client.request("GET", origin.url("/bytes/%d" % size)) for size in (10, 5000, 10)]
+        check("keep-alive sequence", [r.body for r in got], [pattern(10), pattern(5000), pattern(10)])
+        check("HEAD", (client.request("HEAD", origin.url("/bytes/50")).header("content-length")), "50")
+        client.close()
+
+        for size in (100, 2000000):
+            client = Client()
+            response = client.request("CONNECT", "http://%s:%d" % (ORIGIN_ADDR, echo.server_address[1]))
+            data = pattern(size, 3)
+            threading.Thread(target=client.send, args=(data,), daemon=True).start()
+            got = client.stream.read(size) if response is not None and response.status == 200 else None
+            check("CONNECT tunnel %d bytes" % size, got, data)
+            client.close()
+
+        results = [None] * 20
+
+        def one(i):
+            results[i] = body_of(origin.url("/bytes/70000"))
+        threads = [threading.Thread(target=one, args=(i,)) for i in range(20)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        check("20 concurrent", results.count(pattern(70000)), 20)
+    try:
+        run("smoke", [], body)
+    finally:
+        origin.stop()
+        echo.stop()
+
+
+def pipeline():
+    first, second = Origin(8001), Origin(8003)
+
+    def pipelined(requests):
+        client = Client()
+        client.send(b"".join(request_bytes(m, u, h, b) for m, u, h, b in requests))
+        got = []
+        for method, _, _, _ in requests:
+            response = client.response(method)
+            if response is None:
+                break
+            got.append(response.body)
+        client.close()
+        return got
+
+    def body():
+        G = lambda origin, path, method="GET": (method, origin.url(path), (), None)
+        requests = [G(first, "/bytes/1"), G(first, "/bytes/2", "HEAD"), G(first, "/bytes/3"), G(second, "/bytes/4"),
+                    G(first, "/chunked"), G(first, "/bytes/5")] + [G(first, "/bytes/1")] * 20 + \
+                   [("POST", first.url("/echo"), [("Connection", "close")], b"abc")]
+        check("mixed origins, HEAD, chunked, POST", pipelined(requests),
+              [pattern(1), b"", pattern(3), pattern(4), b"hello world", pattern(5)] + [pattern(1)] * 20 + [b"abc"])
+        check("server closes", pipelined([G(first, "/bytes/1"), G(first, "/close"), G(first, "/bytes/2")]), [pattern(1), b"bye"])
+        check("body until eof", pipelined([G(first, "/bytes/1"), G(first, "/eof"), G(first, "/bytes/2")]), [pattern(1), b"until close"])
+    try:
+        run("pipeline", [], body)
+    finally:
+        first.stop()
+        second.stop()
+
+
+def pool():
+    origin = Origin(8001)
+
+    def body():
+        for _ in range(5):
+            body_of(origin.url("/bytes/100"))
+        check("reused for 5 requests", origin.connections, 1)
+        fetch(origin.url("/bytes/50"), method="HEAD")
+        body_of(origin.url("/bytes/7"))
+        check("reused after HEAD", origin.connections, 1)
+        check("chunked", body_of(origin.url("/chunked")), b"hello world")
+        check("204", fetch(origin.url("/nocontent")).status, 204)
+        check("100 Continue", body_of(origin.url("/continue")), b"ok")
+        check("reused after chunked, 204, 100", origin.connections, 1)
+        check("Connection: close", body_of(origin.url("/close")), b"bye")
+        body_of(origin.url("/bytes/5"))
+        check("not reused after close", origin.connections, 2)
+        check("until eof", body_of(origin.url("/eof")), b"until close")
+        body_of(origin.url("/bytes/5"))
+        check("not reused after eof", origin.connections, 3)
+    try:
+        run("pool", [], body)
+    finally:
+        origin.stop()
+
+
+def request():
+    origin = Origin(8001)
+
+    def body():
+        data = pattern(300000, 5)
+        response = fetch(origin.url("/echo"), method="POST", body=data)
+        check("POST with Content-Length", response.body if response else None, data)
+        chunked = b"".join(b"%x\r\n%s\r\n" % (len(data[i:i + 7000]), data[i:i + 7000]) for i in range(0, len(data), 7000)) + b"0\r\n\r\n"
+        response = fetch(origin.url("/echo"), [("Transfer-Encoding", "chunked")], "POST", chunked)
+        check("POST chunked", response.body if response else None, data)
+
+        client = Client()
+        head = request_bytes("GET", origin.url("/bytes/4"), [("X-Long", "a" * 3000)])
+        for i in range(0, len(head), 7):
+            client.send(head[i:i + 7])
+            time.sleep(0.0005)
+        client.send(request_bytes("POST", origin.url("/echo"), (), b"abc") + request_bytes("GET", origin.url("/bytes/2")))
+        got = [client.response(m) for m in ("GET", "POST", "GET")]
+        check("dripped head then pipelined", [r.body if r else None for r in got], [pattern(4), b"abc", pattern(2)])
+        client.close()
+
+        client = Client()
+        client.send(b"POST " + origin.url("/echo").encode() + b" HTTP/1.1\r\nContent-Length: 3\r\nTransfer-Encoding: chunked\r\n\r\n0\r\n\r\n")
+        check("Content-Length with Transfer-Encoding refused", client.closed(), True)
+        client.close()
+    try:
+        run("request", [], body)
+    finally:
+        origin.stop()
+
+
+def obj(name, *headers, **params):
+    query = [("h", h) for h in headers]
+    query += [(k, v) for k, values in sorted(params.items()) for v in (values if isinstance(values, list) else [values])]
+    return "/obj/%s?%s" % (name, urllib.parse.urlencode(query))
+
+
+def cache():
+    origin = Origin(8100)
+
+    def bodies(path, count, headers=()):
+        return [body_of(origin.url(path), headers) for _ in range(count)]
+
+    def body():
+        fresh = obj("fresh", "Cache-Control: max-age=60")
+        check("fresh hits", bodies(fresh, 3), [b"fresh n=1 lang=None\n"] * 3)
+        response = fetch(origin.url(fresh))
+        check("hit carries Age", response.header("age") is not None, True)
+        short = obj("short", "Cache-Control: max-age=1")
+        got = bodies(short, 1)
+        time.sleep(1.3)
+        got += bodies(short, 2)
+        check("expiry", [b.split()[1] for b in got], [b"n=1", b"n=2", b"n=2"])
+        etag = obj("etag", "Cache-Control: max-age=0", 'ETag: "v1"')
+        check("revalidated", bodies(etag, 3), [b"etag n=1 lang=None\n"] * 3)
+        check("revalidations reach the origin", origin.hit_count(etag), 3)
+        updated = obj("updated", "Cache-Control: max-age=0", 'ETag: "u1"', "X-Version: 1",
+                      h304=["Cache-Control: max-age=60", 'ETag: "u1"', "X-Version: 2"])
+        got = [fetch(origin.url(updated)) for _ in range(3)]
+        check("304 fields kept", [(r.body, r.header("x-version"), r.header("cache-control")) for r in got],
+              [(b"updated n=1 lang=None\n", "1", "max-age=0")] + [(b"updated n=1 lang=None\n", "2", "max-age=60")] * 2)
+        check("304 freshness kept", origin.hit_count(updated), 2)
+        retagged = obj("retagged", "Cache-Control: max-age=0", 'ETag: "r1"', h304='ETag: "r2"')
+        got = [fetch(origin.url(retagged)) for _ in range(3)]
+        check("304 ETag kept", [(r.body.split()[1], r.header("etag")) for r in got], [(b"n=1", '"r1"'), (b"n=1", '"r2"'), (b"n=3", '"r1"')])
+        check("revalidated with the new ETag", [f.get("if-none-match") for p, f in origin.requests if p == retagged], [None, '"r1"', '"r2"'])
+        check("no-store", [b.split()[1] for b in bodies(obj("nostore", "Cache-Control: no-store, max-age=60"), 2)], [b"n=1", b"n=2"])
+        check("Set-Cookie", [b.split()[1] for b in bodies(obj("cookie", "Cache-Control: max-age=60", "Set-Cookie: a=b"), 2)], [b"n=1", b"n=2"])
+        vary = obj("vary", "Cache-Control: max-age=60", "Vary: Accept-Language")
+        got = [body_of(origin.url(vary), [("Accept-Language", lang)]) for lang in ("en", "fr", "en", "fr")]
+        check("Vary", got, [b"vary n=1 lang=en\n", b"vary n=2 lang=fr\n", b"vary n=1 lang=en\n", b"vary n=2 lang=fr\n"])
+        vary = obj("vary2", "Cache-Control: max-age=60", "Vary: Accept-Encoding", "Vary: Accept-Language")
+        got = [body_of(origin.url(vary), [("Accept-Language", lang)]) for lang in ("en", "fr", "en", "fr")]
+        check("Vary over two lines", got, [b"vary2 n=1 lang=en\n", b"vary2 n=2 lang=fr\n", b"vary2 n=1 lang=en\n", b"vary2 n=2 lang=fr\n"])
+        names = ["Vary: " + ", ".join("X-Long-Field-Name-%d" % i for i in range(j, j + 8)) for j in (0, 8)]
+        check("Vary too long to keep", [b.split()[1] for b in bodies(obj("varylong", "Cache-Control: max-age=60", *names), 2)], [b"n=1", b"n=2"])
+        nocache = obj("nocache", "Cache-Control: max-age=60")
+        got = bodies(nocache, 1) + bodies(nocache, 1, [("Cache-Control", "no-cache")]) + bodies(nocache, 1)
+        check("client no-cache", [b.split()[1] for b in got], [b"n=1", b"n=2", b"n=2"])
+        check("unknown client directive", [b.split()[1] for b in bodies(nocache, 1, [("Cache-Control", "x-no-store-ext")])], [b"n=2"])
+        aged = obj("aged", "Cache-Control: max-age=60")
+        minfresh = obj("minfresh", "Cache-Control: max-age=5")
+        stale = obj("stale", "Cache-Control: max-age=1")
+        revalidate = obj("revalidate", "Cache-Control: max-age=1, must-revalidate")
+        for path in (aged, minfresh, stale, revalidate):
+            bodies(path, 1)
+        time.sleep(1.3)
+        got = bodies(aged, 1, [("Cache-Control", "max-age=1")]) + bodies(aged, 1)
+        check("client max-age", [b.split()[1] for b in got], [b"n=2", b"n=2"])
+        got = bodies(minfresh, 1, [("Cache-Control", "min-fresh=1")]) + bodies(minfresh, 1, [("Cache-Control", "min-fresh=10")])
+        check("client min-fresh", [b.split()[1] for b in got], [b"n=1", b"n=2"])
+        got = bodies(stale, 1, [("Cache-Control", "max-stale=10")]) + bodies(stale, 1, [("Cache-Control", "max-stale=0")])
+        check("client max-stale", [b.split()[1] for b in got], [b"n=1", b"n=2"])
+        got = bodies(revalidate, 1, [("Cache-Control", "max-stale")])
+        check("max-stale against must-revalidate", [b.split()[1] for b in got], [b"n=2"])
+        check("client's own validator", fetch(origin.url(etag), [("If-None-Match", '"v1"')]).status, 304)
+        big = obj("big", "Cache-Control: max-age=60", size=1500000)
+        check("1.5 MB from memory", bodies(big, 2), [pattern(1500000, 1)] * 2)
+        check("1.5 MB fetched once", origin.hit_count(big), 1)
+
+        client = Client()
+        paths = [fresh, etag, fresh, obj("changed", "Cache-Control: max-age=0"), fresh]
+        client.send(b"".join(request_bytes("GET", origin.url(p)) for p in paths))
+        got = [client.response() for _ in paths]
+        check("pipelined hits and misses in order", [r.body.split()[0] if r else None for r in got],
+              [b"fresh", b"etag", b"fresh", b"changed", b"fresh"])
+        client.close()
+    try:
+        run("cache", ["-c", "64"], body)
+    finally:
+        origin.stop()
+
+
+def damaged_slab(directory, key):
+    """A slab with one committed record whose head runs far past the file."""
+    head = b"HTTP/1.1 200 OK\r\nContent-Length: 4\r\n"
+    record = struct.pack("=IIQqqqIIIIIIQ", 0x54466331, 2, 72 + len(key) + len(head) + 4, int(time.time() * 1000), 0, 600000,
+                         len(key), 0, 0, 0, 0, 1 << 28, 4)
+    with open(os.path.join(directory, "slab.99999999"), "wb") as f:
+        f.write(record + key.encode() + head + b"fake")
+        f.truncate(1 << 20)
+
+
+def disk():
+    origin = Origin(8100)
+    directory = tempfile.mkdtemp(prefix="tinyforward-check-")
+    args = ["-c", "1", "-D", directory, "-Q", "64"] # anything over 32 KB goes to disk
+    big = obj("big", "Cache-Control: max-age=600", size=3000000)
+    etag = obj("bigetag", "Cache-Control: max-age=0", 'ETag: "b1"', size=200000)
+    retagged = obj("bigretagged", "Cache-Control: max-age=0", 'ETag: "r1"', h304='ETag: "r2"', size=100000)
+    damaged = obj("damaged", "Cache-Control: max-age=600", size=100000)
+    vary = obj("bigvary", "Cache-Control: max-age=600", "Vary: Accept-Encoding", "Vary: Accept-Language", size=100000)
+
+    def first():
+        check("spilled", [body_of(origin.url(big)) for _ in range(3)], [pattern(3000000, 1)] * 3)
+        check("spilled, fetched once", origin.hit_count(big), 1)
+        check("revalidated from disk", [body_of(origin.url(etag)) for _ in range(2)], [pattern(200000, 1)] * 2)
+        check("304 ETag kept on disk", [body_of(origin.url(retagged)) for _ in range(3)], [pattern(100000, n) for n in (1, 1, 3)])
+        check("revalidated from disk with the new ETag", [f.get("if-none-match") for p, f in origin.requests if p == retagged], [None, '"r1"', '"r2"'])
+        got = [body_of(origin.url(vary), [("Accept-Language", lang)]) for lang in ("en", "fr", "en", "fr")]
+        check("Vary over two lines on disk", got, [pattern(100000, n) for n in (1, 2, 1, 2)])
+
+    def second():
+        check("damaged record skipped", body_of(origin.url(damaged)), pattern(100000, 1))
+        check("after a restart", body_of(origin.url(big)), pattern(3000000, 1))
+        check("after a restart, fetched once", origin.hit_count(big), 1)
+        check("revalidated after a restart", body_of(origin.url(etag)), pattern(200000, 1))
+        for i in range(30): # 30 x 3 MB through a 64 MB quota
+            body_of(origin.url(obj("quota%d" % i, "Cache-Control: max-age=600", size=3000000)))
+        used = sum(os.stat(os.path.join(directory, name)).st_blocks * 512 for name in os.listdir(directory))
+        check("quota kept", used <= 64 << 20, True)
+    try:
+        run("disk", args, first)
+        time.sleep(0.2)
+        damaged_slab(directory, "GET http://%s:8100%s" % (ORIGIN_ADDR, damaged))
+        run("disk", args, second)
+    finally:
+        origin.stop()
+        shutil.rmtree(directory, ignore_errors=True)
+
+
+def dns():
+    origin, nameserver = Origin(8000), Nameserver()
+    url = lambda name: "http://%s:8000/close" % name # nothing pooled to skip a lookup with
+
+    def body():
+        check("A record", body_of(url("a.test")), b"bye")
+        check("from the cache", body_of(url("a.test")), b"bye")
+        check("asked once within the TTL", (nameserver.asked("a.test"), nameserver.asked("a.test", 28)), (1, 1))
+        check("CNAME chain", body_of(url("cname.test")), b"bye")
+        check("address for another name ignored", body_of(url("planted.test")), None)
+        check("NXDOMAIN", body_of(url("nx.test")), None)
+        check("NXDOMAIN cached", (body_of(url("nx.test")), nameserver.asked("nx.test")), (None, 1))
+        check("noise ignored, asked again", (body_of(url("garbage.test")), nameserver.asked("garbage.test")), (b"bye", 2))
+        check("cut off answer ignored, asked again", (body_of(url("truncated.test")), nameserver.asked("truncated.test")), (b"bye", 2))
+        check("wrong id ignored", body_of(url("wrongid.test")), b"bye")
+        check("answer from another port ignored", body_of(url("spoofed.test")), b"bye")
+        time.sleep(2.2)
+        check("asked again after the TTL", (body_of(url("a.test")), nameserver.asked("a.test")), (b"bye", 2))
+        check("asked again after the negative TTL", (body_of(url("nx.test")), nameserver.asked("nx.test")), (None, 2))
+    try:
+        run("dns", ["-r", nameserver.address], body)
+    finally:
+        origin.stop()
+        nameserver.stop()
+
+
+def parents():
+    origin, up, down = Origin(8000), Origin(8201), Origin(8202) # the parents take absolute-form requests as they are
+    down.health = 503
+    args = ["-u", "%s:8201" % ORIGIN_ADDR, "-u", "%s:8202" % ORIGIN_ADDR, "-k", "http://check/health"]
+
+    def body():
+        time.sleep(7) # three failed checks, two seconds apart
+        checked = down.hit_count("/health")
+        got = [body_of(origin.url("/bytes/%d" % size)) for size in (10, 20, 30, 40)]
+        check("through the parent that is up", got, [pattern(size) for size in (10, 20, 30, 40)])
+        check("parent answering 503 ejected", (checked >= 3, sum(down.hit_count("/bytes/%d" % size) for size in (10, 20, 30, 40))), (True, 0))
+    try:
+        run("parents", args, body)
+    finally:
+        for server in (origin, up, down):
+            server.stop()
+
+
+GROUPS = {
+    "smoke": smoke,
+    "pipeline": pipeline,
+    "pool": pool,
+    "request": request,
+    "cache": cache,
+    "disk": disk,
+    "dns": dns,
+    "parents": parents,
+}
+
+if __name__ == "__main__":
+    names = sys.argv[1:] or list(GROUPS)
+    for name in names:
+        if name not in GROUPS:
+            sys.exit("unknown group %s, there are: %s" % (name, " ".join(GROUPS)))
+    if not os.access(os.path.join(BUILD, "tinyforward"), os.X_OK):
+        sys.exit("%s/tinyforward is missing, run make first" % BUILD)
+    for name in names:
+        print("-- %s" % name)
+        GROUPS[name]()
+    print("%d failed" % failures if failures else "all passed")
+    sys.exit(1 if failures else 0)
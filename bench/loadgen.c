@@ -0,0 +1,381 @@
+//
+//  loadgen.c
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+// Benchmark client: keeps a number of connections busy through the proxy
+// for a fixed time, optionally pipelining, going through CONNECT or
+// reconnecting for every batch, and prints one line of key=value results
+// for the runner to pick up.
+
+#ifdef __linux__
+#define _GNU_SOURCE // memmem(), strcasestr()
+#endif
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOADGEN_BUFFER_SIZE  65536
+#define LOADGEN_MAX_DEPTH    64
+#define LOADGEN_TIMEOUT      10 // s, a stuck read counts as an error
+
+typedef struct client {
+    pthread_t thread;
+    int socket;
+    char buffer[LOADGEN_BUFFER_SIZE];
+    size_t start, end; // unread bytes in buffer
+    unsigned long long requests;
+    unsigned long long errors;
+    unsigned long long bytes;
+    unsigned long long *latencies; // us
+    size_t latency_count, latency_capacity;
+} client_t;
+
+static const char *g_proxy_host = "127.0.0.1";
+static const char *g_proxy_port = "5555";
+static const char *g_target = "127.0.0.2:8080";
+static const char *g_path = "/1024";
+static int g_depth = 1;
+static int g_tunnel = 0;
+static int g_churn = 0; // a new connection for every batch
+static volatile int g_running = 1;
+static char g_batch[LOADGEN_MAX_DEPTH * 512];
+static size_t g_batch_size;
+
+static long long now_us(void){
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int open_socket(void){
+    struct addrinfo hints, *result;
+    struct timeval timeout = {LOADGEN_TIMEOUT, 0};
+    int sock, on = 1;
+    
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo(g_proxy_host, g_proxy_port, &hints, &result) != 0){
+        return -1;
+    }
+    sock = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    if(sock >= 0 && connect(sock, result->ai_addr, result->ai_addrlen) < 0){
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(result);
+    if(sock >= 0){
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+    return sock;
+}
+
+static int send_all(int sock, const char *data, size_t size){
+    ssize_t count;
+    
+    while(size > 0){
+        count = send(sock, data, size, 0);
+        if(count < 0 && errno == EINTR){
+            continue;
+        }
+        if(count <= 0){
+            return -1;
+        }
+        data += count;
+        size -= count;
+    }
+    return 0;
+}
+
+static int fill(client_t *client){
+    ssize_t count;
+    
+    if(client->start == client->end){
+        client->start = client->end = 0;
+    }else if(client->end == sizeof(client->buffer)){ // make room
+        memmove(client->buffer, client->buffer + client->start, client->end - client->start);
+        client->end -= client->start;
+        client->start = 0;
+    }
+    count = recv(client->socket, client->buffer + client->end, sizeof(client->buffer) - client->end, 0);
+    if(count <= 0){
+        return -1;
+    }
+    client->end += count;
+    client->bytes += count;
+    return 0;
+}
+
+// reads a response head, returns its status and sets the body length
+static int read_head(client_t *client, unsigned long long *length){
+    char *head, *end, *field;
+    int status;
+    
+    for(;;){
+        head = client->buffer + client->start;
+        end = memmem(head, client->end - client->start, "\r\n\r\n", 4);
+        if(end != NULL){
+            break;
+        }
+        if(client->end - client->start == sizeof(client->buffer) || fill(client) < 0){
+            return -1;
+        }
+    }
+    *end = '\0';
+    status = strncmp(head, "HTTP/1.", 7) == 0 ? atoi(head + 9) : -1;
+    *length = (field = strcasestr(head, "\nContent-Length:")) != NULL ? strtoull(field + 16, NULL, 10) : 0;
+    client->start = end + 4 - client->buffer;
+    return status;
+}
+
+static int read_response(client_t *client){
+    unsigned long long length, available;
+    
+    if(read_head(client, &length) != 200){
+        return -1;
+    }
+    while(length > 0){
+        if(client->start == client->end && fill(client) < 0){
+            return -1;
+        }
+        available = client->end - client->start;
+        if(available > length){
+            available = length;
+        }
+        client->start += available;
+        length -= available;
+    }
+    return 0;
+}
+
+static int open_client(client_t *client){
+    char request[512];
+    unsigned long long length;
+    int size;
+    
+    client->start = client->end = 0;
+    if((client->socket = open_socket()) < 0){
+        return -1;
+    }
+    if(g_tunnel){
+        size = snprintf(request, sizeof(request), "CONNECT %s HTTP/1.1\r\nHost: %s\r\n\r\n", g_target, g_target);
+        if(send_all(client->socket, request, size) < 0 || read_head(client, &length) != 200){
+            close(client->socket);
+            client->socket = -1;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void record(client_t *client, unsigned long long latency){
+    unsigned long long *latencies;
+    
+    if(client->latency_count == client->latency_capacity){
+        client->latency_capacity = client->latency_capacity ? client->latency_capacity * 2 : 4096;
+        latencies = realloc(client->latencies, client->latency_capacity * sizeof(unsigned long long));
+        if(latencies == NULL){
+            return;
+        }
+        client->latencies = latencies;
+    }
+    client->latencies[client->latency_count++] = latency;
+}
+
+static void *run_client(void *arg){
+    client_t *client = arg;
+    long long started;
+    int i;
+    
+    while(g_running){
+        started = now_us(); // with -C the connect counts too
+        if(client->socket < 0 && open_client(client) < 0){
+            client->errors++;
+            usleep(10000);
+            continue;
+        }
+        if(send_all(client->socket, g_batch, g_batch_size) < 0){
+            goto failed;
+        }
+        for(i = 0; i < g_depth; i++){
+            if(read_response(client) < 0){
+                goto failed;
+            }
+            if(g_running){ // whatever finishes after the deadline doesn't count
+                client->requests++;
+                record(client, now_us() - started);
+            }
+        }
+        if(g_churn){
+            close(client->socket);
+            client->socket = -1;
+        }
+        continue;
+    failed:
+        if(g_running){
+            client->errors++;
+        }
+        close(client->socket);
+        client->socket = -1;
+    }
+    if(client->socket >= 0){
+        close(client->socket);
+    }
+    return NULL;
+}
+
+static int compare(const void *a, const void *b){
+    unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static unsigned long long percentile(unsigned long long *sorted, size_t count, double fraction){
+    size_t index;
+    
+    if(count == 0){
+        return 0;
+    }
+    index = (size_t)(fraction * count);
+    return sorted[index < count ? index : count - 1];
+}
+
+static void usage(const char *name){
+    fprintf(stderr, "usage: %s [-x proxy host:port] [-t target host:port] [-P path] [-c connections]\n"
+            "       [-d seconds] [-n pipeline depth] [-i idle connections] [-T] [-C]\n", name);
+}
+
+int main(int argc, char * const argv[]){
+    client_t *clients;
+    unsigned long long *latencies, requests = 0, errors = 0, bytes = 0;
+    size_t count = 0;
+    char *colon, request[512];
+    int connections = 16, seconds = 5, idle = 0, idle_open = 0, opt, i, size;
+    int *idle_sockets;
+    long long started, elapsed;
+    
+    while((opt = getopt(argc, argv, "x:t:P:c:d:n:i:TCh")) != -1){
+        switch(opt){
+            case 'x':
+                g_proxy_host = strdup(optarg);
+                if((colon = strrchr(g_proxy_host, ':')) != NULL){
+                    *colon = '\0';
+                    g_proxy_port = colon + 1;
+                }
+                break;
+            case 't':
+                g_target = optarg;
+                break;
+            case 'P':
+                g_path = optarg;
+                break;
+            case 'c':
+                connections = atoi(optarg);
+                break;
+            case 'd':
+                seconds = atoi(optarg);
+                break;
+            case 'n':
+                g_depth = atoi(optarg);
+                break;
+            case 'i':
+                idle = atoi(optarg);
+                break;
+            case 'T':
+                g_tunnel = 1;
+                break;
+            case 'C':
+                g_churn = 1;
+                break;
+            default:
+                usage(argv[0]);
+                exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+    if(connections < 1 || seconds < 1 || g_depth < 1 || g_depth > LOADGEN_MAX_DEPTH || idle < 0){
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    
+    // one batch is depth copies of the same request, sent with one send()
+    size = g_tunnel ? snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n", g_path, g_target) :
+        snprintf(request, sizeof(request), "GET http://%s%s HTTP/1.1\r\nHost: %s\r\n\r\n", g_target, g_path, g_target);
+    for(i = 0; i < g_depth; i++){
+        memcpy(g_batch + g_batch_size, request, size);
+        g_batch_size += size;
+    }
+    
+    // connections that never send anything, they only cost the proxy memory
+    idle_sockets = calloc(idle + 1, sizeof(int));
+    for(i = 0; i < idle; i++){
+        if((idle_sockets[idle_open] = open_socket()) >= 0){
+            idle_open++;
+        }
+    }
+    
+    clients = calloc(connections, sizeof(client_t));
+    started = now_us();
+    for(i = 0; i < connections; i++){
+        clients[i].socket = -1;
+        pthread_create(&clients[i].thread, NULL, run_client, &clients[i]);
+    }
+    sleep(seconds);
+    g_running = 0;
+    elapsed = now_us() - started;
+    for(i = 0; i < connections; i++){
+        pthread_join(clients[i].thread, NULL);
+        requests += clients[i].requests;
+        errors += clients[i].errors;
+        bytes += clients[i].bytes;
+        count += clients[i].latency_count;
+    }
+    for(i = 0; i < idle_open; i++){
+        close(idle_sockets[i]);
+    }
+    
+    latencies = malloc((count + 1) * sizeof(unsigned long long));
+    count = 0;
+    for(i = 0; i < connections; i++){
+        memcpy(latencies + count, clients[i].latencies, clients[i].latency_count * sizeof(unsigned long long));
+        count += clients[i].latency_count;
+        free(clients[i].latencies);
+    }
+    qsort(latencies, count, sizeof(unsigned long long), compare);
+    printf("requests=%llu errors=%llu idle=%d seconds=%.2f rps=%.0f mbps=%.1f p50_us=%llu p99_us=%llu p999_us=%llu\n",
+           requests, errors, idle_open, elapsed / 1e6, requests / (elapsed / 1e6), bytes * 8 / (elapsed / 1e6) / 1e6,
+           percentile(latencies, count, 0.5), percentile(latencies, count, 0.99), percentile(latencies, count, 0.999));
+    free(latencies);
+    free(clients);
+    free(idle_sockets);
+    return errors > 0 && requests == 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
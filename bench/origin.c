@@ -0,0 +1,214 @@
+//
+//  origin.c
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+// Benchmark origin: keep-alive HTTP/1.1 with a thread per connection.
+// GET /<bytes> answers with that many bytes, add ?delay=<ms> to wait
+// before answering. Pipelined requests are answered in order, and a
+// CONNECT tunnel pointed here just carries the same requests.
+
+#ifdef __linux__
+#define _GNU_SOURCE // strcasestr()
+#endif
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ORIGIN_BUFFER_SIZE  16384
+#define ORIGIN_BODY_CHUNK   65536
+#define ORIGIN_STACK_SIZE   (128 * 1024)
+
+static char g_body[ORIGIN_BODY_CHUNK];
+static int g_delay = 0; // ms added to every response, -s
+
+static int write_all(int socket, const char *data, size_t size){
+    ssize_t count;
+    
+    while(size > 0){
+        count = send(socket, data, size, 0);
+        if(count < 0 && errno == EINTR){
+            continue;
+        }
+        if(count <= 0){
+            return -1;
+        }
+        data += count;
+        size -= count;
+    }
+    return 0;
+}
+
+static void sleep_ms(int ms){
+    struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+    
+    while(nanosleep(&ts, &ts) < 0 && errno == EINTR);
+}
+
+// answers one request head, returns -1 when the connection should close
+static int respond(int socket, char *head){
+    char header[256];
+    char *path, *query, *end;
+    unsigned long long size, sent, chunk;
+    int delay = g_delay, head_only, close_after, length;
+    
+    head_only = strncmp(head, "HEAD ", 5) == 0;
+    if((path = strchr(head, ' ')) == NULL){
+        return -1;
+    }
+    path++;
+    if(strncmp(path, "http://", 7) == 0 && (path = strchr(path + 7, '/')) == NULL){ // absolute form
+        return -1;
+    }
+    size = strtoull(path + 1, &end, 10);
+    if((query = strstr(path, "delay=")) != NULL && query < strchr(path, ' ')){
+        delay += atoi(query + 6);
+    }
+    close_after = strcasestr(head, "\nConnection: close") != NULL;
+    if(delay > 0){
+        sleep_ms(delay);
+    }
+    length = snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Length: %llu\r\n%s\r\n",
+                      size, close_after ? "Connection: close\r\n" : "");
+    if(write_all(socket, header, length) < 0){
+        return -1;
+    }
+    for(sent = 0; !head_only && sent < size; sent += chunk){
+        chunk = size - sent < ORIGIN_BODY_CHUNK ? size - sent : ORIGIN_BODY_CHUNK;
+        if(write_all(socket, g_body, chunk) < 0){
+            return -1;
+        }
+    }
+    return close_after ? -1 : 0;
+}
+
+static void *serve(void *arg){
+    char buffer[ORIGIN_BUFFER_SIZE + 1];
+    char *end, *length;
+    int socket = (int)(long)arg;
+    size_t used = 0, skip = 0, head;
+    ssize_t count;
+    
+    for(;;){
+        count = recv(socket, buffer + used, ORIGIN_BUFFER_SIZE - used, 0);
+        if(count <= 0){
+            break;
+        }
+        used += count;
+        buffer[used] = '\0';
+        for(;;){
+            if(skip > 0){ // request body, thrown away
+                head = skip < used ? skip : used;
+                memmove(buffer, buffer + head, used - head);
+                used -= head;
+                skip -= head;
+                buffer[used] = '\0';
+            }
+            if(skip > 0 || (end = strstr(buffer, "\r\n\r\n")) == NULL){
+                break;
+            }
+            head = end + 4 - buffer;
+            *end = '\0';
+            if((length = strcasestr(buffer, "\nContent-Length:")) != NULL){
+                skip = strtoull(length + 16, NULL, 10);
+            }
+            if(respond(socket, buffer) < 0){
+                goto done;
+            }
+            memmove(buffer, buffer + head, used - head);
+            used -= head;
+            buffer[used] = '\0';
+        }
+        if(used == ORIGIN_BUFFER_SIZE){ // head too large
+            break;
+        }
+    }
+done:
+    close(socket);
+    return NULL;
+}
+
+int main(int argc, char * const argv[]){
+    struct sockaddr_in addr;
+    pthread_attr_t attr;
+    pthread_t thread;
+    const char *host = "127.0.0.2";
+    int port = 8080, opt, listener, client, on = 1;
+    
+    while((opt = getopt(argc, argv, "a:p:s:h")) != -1){
+        switch(opt){
+            case 'a':
+                host = optarg;
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 's':
+                g_delay = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-a address] [-p port] [-s delay ms]\n", argv[0]);
+                exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+    memset(g_body, 'x', sizeof(g_body));
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if(inet_pton(AF_INET, host, &addr.sin_addr) != 1){
+        fprintf(stderr, "Invalid address %s.\n", host);
+        exit(EXIT_FAILURE);
+    }
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if(bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener, 4096) < 0){
+        perror("origin");
+        exit(EXIT_FAILURE);
+    }
+    
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, ORIGIN_STACK_SIZE);
+    for(;;){
+        if((client = accept(listener, NULL, NULL)) < 0){
+            if(errno == EINTR || errno == ECONNABORTED || errno == EMFILE){
+                continue;
+            }
+            perror("accept");
+            exit(EXIT_FAILURE);
+        }
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        if(pthread_create(&thread, &attr, serve, (void *)(long)client) != 0){
+            close(client);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,128 @@
+#!/usr/bin/env bash
+#
+# Runs TinyForward between the bench origin and load generator, once per
+# scenario, and prints a table. The proxy is restarted for every scenario
+# so peak RSS belongs to that scenario alone.
+#
+#   bench/run.sh [scenario ...]
+#
+# DURATION     seconds per scenario (default 5)
+# BUILD        where make put the binaries (default build)
+# PROXY_ARGS   extra arguments for tinyforward, e.g. "-w 4"
+# ORIGIN_ADDR  address the origin binds, must not be 127.0.0.1 since the
+#              proxy refuses to connect to itself (default 127.0.0.2)
+
+set -u
+
+BUILD=${BUILD:-build}
+DURATION=${DURATION:-5}
+PROXY_ARGS=${PROXY_ARGS:-}
+ORIGIN_ADDR=${ORIGIN_ADDR:-127.0.0.2}
+ORIGIN_PORT=8080
+PROXY_PORT=5555 # fixed in tinyforward.h
+
+# name|load generator arguments
+SCENARIOS=(
+    "small|-c 64 -P /1024"
+    "churn|-c 32 -C -P /1024"
+    "large|-c 8 -P /1048576"
+    "pipeline|-c 16 -n 16 -P /128"
+    "connect|-c 32 -T -P /4096"
+    "idle|-c 16 -i 5000 -P /1024"
+    "slow-origin|-c 256 -P /1024?delay=50"
+)
+
+ORIGIN_PID=
+PROXY_PID=
+
+cleanup(){
+    [ -n "$PROXY_PID" ] && kill "$PROXY_PID" 2>/dev/null
+    [ -n "$ORIGIN_PID" ] && kill "$ORIGIN_PID" 2>/dev/null
+    wait 2>/dev/null
+}
+trap cleanup EXIT
+
+wait_port(){ # host port
+    for _ in $(seq 1 50); do
+        (exec 3<>"/dev/tcp/$1/$2") 2>/dev/null && return 0
+        sleep 0.1
+    done
+    echo "nothing listening on $1:$2" >&2
+    return 1
+}
+
+wait_closed(){ # host port
+    for _ in $(seq 1 50); do
+        (exec 3<>"/dev/tcp/$1/$2") 2>/dev/null || return 0
+        sleep 0.1
+    done
+    return 0
+}
+
+cpu_ticks(){ # utime + stime of a pid, Linux only
+    [ -r "/proc/$1/stat" ] || return 1
+    # the command name may contain spaces, count fields after its closing paren
+    sed 's/.*) //' "/proc/$1/stat" | awk '{ print $12 + $13 }'
+}
+
+peak_rss(){ # kB
+    if [ -r "/proc/$1/status" ]; then
+        awk '/^VmHWM:/ { print $2 }' "/proc/$1/status"
+    else
+        ps -o rss= -p "$1" | tr -d ' ' # current, not peak
+    fi
+}
+
+field(){ # key line
+    echo "$2" | tr ' ' '\n' | sed -n "s/^$1=//p"
+}
+
+for tool in tinyforward origin loadgen; do
+    if [ ! -x "$BUILD/$tool" ]; then
+        echo "$BUILD/$tool is missing, run make bench-tools first" >&2
+        exit 1
+    fi
+done
+ulimit -n "$(ulimit -Hn)" 2>/dev/null # the idle scenario needs a few thousand descriptors
+CLK_TCK=$(getconf CLK_TCK)
+
+"$BUILD/origin" -a "$ORIGIN_ADDR" -p "$ORIGIN_PORT" &
+ORIGIN_PID=$!
+wait_port "$ORIGIN_ADDR" "$ORIGIN_PORT" || exit 1
+
+printf "%-12s %10s %10s %10s %10s %12s %12s %8s\n" scenario req/s p50_us p99_us p999_us cpu_us/req peak_rss_kb errors
+status=0
+for scenario in "${SCENARIOS[@]}"; do
+    name=${scenario%%|*}
+    args=${scenario#*|}
+    if [ $# -gt 0 ] && [[ " $* " != *" $name "* ]]; then
+        continue
+    fi
+    
+    # shellcheck disable=SC2086
+    "$BUILD/tinyforward" -L warn -m 0 $PROXY_ARGS > /dev/null 2> "$BUILD/bench-$name.log" &
+    PROXY_PID=$!
+    wait_port 127.0.0.1 "$PROXY_PORT" || exit 1
+    
+    before=$(cpu_ticks "$PROXY_PID")
+    # shellcheck disable=SC2086
+    result=$("$BUILD/loadgen" -x "127.0.0.1:$PROXY_PORT" -t "$ORIGIN_ADDR:$ORIGIN_PORT" -d "$DURATION" $args)
+    after=$(cpu_ticks "$PROXY_PID")
+    rss=$(peak_rss "$PROXY_PID")
+    requests=$(field requests "$result")
+    
+    if [ -n "$before" ] && [ -n "$after" ] && [ "${requests:-0}" -gt 0 ]; then
+        cpu=$(( (after - before) * 1000000 / CLK_TCK / requests ))
+    else
+        cpu=n/a
+    fi
+    printf "%-12s %10s %10s %10s %10s %12s %12s %8s\n" "$name" "$(field rps "$result")" "$(field p50_us "$result")" \
+        "$(field p99_us "$result")" "$(field p999_us "$result")" "$cpu" "${rss:-n/a}" "$(field errors "$result")"
+    [ "${requests:-0}" -gt 0 ] || status=1
+    
+    kill "$PROXY_PID" 2>/dev/null
+    wait "$PROXY_PID" 2>/dev/null
+    PROXY_PID=
+    wait_closed 127.0.0.1 "$PROXY_PORT" # with -U the ring lets go of the listener a little after exit
+done
+exit $status
@@ -0,0 +1,234 @@
+//
+//  tracestat.c
+//  TinyForward
+//
+//  Copyright (C) 2012  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+// Offline summary of a trace file written by tinyforward -T: how long
+// requests spent in each phase, as percentiles per origin. Each phase is
+// the time from the one before it that the request went through, so a
+// request on a pooled connection has no dns or connect time.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TRACESTAT_LINE_SIZE  4096
+#define TRACESTAT_ORIGIN_SIZE 128
+
+enum {
+    PHASE_HOST,
+    PHASE_DNS,
+    PHASE_CONNECT,
+    PHASE_SEND,
+    PHASE_WAIT,
+    PHASE_RECEIVE,
+    PHASE_TOTAL,
+    PHASES
+};
+
+// the keys in the file, in order, each ending the phase of the same index
+static const char *keys[] = {"host", "resolved", "connected", "sent", "first_byte", "last_byte"};
+static const char *names[] = {"host", "dns", "connect", "send", "wait", "receive", "total"};
+
+typedef struct samples {
+    long long *values; // us
+    size_t count, capacity;
+} samples_t;
+
+typedef struct origin {
+    char name[TRACESTAT_ORIGIN_SIZE];
+    unsigned long long requests;
+    unsigned long long incomplete; // the connection went away before the response was in
+    unsigned long long reused;
+    unsigned long long hits;
+    samples_t phases[PHASES];
+} origin_t;
+
+static origin_t *g_origins;
+static size_t g_origin_count, g_origin_capacity;
+
+static void add_sample(samples_t *samples, long long value){
+    if(samples->count == samples->capacity){
+        samples->capacity = samples->capacity ? samples->capacity * 2 : 64;
+        samples->values = realloc(samples->values, samples->capacity * sizeof(long long));
+    }
+    samples->values[samples->count++] = value;
+}
+
+static origin_t *find_origin(const char *name){
+    size_t i;
+    
+    for(i = 0; i < g_origin_count; i++){
+        if(strcmp(g_origins[i].name, name) == 0){
+            return &g_origins[i];
+        }
+    }
+    if(g_origin_count == g_origin_capacity){
+        g_origin_capacity = g_origin_capacity ? g_origin_capacity * 2 : 16;
+        g_origins = realloc(g_origins, g_origin_capacity * sizeof(origin_t));
+    }
+    memset(&g_origins[g_origin_count], 0, sizeof(origin_t));
+    snprintf(g_origins[g_origin_count].name, TRACESTAT_ORIGIN_SIZE, "%s", name);
+    return &g_origins[g_origin_count++];
+}
+
+// the value of "key": in a record, -1 if it isn't there
+static long long number(const char *line, const char *key){
+    char pattern[64];
+    const char *found;
+    
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    if((found = strstr(line, pattern)) == NULL){
+        return -1;
+    }
+    return strtoll(found + strlen(pattern), NULL, 10);
+}
+
+static int string(const char *line, const char *key, char *value, size_t size){
+    char pattern[64];
+    const char *found, *end;
+    
+    snprintf(pattern, sizeof(pattern), "\"%s\":\"", key);
+    if((found = strstr(line, pattern)) == NULL){
+        return -1;
+    }
+    found += strlen(pattern);
+    if((end = strchr(found, '"')) == NULL){
+        return -1;
+    }
+    snprintf(value, size, "%.*s", (int)(end - found), found);
+    return 0;
+}
+
+static void add_record(const char *line){
+    char name[TRACESTAT_ORIGIN_SIZE], cache[32];
+    origin_t *origin;
+    long long at, previous = 0;
+    int i;
+    
+    if(string(line, "origin", name, sizeof(name)) < 0){
+        return;
+    }
+    origin = find_origin(name);
+    origin->requests++;
+    origin->reused += number(line, "reused") == 1;
+    if(string(line, "cache", cache, sizeof(cache)) == 0 && strcmp(cache, "hit") == 0){
+        origin->hits++;
+    }
+    for(i = 0; i < PHASE_TOTAL; i++){
+        if((at = number(line, keys[i])) < 0){ // skipped, the next phase takes over from the last one
+            continue;
+        }
+        add_sample(&origin->phases[i], at - previous);
+        previous = at;
+    }
+    if(number(line, "last_byte") < 0){
+        origin->incomplete++;
+    }else{
+        add_sample(&origin->phases[PHASE_TOTAL], previous);
+    }
+}
+
+static int compare(const void *a, const void *b){
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int busiest(const void *a, const void *b){
+    const origin_t *x = a, *y = b;
+    return x->requests > y->requests ? -1 : x->requests < y->requests;
+}
+
+static double percentile(const samples_t *samples, double fraction){
+    size_t index = (size_t)(fraction * samples->count);
+    return samples->values[index < samples->count ? index : samples->count - 1] / 1000.0;
+}
+
+static void report(origin_t *origin){
+    samples_t *samples;
+    int i;
+    
+    printf("%s: %llu requests, %llu incomplete, %llu on pooled connections, %llu cache hits\n",
+           origin->name, origin->requests, origin->incomplete, origin->reused, origin->hits);
+    printf("  %-8s %8s %10s %10s %10s %10s\n", "phase", "count", "p50 ms", "p90 ms", "p99 ms", "max ms");
+    for(i = 0; i < PHASES; i++){
+        samples = &origin->phases[i];
+        if(samples->count == 0){
+            continue;
+        }
+        qsort(samples->values, samples->count, sizeof(long long), compare);
+        printf("  %-8s %8zu %10.3f %10.3f %10.3f %10.3f\n", names[i], samples->count,
+               percentile(samples, 0.5), percentile(samples, 0.9), percentile(samples, 0.99), percentile(samples, 1.0));
+    }
+}
+
+static int read_file(FILE *file){
+    char line[TRACESTAT_LINE_SIZE];
+    
+    while(fgets(line, sizeof(line), file) != NULL){
+        add_record(line);
+    }
+    return ferror(file) ? -1 : 0;
+}
+
+static void usage(const char *name){
+    fprintf(stderr, "usage: %s [-n origins] [file ...]\n", name);
+}
+
+int main(int argc, char * const argv[]){
+    FILE *file;
+    int top = 20, opt, i;
+    size_t n;
+    
+    while((opt = getopt(argc, argv, "n:h")) != -1){
+        switch(opt){
+            case 'n':
+                top = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+    if(top < 1){
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if(optind == argc && read_file(stdin) < 0){ // no files, a pipe then
+        perror("stdin");
+        exit(EXIT_FAILURE);
+    }
+    for(i = optind; i < argc; i++){
+        if((file = fopen(argv[i], "r")) == NULL || read_file(file) < 0){
+            perror(argv[i]);
+            exit(EXIT_FAILURE);
+        }
+        fclose(file);
+    }
+    
+    // the busiest origins first
+    qsort(g_origins, g_origin_count, sizeof(origin_t), busiest);
+    for(n = 0; n < g_origin_count && n < (size_t)top; n++){
+        report(&g_origins[n]);
+    }
+    if(g_origin_count > (size_t)top){
+        printf("... and %zu more origins\n", g_origin_count - top);
+    }
+    return EXIT_SUCCESS;
+}